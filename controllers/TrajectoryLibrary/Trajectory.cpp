@@ -7,6 +7,8 @@
 
 #include "Trajectory.hpp"
 
+#include <algorithm>
+
 
 Trajectory::Trajectory() {
     trajectory_number_ = -1;
@@ -63,22 +65,20 @@ void Trajectory::LoadTrajectory(std::string filename_prefix, bool quiet) {
             exit(1);
     }
 
-    // set the minimum altitude
-    BotTrans trans;
-    bot_trans_set_identity(&trans);
-    bool first_run = true;
+    // cache the positions
+    x_points_.resize(GetNumberOfPoints());
+    y_points_.resize(GetNumberOfPoints());
+    z_points_.resize(GetNumberOfPoints());
 
     for (int i = 0; i < GetNumberOfPoints(); i++) {
+        x_points_[i] = xpoints_(i, 1);
+        y_points_[i] = xpoints_(i, 2);
+        z_points_[i] = xpoints_(i, 3);
+    }
 
-        double this_t = GetTimeAtIndex(i);
-        double xyz[3];
-
-        GetXyzYawTransformedPoint(this_t, trans, xyz);
-
-        if (xyz[2] < min_altitude_ || first_run == true) {
-            min_altitude_ = xyz[2];
-            first_run = false;
-        }
+    // set the minimum altitude
+    if (z_points_.size() > 0) {
+        min_altitude_ = *std::min_element(z_points_.begin(), z_points_.end());
     }
 }
 
@@ -296,32 +296,46 @@ void Trajectory::Print() const {
  * Returns a point along the trajectory transformed with xyz and yaw.  Ignores pitch and roll.
  */
 void Trajectory::GetXyzYawTransformedPoint(double t, const BotTrans &transform, double *xyz) const {
-    // apply the transformation from the global frame: orgin = (0,0,0)
-    // to the local frame point
-
-    Eigen::VectorXd state = GetState(t);
+    GetXyzYawTransformedPoints(transform, GetIndexAtTime(t), 1, 1, xyz);
+}
 
-    double original_point[3];
-    original_point[0] = state(0);
-    original_point[1] = state(1);
-    original_point[2] = state(2);
+/**
+ * Returns points along the trajectory transformed with xyz and yaw.  Ignores pitch and roll.
+ *
+ * The rotation is worked out once for all of the points, so the loop over
+ * them is only multiply-adds.
+ *
+ * @param transform transform to apply, usually body to local
+ * @param first_index index of the first point
+ * @param stride number of indices between points
+ * @param number_of_points number of points to transform
+ * @param xyz output, 3 doubles per point
+ */
+void Trajectory::GetXyzYawTransformedPoints(const BotTrans &transform, int first_index, int stride, int number_of_points, double *xyz) const {
 
     // remove roll and pitch from the transform
-    BotTrans trans_xyz_yaw;
-
-    bot_trans_copy(&trans_xyz_yaw, &transform);
-
     double rpy[3];
-    bot_quat_to_roll_pitch_yaw(trans_xyz_yaw.rot_quat, rpy);
+    bot_quat_to_roll_pitch_yaw(transform.rot_quat, rpy);
 
-    rpy[0] = 0;
-    rpy[1] = 0;
+    double cos_yaw = cos(rpy[2]);
+    double sin_yaw = sin(rpy[2]);
 
-    bot_roll_pitch_yaw_to_quat(rpy, trans_xyz_yaw.rot_quat);
+    double trans_x = transform.trans_vec[0];
+    double trans_y = transform.trans_vec[1];
+    double trans_z = transform.trans_vec[2];
 
+    const double *x_points = x_points_.data() + first_index;
+    const double *y_points = y_points_.data() + first_index;
+    const double *z_points = z_points_.data() + first_index;
 
-    bot_trans_apply_vec(&trans_xyz_yaw, original_point, xyz);
+    for (int i = 0; i < number_of_points; i++) {
+        double x = x_points[i * stride];
+        double y = y_points[i * stride];
 
+        xyz[3*i] = cos_yaw * x - sin_yaw * y + trans_x;
+        xyz[3*i + 1] = sin_yaw * x + cos_yaw * y + trans_y;
+        xyz[3*i + 2] = z_points[i * stride] + trans_z;
+    }
 }
 
 void Trajectory::Draw(bot_lcmgl_t *lcmgl, const BotTrans *transform, double final_time) const {
@@ -420,25 +434,19 @@ double Trajectory::ClosestObstacleInRemainderOfTrajectory(const StereoOctomap &o
     int number_of_points = GetNumberOfPoints();
 
     int starting_index = GetIndexAtTime(current_t);
-    std::vector<double> point_distances(number_of_points); // TODO: potentially inefficient
-    double closest_obstacle_distance = -1;
+    int number_remaining = std::max(0, number_of_points - starting_index);
 
-    for (int i = starting_index; i < number_of_points; i++) {
-        // for each point in the trajectory
-
-        // subtract the current position (ie move the trajectory to where we are)
-        double transformed_point[3];
-
-        double this_t = GetTimeAtIndex(i);
-
-        GetXyzYawTransformedPoint(this_t, body_to_local, transformed_point);
+    std::vector<double> transformed_points(3 * number_remaining);
+    std::vector<double> point_distances(number_remaining);
+    double closest_obstacle_distance = -1;
 
-        // check if there is an obstacle nearby
-        point_distances.at(i) = octomap.NearestNeighbor(transformed_point);
+    // subtract the current position (ie move the trajectory to where we are)
+    GetXyzYawTransformedPoints(body_to_local, starting_index, 1, number_remaining, transformed_points.data());
 
-    }
+    // check if there is an obstacle nearby
+    octomap.NearestNeighbors(transformed_points.data(), number_remaining, point_distances.data());
 
-    for (int i = starting_index; i < number_of_points; i++) {
+    for (int i = 0; i < number_remaining; i++) {
         double distance_to_point = point_distances.at(i);
         if (distance_to_point >= 0) {
             if (distance_to_point < closest_obstacle_distance || closest_obstacle_distance < 0) {
@@ -43,6 +43,7 @@ class Trajectory
         double GetDT() const { return dt_; }
 
         void GetXyzYawTransformedPoint(double t, const BotTrans &transform, double *xyz) const;
+        void GetXyzYawTransformedPoints(const BotTrans &transform, int first_index, int stride, int number_of_points, double *xyz) const;
         void Draw(bot_lcmgl_t *lcmgl, const BotTrans *transform = nullptr, double final_time = -1) const;
 
         int GetIndexAtTime(double t) const;
@@ -76,6 +77,12 @@ class Trajectory
         Eigen::MatrixXd kpoints_;
         Eigen::MatrixXd affine_points_;
 
+        // xyz of each point in xpoints_, so searches can transform them
+        // without going through GetState
+        std::vector<double> x_points_;
+        std::vector<double> y_points_;
+        std::vector<double> z_points_;
+
         double dt_;
         double min_altitude_;
 
@@ -7,6 +7,9 @@
 
 #include "TrajectoryLibrary.hpp"
 
+#include <algorithm>
+#include <cmath>
+
 // Constructor that loads a trajectorys from a directory
 TrajectoryLibrary::TrajectoryLibrary(double ground_safety_distance)
 {
@@ -100,108 +103,282 @@ const Trajectory* TrajectoryLibrary::GetTrajectoryByNumber(int number) const {
 
 }
 
+/**
+ * Gets the order FindFarthestTrajectory looks at trajectories in: the
+ * preferred one first, then the rest in order.
+ */
+std::vector<int> TrajectoryLibrary::GetSearchOrder(int preferred_traj) const {
+
+    if (preferred_traj >= GetNumberTrajectories()) {
+        std::cerr << "WARNING: preferred trajectory number exceeds library size, ignoring it." << std::endl;
+        preferred_traj = -1;
+    }
+
+    std::vector<int> search_order;
+
+    if (preferred_traj >= 0) {
+        search_order.push_back(preferred_traj);
+    }
+
+    for (int i = 0; i < GetNumberTrajectories(); i++) {
+        if (i != preferred_traj) {
+            search_order.push_back(i);
+        }
+    }
+
+    return search_order;
+}
+
+/**
+ * Searches the points of a trajectory for the closest obstacle.
+ *
+ * @param octomap obstacle map
+ * @param traj trajectory to search
+ * @param body_to_local where the aircraft is in the map
+ * @param stride only search every stride-th point, starting with the first
+ * @param stop_distance stop as soon as a point is at or below this distance,
+ *  or -1 to search all of them
+ * @param transformed_points buffer for 3 doubles per point searched
+ * @param point_distances buffer for a double per point searched
+ * @param closest_out distance to the closest obstacle over the points that
+ *  were searched, or -1 if there are no obstacles
+ *
+ * @retval false if the search stopped early
+ */
+bool TrajectoryLibrary::SearchTrajectory(const StereoOctomap &octomap, const Trajectory &traj, const BotTrans &body_to_local, int stride, double stop_distance, double *transformed_points, double *point_distances, double *closest_out) const {
+
+    int number_of_points = (traj.GetNumberOfPoints() + stride - 1) / stride;
+
+    traj.GetXyzYawTransformedPoints(body_to_local, 0, stride, number_of_points, transformed_points);
+
+    // so points we don't get to aren't counted
+    std::fill(point_distances, point_distances + number_of_points, -1);
+
+    // in time order, so the start of the trajectory, which we'll fly first,
+    // is searched first
+    bool finished = octomap.NearestNeighbors(transformed_points, number_of_points, point_distances, stop_distance);
+
+    double closest_obstacle_distance = -1;
+
+    for (int j = 0; j < number_of_points; j++) {
+        double distance_to_point = point_distances[j];
+        if (distance_to_point >= 0) {
+            if (distance_to_point < closest_obstacle_distance || closest_obstacle_distance < 0) {
+                closest_obstacle_distance = distance_to_point;
+            }
+        }
+    }
+
+    *closest_out = closest_obstacle_distance;
+
+    return finished;
+}
+
 /**
  * Finds the first Trajectory that is at least "threshold" distance away from any obstacle and the ground.
  * In the case  that there is no such trajectory, returns the trajectory that is furthest from obstacles and
  * the ground.
  *
+ * Gives the same result as FindFarthestTrajectoryExhaustive, but bounds each
+ * trajectory first so it can skip most of the points:
+ *
+ *   1) The closest obstacle to a few points spread along each trajectory is
+ *      an upper bound on its distance.
+ *
+ *   2) In search order, each trajectory whose bound is above the threshold
+ *      is searched until a point is within the threshold.  The first one
+ *      without any such point is the answer.
+ *
+ *   3) Otherwise, in order of decreasing bound, each trajectory is searched
+ *      until a point is as close as the best trajectory so far.  Once the
+ *      bound can't beat the best, we're done.
+ *
  * @param octomap obstacle map
  * @param body_to_local tranform for the aircraft that describes where we are in the map
  * @param threshold minimum safe distance for the aircraft
- * @param trajectory_out pointer that will be set to the best trajectory
  * @param (optional) lcmgl if not NULL, will draw debug data
+ * @param (optional) preferred_traj trajectory to check first
  *
- * @retval the distance to the closest obstacle or -1 if there are no obstacles
+ * @retval the distance to the closest obstacle or -1 if there are no obstacles, and the trajectory
  */
 std::tuple<double, const Trajectory*> TrajectoryLibrary::FindFarthestTrajectory(const StereoOctomap &octomap, const BotTrans &body_to_local, double threshold, bot_lcmgl_t* lcmgl, int preferred_traj) const {
 
-    const Trajectory *farthest_traj = nullptr;
-
-    double traj_closest_dist = -1;
+    std::vector<int> search_order = GetSearchOrder(preferred_traj);
+    int number_of_trajectories = search_order.size();
 
-    if (lcmgl != NULL) {
-        bot_lcmgl_push_matrix(lcmgl);
+    // buffers for the points of one trajectory, big enough for any of them
+    int max_number_of_points = 0;
+    for (const Trajectory &traj : traj_vec_) {
+        max_number_of_points = std::max(max_number_of_points, traj.GetNumberOfPoints());
     }
 
+    std::vector<double> transformed_points(3 * max_number_of_points);
+    std::vector<double> point_distances(max_number_of_points);
 
-    // for each point in each trajectory, find the point that is closest in the octree
-    for (int i = 0; i < GetNumberTrajectories(); i++) {
+    // upper bound on each trajectory's distance, by position in the search
+    // order, and whether the bound is its exact distance
+    std::vector<double> bound(number_of_trajectories);
+    std::vector<bool> exact(number_of_trajectories);
 
-        int this_traj = i;
+    for (int k = 0; k < number_of_trajectories; k++) {
+        const Trajectory &traj = traj_vec_.at(search_order[k]);
 
-        if (preferred_traj >= GetNumberTrajectories()) {
-            std::cerr << "WARNING: preferred trajectory number exceeds library size, ignoring it." << std::endl;
-            preferred_traj = -1;
+        // check minumum altitude
+        double min_altitude = traj.GetMinimumAltitude() + body_to_local.trans_vec[2];
+        if (min_altitude < ground_safety_distance_) {
+            // this trajectory would impact the ground
+            bound[k] = 0;
+            exact[k] = true;
+            continue;
         }
 
-        if (preferred_traj >= 0) {
-            // there is a preferred trajectory active
+        int stride = std::max(1, traj.GetNumberOfPoints() / TRAJECTORY_BOUND_SAMPLES);
 
-            if (i == 0) {
-                // search for the preferred traj
-                this_traj = preferred_traj;
-            } else {
-                // searching for something else, make sure to skip searching
-                // for the preferred traj
-                if (i <= preferred_traj) {
-                    this_traj = i - 1;
-                } else {
-                    this_traj = i;
-                }
-            }
+        SearchTrajectory(octomap, traj, body_to_local, stride, -1, transformed_points.data(), point_distances.data(), &bound[k]);
+
+        if (bound[k] < 0) {
+            // no obstacles at all, nothing to bound
+            return FindFarthestTrajectoryExhaustive(octomap, body_to_local, threshold, lcmgl, preferred_traj);
         }
 
-        //std::cout << "Searching trajectory: " << this_traj << std::endl;
+        exact[k] = stride == 1;
+    }
 
-        double closest_obstacle_distance = -1;
+    int best = -1;
+    double best_dist = -1;
 
-        int number_of_points = traj_vec_.at(this_traj).GetNumberOfPoints();
-        vector<double> point_distances(number_of_points);
+    // look for the first trajectory in the search order that is far enough
+    // away
+    for (int k = 0; k < number_of_trajectories && best < 0; k++) {
+        if (bound[k] <= threshold) {
+            // can't be far enough away
+            continue;
+        }
 
-        // check minumum altitude
-        double min_altitude = traj_vec_.at(this_traj).GetMinimumAltitude() + body_to_local.trans_vec[2];
-        if (min_altitude < ground_safety_distance_) {
-            // this trajectory would impact the ground
-            closest_obstacle_distance = 0;
-            //std::cout << "Trajectory " << this_traj << " would violate ground safety." << std::endl;
-        } else {
+        double dist;
 
-            // for each trajectory, look at each point
+        if (exact[k]) {
+            dist = bound[k];
+        } else if (SearchTrajectory(octomap, traj_vec_.at(search_order[k]), body_to_local, 1, threshold, transformed_points.data(), point_distances.data(), &dist) == false) {
+            // it's within the threshold somewhere, tighten its bound
+            bound[k] = std::min(bound[k], dist);
+            continue;
+        }
 
-            // use all availble processors
-            #pragma omp parallel for
-            for (int j = 0; j < number_of_points; j++) {
-                // now we are looking at a single point in a trajectorybot_lcmgl_t *lcmgl
+        exact[k] = true;
 
-                double transformedPoint[3];
+        if (dist > threshold) {
+            // we are satisfied with this one, run it!
+            best = k;
+            best_dist = dist;
+        }
+    }
+
+    if (best < 0) {
+        // nothing is far enough away, so find the farthest, breaking ties by
+        // the search order
+        std::vector<int> bound_order(number_of_trajectories);
+        for (int k = 0; k < number_of_trajectories; k++) {
+            bound_order[k] = k;
+        }
 
-                double this_t = traj_vec_.at(this_traj).GetTimeAtIndex(j);
+        std::stable_sort(bound_order.begin(), bound_order.end(), [&bound](int a, int b) { return bound[a] > bound[b]; });
 
-                traj_vec_.at(this_traj).GetXyzYawTransformedPoint(this_t, body_to_local, transformedPoint);
+        for (int k : bound_order) {
 
-                //std::cout << "searching at (" << transformedPoint[0] << ", " << transformedPoint[1] << ", " << transformedPoint[2] << ")...";
+            if (best >= 0 && (bound[k] < best_dist || (bound[k] == best_dist && k > best))) {
+                // nothing left can beat the best
+                break;
+            }
 
-                point_distances.at(j) = octomap.NearestNeighbor(transformedPoint);
+            double dist;
 
-                //std::cout << "distance is: " << distance_to_point << std::endl;
+            if (exact[k]) {
+                dist = bound[k];
+            } else {
+                // to beat the best, we need to be farther, or as far if we
+                // come first in the search order
+                double stop_distance = -1;
 
-            }
+                if (best >= 0) {
+                    stop_distance = k < best ? std::nextafter(best_dist, -1.0) : best_dist;
+                }
 
-            for (int j = 0; j < number_of_points; j++) {
-                double distance_to_point = point_distances.at(j);
-                if (distance_to_point >= 0) {
-                    if (distance_to_point < closest_obstacle_distance || closest_obstacle_distance < 0) {
-                        closest_obstacle_distance = distance_to_point;
-                    }
+                if (SearchTrajectory(octomap, traj_vec_.at(search_order[k]), body_to_local, 1, stop_distance, transformed_points.data(), point_distances.data(), &dist) == false) {
+                    continue;
                 }
             }
+
+            if (best < 0 || dist > best_dist || (dist == best_dist && k < best)) {
+                best = k;
+                best_dist = dist;
+            }
         }
+    }
 
-        //std::cout << "Trajectory " << this_traj << " has distance = " << closest_obstacle_distance << std::endl;
+    const Trajectory *farthest_traj = best >= 0 ? &traj_vec_.at(search_order[best]) : nullptr;
 
-        //if (lcmgl != nullptr) {
-            //traj_vector_[this_traj].PlotTransformedTrajectory(lcmgl, body_to_local);
-        //}
+    if (lcmgl != nullptr) {
+        bot_lcmgl_push_matrix(lcmgl);
+
+        // plot the best trajectory
+        if (farthest_traj != NULL) {
+            bot_lcmgl_color3f(lcmgl, 1, 0, 0);
+            farthest_traj->Draw(lcmgl, &body_to_local);
+        }
+
+        bot_lcmgl_pop_matrix(lcmgl);
+        bot_lcmgl_switch_buffer(lcmgl);
+    }
+
+    return std::tuple<double, const Trajectory*>(best_dist, farthest_traj);
+}
+
+/**
+ * Finds the farthest trajectory as FindFarthestTrajectory does, by searching
+ * every point of every trajectory.  Used when there are no obstacles to bound
+ * against and to check FindFarthestTrajectory.
+ *
+ * @param octomap obstacle map
+ * @param body_to_local tranform for the aircraft that describes where we are in the map
+ * @param threshold minimum safe distance for the aircraft
+ * @param (optional) lcmgl if not NULL, will draw debug data
+ * @param (optional) preferred_traj trajectory to check first
+ *
+ * @retval the distance to the closest obstacle or -1 if there are no obstacles, and the trajectory
+ */
+std::tuple<double, const Trajectory*> TrajectoryLibrary::FindFarthestTrajectoryExhaustive(const StereoOctomap &octomap, const BotTrans &body_to_local, double threshold, bot_lcmgl_t* lcmgl, int preferred_traj) const {
+
+    const Trajectory *farthest_traj = nullptr;
+
+    double traj_closest_dist = -1;
+
+    if (lcmgl != NULL) {
+        bot_lcmgl_push_matrix(lcmgl);
+    }
+
+    // buffers for the points of one trajectory, big enough for any of them
+    int max_number_of_points = 0;
+    for (const Trajectory &traj : traj_vec_) {
+        max_number_of_points = std::max(max_number_of_points, traj.GetNumberOfPoints());
+    }
+
+    std::vector<double> transformed_points(3 * max_number_of_points);
+    std::vector<double> point_distances(max_number_of_points);
+
+    // for each point in each trajectory, find the point that is closest in the octree
+    for (int this_traj : GetSearchOrder(preferred_traj)) {
+
+        double closest_obstacle_distance = -1;
+
+        // check minumum altitude
+        double min_altitude = traj_vec_.at(this_traj).GetMinimumAltitude() + body_to_local.trans_vec[2];
+        if (min_altitude < ground_safety_distance_) {
+            // this trajectory would impact the ground
+            closest_obstacle_distance = 0;
+        } else {
+            SearchTrajectory(octomap, traj_vec_.at(this_traj), body_to_local, 1, -1, transformed_points.data(), point_distances.data(), &closest_obstacle_distance);
+        }
 
         if (traj_closest_dist == -1 || closest_obstacle_distance > traj_closest_dist) {
             traj_closest_dist = closest_obstacle_distance;
@@ -209,16 +386,7 @@ std::tuple<double, const Trajectory*> TrajectoryLibrary::FindFarthestTrajectory(
 
             if (traj_closest_dist > threshold || traj_closest_dist < 0) {
                 // we are satisfied with this one, run it!
-                if (lcmgl != NULL) {
-                    bot_lcmgl_color3f(lcmgl, 1, 0, 0);
-                    farthest_traj->Draw(lcmgl, &body_to_local);
-                    bot_lcmgl_pop_matrix(lcmgl);
-                    bot_lcmgl_switch_buffer(lcmgl);
-                }
-
-                //std::cout << "Trajectory " << this_traj << " is good enough, running!" << std::endl;
-
-                return std::tuple<double, const Trajectory*>(traj_closest_dist, farthest_traj);
+                break;
             }
         }
     }
@@ -26,6 +26,9 @@
 #include "Trajectory.hpp"
 #include "../../estimators/StereoOctomap/StereoOctomap.hpp"
 
+// points per trajectory that FindFarthestTrajectory searches to bound it
+#define TRAJECTORY_BOUND_SAMPLES 8
+
 class TrajectoryLibrary
 {
 
@@ -40,6 +43,7 @@ class TrajectoryLibrary
         bool LoadLibrary(std::string dirname, bool quiet = false);  // loads a trajectory from a directory of .csv files
 
         std::tuple<double, const Trajectory*> FindFarthestTrajectory(const StereoOctomap &octomap, const BotTrans &bodyToLocal, double threshold, bot_lcmgl_t* lcmgl = nullptr, int preferred_traj = -1) const;
+        std::tuple<double, const Trajectory*> FindFarthestTrajectoryExhaustive(const StereoOctomap &octomap, const BotTrans &bodyToLocal, double threshold, bot_lcmgl_t* lcmgl = nullptr, int preferred_traj = -1) const;
 
         void Print() const;
         void Draw(lcm_t *lcm, const BotTrans *transform = nullptr) const;
@@ -47,6 +51,9 @@ class TrajectoryLibrary
 
 
     private:
+        std::vector<int> GetSearchOrder(int preferred_traj) const;
+        bool SearchTrajectory(const StereoOctomap &octomap, const Trajectory &traj, const BotTrans &body_to_local, int stride, double stop_distance, double *transformed_points, double *point_distances, double *closest_out) const;
+
         std::vector<Trajectory> traj_vec_;
         double ground_safety_distance_;
 
@@ -233,6 +233,56 @@ TEST_F(TrajectoryLibraryTest, GetTransformedPoint) {
 
 }
 
+/**
+ * Check that transforming a batch of points gives the same points as
+ * transforming them one at a time
+ */
+TEST_F(TrajectoryLibraryTest, GetTransformedPoints) {
+    Trajectory traj("trajtest/ti/TI-test-TI-straight-pd-no-yaw-00000", true);
+
+    BotTrans trans;
+    bot_trans_set_identity(&trans);
+
+    trans.trans_vec[0] = 1;
+    trans.trans_vec[1] = -2;
+    trans.trans_vec[2] = 30;
+
+    // roll, pitch, and yaw, but only yaw should be applied
+    double rpy[3] = { 0.1, -0.2, 0.7 };
+    bot_roll_pitch_yaw_to_quat(rpy, trans.rot_quat);
+
+    int stride = 3;
+    int first_index = 2;
+    int number_of_points = (traj.GetNumberOfPoints() - first_index) / stride;
+
+    ASSERT_TRUE(number_of_points > 0);
+
+    std::vector<double> points(3 * number_of_points);
+
+    traj.GetXyzYawTransformedPoints(trans, first_index, stride, number_of_points, points.data());
+
+    // the same transform without roll and pitch
+    BotTrans trans_yaw;
+    bot_trans_copy(&trans_yaw, &trans);
+
+    rpy[0] = 0;
+    rpy[1] = 0;
+    bot_roll_pitch_yaw_to_quat(rpy, trans_yaw.rot_quat);
+
+    for (int i = 0; i < number_of_points; i++) {
+        Eigen::VectorXd state = traj.GetState(traj.GetTimeAtIndex(first_index + i * stride));
+
+        double point[3] = { state(0), state(1), state(2) };
+        double expected[3];
+
+        bot_trans_apply_vec(&trans_yaw, point, expected);
+
+        for (int j = 0; j < 3; j++) {
+            EXPECT_NEAR(expected[j], points[3*i + j], TOLERANCE);
+        }
+    }
+}
+
 TEST_F(TrajectoryLibraryTest, CheckBounds) {
     Trajectory traj("trajtest/simple/two-point-00000", true);
 
@@ -564,6 +614,88 @@ TEST_F(TrajectoryLibraryTest, TimingTest) {
     double num_sec = toc();
 
     std::cout << num_lookups <<  " lookups with " << lib.GetNumberTrajectories() << " trajectories on a cloud (" << num_points << ") took: " << num_sec << " sec (" << num_sec / (double)num_lookups*1000.0 << " ms / lookup)" << std::endl;
+
+    // compare against searching every point on the full library
+    TrajectoryLibrary trajlib(0);
+    ASSERT_TRUE(trajlib.LoadLibrary("trajlib", true));
+
+    for (double threshold : {5.0, 50.0}) {
+        double dist, dist_exhaustive;
+        const Trajectory *best_traj, *best_traj_exhaustive;
+
+        tic();
+
+        for (int i = 0; i < num_lookups; i++) {
+            std::tie(dist_exhaustive, best_traj_exhaustive) = trajlib.FindFarthestTrajectoryExhaustive(octomap, trans, threshold);
+        }
+
+        double num_sec_exhaustive = toc();
+
+        tic();
+
+        for (int i = 0; i < num_lookups; i++) {
+            std::tie(dist, best_traj) = trajlib.FindFarthestTrajectory(octomap, trans, threshold);
+        }
+
+        num_sec = toc();
+
+        EXPECT_EQ_ARM(dist, dist_exhaustive);
+        EXPECT_TRUE(best_traj == best_traj_exhaustive);
+
+        std::cout << num_lookups <<  " lookups with " << trajlib.GetNumberTrajectories() << " trajectories (threshold = " << threshold << ") took: " << num_sec << " sec (" << num_sec / (double)num_lookups*1000.0 << " ms / lookup), exhaustive took: " << num_sec_exhaustive << " sec (" << num_sec_exhaustive / (double)num_lookups*1000.0 << " ms / lookup), speedup: " << num_sec_exhaustive / num_sec << "x" << std::endl;
+    }
+}
+
+/**
+ * Check that the bounded search gives the same trajectory as searching every
+ * point, for thresholds that some, all, or none of the trajectories meet.
+ */
+TEST_F(TrajectoryLibraryTest, FindFarthestMatchesExhaustive) {
+
+    double altitude = 30;
+
+    std::uniform_real_distribution<double> uniform_dist(-30, 30);
+    std::default_random_engine rand_engine(17);
+
+    for (std::string dir : {"trajtest/many", "trajlib"}) {
+
+        TrajectoryLibrary lib(0);
+        ASSERT_TRUE(lib.LoadLibrary(dir, true));
+
+        for (int trial = 0; trial < 5; trial++) {
+
+            StereoOctomap octomap(bot_frames_);
+
+            int num_points = 200;
+            float x[num_points], y[num_points], z[num_points];
+
+            for (int i = 0; i < num_points; i++) {
+                x[i] = uniform_dist(rand_engine) + 30;
+                y[i] = uniform_dist(rand_engine);
+                z[i] = uniform_dist(rand_engine);
+            }
+
+            AddManyPointsToOctree(&octomap, x, y, z, num_points, altitude);
+
+            BotTrans trans;
+            bot_trans_set_identity(&trans);
+            trans.trans_vec[2] = altitude;
+
+            for (double threshold : {0.5, 2.0, 5.0, 50.0}) {
+                for (int preferred_traj = -1; preferred_traj < lib.GetNumberTrajectories(); preferred_traj += 3) {
+
+                    double dist, dist_exhaustive;
+                    const Trajectory *best_traj, *best_traj_exhaustive;
+
+                    std::tie(dist, best_traj) = lib.FindFarthestTrajectory(octomap, trans, threshold, nullptr, preferred_traj);
+                    std::tie(dist_exhaustive, best_traj_exhaustive) = lib.FindFarthestTrajectoryExhaustive(octomap, trans, threshold, nullptr, preferred_traj);
+
+                    EXPECT_EQ_ARM(dist, dist_exhaustive);
+                    EXPECT_TRUE(best_traj == best_traj_exhaustive) << dir << ", threshold = " << threshold << ", preferred = " << preferred_traj;
+                }
+            }
+        }
+    }
 }
 
 TEST_F(TrajectoryLibraryTest, RemainderTrajectorySimple) {
@@ -39,7 +39,42 @@ StateMachineControl::StateMachineControl(lcm::LCM *lcm, std::string traj_dir, st
 
     int stable_traj_num = bot_param_get_int_or_fail(param_, "tvlqr_controller.stable_controller");
 
-    octomap_ = new StereoOctomap(bot_frames_);
+    // optional, defaults to the octree
+    ObstacleMapBackend map_backend = OCTREE_BACKEND;
+    char *map_backend_str;
+    if (bot_param_get_str(param_, "obstacle_avoidance.map_backend", &map_backend_str) >= 0) {
+        if (std::string(map_backend_str) == "voxel_ring") {
+            map_backend = VOXEL_RING_BACKEND;
+        } else if (std::string(map_backend_str) != "octree") {
+            std::cerr << "ERROR: obstacle_avoidance.map_backend must be \"octree\" or \"voxel_ring\"." << std::endl;
+            exit(1);
+        }
+        free(map_backend_str);
+    }
+
+    double map_horizon = OCTREE_LIFE / 1000000.0;
+    bot_param_get_double(param_, "obstacle_avoidance.map_horizon", &map_horizon);
+
+    octomap_ = new StereoOctomap(bot_frames_, map_backend, map_horizon * 1000000.0);
+
+    // optional, 0 leaves it off
+    double distance_field_resolution = 0;
+    bot_param_get_double(param_, "obstacle_avoidance.distance_field_resolution", &distance_field_resolution);
+
+    if (distance_field_resolution > 0) {
+        double distance_field_window = bot_param_get_double_or_fail(param_, "obstacle_avoidance.distance_field_window");
+        double distance_field_max_distance = bot_param_get_double_or_fail(param_, "obstacle_avoidance.distance_field_max_distance");
+
+        if (distance_field_max_distance <= safe_distance_ + min_improvement_to_switch_trajs_) {
+            std::cerr << "ERROR: obstacle_avoidance.distance_field_max_distance must be greater than safe_distance_threshold + min_improvement_to_switch_trajs." << std::endl;
+            exit(1);
+        }
+
+        if (octomap_->EnableDistanceField(distance_field_resolution, distance_field_window, distance_field_max_distance) == false) {
+            std::cerr << "ERROR: obstacle_avoidance.distance_field_resolution needs map_backend = \"voxel_ring\"." << std::endl;
+            exit(1);
+        }
+    }
 
     trajlib_ = new TrajectoryLibrary(ground_safety_distance_);
 
@@ -0,0 +1,231 @@
+#include "DistanceField.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+/**
+ * @param resolution spacing of the nodes in meters
+ * @param window_size edge length of the window in meters
+ * @param max_distance distances are capped at this, and inserting a point
+ *  touches every node within it, so keep it just above the largest
+ *  distance you care about
+ * @param num_slices number of time slices, as in the VoxelRingMap
+ */
+DistanceField::DistanceField(double resolution, double window_size, double max_distance, int num_slices) {
+    resolution_ = resolution;
+    max_distance_ = max_distance;
+    num_slices_ = num_slices;
+
+    size_ = std::max(2, (int)ceil(window_size / resolution_) + 1);
+
+    num_nodes_ = size_ * size_ * size_;
+    levels_.resize((size_t)num_nodes_ * num_slices_);
+
+    origin_[0] = 0;
+    origin_[1] = 0;
+    origin_[2] = 0;
+
+    Clear();
+}
+
+double DistanceField::GetTolerance() const {
+    return resolution_ * sqrt(3.0) / 2.0 + max_distance_ * sqrt(1.0 / DISTANCE_FIELD_LEVELS);
+}
+
+/**
+ * Resets every node to max_distance.
+ */
+void DistanceField::Clear() {
+    std::fill(levels_.begin(), levels_.end(), DISTANCE_FIELD_LEVELS);
+    centered_ = false;
+}
+
+/**
+ * Resets the slices' layers, for when their points have expired.
+ *
+ * @param slice_mask bitmask of the slices to clear
+ */
+void DistanceField::ClearSlices(uint32_t slice_mask) {
+
+    slice_mask &= (num_slices_ >= 32) ? ~0u : (1u << num_slices_) - 1;
+
+    if (slice_mask == 0) {
+        return;
+    }
+
+    for (int slice = 0; slice < num_slices_; slice++) {
+        if (slice_mask & (1u << slice)) {
+            uint16_t *level = levels_.data() + (size_t)slice * num_nodes_;
+
+            std::fill(level, level + num_nodes_, DISTANCE_FIELD_LEVELS);
+        }
+    }
+}
+
+/**
+ * Moves the window to be around a point.  The window only moves once the
+ * point is a quarter of the window away from its center.
+ *
+ * The field is cleared when the window moves, so the caller needs to
+ * insert all of its points again.
+ *
+ * @param center point to center on, usually the aircraft
+ *
+ * @retval true if the window moved
+ */
+bool DistanceField::SetCenter(const double center[3]) {
+
+    int64_t new_origin[3];
+    bool move = !centered_;
+
+    for (int i = 0; i < 3; i++) {
+        new_origin[i] = (int64_t)floor(center[i] / resolution_ + 0.5) - size_ / 2;
+
+        if (llabs(new_origin[i] - origin_[i]) > size_ / 4) {
+            move = true;
+        }
+    }
+
+    if (!move) {
+        return false;
+    }
+
+    Clear();
+
+    for (int i = 0; i < 3; i++) {
+        origin_[i] = new_origin[i];
+    }
+    centered_ = true;
+
+    return true;
+}
+
+/**
+ * Lowers every node within max_distance of a point to its distance from
+ * the point.
+ *
+ * @param point xyz point to add
+ * @param slice time slice the point is in
+ */
+void DistanceField::InsertPoint(const double point[3], int slice) {
+
+    if (!centered_) {
+        return;
+    }
+
+    // the point, in node units from the window's first node
+    double p[3];
+    int low[3], high[3];
+
+    double radius = max_distance_ / resolution_;
+
+    for (int i = 0; i < 3; i++) {
+        p[i] = point[i] / resolution_ - origin_[i];
+
+        if (p[i] + radius < 0 || p[i] - radius > size_ - 1) {
+            // nowhere near the window
+            return;
+        }
+
+        low[i] = std::max(0, (int)ceil(p[i] - radius));
+        high[i] = std::min(size_ - 1, (int)floor(p[i] + radius));
+    }
+
+    float radius_sq = radius * radius;
+    float scale = DISTANCE_FIELD_LEVELS / radius_sq;
+
+    uint16_t *layer = levels_.data() + (size_t)slice * num_nodes_;
+
+    for (int iz = low[2]; iz <= high[2]; iz++) {
+        float dz = iz - p[2];
+        float dz_sq = dz * dz;
+
+        for (int iy = low[1]; iy <= high[1]; iy++) {
+            float dy = iy - p[1];
+            float dyz_sq = dz_sq + dy * dy;
+
+            if (dyz_sq >= radius_sq) {
+                continue;
+            }
+
+            // only the part of the row inside the sphere
+            float half_width = sqrtf(radius_sq - dyz_sq);
+            int x_start = std::max(low[0], (int)ceilf(p[0] - half_width));
+            int x_end = std::min(high[0], (int)floorf(p[0] + half_width));
+
+            uint16_t *level = layer + GetIndex(0, iy, iz);
+            float px = p[0];
+
+            for (int ix = x_start; ix <= x_end; ix++) {
+                float dx = ix - px;
+
+                // truncate so the field never says an obstacle is
+                // farther than it is
+                uint16_t this_level = (dx * dx + dyz_sq) * scale;
+
+                level[ix] = std::min(level[ix], this_level);
+            }
+        }
+    }
+}
+
+/**
+ * Looks up the distance to the nearest point, capped at max_distance.
+ *
+ * @param point xyz point to look up
+ * @param distance output distance, within GetTolerance() of
+ *  min(exact distance, max_distance)
+ *
+ * @retval false if the point is outside the window
+ */
+bool DistanceField::Lookup(const double point[3], double *distance) const {
+
+    if (!centered_) {
+        return false;
+    }
+
+    int base[3];
+    double frac[3];
+
+    for (int i = 0; i < 3; i++) {
+        double p = point[i] / resolution_ - origin_[i];
+        double p_floor = floor(p);
+
+        if (p_floor < 0 || p_floor >= size_ - 1) {
+            return false;
+        }
+
+        base[i] = (int)p_floor;
+        frac[i] = p - p_floor;
+    }
+
+    // nearest over all slices at each corner
+    double corner[8];
+
+    for (int c = 0; c < 8; c++) {
+        const uint16_t *level = levels_.data() + GetIndex(base[0] + (c & 1), base[1] + ((c >> 1) & 1), base[2] + ((c >> 2) & 1));
+
+        uint16_t nearest = level[0];
+        for (int slice = 1; slice < num_slices_; slice++) {
+            nearest = std::min(nearest, level[slice * num_nodes_]);
+        }
+
+        corner[c] = sqrt((double)nearest);
+    }
+
+    double x00 = corner[0] + frac[0] * (corner[1] - corner[0]);
+    double x10 = corner[2] + frac[0] * (corner[3] - corner[2]);
+    double x01 = corner[4] + frac[0] * (corner[5] - corner[4]);
+    double x11 = corner[6] + frac[0] * (corner[7] - corner[6]);
+
+    double y0 = x00 + frac[1] * (x10 - x00);
+    double y1 = x01 + frac[1] * (x11 - x01);
+
+    double level = y0 + frac[2] * (y1 - y0);
+
+    *distance = level * max_distance_ * sqrt(1.0 / DISTANCE_FIELD_LEVELS);
+
+    return true;
+}
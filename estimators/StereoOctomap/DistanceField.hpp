@@ -0,0 +1,72 @@
+/**
+ * Bounded-radius Euclidean distance field over a window that follows the
+ * aircraft, for answering nearest neighbor queries with a lookup.
+ *
+ * The window is a cube of nodes spaced resolution apart.  Each node holds,
+ * for each time slice of the VoxelRingMap it mirrors, the distance to the
+ * nearest point of that slice, capped at max_distance.  Inserting a point
+ * lowers the nodes within max_distance of it; expiring a slice resets its
+ * layer.  A query takes the minimum over slices at the 8 nodes around it
+ * and interpolates trilinearly.
+ *
+ * Distance is 1-Lipschitz, so the interpolated value is within
+ * resolution * sqrt(3) / 2 of min(exact distance, max_distance), plus the
+ * quantization of the stored distances.  GetTolerance() returns that
+ * bound.
+ *
+ * Each slice's layer is contiguous and holds squared distances, so the
+ * inner loop of an insertion is a multiply-add and a min over a row of
+ * nodes.
+ *
+ * (C) 2015 Andrew Barry <abarry@csail.mit.edu>
+ */
+
+#ifndef DISTANCE_FIELD_H_
+#define DISTANCE_FIELD_H_
+
+#include <stdint.h>
+#include <vector>
+
+// squared distances are stored in 16 bits, in units of max_distance^2 / this
+#define DISTANCE_FIELD_LEVELS 65535
+
+class DistanceField {
+
+    public:
+
+        DistanceField(double resolution, double window_size, double max_distance, int num_slices);
+
+        bool SetCenter(const double center[3]);
+
+        void InsertPoint(const double point[3], int slice);
+
+        void ClearSlices(uint32_t slice_mask);
+        void Clear();
+
+        bool Lookup(const double point[3], double *distance) const;
+
+        double GetMaxDistance() const { return max_distance_; }
+        double GetTolerance() const;
+
+    private:
+
+        int GetIndex(int ix, int iy, int iz) const { return (iz * size_ + iy) * size_ + ix; }
+
+        double resolution_;
+        double max_distance_;
+        int num_slices_;
+
+        // nodes per side of the window
+        int size_;
+
+        // lattice index of the window's first node
+        int64_t origin_[3];
+        bool centered_;
+
+        int num_nodes_;
+
+        // for each slice, the quantized squared distance at each node
+        std::vector<uint16_t> levels_;
+};
+
+#endif
@@ -1,21 +1,41 @@
 #include "StereoOctomap.hpp"
 
+#include <algorithm>
+
 #define OCTREE_RESOLUTION 128.0f // TODO: set me
 
 
-StereoOctomap::StereoOctomap(BotFrames *bot_frames) {
+/**
+ * @param bot_frames frames to get the camera to local transform from
+ * @param backend data structure to keep the points in
+ * @param horizon how long points stay in the map (in usec).  The octree
+ *  backend keeps them for horizon/2 to horizon.
+ */
+StereoOctomap::StereoOctomap(BotFrames *bot_frames, ObstacleMapBackend backend, int64_t horizon) {
     bot_frames_ = bot_frames;
+    backend_ = backend;
+    horizon_ = horizon;
 
     current_cloud_ = pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>());
     building_cloud_ = pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>());
 
+    if (backend_ == VOXEL_RING_BACKEND) {
+        current_octree_ = NULL;
+        building_octree_ = NULL;
 
-    current_octree_ = new pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(OCTREE_RESOLUTION);
-    current_octree_->setInputCloud((pcl::PointCloud<pcl::PointXYZ>::Ptr)current_cloud_);
+        voxel_map_ = new VoxelRingMap(VOXEL_RING_MAP_DEFAULT_VOXEL_SIZE, horizon_, VOXEL_RING_MAP_DEFAULT_SLICES);
+    } else {
+        current_octree_ = new pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(OCTREE_RESOLUTION);
+        current_octree_->setInputCloud((pcl::PointCloud<pcl::PointXYZ>::Ptr)current_cloud_);
 
-    building_octree_ = new pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(OCTREE_RESOLUTION);
-    building_octree_->setInputCloud(building_cloud_);
+        building_octree_ = new pcl::octree::OctreePointCloudSearch<pcl::PointXYZ>(OCTREE_RESOLUTION);
+        building_octree_->setInputCloud(building_cloud_);
 
+        voxel_map_ = NULL;
+    }
+
+
+    distance_field_ = NULL;
 
     current_octree_timestamp_ = -1;
     building_octree_timestamp_ = -1;
@@ -24,6 +44,61 @@ StereoOctomap::StereoOctomap(BotFrames *bot_frames) {
 
 }
 
+StereoOctomap::~StereoOctomap() {
+    delete current_octree_;
+    delete building_octree_;
+    delete voxel_map_;
+    delete distance_field_;
+}
+
+/**
+ * Keeps a distance field around the aircraft, so NearestNeighbor() is a
+ * lookup for points near it.  Only the VOXEL_RING_BACKEND supports this.
+ *
+ * With the field on, NearestNeighbor() returns min(distance, max_distance),
+ * to within DistanceField::GetTolerance().
+ *
+ * @param resolution spacing of the field's nodes in meters
+ * @param window_size edge length of the window around the aircraft in meters
+ * @param max_distance largest distance the field holds, in meters
+ *
+ * @retval false if this backend can't keep a distance field
+ */
+bool StereoOctomap::EnableDistanceField(double resolution, double window_size, double max_distance) {
+
+    if (backend_ != VOXEL_RING_BACKEND) {
+        std::cerr << "WARNING: the distance field needs the voxel ring backend, not enabling it." << std::endl;
+        return false;
+    }
+
+    delete distance_field_;
+    distance_field_ = new DistanceField(resolution, window_size, max_distance, voxel_map_->GetNumberOfSlices());
+
+    return true;
+}
+
+/**
+ * Moves the distance field's window to the aircraft, refilling it from the
+ * map if it moved.
+ */
+void StereoOctomap::UpdateDistanceFieldCenter() {
+    BotTrans body_to_local;
+    bot_frames_get_trans(bot_frames_, "body", "local", &body_to_local);
+
+    if (distance_field_->SetCenter(body_to_local.trans_vec)) {
+        std::vector<double> x, y, z;
+        std::vector<int> slices;
+
+        voxel_map_->GetPoints(&x, &y, &z, &slices);
+
+        for (int i = 0; i < (int)x.size(); i++) {
+            double point[3] = { x[i], y[i], z[i] };
+
+            distance_field_->InsertPoint(point, slices[i]);
+        }
+    }
+}
+
 void StereoOctomap::ProcessStereoMessage(const lcmt::stereo *msg) {
 
     // get transform from global to body frame
@@ -32,11 +107,23 @@ void StereoOctomap::ProcessStereoMessage(const lcmt::stereo *msg) {
     BotTrans to_open_cv;
     bot_frames_get_trans(bot_frames_, "opencvFrame", "local", &to_open_cv);
 
+    if (backend_ == VOXEL_RING_BACKEND) {
+        // expire old slices before adding the new points
+        uint32_t cleared_slices = voxel_map_->SetTime(msg->timestamp);
+
+        if (distance_field_ != NULL) {
+            distance_field_->ClearSlices(cleared_slices);
+            UpdateDistanceFieldCenter();
+        }
+    }
+
     // insert the points into the octree
     InsertPointsIntoOctree(msg, &to_open_cv);
 
-    // zap the old points from the tree
-    RemoveOldPoints(msg->timestamp);
+    if (backend_ == OCTREE_BACKEND) {
+        // zap the old points from the tree
+        RemoveOldPoints(msg->timestamp);
+    }
 
 }
 
@@ -53,6 +140,15 @@ void StereoOctomap::InsertPointsIntoOctree(const lcmt::stereo *msg, BotTrans *to
         // add the position vector
         bot_trans_apply_vec(to_open_cv, this_point_d, trans_point);
 
+        if (backend_ == VOXEL_RING_BACKEND) {
+            voxel_map_->InsertPoint(trans_point);
+
+            if (distance_field_ != NULL) {
+                distance_field_->InsertPoint(trans_point, voxel_map_->GetCurrentSlice());
+            }
+            continue;
+        }
+
         // add point to cloud
         pcl::PointXYZ this_point(trans_point[0], trans_point[1], trans_point[2]);
         current_octree_->addPointToCloud(this_point, current_cloud_);
@@ -65,7 +161,7 @@ void StereoOctomap::RemoveOldPoints(int64_t last_msg_time) {
     // check timestamps
     if (current_octree_timestamp_ < 0) {
          current_octree_timestamp_ = last_msg_time;
-         building_octree_timestamp_ = last_msg_time + OCTREE_LIFE/2; // half a life in the future
+         building_octree_timestamp_ = last_msg_time + horizon_/2; // half a life in the future
     } else if (current_octree_timestamp_ > last_msg_time) {
         // can happen if you're replaying a log and jump back
 
@@ -76,7 +172,7 @@ void StereoOctomap::RemoveOldPoints(int64_t last_msg_time) {
         // we don't have to delete the clouds since they are shared pointers and will auto-delete
 
         current_octree_timestamp_ = last_msg_time;
-        building_octree_timestamp_ = last_msg_time + OCTREE_LIFE/2;
+        building_octree_timestamp_ = last_msg_time + horizon_/2;
 
         current_cloud_ = pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>());
         building_cloud_ = pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>());
@@ -90,7 +186,7 @@ void StereoOctomap::RemoveOldPoints(int64_t last_msg_time) {
         std::cout << std::endl << "swapping octrees because jump back in time" << std::endl;
 
 
-    } else if (current_octree_timestamp_ + OCTREE_LIFE < last_msg_time && last_msg_time - building_octree_timestamp_ > OCTREE_LIFE/2) {
+    } else if (current_octree_timestamp_ + horizon_ < last_msg_time && last_msg_time - building_octree_timestamp_ > horizon_/2) {
         std::cout << "swapping octrees (old: " << (current_octree_timestamp_ - last_msg_time) / 1000000.0f << ", new: " << (building_octree_timestamp_ - last_msg_time) / 1000000.0f << ")" << std::endl;
         // swap out trees since this one has expired
         delete current_octree_;
@@ -114,43 +210,207 @@ void StereoOctomap::RemoveOldPoints(int64_t last_msg_time) {
 /**
  * Find the distance to the nearest neighbor of a point
  *
+ * With the distance field enabled, this is capped at its max distance and
+ * is within its tolerance of the exact distance.
+ *
  * @param point the xyz point to search
  *
  * @retval distance to the nearest neighbor or -1 if no points found.
  */
 double StereoOctomap::NearestNeighbor(double point[3]) const {
+    double distance;
 
-    pcl::PointXYZ search_point;
-    search_point.x = point[0];
-    search_point.y = point[1];
-    search_point.z = point[2];
+    NearestNeighbors(point, 1, &distance);
 
-    // init output parameters
-    std::vector<int> point_out_indices(1);
-    std::vector<float> k_sqr_distances(1);
+    return distance;
+}
+
+/**
+ * Spreads the low 10 bits of a value out to every third bit.
+ */
+static uint32_t SpreadBits(uint32_t value) {
+    value &= 0x3ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+
+    return value;
+}
+
+/**
+ * Sorts the points in a batch by their Morton code over the batch's
+ * bounding box, so that searches that run one after the other are near
+ * each other in the map.
+ */
+void StereoOctomap::SortByMortonCode(const double *points, int number_of_points) const {
+
+    double low[3], high[3];
+
+    for (int j = 0; j < 3; j++) {
+        low[j] = points[j];
+        high[j] = points[j];
+    }
+
+    for (int i = 1; i < number_of_points; i++) {
+        for (int j = 0; j < 3; j++) {
+            low[j] = std::min(low[j], points[3*i + j]);
+            high[j] = std::max(high[j], points[3*i + j]);
+        }
+    }
 
-    // ensure there is at least one point in the tree
-    if (current_octree_->getLeafCount() < 1) {
-        // no points in octree
-        return -1;
+    double scale[3];
+    for (int j = 0; j < 3; j++) {
+        scale[j] = high[j] > low[j] ? 1023.0 / (high[j] - low[j]) : 0;
     }
 
-    int num_points_found = current_octree_->nearestKSearch(search_point, 1, point_out_indices, k_sqr_distances);
+    query_order_.resize(number_of_points);
 
-    if (num_points_found < 1) {
-        // no points found
-        return -1;
+    for (int i = 0; i < number_of_points; i++) {
+        uint32_t code = 0;
+
+        for (int j = 0; j < 3; j++) {
+            code |= SpreadBits((uint32_t)((points[3*i + j] - low[j]) * scale[j])) << j;
+        }
+
+        query_order_[i] = std::pair<uint32_t, int>(code, i);
+    }
+
+    std::sort(query_order_.begin(), query_order_.end());
+}
+
+/**
+ * Find the distance to the nearest neighbor of each point in a batch.
+ *
+ * Checks for an empty map and sets up the search buffers once for the
+ * whole batch.  Not safe to call from two threads at once, since the
+ * Morton ordering is kept between calls.
+ *
+ * @param points the xyz points to search, one after the other
+ * @param number_of_points number of points
+ * @param distances output distance for each point, as from NearestNeighbor()
+ * @param stop_distance (optional) stop searching as soon as a distance is at
+ *  or below this.  The distances for points that weren't searched are left
+ *  as they were.  -1 searches every point.
+ * @param morton_order (optional) search the points in Morton order
+ *
+ * @retval false if the search stopped early
+ */
+bool StereoOctomap::NearestNeighbors(const double *points, int number_of_points, double *distances, double stop_distance, bool morton_order) const {
+
+    if (number_of_points < 1) {
+        return true;
+    }
+
+    // ensure there is at least one point in the map
+    bool empty;
+
+    if (backend_ == VOXEL_RING_BACKEND) {
+        empty = voxel_map_->GetNumberOfPoints() < 1;
     } else {
+        empty = current_octree_->getLeafCount() < 1;
+    }
+
+    if (empty) {
+        for (int i = 0; i < number_of_points; i++) {
+            distances[i] = -1;
+        }
 
-        return sqrt(k_sqr_distances.at(0));
+        return true;
     }
 
+    if (morton_order && number_of_points > 1) {
+        SortByMortonCode(points, number_of_points);
+    }
+
+    bool stopped = false;
+
+    #pragma omp parallel if (number_of_points > 1)
+    {
+        // output buffers for the octree search
+        std::vector<int> point_out_indices(1);
+        std::vector<float> k_sqr_distances(1);
+
+        #pragma omp for
+        for (int n = 0; n < number_of_points; n++) {
+
+            bool stop;
+            #pragma omp atomic read
+            stop = stopped;
+
+            if (stop) {
+                continue;
+            }
+
+            int i = (morton_order && number_of_points > 1) ? query_order_[n].second : n;
+            const double *point = points + 3*i;
+
+            double distance;
+
+            if (distance_field_ != NULL) {
+                if (distance_field_->Lookup(point, &distance) == false) {
+                    // outside of the window
+                    distance = std::min(voxel_map_->NearestNeighbor(point), distance_field_->GetMaxDistance());
+                }
+
+            } else if (backend_ == VOXEL_RING_BACKEND) {
+                distance = voxel_map_->NearestNeighbor(point);
+
+            } else {
+                pcl::PointXYZ search_point;
+                search_point.x = point[0];
+                search_point.y = point[1];
+                search_point.z = point[2];
+
+                int num_points_found = current_octree_->nearestKSearch(search_point, 1, point_out_indices, k_sqr_distances);
+
+                if (num_points_found < 1) {
+                    // no points found
+                    distance = -1;
+                } else {
+                    distance = sqrt(k_sqr_distances.at(0));
+                }
+            }
+
+            distances[i] = distance;
+
+            if (distance >= 0 && distance <= stop_distance) {
+                #pragma omp atomic write
+                stopped = true;
+            }
+        }
+    }
+
+    return !stopped;
 }
 
+/**
+ * Gets every point in the map, in the local frame.
+ */
+void StereoOctomap::GetPoints(std::vector<double> *x, std::vector<double> *y, std::vector<double> *z) const {
+
+    if (backend_ == VOXEL_RING_BACKEND) {
+        voxel_map_->GetPoints(x, y, z);
+        return;
+    }
+
+    x->clear();
+    y->clear();
+    z->clear();
 
-void StereoOctomap::PrintAllPoints() const {
     for(pcl::PointCloud<pcl::PointXYZ>::iterator it = current_cloud_->begin(); it != current_cloud_->end(); it++) {
-        std::cout << "(" << it->x << ", " << it->y << ", " << it->z << ")" << std::endl;
+        x->push_back(it->x);
+        y->push_back(it->y);
+        z->push_back(it->z);
+    }
+}
+
+void StereoOctomap::PrintAllPoints() const {
+    std::vector<double> x, y, z;
+    GetPoints(&x, &y, &z);
+
+    for (int i = 0; i < (int)x.size(); i++) {
+        std::cout << "(" << x[i] << ", " << y[i] << ", " << z[i] << ")" << std::endl;
     }
 
 }
@@ -159,11 +419,14 @@ void StereoOctomap::Draw(lcm_t *lcm) const {
     bot_lcmgl_t *lcmgl = bot_lcmgl_init(lcm, "PointCloud");
     bot_lcmgl_color3f(lcmgl, 1, 0, 0);
 
-    for(pcl::PointCloud<pcl::PointXYZ>::iterator it = current_cloud_->begin(); it != current_cloud_->end(); it++) {
+    std::vector<double> x_points, y_points, z_points;
+    GetPoints(&x_points, &y_points, &z_points);
+
+    for (int i = 0; i < (int)x_points.size(); i++) {
         double xyz[3];
-        xyz[0] = it->x;
-        xyz[1] = it->y;
-        xyz[2] = it->z;
+        xyz[0] = x_points[i];
+        xyz[1] = y_points[i];
+        xyz[2] = z_points[i];
 
         float box_size[3] = { .25, .25, .25 };
 
@@ -189,23 +452,19 @@ void StereoOctomap::PublishToHud(lcm_t *lcm) const {
     msg.frame_number = -1;
     msg.video_number = -1;
 
-    int counter = 0;
+    std::vector<double> x_points, y_points, z_points;
+    GetPoints(&x_points, &y_points, &z_points);
 
-    // point cloud size
-    // TODO: this must be a function call
-    for(pcl::PointCloud<pcl::PointXYZ>::iterator it = current_cloud_->begin(); it != current_cloud_->end(); it++) {
-        counter ++;
-    }
+    int counter = x_points.size();
 
     float x[counter], y[counter], z[counter];
     unsigned char grey[counter];
 
-    int i = 0;
-    for(pcl::PointCloud<pcl::PointXYZ>::iterator it = current_cloud_->begin(); it != current_cloud_->end(); it++) {
+    for (int i = 0; i < counter; i++) {
         double xyz[3], xyz_camera_frame[3];
-        xyz[0] = it->x;
-        xyz[1] = it->y;
-        xyz[2] = it->z;
+        xyz[0] = x_points[i];
+        xyz[1] = y_points[i];
+        xyz[2] = z_points[i];
 
         // transform this point into the camera frame
         bot_trans_apply_vec(&trans, xyz, xyz_camera_frame);
@@ -215,8 +474,6 @@ void StereoOctomap::PublishToHud(lcm_t *lcm) const {
         z[i] = xyz_camera_frame[2];
 
         grey[i] = 0;
-
-        i++;
     }
 
     msg.number_of_points = counter;
@@ -2,6 +2,11 @@
  * Implements a octree data structure using PCL as a backend
  * for pushbroom stereo data.
  *
+ * Can also store the points in a VoxelRingMap, which expires them exactly
+ * at the horizon and inserts each point once instead of into two trees.
+ * That backend can keep a DistanceField around the aircraft too, so
+ * nearest neighbor queries along trajectories are lookups.
+ *
  * Supports checking trajectories against the octree to determine nearest neighbor.
  *
  * (C) 2015 Andrew Barry <abarry@csail.mit.edu>
@@ -28,18 +33,26 @@
 #include "../../LCM/lcmt_stereo_with_xy.h"
 #include "../../LCM/lcmt/stereo.hpp"
 #include "../../sensors/stereo/opencv-stereo-util.hpp"
+#include "VoxelRingMap.hpp"
+#include "DistanceField.hpp"
 
 #define OCTREE_LIFE 4000000 // in usec
 
 using Eigen::Matrix3d;
 using Eigen::Vector3d;
 
+enum ObstacleMapBackend {
+    OCTREE_BACKEND,
+    VOXEL_RING_BACKEND
+};
+
 
 class StereoOctomap {
 
     public:
 
-        StereoOctomap(BotFrames *bot_frames);
+        StereoOctomap(BotFrames *bot_frames, ObstacleMapBackend backend = OCTREE_BACKEND, int64_t horizon = OCTREE_LIFE);
+        ~StereoOctomap();
 
         void ProcessStereoMessage(const lcmt::stereo *msg);
 
@@ -60,12 +73,21 @@ class StereoOctomap {
 
 
         double NearestNeighbor(double point[3]) const;
+        bool NearestNeighbors(const double *points, int number_of_points, double *distances, double stop_distance = -1, bool morton_order = false) const;
+
+        ObstacleMapBackend GetBackend() const { return backend_; }
+
+        bool EnableDistanceField(double resolution, double window_size, double max_distance);
+        const DistanceField* GetDistanceField() const { return distance_field_; }
 
 
     private:
 
         void InsertPointsIntoOctree(const lcmt::stereo *msg, BotTrans *to_open_cv);
         void RemoveOldPoints(int64_t last_msg_time);
+        void GetPoints(std::vector<double> *x, std::vector<double> *y, std::vector<double> *z) const;
+        void UpdateDistanceFieldCenter();
+        void SortByMortonCode(const double *points, int number_of_points) const;
 
         OpenCvStereoCalibration stereo_calibration_;
         OpenCvStereoConfig stereo_config_;
@@ -81,6 +103,19 @@ class StereoOctomap {
         pcl::PointCloud<pcl::PointXYZ>::Ptr current_cloud_;
         pcl::PointCloud<pcl::PointXYZ>::Ptr building_cloud_;
 
+        ObstacleMapBackend backend_;
+        int64_t horizon_;
+
+        // only used by VOXEL_RING_BACKEND, the octrees are NULL then
+        VoxelRingMap *voxel_map_;
+
+        // NULL unless EnableDistanceField() was called
+        DistanceField *distance_field_;
+
+        // (Morton code, index) for each point of the last batch searched
+        // in Morton order, kept so searches don't allocate
+        mutable std::vector<std::pair<uint32_t, int> > query_order_;
+
 
 
 
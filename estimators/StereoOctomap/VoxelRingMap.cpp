@@ -0,0 +1,338 @@
+#include "VoxelRingMap.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+
+/**
+ * @param voxel_size edge length of a voxel in meters.  Nearest neighbor
+ *  searches scan whole voxels, so this should be around the distances you
+ *  query for.
+ * @param horizon how long points stay in the map (in usec)
+ * @param num_slices how many time slices the horizon is split into.  Points
+ *  expire between horizon - horizon / num_slices and horizon after the
+ *  message they came in.
+ */
+VoxelRingMap::VoxelRingMap(double voxel_size, int64_t horizon, int num_slices) {
+
+    if (num_slices < 1 || num_slices > VOXEL_RING_MAP_MAX_SLICES) {
+        std::cerr << "WARNING: VoxelRingMap supports 1 to " << VOXEL_RING_MAP_MAX_SLICES << " slices, not " << num_slices << ", using " << VOXEL_RING_MAP_DEFAULT_SLICES << "." << std::endl;
+        num_slices = VOXEL_RING_MAP_DEFAULT_SLICES;
+    }
+
+    voxel_size_ = voxel_size;
+    num_slices_ = num_slices;
+
+    slice_length_ = horizon / num_slices;
+    if (slice_length_ < 1) {
+        slice_length_ = 1;
+    }
+
+    slices_.resize(num_slices_);
+
+    Clear();
+}
+
+/**
+ * Removes every point from the map.
+ */
+void VoxelRingMap::Clear() {
+    cells_.clear();
+
+    for (int i = 0; i < num_slices_; i++) {
+        slices_[i].keys.clear();
+    }
+
+    current_slice_ = -1;
+    newest_time_index_ = 0;
+    num_points_ = 0;
+}
+
+/**
+ * Sets the time of the points that are about to be inserted, expiring
+ * every slice that has fallen out of the horizon.
+ *
+ * A time older than everything in the map (from jumping back in a log)
+ * clears the map.
+ *
+ * @param timestamp time of the next points (in usec)
+ *
+ * @retval bitmask of the slices that were emptied
+ */
+uint32_t VoxelRingMap::SetTime(int64_t timestamp) {
+
+    uint32_t cleared = 0;
+
+    // floor, so slices don't double up around zero
+    int64_t time_index = timestamp / slice_length_;
+    if (timestamp < 0 && time_index * slice_length_ != timestamp) {
+        time_index--;
+    }
+
+    if (current_slice_ >= 0 && time_index <= newest_time_index_ - num_slices_) {
+        // can happen if you're replaying a log and jump back
+        std::cout << std::endl << "clearing voxel map because jump back in time" << std::endl;
+        Clear();
+
+        cleared = ~0u;
+    }
+
+    if (current_slice_ < 0) {
+        newest_time_index_ = time_index - 1;
+    }
+
+    if (time_index > newest_time_index_) {
+        // advance the ring, zapping each slice we reuse
+        int64_t first = newest_time_index_ + 1;
+        if (time_index - first >= num_slices_) {
+            first = time_index - num_slices_ + 1;
+        }
+
+        for (int64_t i = first; i <= time_index; i++) {
+            int slice = GetSlice(i);
+
+            ClearSlice(slice);
+            cleared |= 1u << slice;
+        }
+
+        newest_time_index_ = time_index;
+    }
+
+    // late messages go into their own, still live, slice
+    current_slice_ = GetSlice(time_index);
+
+    return cleared;
+}
+
+int VoxelRingMap::GetSlice(int64_t time_index) const {
+    int slice = time_index % num_slices_;
+
+    return slice < 0 ? slice + num_slices_ : slice;
+}
+
+void VoxelRingMap::ClearSlice(int slice) {
+
+    uint32_t bit = 1u << slice;
+
+    for (uint64_t key : slices_[slice].keys) {
+        std::unordered_map<uint64_t, VoxelCell>::iterator it = cells_.find(key);
+
+        VoxelCell &cell = it->second;
+        std::vector<VoxelPoint> &points = cell.points;
+
+        // keep the points from other slices
+        int kept = 0;
+        for (int i = 0; i < (int)points.size(); i++) {
+            if (points[i].slice != slice) {
+                points[kept] = points[i];
+                kept++;
+            }
+        }
+
+        num_points_ -= points.size() - kept;
+        points.resize(kept);
+        cell.slice_mask &= ~bit;
+
+        if (cell.slice_mask == 0) {
+            cells_.erase(it);
+        }
+    }
+
+    slices_[slice].keys.clear();
+}
+
+bool VoxelRingMap::GetVoxelIndex(double value, int64_t *index) const {
+    double i = floor(value / voxel_size_);
+
+    if (i < -VOXEL_RING_MAP_MAX_INDEX || i > VOXEL_RING_MAP_MAX_INDEX) {
+        return false;
+    }
+
+    *index = (int64_t)i;
+    return true;
+}
+
+uint64_t VoxelRingMap::GetKey(int64_t ix, int64_t iy, int64_t iz) {
+    const int64_t offset = VOXEL_RING_MAP_MAX_INDEX + 1;
+
+    return ((uint64_t)(ix + offset) << 42) | ((uint64_t)(iy + offset) << 21) | (uint64_t)(iz + offset);
+}
+
+/**
+ * Adds a point to the map at the time from the last SetTime().
+ *
+ * @param point xyz point to add, in the same frame as the searches
+ */
+void VoxelRingMap::InsertPoint(const double point[3]) {
+
+    if (current_slice_ < 0) {
+        std::cerr << "WARNING: VoxelRingMap::InsertPoint called before SetTime, ignoring point." << std::endl;
+        return;
+    }
+
+    int64_t ix, iy, iz;
+
+    if (!GetVoxelIndex(point[0], &ix) || !GetVoxelIndex(point[1], &iy) || !GetVoxelIndex(point[2], &iz)) {
+        // too far away to index
+        return;
+    }
+
+    uint64_t key = GetKey(ix, iy, iz);
+    VoxelCell &cell = cells_[key];
+
+    uint32_t bit = 1u << current_slice_;
+
+    if ((cell.slice_mask & bit) == 0) {
+        // first point in this voxel for this slice, so the slice
+        // needs to know to come back here when it expires
+        cell.slice_mask |= bit;
+        slices_[current_slice_].keys.push_back(key);
+    }
+
+    VoxelPoint this_point;
+    this_point.x = point[0];
+    this_point.y = point[1];
+    this_point.z = point[2];
+    this_point.slice = current_slice_;
+
+    cell.points.push_back(this_point);
+    num_points_++;
+}
+
+void VoxelRingMap::SearchCell(const VoxelCell &cell, const double point[3], double *best_dist_sq) const {
+    for (const VoxelPoint &p : cell.points) {
+        double dx = p.x - point[0];
+        double dy = p.y - point[1];
+        double dz = p.z - point[2];
+
+        double dist_sq = dx*dx + dy*dy + dz*dz;
+
+        if (dist_sq < *best_dist_sq || *best_dist_sq < 0) {
+            *best_dist_sq = dist_sq;
+        }
+    }
+}
+
+void VoxelRingMap::SearchAllCells(const double point[3], double *best_dist_sq) const {
+    for (std::unordered_map<uint64_t, VoxelCell>::const_iterator it = cells_.begin(); it != cells_.end(); it++) {
+        SearchCell(it->second, point, best_dist_sq);
+    }
+}
+
+/**
+ * Find the distance to the nearest neighbor of a point
+ *
+ * Scans shells of voxels outward from the point until the next shell can't
+ * hold anything closer.  Once that would cost more than scanning every
+ * occupied voxel, it scans those instead.
+ *
+ * @param point the xyz point to search
+ *
+ * @retval distance to the nearest neighbor or -1 if no points found.
+ */
+double VoxelRingMap::NearestNeighbor(const double point[3]) const {
+
+    if (num_points_ < 1) {
+        return -1;
+    }
+
+    double best_dist_sq = -1;
+
+    int64_t center[3];
+
+    if (!GetVoxelIndex(point[0], &center[0]) || !GetVoxelIndex(point[1], &center[1]) || !GetVoxelIndex(point[2], &center[2])) {
+        SearchAllCells(point, &best_dist_sq);
+        return sqrt(best_dist_sq);
+    }
+
+    // distance from the point to the nearest face of its own voxel
+    double margin = voxel_size_;
+    for (int i = 0; i < 3; i++) {
+        double low = point[i] - center[i] * voxel_size_;
+        double high = (center[i] + 1) * voxel_size_ - point[i];
+
+        margin = std::min(margin, std::max(0.0, std::min(low, high)));
+    }
+
+    int64_t num_cells = cells_.size();
+
+    for (int64_t r = 0; ; r++) {
+
+        // voxels we'll have looked at after this shell
+        int64_t cube_size = (2*r + 1) * (2*r + 1) * (2*r + 1);
+
+        // a lookup, mostly for an empty voxel, costs a few times what
+        // walking past an occupied one does
+        if (4 * cube_size > num_cells) {
+            // cheaper to look at everything
+            SearchAllCells(point, &best_dist_sq);
+            break;
+        }
+
+        for (int64_t dx = -r; dx <= r; dx++) {
+            for (int64_t dy = -r; dy <= r; dy++) {
+
+                // on the x or y faces of the shell we need the whole column,
+                // otherwise just its top and bottom
+                bool on_face = dx == -r || dx == r || dy == -r || dy == r;
+                int64_t dz_step = on_face ? 1 : std::max((int64_t)1, 2*r);
+
+                for (int64_t dz = -r; dz <= r; dz += dz_step) {
+                    int64_t ix = center[0] + dx;
+                    int64_t iy = center[1] + dy;
+                    int64_t iz = center[2] + dz;
+
+                    if (llabs(ix) > VOXEL_RING_MAP_MAX_INDEX || llabs(iy) > VOXEL_RING_MAP_MAX_INDEX || llabs(iz) > VOXEL_RING_MAP_MAX_INDEX) {
+                        continue;
+                    }
+
+                    std::unordered_map<uint64_t, VoxelCell>::const_iterator it = cells_.find(GetKey(ix, iy, iz));
+
+                    if (it != cells_.end()) {
+                        SearchCell(it->second, point, &best_dist_sq);
+                    }
+                }
+            }
+        }
+
+        // anything we haven't looked at is at least this far away
+        double bound = margin + r * voxel_size_;
+
+        if (best_dist_sq >= 0 && best_dist_sq <= bound * bound) {
+            break;
+        }
+    }
+
+    return sqrt(best_dist_sq);
+}
+
+/**
+ * Gets every point in the map.
+ *
+ * @param x output x coordinates
+ * @param y output y coordinates
+ * @param z output z coordinates
+ * @param slices (optional) output slice each point is in
+ */
+void VoxelRingMap::GetPoints(std::vector<double> *x, std::vector<double> *y, std::vector<double> *z, std::vector<int> *slices) const {
+    x->clear();
+    y->clear();
+    z->clear();
+
+    if (slices != NULL) {
+        slices->clear();
+    }
+
+    for (std::unordered_map<uint64_t, VoxelCell>::const_iterator it = cells_.begin(); it != cells_.end(); it++) {
+        for (const VoxelPoint &p : it->second.points) {
+            x->push_back(p.x);
+            y->push_back(p.y);
+            z->push_back(p.z);
+
+            if (slices != NULL) {
+                slices->push_back(p.slice);
+            }
+        }
+    }
+}
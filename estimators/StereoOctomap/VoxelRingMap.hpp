@@ -0,0 +1,100 @@
+/**
+ * Obstacle map made of a ring of time slices over a sparse hashed voxel
+ * grid.
+ *
+ * Every point goes into one voxel, tagged with the time slice its message
+ * arrived in.  When the ring advances past a slice, exactly that slice's
+ * points are removed, so a point lives for the horizon (to within one
+ * slice) instead of the 2 to 4 seconds of the double octree.
+ *
+ * Nearest neighbor searches look at shells of voxels around the query,
+ * nearest first, and stop as soon as no unscanned voxel can hold anything
+ * closer.
+ *
+ * (C) 2015 Andrew Barry <abarry@csail.mit.edu>
+ */
+
+#ifndef VOXEL_RING_MAP_H_
+#define VOXEL_RING_MAP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+
+#define VOXEL_RING_MAP_DEFAULT_VOXEL_SIZE 1.0 // in meters
+#define VOXEL_RING_MAP_DEFAULT_SLICES 8
+
+// each voxel keeps a bitmask of the slices it holds points from
+#define VOXEL_RING_MAP_MAX_SLICES 32
+
+// voxel indices are packed into 21 bits per axis
+#define VOXEL_RING_MAP_MAX_INDEX ((1 << 20) - 1)
+
+class VoxelRingMap {
+
+    public:
+
+        VoxelRingMap(double voxel_size, int64_t horizon, int num_slices);
+
+        uint32_t SetTime(int64_t timestamp);
+
+        void InsertPoint(const double point[3]);
+
+        double NearestNeighbor(const double point[3]) const;
+
+        void GetPoints(std::vector<double> *x, std::vector<double> *y, std::vector<double> *z, std::vector<int> *slices = NULL) const;
+
+        void Clear();
+
+        int GetNumberOfPoints() const { return num_points_; }
+
+        // slice that InsertPoint() writes to, -1 before the first SetTime()
+        int GetCurrentSlice() const { return current_slice_; }
+        int GetNumberOfSlices() const { return num_slices_; }
+
+        double GetVoxelSize() const { return voxel_size_; }
+        int64_t GetHorizon() const { return slice_length_ * num_slices_; }
+
+    private:
+
+        struct VoxelPoint {
+            double x, y, z;
+            int slice;
+        };
+
+        struct VoxelCell {
+            VoxelCell() : slice_mask(0) {}
+
+            std::vector<VoxelPoint> points;
+            uint32_t slice_mask;
+        };
+
+        struct VoxelSlice {
+            // each voxel this slice put points in, once
+            std::vector<uint64_t> keys;
+        };
+
+        bool GetVoxelIndex(double value, int64_t *index) const;
+        static uint64_t GetKey(int64_t ix, int64_t iy, int64_t iz);
+
+        int GetSlice(int64_t time_index) const;
+        void ClearSlice(int slice);
+
+        void SearchCell(const VoxelCell &cell, const double point[3], double *best_dist_sq) const;
+        void SearchAllCells(const double point[3], double *best_dist_sq) const;
+
+        double voxel_size_;
+        int64_t slice_length_;
+        int num_slices_;
+
+        std::unordered_map<uint64_t, VoxelCell> cells_;
+        std::vector<VoxelSlice> slices_;
+
+        int current_slice_;
+        int64_t newest_time_index_;
+
+        int num_points_;
+};
+
+#endif
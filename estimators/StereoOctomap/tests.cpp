@@ -9,7 +9,8 @@
 #define TOLERANCE 0.0001
 
 
-class StereoOctomapTest : public testing::Test {
+// runs each test against both map backends
+class StereoOctomapTest : public testing::TestWithParam<ObstacleMapBackend> {
 
     protected:
 
@@ -93,9 +94,9 @@ class StereoOctomapTest : public testing::Test {
 
 };
 
-TEST_F(StereoOctomapTest, SimpleNearestNeighbor) {
+TEST_P(StereoOctomapTest, SimpleNearestNeighbor) {
 
-    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_);
+    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_, GetParam());
 
     // first test when no points are there
 
@@ -209,7 +210,7 @@ TEST_F(StereoOctomapTest, SimpleNearestNeighbor) {
 
 }
 
-TEST_F(StereoOctomapTest, CheckAgainstLinearSearch) {
+TEST_P(StereoOctomapTest, CheckAgainstLinearSearch) {
 
     int num_points = 10000;
 
@@ -217,7 +218,7 @@ TEST_F(StereoOctomapTest, CheckAgainstLinearSearch) {
     vector<float> y;
     vector<float> z;
 
-    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_);
+    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_, GetParam());
 
     // create a random point cloud
 
@@ -298,6 +299,420 @@ TEST_F(StereoOctomapTest, CheckAgainstLinearSearch) {
 }
 
 
+TEST_P(StereoOctomapTest, DistanceFieldWithinTolerance) {
+
+    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_, GetParam());
+
+    double max_distance = 6;
+
+    if (GetParam() != VOXEL_RING_BACKEND) {
+        EXPECT_FALSE(stereo_octomap->EnableDistanceField(0.5, 32, max_distance));
+        delete stereo_octomap;
+        return;
+    }
+
+    ASSERT_TRUE(stereo_octomap->EnableDistanceField(0.5, 32, max_distance));
+
+    double origin[3] = { 0, 0, 0 };
+    EXPECT_TRUE(stereo_octomap->NearestNeighbor(origin) == -1) << "No points in octomap failed." << std::endl;
+
+    std::uniform_real_distribution<double> uniform_dist(-10, 10);
+    std::default_random_engine rand_engine(0);
+
+    vector<float> x, y, z;
+
+    for (int i = 0; i < 1000; i++) {
+        double this_point[3], translated_point[3];
+
+        this_point[0] = uniform_dist(rand_engine);
+        this_point[1] = uniform_dist(rand_engine);
+        this_point[2] = uniform_dist(rand_engine);
+
+        GlobalToCameraFrame(this_point, translated_point);
+
+        x.push_back(translated_point[0]);
+        y.push_back(translated_point[1]);
+        z.push_back(translated_point[2]);
+    }
+
+    lcmt::stereo msg;
+
+    msg.timestamp = GetTimestampNow();
+    msg.x = x;
+    msg.y = y;
+    msg.z = z;
+    msg.number_of_points = x.size();
+    msg.frame_number = 0;
+    msg.video_number = 0;
+
+    stereo_octomap->ProcessStereoMessage(&msg);
+
+    double tolerance = stereo_octomap->GetDistanceField()->GetTolerance();
+
+    for (int i = 0; i < 1000; i++) {
+        double search_point[3];
+
+        // some of these are outside of the window
+        search_point[0] = 3 * uniform_dist(rand_engine);
+        search_point[1] = 3 * uniform_dist(rand_engine);
+        search_point[2] = 3 * uniform_dist(rand_engine);
+
+        double linear_search_dist = std::min(NearestNeighborLinear(x, y, z, search_point), max_distance);
+
+        EXPECT_NEAR(stereo_octomap->NearestNeighbor(search_point), linear_search_dist, tolerance);
+    }
+
+    delete stereo_octomap;
+}
+
+TEST_P(StereoOctomapTest, BatchNearestNeighbors) {
+
+    StereoOctomap *stereo_octomap = new StereoOctomap(bot_frames_, GetParam());
+
+    int num_points = 1000;
+    int num_searches = 500;
+
+    std::uniform_real_distribution<double> uniform_dist(-50, 50);
+    std::default_random_engine rand_engine(0);
+
+    vector<double> search_points(3 * num_searches);
+
+    for (int i = 0; i < 3 * num_searches; i++) {
+        search_points[i] = uniform_dist(rand_engine);
+    }
+
+    vector<double> distances(num_searches, -2);
+
+    // empty map
+    EXPECT_TRUE(stereo_octomap->NearestNeighbors(search_points.data(), num_searches, distances.data(), 100));
+
+    for (int i = 0; i < num_searches; i++) {
+        EXPECT_TRUE(distances[i] == -1) << "No points in octomap failed." << std::endl;
+    }
+
+    vector<float> x, y, z;
+
+    for (int i = 0; i < num_points; i++) {
+        double this_point[3], translated_point[3];
+
+        this_point[0] = uniform_dist(rand_engine);
+        this_point[1] = uniform_dist(rand_engine);
+        this_point[2] = uniform_dist(rand_engine);
+
+        GlobalToCameraFrame(this_point, translated_point);
+
+        x.push_back(translated_point[0]);
+        y.push_back(translated_point[1]);
+        z.push_back(translated_point[2]);
+    }
+
+    lcmt::stereo msg;
+
+    msg.timestamp = GetTimestampNow();
+    msg.x = x;
+    msg.y = y;
+    msg.z = z;
+    msg.number_of_points = num_points;
+    msg.frame_number = 0;
+    msg.video_number = 0;
+
+    stereo_octomap->ProcessStereoMessage(&msg);
+
+    vector<double> morton_distances(num_searches);
+
+    EXPECT_TRUE(stereo_octomap->NearestNeighbors(search_points.data(), num_searches, distances.data()));
+    EXPECT_TRUE(stereo_octomap->NearestNeighbors(search_points.data(), num_searches, morton_distances.data(), -1, true));
+
+    double min_distance = -1;
+
+    for (int i = 0; i < num_searches; i++) {
+        double single_distance = stereo_octomap->NearestNeighbor(&search_points[3*i]);
+
+        EXPECT_EQ_ARM(distances[i], single_distance);
+        EXPECT_EQ_ARM(morton_distances[i], single_distance);
+
+        if (single_distance < min_distance || min_distance < 0) {
+            min_distance = single_distance;
+        }
+    }
+
+    // nothing is that close, so the search goes all the way through
+    EXPECT_TRUE(stereo_octomap->NearestNeighbors(search_points.data(), num_searches, distances.data(), min_distance / 2));
+
+    // stop once we find something close
+    double stop_distance = (min_distance + distances[num_searches / 2]) / 2;
+
+    for (int morton = 0; morton < 2; morton++) {
+        std::fill(distances.begin(), distances.end(), -2);
+
+        EXPECT_FALSE(stereo_octomap->NearestNeighbors(search_points.data(), num_searches, distances.data(), stop_distance, morton == 1));
+
+        bool found_close = false;
+
+        for (int i = 0; i < num_searches; i++) {
+            if (distances[i] != -2) {
+                // the ones it did search are right
+                EXPECT_EQ_ARM(distances[i], stereo_octomap->NearestNeighbor(&search_points[3*i]));
+
+                found_close = found_close || distances[i] <= stop_distance;
+            }
+        }
+
+        EXPECT_TRUE(found_close);
+    }
+
+    delete stereo_octomap;
+}
+
+INSTANTIATE_TEST_CASE_P(Backends, StereoOctomapTest, testing::Values(OCTREE_BACKEND, VOXEL_RING_BACKEND));
+
+static double NearestNeighborLinear(const vector<double> &x, const vector<double> &y, const vector<double> &z, const double query_point[3]) {
+    double best_dist = -1;
+
+    for (int i = 0; i < (int)x.size(); i++) {
+        double this_dist = sqrt(pow(x[i] - query_point[0], 2) + pow(y[i] - query_point[1], 2) + pow(z[i] - query_point[2], 2));
+
+        if (this_dist < best_dist || best_dist < 0) {
+            best_dist = this_dist;
+        }
+    }
+
+    return best_dist;
+}
+
+TEST(VoxelRingMapTest, ExpiresAtHorizon) {
+
+    // 4 slices of 1 second
+    VoxelRingMap map(1.0, 4000000, 4);
+
+    double point[3] = { 0, 0, 0 };
+    double far_point[3] = { 10, 0, 0 };
+
+    EXPECT_TRUE(map.NearestNeighbor(point) == -1) << "No points in map failed." << std::endl;
+
+    map.SetTime(1000000);
+    map.InsertPoint(point);
+
+    map.SetTime(2500000);
+    map.InsertPoint(far_point);
+
+    EXPECT_EQ(map.GetNumberOfPoints(), 2);
+    EXPECT_NEAR(map.NearestNeighbor(point), 0, TOLERANCE);
+
+    // the first point's slice is still in the horizon
+    map.SetTime(4999999);
+    EXPECT_EQ(map.GetNumberOfPoints(), 2);
+    EXPECT_NEAR(map.NearestNeighbor(point), 0, TOLERANCE);
+
+    // and now it isn't
+    map.SetTime(5000000);
+    EXPECT_EQ(map.GetNumberOfPoints(), 1);
+    EXPECT_NEAR(map.NearestNeighbor(point), 10, TOLERANCE);
+
+    map.SetTime(6500000);
+    EXPECT_EQ(map.GetNumberOfPoints(), 0);
+    EXPECT_TRUE(map.NearestNeighbor(point) == -1);
+
+    // late messages go into their own slice and expire with it
+    map.SetTime(7000000);
+    map.InsertPoint(point);
+    map.SetTime(6000000);
+    map.InsertPoint(far_point);
+
+    map.SetTime(10000000);
+    EXPECT_EQ(map.GetNumberOfPoints(), 1);
+    EXPECT_NEAR(map.NearestNeighbor(point), 0, TOLERANCE);
+}
+
+TEST(VoxelRingMapTest, JumpBackInTime) {
+
+    VoxelRingMap map(1.0, 4000000, 4);
+
+    double point[3] = { 1, 2, 3 };
+
+    map.SetTime(100000000);
+    map.InsertPoint(point);
+
+    // replaying a log from the start
+    map.SetTime(1000000);
+    EXPECT_EQ(map.GetNumberOfPoints(), 0);
+
+    map.InsertPoint(point);
+    EXPECT_EQ(map.GetNumberOfPoints(), 1);
+    EXPECT_NEAR(map.NearestNeighbor(point), 0, TOLERANCE);
+}
+
+TEST(VoxelRingMapTest, CheckAgainstLinearSearch) {
+
+    std::uniform_real_distribution<double> uniform_dist(-20, 20);
+    std::default_random_engine rand_engine(0);
+
+    // small voxels so searches go through many shells, big ones so
+    // searches land in dense voxels
+    double voxel_sizes[] = { 0.25, 1.0, 8.0 };
+
+    for (double voxel_size : voxel_sizes) {
+        VoxelRingMap map(voxel_size, 4000000, 8);
+
+        vector<double> x, y, z;
+
+        for (int frame = 0; frame < 10; frame++) {
+            map.SetTime(frame * 100000);
+
+            for (int i = 0; i < 300; i++) {
+                double this_point[3];
+
+                this_point[0] = uniform_dist(rand_engine);
+                this_point[1] = uniform_dist(rand_engine);
+                this_point[2] = uniform_dist(rand_engine) / 4;
+
+                map.InsertPoint(this_point);
+
+                x.push_back(this_point[0]);
+                y.push_back(this_point[1]);
+                z.push_back(this_point[2]);
+            }
+        }
+
+        for (int i = 0; i < 1000; i++) {
+            double search_point[3];
+
+            // some searches well outside the points
+            search_point[0] = 2 * uniform_dist(rand_engine);
+            search_point[1] = 2 * uniform_dist(rand_engine);
+            search_point[2] = 2 * uniform_dist(rand_engine);
+
+            EXPECT_NEAR(map.NearestNeighbor(search_point), NearestNeighborLinear(x, y, z, search_point), TOLERANCE) << "voxel size = " << voxel_size;
+        }
+    }
+}
+
+TEST(DistanceFieldTest, CheckAgainstLinearSearch) {
+
+    std::uniform_real_distribution<double> uniform_dist(-10, 10);
+    std::default_random_engine rand_engine(0);
+
+    double max_distance = 4;
+    int num_slices = 4;
+
+    DistanceField field(0.25, 16, max_distance, num_slices);
+
+    double center[3] = { 1, 2, 3 };
+    EXPECT_TRUE(field.SetCenter(center));
+
+    vector<double> x, y, z;
+
+    for (int i = 0; i < 500; i++) {
+        double this_point[3];
+
+        this_point[0] = uniform_dist(rand_engine);
+        this_point[1] = uniform_dist(rand_engine);
+        this_point[2] = uniform_dist(rand_engine);
+
+        field.InsertPoint(this_point, i % num_slices);
+
+        x.push_back(this_point[0]);
+        y.push_back(this_point[1]);
+        z.push_back(this_point[2]);
+    }
+
+    int num_inside = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        double search_point[3];
+
+        search_point[0] = uniform_dist(rand_engine);
+        search_point[1] = uniform_dist(rand_engine);
+        search_point[2] = uniform_dist(rand_engine);
+
+        double distance;
+
+        if (field.Lookup(search_point, &distance)) {
+            double linear_search_dist = std::min(NearestNeighborLinear(x, y, z, search_point), max_distance);
+
+            EXPECT_NEAR(distance, linear_search_dist, field.GetTolerance());
+
+            // never farther than the truth by more than the interpolation
+            EXPECT_LE(distance, linear_search_dist + 0.25 * sqrt(3) / 2 + TOLERANCE);
+
+            num_inside++;
+        } else {
+            // outside of the window
+            bool outside = false;
+
+            for (int j = 0; j < 3; j++) {
+                outside = outside || search_point[j] < center[j] - 8 || search_point[j] >= center[j] + 8;
+            }
+
+            EXPECT_TRUE(outside);
+        }
+    }
+
+    EXPECT_GT(num_inside, 100);
+}
+
+TEST(DistanceFieldTest, ClearSlices) {
+
+    DistanceField field(0.5, 16, 5, 2);
+
+    double center[3] = { 0, 0, 0 };
+    field.SetCenter(center);
+
+    double point[3] = { 1, 0, 0 };
+    double far_point[3] = { -3, 0, 0 };
+
+    double distance;
+
+    ASSERT_TRUE(field.Lookup(center, &distance));
+    EXPECT_NEAR(distance, 5, TOLERANCE) << "Empty field isn't at max distance.";
+
+    field.InsertPoint(point, 0);
+    field.InsertPoint(far_point, 1);
+
+    ASSERT_TRUE(field.Lookup(center, &distance));
+    EXPECT_NEAR(distance, 1, field.GetTolerance());
+
+    // expire the near point's slice
+    field.ClearSlices(1u << 0);
+
+    ASSERT_TRUE(field.Lookup(center, &distance));
+    EXPECT_NEAR(distance, 3, field.GetTolerance());
+
+    field.ClearSlices(1u << 1);
+
+    ASSERT_TRUE(field.Lookup(center, &distance));
+    EXPECT_NEAR(distance, 5, TOLERANCE);
+}
+
+TEST(DistanceFieldTest, SetCenter) {
+
+    DistanceField field(0.5, 16, 5, 1);
+
+    double point[3] = { 0, 0, 0 };
+    double distance;
+
+    EXPECT_FALSE(field.Lookup(point, &distance)) << "Lookup before the window is placed.";
+
+    EXPECT_TRUE(field.SetCenter(point));
+    field.InsertPoint(point, 0);
+
+    // small moves keep the window where it is
+    double center[3] = { 1.5, -1.5, 1 };
+    EXPECT_FALSE(field.SetCenter(center));
+
+    ASSERT_TRUE(field.Lookup(point, &distance));
+    EXPECT_NEAR(distance, 0, field.GetTolerance());
+
+    // big ones clear it
+    center[0] = 10;
+    EXPECT_TRUE(field.SetCenter(center));
+
+    ASSERT_TRUE(field.Lookup(center, &distance));
+    EXPECT_NEAR(distance, 5, TOLERANCE);
+
+    EXPECT_FALSE(field.Lookup(point, &distance));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
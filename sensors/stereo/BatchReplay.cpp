@@ -0,0 +1,179 @@
+/**
+ * Runs pushbroom stereo over recorded frames as fast as the machine can go,
+ * for tuning parameters offline.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "BatchReplay.hpp"
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+
+BatchReplay::BatchReplay(const PushbroomStereoState &state, int num_workers) : latency_("frame", 0.5, 400) {
+
+    state_ = state;
+
+    // nothing is shown, but this is what gets us each hit's pixel and SAD
+    // score for the results
+    state_.show_display = true;
+
+    if (num_workers <= 0) {
+        num_workers = std::thread::hardware_concurrency();
+
+        if (num_workers <= 0) {
+            // unknown, make a guess
+            num_workers = 4;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        PushbroomStereo *stereo = new PushbroomStereo();
+
+        // the workers already fill every core, so each frame runs on the
+        // thread that loaded it
+        stereo->SetNumWorkStealingThreads(1);
+
+        stereo_.push_back(stereo);
+    }
+
+    first_frame_ = 0;
+    next_frame_ = 0;
+
+    num_frames_ = 0;
+    num_missing_ = 0;
+    num_hits_ = 0;
+    elapsed_ = 0;
+}
+
+BatchReplay::~BatchReplay() {
+    for (unsigned int i = 0; i < stereo_.size(); i++) {
+        delete stereo_[i];
+    }
+}
+
+/**
+ * Runs stereo on a range of frames from one recording and writes the hits
+ * out in frame order.  Frames missing from the recording are skipped.
+ *
+ * @param sources one source for each worker, all for the same recording.
+ *  If there are fewer sources than workers, only that many workers run.
+ * @param first_frame first frame to run
+ * @param last_frame last frame to run
+ * @param results file to write hits to (can be NULL)
+ *
+ * @retval false if the results couldn't be written
+ */
+bool BatchReplay::Run(const std::vector<ReplayFrameSource*> &sources, int first_frame, int last_frame, ReplayResultsWriter *results) {
+
+    if (last_frame < first_frame || sources.size() == 0) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    frames_.clear();
+    frames_.resize(last_frame - first_frame + 1);
+
+    for (unsigned int i = 0; i < frames_.size(); i++) {
+        frames_[i].done = false;
+        frames_[i].missing = false;
+        frames_[i].latency_ms = 0;
+    }
+
+    first_frame_ = first_frame;
+    next_frame_ = 0;
+
+    int num_workers = std::min(GetNumWorkers(), (int)sources.size());
+
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_workers; i++) {
+        threads.push_back(std::thread(&BatchReplay::WorkerLoop, this, i, sources[i]));
+    }
+
+    bool ok = true;
+
+    for (unsigned int i = 0; i < frames_.size(); i++) {
+
+        FrameResult *frame = &frames_[i];
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_done_.wait(lock, [frame] { return frame->done; });
+        }
+
+        if (frame->missing) {
+            num_missing_ ++;
+            continue;
+        }
+
+        if (results != NULL
+            && results->WriteFrame(first_frame + i, frame->points3d, frame->points2d, frame->disparities) == false) {
+
+            ok = false;
+        }
+
+        num_frames_ ++;
+        num_hits_ += frame->points3d.size();
+        latency_.Add(frame->latency_ms);
+
+        // done with it, so don't hold on to the hits for the whole run
+        FrameResult empty;
+        std::swap(frame->points3d, empty.points3d);
+        std::swap(frame->points2d, empty.points2d);
+        std::swap(frame->colors, empty.colors);
+        std::swap(frame->disparities, empty.disparities);
+    }
+
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    frames_.clear();
+
+    elapsed_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return ok;
+}
+
+void BatchReplay::PrintStats() const {
+    printf("Replay: %d frames (%d missing), %ld hits in %.1f sec, %.1f frames/sec on %d workers.\n",
+        num_frames_, num_missing_, num_hits_, elapsed_, elapsed_ > 0 ? num_frames_ / elapsed_ : 0.0,
+        GetNumWorkers());
+
+    latency_.PrintSummary();
+}
+
+void BatchReplay::WorkerLoop(int worker, ReplayFrameSource *source) {
+
+    Mat left, right;
+
+    while (true) {
+        int n = next_frame_ ++;
+
+        if (n >= (int)frames_.size()) {
+            break;
+        }
+
+        // nobody else touches this frame until it's done
+        FrameResult *frame = &frames_[n];
+
+        auto start = std::chrono::steady_clock::now();
+
+        if (source->GetFrames(first_frame_ + n, &left, &right)) {
+            stereo_[worker]->ProcessImages(left, right, &frame->points3d, &frame->colors, &frame->points2d, state_, &frame->disparities);
+        } else {
+            frame->missing = true;
+        }
+
+        frame->latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            frame->done = true;
+        }
+        cv_done_.notify_one();
+    }
+}
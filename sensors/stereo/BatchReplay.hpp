@@ -0,0 +1,109 @@
+/**
+ * Runs pushbroom stereo over recorded frames as fast as the machine can go,
+ * for tuning parameters offline.
+ *
+ * Frames are handed out one at a time to a worker per core.  Each worker
+ * has its own frame source and its own single-threaded PushbroomStereo, so
+ * whole frames run in parallel instead of strips of one frame.  Results
+ * are written out in frame order as they finish, so the output is the same
+ * for any number of workers.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef BATCH_REPLAY_HPP
+#define BATCH_REPLAY_HPP
+
+#include "opencv2/opencv.hpp"
+#include "pushbroom-stereo.hpp"
+#include "LatencyHistogram.hpp"
+#include "ReplayResults.hpp"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace cv;
+
+/**
+ * Random-access frames from one recording.  Each worker gets its own, so
+ * implementations don't need to be thread-safe.
+ */
+class ReplayFrameSource {
+
+    public:
+        virtual ~ReplayFrameSource() {}
+
+        /**
+         * @param frame_number frame to get, counting from the start of the
+         *  recording
+         * @param image_left output: left image
+         * @param image_right output: right image
+         *
+         * @retval false if the recording doesn't have this frame
+         */
+        virtual bool GetFrames(int frame_number, Mat *image_left, Mat *image_right) = 0;
+};
+
+class BatchReplay {
+
+    public:
+        /**
+         * @param state stereo settings (random_results must be off)
+         * @param num_workers frames to run at once (0 for one per core)
+         */
+        BatchReplay(const PushbroomStereoState &state, int num_workers = 0);
+        ~BatchReplay();
+
+        int GetNumWorkers() const { return (int)stereo_.size(); }
+
+        bool Run(const std::vector<ReplayFrameSource*> &sources, int first_frame, int last_frame, ReplayResultsWriter *results);
+
+        // totals over every Run
+        int GetNumFrames() const { return num_frames_; }
+        int GetNumMissing() const { return num_missing_; }
+        long GetNumHits() const { return num_hits_; }
+        double GetElapsedSeconds() const { return elapsed_; }
+
+        // time to load and process each frame on one worker
+        const LatencyHistogram& GetLatency() const { return latency_; }
+
+        void PrintStats() const;
+
+    private:
+        struct FrameResult {
+            bool done;
+            bool missing;
+
+            cv::vector<Point3f> points3d;
+            cv::vector<Point3i> points2d;
+            cv::vector<uchar> colors;
+            cv::vector<int> disparities;
+
+            double latency_ms;
+        };
+
+        void WorkerLoop(int worker, ReplayFrameSource *source);
+
+        PushbroomStereoState state_;
+
+        std::vector<PushbroomStereo*> stereo_;
+
+        // the frames of the current Run, indexed from first_frame_
+        std::vector<FrameResult> frames_;
+        int first_frame_;
+        std::atomic<int> next_frame_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_done_;
+
+        int num_frames_;
+        int num_missing_;
+        long num_hits_;
+        double elapsed_;
+        LatencyHistogram latency_;
+};
+
+#endif
@@ -0,0 +1,46 @@
+/**
+ * Zero-copy access to a camera's capture buffers.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "CameraSource.hpp"
+
+/**
+ * Wraps a dequeued buffer.  The frame owns the buffer from here on.
+ *
+ * @param source source to give the buffer back to
+ * @param buffer buffer from source->DequeueBuffer
+ */
+CameraFrame::CameraFrame(CameraSource *source, const CameraBuffer &buffer) {
+
+    lease_ = std::make_shared<CameraBufferLease>(source, buffer);
+
+    // a header on the camera's memory, no copy
+    image_ = Mat(buffer.height, buffer.width, CV_8UC1, buffer.image, buffer.stride);
+}
+
+/**
+ * Gets the next frame without copying it out of the capture buffer.
+ *
+ * @param frame output: the new frame.  Whatever it held before is released
+ *      first, so a source with few buffers doesn't run out while we wait.
+ *
+ * @retval false if the source didn't give us a frame, in which case frame
+ *      is left empty
+ */
+bool CameraSource::GrabFrame(CameraFrame *frame) {
+
+    frame->Release();
+
+    CameraBuffer buffer;
+
+    if (DequeueBuffer(&buffer) == false) {
+        return false;
+    }
+
+    *frame = CameraFrame(this, buffer);
+
+    return true;
+}
@@ -0,0 +1,123 @@
+/**
+ * Zero-copy access to a camera's capture buffers.  A CameraSource follows
+ * the dc1394 contract: buffers are dequeued when a frame is ready and must
+ * be enqueued again before the camera can fill them.  CameraFrame wraps a
+ * dequeued buffer so that everyone who uses the frame shares it, and the
+ * buffer goes back to the camera when the last of them is done.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef CAMERA_SOURCE_HPP
+#define CAMERA_SOURCE_HPP
+
+#include "opencv2/opencv.hpp"
+#include <stdint.h>
+#include <memory>
+
+using namespace cv;
+
+/**
+ * One of the camera's capture buffers, as handed out by DequeueBuffer.
+ */
+struct CameraBuffer {
+    uint8_t *image;
+
+    int width;
+    int height;
+    size_t stride;
+
+    // capture time in microseconds, from the camera if it has one
+    uint64_t timestamp;
+
+    uint32_t frame_number;
+
+    // whatever the source needs to enqueue the buffer again
+    void *handle;
+};
+
+class CameraFrame;
+
+class CameraSource {
+
+    public:
+        virtual ~CameraSource() {}
+
+        /**
+         * Waits for the next frame.  The buffer belongs to the caller
+         * until it is passed to EnqueueBuffer.
+         *
+         * @retval false if there is no frame
+         */
+        virtual bool DequeueBuffer(CameraBuffer *buffer) = 0;
+
+        /**
+         * Gives a buffer from DequeueBuffer back to the camera.
+         */
+        virtual void EnqueueBuffer(const CameraBuffer &buffer) = 0;
+
+        bool GrabFrame(CameraFrame *frame);
+};
+
+/**
+ * Hands a buffer back to its source when destroyed.  Shared between all
+ * the copies of a CameraFrame.
+ */
+class CameraBufferLease {
+
+    public:
+        CameraBufferLease(CameraSource *source, const CameraBuffer &buffer) {
+            source_ = source;
+            buffer_ = buffer;
+        }
+
+        ~CameraBufferLease() { source_->EnqueueBuffer(buffer_); }
+
+        const CameraBuffer& GetBuffer() const { return buffer_; }
+
+    private:
+        // not copyable, each lease enqueues exactly once
+        CameraBufferLease(const CameraBufferLease&);
+        CameraBufferLease& operator=(const CameraBufferLease&);
+
+        CameraSource *source_;
+        CameraBuffer buffer_;
+};
+
+/**
+ * A frame that points straight into the camera's buffer.  Copies are
+ * cheap and share the buffer, which is enqueued again when the last copy
+ * is released or destroyed.
+ *
+ * GetImage() doesn't hold on to the buffer by itself: a Mat taken from it
+ * (or any Mat sharing its data) must not be used after the frame is
+ * released.  Anything that keeps an image for longer, like the recorder,
+ * has to clone() it.
+ */
+class CameraFrame {
+
+    public:
+        CameraFrame() {}
+
+        CameraFrame(CameraSource *source, const CameraBuffer &buffer);
+
+        const Mat& GetImage() const { return image_; }
+
+        uint64_t GetTimestamp() const { return lease_ ? lease_->GetBuffer().timestamp : 0; }
+        uint32_t GetFrameNumber() const { return lease_ ? lease_->GetBuffer().frame_number : 0; }
+
+        bool empty() const { return !lease_; }
+
+        void Release() {
+            image_ = Mat();
+            lease_.reset();
+        }
+
+    private:
+        Mat image_;
+
+        std::shared_ptr<CameraBufferLease> lease_;
+};
+
+#endif
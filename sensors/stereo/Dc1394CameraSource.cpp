@@ -0,0 +1,48 @@
+/**
+ * CameraSource on a dc1394 camera's DMA ring buffer.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "Dc1394CameraSource.hpp"
+#include <iostream>
+
+bool Dc1394CameraSource::DequeueBuffer(CameraBuffer *buffer) {
+
+    dc1394error_t err;
+    dc1394video_frame_t *frame = NULL;
+
+    err = dc1394_capture_dequeue(camera_, DC1394_CAPTURE_POLICY_WAIT, &frame);
+    DC1394_WRN(err,"Could not capture a frame");
+
+    if (err != 0 || frame == NULL) {
+        std::cout << "Warning: failed to capture a frame." << std::endl;
+
+        // attempt release the buffer
+        if (frame) {
+            err = dc1394_capture_enqueue(camera_, frame);
+            DC1394_WRN(err,"releasing buffer after failure");
+        }
+
+        return false;
+    }
+
+    buffer->image = frame->image;
+    buffer->width = frame->size[0];
+    buffer->height = frame->size[1];
+    buffer->stride = frame->stride;
+    buffer->timestamp = frame->timestamp;
+    buffer->frame_number = frame_count_ ++;
+    buffer->handle = frame;
+
+    return true;
+}
+
+void Dc1394CameraSource::EnqueueBuffer(const CameraBuffer &buffer) {
+
+    dc1394error_t err;
+
+    err = dc1394_capture_enqueue(camera_, (dc1394video_frame_t*) buffer.handle);
+    DC1394_WRN(err,"releasing buffer");
+}
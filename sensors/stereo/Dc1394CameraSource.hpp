@@ -0,0 +1,41 @@
+/**
+ * CameraSource on a dc1394 camera's DMA ring buffer.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef DC1394_CAMERA_SOURCE_HPP
+#define DC1394_CAMERA_SOURCE_HPP
+
+#include "CameraSource.hpp"
+
+extern "C"
+{
+    #include <dc1394/dc1394.h>
+}
+
+class Dc1394CameraSource : public CameraSource {
+
+    public:
+        /**
+         * @param camera camera that is already set up for capture.  Must
+         *      outlive this and every frame taken from it.
+         */
+        Dc1394CameraSource(dc1394camera_t *camera) {
+            camera_ = camera;
+            frame_count_ = 0;
+        }
+
+        bool DequeueBuffer(CameraBuffer *buffer);
+        void EnqueueBuffer(const CameraBuffer &buffer);
+
+    private:
+        dc1394camera_t *camera_;
+
+        // frame->id is the buffer's place in the ring, so count frames
+        // ourselves
+        uint32_t frame_count_;
+};
+
+#endif
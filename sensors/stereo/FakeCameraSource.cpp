@@ -0,0 +1,124 @@
+/**
+ * CameraSource that makes up its frames, for tests and benchmarks without
+ * cameras.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "FakeCameraSource.hpp"
+#include <iostream>
+#include <thread>
+
+FakeCameraSource::FakeCameraSource(int width, int height, int num_buffers, uint64_t frame_period) {
+    width_ = width;
+    height_ = height;
+
+    // pad the rows like a camera might, so that nobody gets away with
+    // assuming stride == width
+    stride_ = (width + 15) / 16 * 16 + 16;
+
+    frame_period_ = frame_period;
+    timestamp_offset_ = 0;
+
+    realtime_ = false;
+    drop_every_ = 0;
+
+    buffers_.resize(num_buffers, std::vector<uint8_t>(stride_ * height));
+    outstanding_.resize(num_buffers, false);
+
+    frame_count_ = 0;
+    contract_errors_ = 0;
+}
+
+bool FakeCameraSource::DequeueBuffer(CameraBuffer *buffer) {
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (drop_every_ > 0 && (frame_count_ + 1) % drop_every_ == 0) {
+        frame_count_ ++;
+    }
+
+    if (realtime_) {
+        if (frame_count_ == 0) {
+            start_time_ = std::chrono::steady_clock::now();
+        }
+
+        std::chrono::steady_clock::time_point due = start_time_ + std::chrono::microseconds(frame_count_ * frame_period_);
+
+        // don't hold the lock while we wait, enqueues still need it
+        lock.unlock();
+        std::this_thread::sleep_until(due);
+        lock.lock();
+    }
+
+    int index = -1;
+    for (int i = 0; i < (int)buffers_.size(); i++) {
+        if (outstanding_[i] == false) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0) {
+        std::cerr << "Warning: FakeCameraSource: dequeue with all " << buffers_.size() << " buffers outstanding, a camera would wait forever here." << std::endl;
+        contract_errors_ ++;
+        return false;
+    }
+
+    outstanding_[index] = true;
+
+    uint8_t *image = buffers_[index].data();
+
+    for (int row = 0; row < height_; row++) {
+        for (int col = 0; col < width_; col++) {
+            image[row * stride_ + col] = GetPixel(frame_count_, row, col);
+        }
+    }
+
+    buffer->image = image;
+    buffer->width = width_;
+    buffer->height = height_;
+    buffer->stride = stride_;
+    buffer->timestamp = timestamp_offset_ + frame_count_ * frame_period_;
+    buffer->frame_number = frame_count_;
+    buffer->handle = (void*)(intptr_t)index;
+
+    frame_count_ ++;
+
+    return true;
+}
+
+void FakeCameraSource::EnqueueBuffer(const CameraBuffer &buffer) {
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    int index = (int)(intptr_t)buffer.handle;
+
+    if (index < 0 || index >= (int)buffers_.size() || outstanding_[index] == false
+        || buffer.image != buffers_[index].data()) {
+
+        std::cerr << "Warning: FakeCameraSource: enqueue of a buffer that is not dequeued (" << index << ")." << std::endl;
+        contract_errors_ ++;
+        return;
+    }
+
+    outstanding_[index] = false;
+}
+
+int FakeCameraSource::GetNumOutstanding() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    int count = 0;
+    for (bool out : outstanding_) {
+        if (out) {
+            count ++;
+        }
+    }
+    return count;
+}
+
+int FakeCameraSource::GetNumContractErrors() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return contract_errors_;
+}
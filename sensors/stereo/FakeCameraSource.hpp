@@ -0,0 +1,82 @@
+/**
+ * CameraSource that makes up its frames, for tests and benchmarks without
+ * cameras.  Keeps to the same buffer contract as dc1394 and counts anyone
+ * who doesn't.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef FAKE_CAMERA_SOURCE_HPP
+#define FAKE_CAMERA_SOURCE_HPP
+
+#include "CameraSource.hpp"
+#include <mutex>
+#include <chrono>
+#include <vector>
+
+class FakeCameraSource : public CameraSource {
+
+    public:
+        /**
+         * @param width image width
+         * @param height image height
+         * @param num_buffers size of the ring, like the dc1394 num_dma_buffers
+         * @param frame_period microseconds between frame timestamps
+         */
+        FakeCameraSource(int width, int height, int num_buffers, uint64_t frame_period = 33333);
+
+        bool DequeueBuffer(CameraBuffer *buffer);
+        void EnqueueBuffer(const CameraBuffer &buffer);
+
+        /**
+         * Sleeps in DequeueBuffer until the frame is due, so capture runs at
+         * the camera's rate instead of as fast as we can ask.
+         */
+        void SetRealtime(bool x) { realtime_ = x; }
+
+        // added to every timestamp, like a camera that started a bit later
+        void SetTimestampOffset(uint64_t x) { timestamp_offset_ = x; }
+
+        // skips every nth frame, like a camera that missed one
+        void SetDropEvery(int n) { drop_every_ = n; }
+
+        int GetNumBuffers() const { return (int)buffers_.size(); }
+        int GetNumOutstanding();
+
+        /**
+         * Number of times the buffer contract was broken: a buffer enqueued
+         * that wasn't dequeued, or a dequeue with every buffer already out
+         * (which would wait forever on a real camera).
+         */
+        int GetNumContractErrors();
+
+        /**
+         * Value of a pixel in a frame, so that tests can check the contents.
+         */
+        static uint8_t GetPixel(uint32_t frame_number, int row, int col) {
+            return (uint8_t)(row + 3 * col + 7 * frame_number);
+        }
+
+    private:
+        int width_, height_;
+        size_t stride_;
+        uint64_t frame_period_;
+        uint64_t timestamp_offset_;
+
+        bool realtime_;
+        std::chrono::steady_clock::time_point start_time_;
+
+        int drop_every_;
+
+        std::vector<std::vector<uint8_t> > buffers_;
+        std::vector<bool> outstanding_;
+
+        uint32_t frame_count_;
+        int contract_errors_;
+
+        // enqueues usually come from a different thread than dequeues
+        std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,143 @@
+/**
+ * Fixed-bucket histogram of per-frame latencies.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "LatencyHistogram.hpp"
+
+#define HISTOGRAM_BAR_WIDTH 50
+
+/**
+ * @param name name to print with the histogram
+ * @param bucket_width_ms width of each bucket in milliseconds
+ * @param num_buckets number of buckets.  Latencies past the last bucket
+ *      are counted in it.
+ */
+LatencyHistogram::LatencyHistogram(std::string name, double bucket_width_ms, int num_buckets) {
+    name_ = name;
+    bucket_width_ms_ = bucket_width_ms;
+
+    if (num_buckets < 1) {
+        num_buckets = 1;
+    }
+
+    buckets_.resize(num_buckets);
+
+    Clear();
+}
+
+void LatencyHistogram::Add(double latency_ms) {
+
+    int bucket = latency_ms / bucket_width_ms_;
+
+    if (bucket < 0) {
+        bucket = 0;
+    } else if (bucket >= (int)buckets_.size()) {
+        bucket = buckets_.size() - 1;
+    }
+
+    buckets_[bucket] ++;
+
+    if (count_ == 0 || latency_ms < min_) {
+        min_ = latency_ms;
+    }
+
+    if (count_ == 0 || latency_ms > max_) {
+        max_ = latency_ms;
+    }
+
+    sum_ += latency_ms;
+    count_ ++;
+}
+
+void LatencyHistogram::Clear() {
+    for (unsigned int i = 0; i < buckets_.size(); i++) {
+        buckets_[i] = 0;
+    }
+
+    count_ = 0;
+    sum_ = 0;
+    min_ = 0;
+    max_ = 0;
+}
+
+/**
+ * Estimates a percentile from the buckets.
+ *
+ * @param percentile between 0 and 100
+ *
+ * @retval upper edge of the bucket the percentile falls in (capped at the
+ *      largest latency seen), or 0 if the histogram is empty
+ */
+double LatencyHistogram::GetPercentile(double percentile) const {
+
+    if (count_ == 0) {
+        return 0;
+    }
+
+    double target = percentile / 100.0 * count_;
+    int seen = 0;
+
+    for (unsigned int i = 0; i < buckets_.size(); i++) {
+        seen += buckets_[i];
+
+        if (seen >= target && seen > 0) {
+            double edge = (i + 1) * bucket_width_ms_;
+            return edge < max_ ? edge : max_;
+        }
+    }
+
+    return max_;
+}
+
+/**
+ * Prints one line with the count, mean and tail latencies.
+ */
+void LatencyHistogram::PrintSummary(FILE *stream) const {
+    fprintf(stream, "%-16s n = %6d  mean = %7.3f ms  min = %7.3f  p50 = %7.3f  p90 = %7.3f  p99 = %7.3f  max = %7.3f\n",
+        name_.c_str(), count_, GetMean(), min_, GetPercentile(50), GetPercentile(90),
+        GetPercentile(99), max_);
+}
+
+/**
+ * Prints the summary and a bar for every non-empty bucket.
+ */
+void LatencyHistogram::Print(FILE *stream) const {
+
+    PrintSummary(stream);
+
+    if (count_ == 0) {
+        return;
+    }
+
+    int most = 0;
+
+    for (unsigned int i = 0; i < buckets_.size(); i++) {
+        if (buckets_[i] > most) {
+            most = buckets_[i];
+        }
+    }
+
+    for (int i = 0; i < (int)buckets_.size(); i++) {
+
+        if (buckets_[i] == 0) {
+            continue;
+        }
+
+        int bar = (long)buckets_[i] * HISTOGRAM_BAR_WIDTH / most;
+
+        if (i == (int)buckets_.size() - 1) {
+            fprintf(stream, "  %7.2f+         ms %6d |", i * bucket_width_ms_, buckets_[i]);
+        } else {
+            fprintf(stream, "  %7.2f - %7.2f ms %6d |", i * bucket_width_ms_, (i + 1) * bucket_width_ms_, buckets_[i]);
+        }
+
+        for (int j = 0; j < bar; j++) {
+            fputc('#', stream);
+        }
+
+        fputc('\n', stream);
+    }
+}
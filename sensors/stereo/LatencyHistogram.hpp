@@ -0,0 +1,48 @@
+/**
+ * Fixed-bucket histogram of per-frame latencies, for comparing how
+ * steady different ways of running the stereo pipeline are.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class LatencyHistogram {
+
+    public:
+        LatencyHistogram(std::string name, double bucket_width_ms = 0.1, int num_buckets = 300);
+
+        void Add(double latency_ms);
+
+        void Clear();
+
+        int GetCount() const { return count_; }
+        double GetMean() const { return count_ > 0 ? sum_ / count_ : 0; }
+        double GetMin() const { return min_; }
+        double GetMax() const { return max_; }
+
+        double GetPercentile(double percentile) const;
+
+        void Print(FILE *stream = stdout) const;
+        void PrintSummary(FILE *stream = stdout) const;
+
+    private:
+        std::string name_;
+        double bucket_width_ms_;
+
+        // the last bucket catches everything past the end
+        std::vector<int> buckets_;
+
+        int count_;
+        double sum_;
+        double min_;
+        double max_;
+};
+
+#endif
@@ -0,0 +1,511 @@
+/**
+ * Sweeps pushbroom stereo thresholds over recorded frames and scores each
+ * setting against ground-truth boxes drawn in the HUD.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "ParameterSweep.hpp"
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+
+/**
+ * Reads a box file from the HUD.  Lines that can't be read are skipped with
+ * a warning.
+ *
+ * @param filename file written by hud -b
+ * @param video_number only use boxes for this video (-1 for all of them)
+ *
+ * @retval false if the file can't be opened
+ */
+bool GroundTruthBoxes::Load(std::string filename, int video_number) {
+
+    boxes_.clear();
+
+    std::ifstream file(filename.c_str());
+
+    if (file.is_open() == false) {
+        std::cerr << "Error: failed to open " << filename << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_number = 0;
+
+    while (std::getline(file, line)) {
+
+        line_number ++;
+
+        if (line.length() == 0) {
+            continue;
+        }
+
+        int this_video_number, frame_number;
+        double x1, y1, x2, y2;
+
+        if (sscanf(line.c_str(), "%d,%d,%lf,%lf,%lf,%lf", &this_video_number, &frame_number, &x1, &y1, &x2, &y2) != 6) {
+            std::cerr << "Warning: can't read line " << line_number << " of " << filename << ", skipping it." << std::endl;
+            continue;
+        }
+
+        if (video_number >= 0 && this_video_number != video_number) {
+            continue;
+        }
+
+        // the corners can be clicked in either order
+        GroundTruthBox box;
+        box.x_min = std::min(x1, x2);
+        box.y_min = std::min(y1, y2);
+        box.x_max = std::max(x1, x2);
+        box.y_max = std::max(y1, y2);
+
+        boxes_[frame_number].push_back(box);
+    }
+
+    return true;
+}
+
+const std::vector<GroundTruthBox>* GroundTruthBoxes::GetBoxes(int frame_number) const {
+
+    std::map<int, std::vector<GroundTruthBox> >::const_iterator it = boxes_.find(frame_number);
+
+    if (it == boxes_.end()) {
+        return NULL;
+    }
+
+    return &it->second;
+}
+
+static bool InAnyBox(const std::vector<GroundTruthBox> &boxes, double x, double y) {
+
+    for (unsigned int i = 0; i < boxes.size(); i++) {
+        if (x >= boxes[i].x_min && x <= boxes[i].x_max
+            && y >= boxes[i].y_min && y <= boxes[i].y_max) {
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+ParameterSweep::ParameterSweep(const PushbroomStereoState &state, int num_workers) {
+
+    state_ = state;
+
+    if (num_workers <= 0) {
+        num_workers = std::thread::hardware_concurrency();
+
+        if (num_workers <= 0) {
+            // unknown, make a guess
+            num_workers = 4;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        stereo_.push_back(new PushbroomStereo());
+    }
+
+    first_frame_ = 0;
+    next_frame_ = 0;
+
+    cache_in_memory_ = true;
+
+    num_missing_ = 0;
+    num_cells_ = 0;
+    cache_elapsed_ = 0;
+    sweep_elapsed_ = 0;
+}
+
+ParameterSweep::~ParameterSweep() {
+    for (unsigned int i = 0; i < stereo_.size(); i++) {
+        delete stereo_[i];
+    }
+
+    RemoveCacheFiles();
+}
+
+/**
+ * Remaps and filters a range of frames from one recording and keeps them
+ * for Run.  Frames missing from the recording are skipped.  Replaces
+ * anything cached before.
+ *
+ * @param sources one source for each worker, all for the same recording.
+ *  If there are fewer sources than workers, only that many workers run.
+ * @param first_frame first frame to cache
+ * @param last_frame last frame to cache
+ * @param cache_filename if set, the frames are written to
+ *  cache_filename-remapped.slog and cache_filename-laplacian.slog and
+ *  mapped back in by Run instead of being held in memory.  The files are
+ *  removed when the sweep is deleted.
+ *
+ * @retval false if the cache files couldn't be written
+ */
+bool ParameterSweep::CacheFrames(const std::vector<ReplayFrameSource*> &sources, int first_frame, int last_frame, std::string cache_filename) {
+
+    RemoveCacheFiles();
+
+    frame_numbers_.clear();
+    frames_.clear();
+    num_missing_ = 0;
+
+    cache_in_memory_ = cache_filename.length() == 0;
+
+    if (last_frame < first_frame || sources.size() == 0) {
+        return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    StereoLogWriter remapped_writer, laplacian_writer;
+
+    if (cache_in_memory_ == false) {
+        remapped_filename_ = cache_filename + "-remapped" + STEREO_LOG_EXTENSION;
+        laplacian_filename_ = cache_filename + "-laplacian" + STEREO_LOG_EXTENSION;
+
+        if (remapped_writer.Open(remapped_filename_) == false
+            || laplacian_writer.Open(laplacian_filename_) == false) {
+
+            return false;
+        }
+    }
+
+    frames_.resize(last_frame - first_frame + 1);
+
+    for (unsigned int i = 0; i < frames_.size(); i++) {
+        frames_[i].done = false;
+        frames_[i].missing = false;
+    }
+
+    first_frame_ = first_frame;
+    next_frame_ = 0;
+
+    int num_workers = std::min(GetNumWorkers(), (int)sources.size());
+
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_workers; i++) {
+        threads.push_back(std::thread(&ParameterSweep::CacheWorkerLoop, this, i, sources[i]));
+    }
+
+    bool ok = true;
+
+    for (unsigned int i = 0; i < frames_.size(); i++) {
+
+        CachedFrame *frame = &frames_[i];
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_done_.wait(lock, [frame] { return frame->done; });
+        }
+
+        if (frame->missing) {
+            num_missing_ ++;
+            continue;
+        }
+
+        frame_numbers_.push_back(first_frame + i);
+
+        if (cache_in_memory_ == false) {
+
+            if (ok) {
+                ok = remapped_writer.WriteFrames(frame->remapped_left, frame->remapped_right, first_frame + i, 0)
+                    && laplacian_writer.WriteFrames(frame->laplacian_left, frame->laplacian_right, first_frame + i, 0);
+            }
+
+            // it's on disk now
+            frame->remapped_left.release();
+            frame->remapped_right.release();
+            frame->laplacian_left.release();
+            frame->laplacian_right.release();
+        }
+    }
+
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    if (cache_in_memory_ == false) {
+        if (remapped_writer.Close() == false || laplacian_writer.Close() == false) {
+            ok = false;
+        }
+
+        frames_.clear();
+    }
+
+    cache_elapsed_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return ok;
+}
+
+void ParameterSweep::CacheWorkerLoop(int worker, ReplayFrameSource *source) {
+
+    Mat left, right;
+
+    while (true) {
+        int n = next_frame_ ++;
+
+        if (n >= (int)frames_.size()) {
+            break;
+        }
+
+        // nobody else touches this frame until it's done
+        CachedFrame *frame = &frames_[n];
+
+        if (source->GetFrames(first_frame_ + n, &left, &right)) {
+            stereo_[worker]->RemapAndFilter(left, right, state_, &frame->remapped_left, &frame->remapped_right, &frame->laplacian_left, &frame->laplacian_right);
+        } else {
+            frame->missing = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            frame->done = true;
+        }
+        cv_done_.notify_one();
+    }
+}
+
+/**
+ * Runs every combination of settings in the grid over the cached frames.
+ *
+ * @param grid values to try
+ * @param boxes ground truth (can be NULL)
+ * @param results output: one for each combination, with the block size
+ *  changing slowest, then sadThreshold, sobelLimit, and
+ *  horizontalInvarianceMultiplier
+ *
+ * @retval false if the grid is empty or the cache can't be read
+ */
+bool ParameterSweep::Run(const SweepGrid &grid, const GroundTruthBoxes *boxes, std::vector<SweepResult> *results) {
+
+    results->clear();
+
+    if (grid.block_sizes.size() == 0 || grid.sad_thresholds.size() == 0
+        || grid.sobel_limits.size() == 0 || grid.horizontal_invariance_multipliers.size() == 0) {
+
+        std::cerr << "Error: nothing to sweep, every parameter needs at least one value." << std::endl;
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // each worker maps the cache for itself, since the readers keep track
+    // of where playback is to read ahead
+    int num_workers = std::min(GetNumWorkers(), std::max(1, GetNumCachedFrames()));
+
+    std::vector<StereoLogReader*> remapped_readers, laplacian_readers;
+
+    bool ok = true;
+
+    for (int i = 0; i < num_workers; i++) {
+        remapped_readers.push_back(new StereoLogReader());
+        laplacian_readers.push_back(new StereoLogReader());
+
+        if (cache_in_memory_ == false
+            && (remapped_readers[i]->Open(remapped_filename_) == false
+                || laplacian_readers[i]->Open(laplacian_filename_) == false)) {
+
+            ok = false;
+        }
+    }
+
+    // a block that misses with the loosest thresholds misses with all of
+    // them, so those are what the blocks are scored with
+    int max_sad_threshold = *std::max_element(grid.sad_thresholds.begin(), grid.sad_thresholds.end());
+    int min_sobel_limit = *std::min_element(grid.sobel_limits.begin(), grid.sobel_limits.end());
+
+    for (unsigned int b = 0; b < grid.block_sizes.size() && ok; b++) {
+
+        search_state_ = state_;
+        search_state_.blockSize = grid.block_sizes[b];
+        search_state_.sadThreshold = max_sad_threshold;
+        search_state_.sobelLimit = min_sobel_limit;
+
+        std::vector<SweepCell> cells;
+
+        for (unsigned int s = 0; s < grid.sad_thresholds.size(); s++) {
+            for (unsigned int l = 0; l < grid.sobel_limits.size(); l++) {
+                for (unsigned int m = 0; m < grid.horizontal_invariance_multipliers.size(); m++) {
+
+                    SweepCell cell;
+                    cell.state = search_state_;
+                    cell.state.sadThreshold = grid.sad_thresholds[s];
+                    cell.state.sobelLimit = grid.sobel_limits[l];
+                    cell.state.horizontalInvarianceMultiplier = grid.horizontal_invariance_multipliers[m];
+
+                    cell.hits = 0;
+                    cell.boxed_frame_hits = 0;
+                    cell.hits_in_boxes = 0;
+                    cell.boxed_frames_detected = 0;
+
+                    cells.push_back(cell);
+                }
+            }
+        }
+
+        // every worker counts on its own, then we add them up, so the
+        // totals don't depend on who ran what
+        std::vector<std::vector<SweepCell> > worker_cells(num_workers, cells);
+
+        next_frame_ = 0;
+
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < num_workers; i++) {
+            threads.push_back(std::thread(&ParameterSweep::SweepWorkerLoop, this, i, remapped_readers[i], laplacian_readers[i], boxes, &worker_cells[i]));
+        }
+
+        for (unsigned int i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+
+        for (unsigned int c = 0; c < cells.size(); c++) {
+
+            SweepResult result;
+            result.block_size = cells[c].state.blockSize;
+            result.sad_threshold = cells[c].state.sadThreshold;
+            result.sobel_limit = cells[c].state.sobelLimit;
+            result.horizontal_invariance_multiplier = cells[c].state.horizontalInvarianceMultiplier;
+
+            result.hits = 0;
+            result.boxed_frame_hits = 0;
+            result.hits_in_boxes = 0;
+            result.boxed_frames_detected = 0;
+
+            for (int i = 0; i < num_workers; i++) {
+                result.hits += worker_cells[i][c].hits;
+                result.boxed_frame_hits += worker_cells[i][c].boxed_frame_hits;
+                result.hits_in_boxes += worker_cells[i][c].hits_in_boxes;
+                result.boxed_frames_detected += worker_cells[i][c].boxed_frames_detected;
+            }
+
+            results->push_back(result);
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        delete remapped_readers[i];
+        delete laplacian_readers[i];
+    }
+
+    num_cells_ += results->size();
+    sweep_elapsed_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return ok;
+}
+
+void ParameterSweep::SweepWorkerLoop(int worker, StereoLogReader *remapped_reader, StereoLogReader *laplacian_reader, const GroundTruthBoxes *boxes, std::vector<SweepCell> *cells) {
+
+    Mat remapped_left, remapped_right, laplacian_left, laplacian_right;
+
+    PushbroomFrameScores scores;
+
+    std::vector<bool> detected(cells->size());
+
+    while (true) {
+        int n = next_frame_ ++;
+
+        if (n >= GetNumCachedFrames()) {
+            break;
+        }
+
+        if (GetCachedFrame(n, remapped_reader, laplacian_reader, &remapped_left, &remapped_right, &laplacian_left, &laplacian_right) == false) {
+            std::cerr << "Warning: failed to read frame " << frame_numbers_[n] << " from the cache, skipping." << std::endl;
+            continue;
+        }
+
+        stereo_[worker]->GetBlockScores(remapped_left, remapped_right, laplacian_left, laplacian_right, search_state_, &scores);
+
+        const std::vector<GroundTruthBox> *frame_boxes = NULL;
+
+        if (boxes != NULL) {
+            frame_boxes = boxes->GetBoxes(frame_numbers_[n]);
+        }
+
+        std::fill(detected.begin(), detected.end(), false);
+
+        for (unsigned int block = 0; block < scores.blocks.size(); block++) {
+
+            // hits are at the center of the block
+            double x = scores.blocks[block].pixel_x + scores.block_size / 2.0;
+            double y = scores.blocks[block].pixel_y + scores.block_size / 2.0;
+
+            bool in_box = frame_boxes != NULL && InAnyBox(*frame_boxes, x, y);
+
+            for (unsigned int c = 0; c < cells->size(); c++) {
+
+                SweepCell *cell = &(*cells)[c];
+
+                if (PushbroomStereo::IsBlockHit(scores, block, cell->state) == false) {
+                    continue;
+                }
+
+                cell->hits ++;
+
+                if (frame_boxes != NULL) {
+                    cell->boxed_frame_hits ++;
+
+                    if (in_box) {
+                        cell->hits_in_boxes ++;
+                        detected[c] = true;
+                    }
+                }
+            }
+        }
+
+        for (unsigned int c = 0; c < cells->size(); c++) {
+            if (detected[c]) {
+                (*cells)[c].boxed_frames_detected ++;
+            }
+        }
+    }
+}
+
+/**
+ * Gets the images for cached frame number index (counting only the frames
+ * that were cached).  From the cache files, the images point into the
+ * mapping and are only good until the next call.
+ */
+bool ParameterSweep::GetCachedFrame(int index, StereoLogReader *remapped_reader, StereoLogReader *laplacian_reader, Mat *remapped_left, Mat *remapped_right, Mat *laplacian_left, Mat *laplacian_right) {
+
+    int frame_number = frame_numbers_[index];
+
+    if (cache_in_memory_) {
+        const CachedFrame &frame = frames_[frame_number - first_frame_];
+
+        *remapped_left = frame.remapped_left;
+        *remapped_right = frame.remapped_right;
+        *laplacian_left = frame.laplacian_left;
+        *laplacian_right = frame.laplacian_right;
+
+        return true;
+    }
+
+    return remapped_reader->MapFrames(frame_number, remapped_left, remapped_right)
+        && laplacian_reader->MapFrames(frame_number, laplacian_left, laplacian_right);
+}
+
+void ParameterSweep::RemoveCacheFiles() {
+
+    if (remapped_filename_.length() > 0) {
+        remove(remapped_filename_.c_str());
+    }
+
+    if (laplacian_filename_.length() > 0) {
+        remove(laplacian_filename_.c_str());
+    }
+
+    remapped_filename_ = "";
+    laplacian_filename_ = "";
+}
+
+void ParameterSweep::PrintStats() const {
+    printf("Sweep: cached %d frames (%d missing) in %.1f sec, ran %d settings in %.1f sec on %d workers.\n",
+        GetNumCachedFrames(), num_missing_, cache_elapsed_, num_cells_, sweep_elapsed_, GetNumWorkers());
+}
@@ -0,0 +1,173 @@
+/**
+ * Sweeps pushbroom stereo thresholds over recorded frames and scores each
+ * setting against ground-truth boxes drawn in the HUD.
+ *
+ * The expensive parts of the search are done as few times as possible:
+ * frames are remapped and filtered once for the whole sweep and cached (in
+ * memory, or in stereo logs that are mapped back in for long recordings),
+ * and for each block size every frame is searched once with the loosest
+ * thresholds, keeping the raw SAD and interest sums for each block.  Every
+ * sadThreshold, sobelLimit, and horizontalInvarianceMultiplier is then just
+ * a comparison against those sums.  Frames are spread over a worker per
+ * core.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef PARAMETER_SWEEP_HPP
+#define PARAMETER_SWEEP_HPP
+
+#include "opencv2/opencv.hpp"
+#include "pushbroom-stereo.hpp"
+#include "BatchReplay.hpp"
+#include "StereoLog.hpp"
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace cv;
+
+/**
+ * Box around an obstacle in the rectified image, in pixels.
+ */
+struct GroundTruthBox {
+    double x_min;
+    double y_min;
+    double x_max;
+    double y_max;
+};
+
+/**
+ * Boxes from the HUD's box drawing mode (hud -b).  Each line of the file
+ * is:
+ *
+ *   video_number,frame_number,x1,y1,x2,y2[,valid block matching points...]
+ *
+ * with the corners in rectified image pixels.
+ */
+class GroundTruthBoxes {
+
+    public:
+        bool Load(std::string filename, int video_number = -1);
+
+        // NULL if the frame doesn't have any boxes
+        const std::vector<GroundTruthBox>* GetBoxes(int frame_number) const;
+
+        int GetNumFrames() const { return (int)boxes_.size(); }
+
+    private:
+        std::map<int, std::vector<GroundTruthBox> > boxes_;
+};
+
+/**
+ * Values to try.  Every combination is run.
+ */
+struct SweepGrid {
+    std::vector<int> block_sizes;
+    std::vector<int> sad_thresholds;
+    std::vector<int> sobel_limits;
+    std::vector<float> horizontal_invariance_multipliers;
+};
+
+struct SweepResult {
+    int block_size;
+    int sad_threshold;
+    int sobel_limit;
+    float horizontal_invariance_multiplier;
+
+    // over every frame
+    long hits;
+
+    // hits on frames that have boxes, and how many of those are in a box
+    long boxed_frame_hits;
+    long hits_in_boxes;
+
+    // frames with boxes that have at least one hit in a box
+    int boxed_frames_detected;
+};
+
+class ParameterSweep {
+
+    public:
+        /**
+         * @param state stereo settings.  The thresholds being swept are
+         *  ignored.
+         * @param num_workers frames to run at once (0 for one per core)
+         */
+        ParameterSweep(const PushbroomStereoState &state, int num_workers = 0);
+        ~ParameterSweep();
+
+        int GetNumWorkers() const { return (int)stereo_.size(); }
+
+        bool CacheFrames(const std::vector<ReplayFrameSource*> &sources, int first_frame, int last_frame, std::string cache_filename = "");
+
+        int GetNumCachedFrames() const { return (int)frame_numbers_.size(); }
+
+        bool Run(const SweepGrid &grid, const GroundTruthBoxes *boxes, std::vector<SweepResult> *results);
+
+        void PrintStats() const;
+
+    private:
+        struct CachedFrame {
+            bool done;
+            bool missing;
+
+            Mat remapped_left;
+            Mat remapped_right;
+            Mat laplacian_left;
+            Mat laplacian_right;
+        };
+
+        // one setting of the thresholds for one block size
+        struct SweepCell {
+            PushbroomStereoState state;
+
+            long hits;
+            long boxed_frame_hits;
+            long hits_in_boxes;
+            int boxed_frames_detected;
+        };
+
+        void CacheWorkerLoop(int worker, ReplayFrameSource *source);
+
+        void SweepWorkerLoop(int worker, StereoLogReader *remapped_reader, StereoLogReader *laplacian_reader, const GroundTruthBoxes *boxes, std::vector<SweepCell> *cells);
+
+        bool GetCachedFrame(int index, StereoLogReader *remapped_reader, StereoLogReader *laplacian_reader, Mat *remapped_left, Mat *remapped_right, Mat *laplacian_left, Mat *laplacian_right);
+
+        void RemoveCacheFiles();
+
+        PushbroomStereoState state_;
+
+        std::vector<PushbroomStereo*> stereo_;
+
+        // frames that were cached, in order.  If the cache is in memory,
+        // frames_ has the images, otherwise they're in the cache files.
+        std::vector<int> frame_numbers_;
+        std::vector<CachedFrame> frames_;
+
+        std::string remapped_filename_;
+        std::string laplacian_filename_;
+
+        int first_frame_;
+        std::atomic<int> next_frame_;
+
+        // settings for the block size being swept
+        PushbroomStereoState search_state_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_done_;
+
+        bool cache_in_memory_;
+
+        int num_missing_;
+        int num_cells_;
+        double cache_elapsed_;
+        double sweep_elapsed_;
+};
+
+#endif
@@ -12,9 +12,22 @@ RecordingManager::RecordingManager() {
 
     quiet_mode_ = false;
 
+    file_frame_number_ = 0;
+    file_frame_skip_ = 0;
+
     left_video_capture_ = NULL;
     right_video_capture_ = NULL;
 
+    writer_ = NULL;
+    writer_needs_open_ = false;
+    recording_on_ = false;
+    rec_num_frames_ = 0;
+
+    reading_pgm_ = false;
+    reading_log_ = false;
+    log_reader_ = NULL;
+    retired_log_reader_ = NULL;
+
     init_ok_ = false;
 
 }
@@ -28,6 +41,18 @@ RecordingManager::~RecordingManager() {
     if (right_video_capture_) {
         delete right_video_capture_;
     }
+
+    if (writer_) {
+        delete writer_;
+    }
+
+    if (log_reader_) {
+        delete log_reader_;
+    }
+
+    if (retired_log_reader_) {
+        delete retired_log_reader_;
+    }
 }
 
 void RecordingManager::Init(OpenCvStereoConfig stereo_config) {
@@ -46,18 +71,11 @@ bool RecordingManager::InitRecording(Mat image_left, Mat image_right) {
 
     rec_num_frames_ = 0;
 
-    // allocate a huge buffer for video frames
-    printf("Allocating ringbuffer data... ");
-    fflush(stdout);
-
-    for (int i=0; i<RINGBUFFER_SIZE; i++)
-    {
-        ringbufferL[i].create(image_left.size(), image_left.type());
-        ringbufferR[i].create(image_right.size(), image_right.type());
+    // frames go to disk as we record them, on the writer's thread
+    if (writer_ == NULL) {
+        writer_ = new RecordingWriter(RECORDING_QUEUE_SIZE);
     }
 
-    printf("done.\n");
-
     BeginNewRecording();
 
     return true;
@@ -65,13 +83,18 @@ bool RecordingManager::InitRecording(Mat image_left, Mat image_right) {
 }
 
 /**
- * Sets up variables to start recording on the next frame.
+ * Starts recording to new files on the next frame.  Finishes the last
+ * recording first, if there was one.
  */
 void RecordingManager::BeginNewRecording() {
 
+    if (writer_ != NULL) {
+        writer_->Close();
+    }
+
     // get a new filename
     if (video_number_ < 0) {
-        video_number_ = GetNextVideoNumber(stereo_config_.usePGM, true);
+        video_number_ = GetNextVideoNumber(GetVideoExtension(), true);
     } else {
         video_number_ ++;
     }
@@ -79,89 +102,101 @@ void RecordingManager::BeginNewRecording() {
     // reset the number of frames we've recorded
     rec_num_frames_ = 0;
 
+    // files are made when the first frame shows up
+    writer_needs_open_ = true;
+
     recording_on_ = true;
 }
 
-void RecordingManager::AddFrames(Mat image_left, Mat image_right) {
-
-    if (recording_on_) {
-        ringbufferL[rec_num_frames_%RINGBUFFER_SIZE] = image_left;
-        ringbufferR[rec_num_frames_%RINGBUFFER_SIZE] = image_right;
-
-        rec_num_frames_ ++;
-    }
-}
+/**
+ * Makes the files for a new recording and points the writer at them.
+ */
+void RecordingManager::OpenRecording() {
 
-void RecordingManager::FlushBufferToDisk() {
+    // we write every frame starting from the first, so nothing is ever
+    // skipped at the start of the video
+    if (stereo_config_.useStereoLog) {
+        CheckOrCreateDirectory(stereo_config_.videoSaveDir);
 
+        // one file for both cameras
+        writer_->OpenStereoLog(GetNextVideoFilename("videoS-skip-0", STEREO_LOG_EXTENSION, true));
 
-    printf("Writing video...\n");
+    } else if (stereo_config_.usePGM) {
+        string video_l_dir = SetupVideoWriterPGM("videoL-skip-0", true);
+        string video_r_dir = SetupVideoWriterPGM("videoR-skip-0", false);
 
-    int endI, firstFrame = 0;
-    if (rec_num_frames_ < RINGBUFFER_SIZE)
-    {
-        endI = rec_num_frames_;
+        writer_->OpenPGM(video_l_dir, video_r_dir);
     } else {
-        // our buffer is smaller than the full movie.
-        // figure out where in the ringbuffer we are
-        firstFrame = rec_num_frames_%RINGBUFFER_SIZE+1;
-        if (firstFrame > RINGBUFFER_SIZE)
-        {
-            firstFrame = 0;
-        }
-
-        endI = RINGBUFFER_SIZE;
+        CheckOrCreateDirectory(stereo_config_.videoSaveDir);
 
-        printf("\nWARNING: buffer size exceeded by %d frames, which have been dropped.\n\n", rec_num_frames_ - RINGBUFFER_SIZE);
+        string filename_left = GetNextVideoFilename("videoL-skip-0", ".avi", true);
+        string filename_right = GetNextVideoFilename("videoR-skip-0", ".avi", false);
 
+        writer_->OpenAVI(filename_left, filename_right, GetFourcc());
     }
 
-    if (stereo_config_.usePGM) {
-        printf("Using PGM format...\n");
+    writer_needs_open_ = false;
+}
 
-        string video_l_dir = SetupVideoWriterPGM("videoL-skip-" + std::to_string(firstFrame), true);
+void RecordingManager::AddFrames(Mat image_left, Mat image_right) {
+    RecordFrames(image_left, image_right, GetTimestampNow());
+}
 
-        string video_r_dir = SetupVideoWriterPGM("videoR-skip-" + std::to_string(firstFrame), false);
+/**
+ * Records frames that still point into the cameras' capture buffers.  The
+ * writer can hold frames longer than the cameras can spare their buffers,
+ * so these are copied out, but only while we are recording.
+ */
+void RecordingManager::AddFrames(const CameraFrame &frame_left, const CameraFrame &frame_right) {
 
-        // write the video
-        for (int i = 0; i < endI; i++) {
+    if (IsRecording()) {
+        RecordFrames(frame_left.GetImage().clone(), frame_right.GetImage().clone(), frame_left.GetTimestamp());
+    }
+}
 
-            boost::format formatter_left = boost::format("/left%05d.pgm") % i;
-            string im_name_left = formatter_left.str();
+/**
+ * @param image_left left image, which the writer keeps
+ * @param image_right right image, which the writer keeps
+ * @param timestamp capture time in microseconds
+ */
+void RecordingManager::RecordFrames(Mat image_left, Mat image_right, uint64_t timestamp) {
 
-            boost::format formatter_right = boost::format("/right%05d.pgm") % i;
-            string im_name_right = formatter_right.str();
+    if (recording_on_ && writer_ != NULL) {
 
-            imwrite( video_l_dir + im_name_left, ringbufferL[(i+firstFrame)%RINGBUFFER_SIZE]);
+        if (writer_needs_open_) {
+            OpenRecording();
+        }
 
-            imwrite( video_r_dir + im_name_right, ringbufferR[(i+firstFrame)%RINGBUFFER_SIZE]);
+        // number frames even if the writer has to drop them, so they stay
+        // in line with the frame numbers we send out
+        writer_->AddFrames(image_left, image_right, rec_num_frames_, timestamp);
 
-            if (quiet_mode_ == false || i % 100 == 0) {
-                printf("\rWriting video: (%.1f%%) -- %d/%d frames", (float)(i+1)/endI*100, i+1, endI);
-                fflush(stdout);
-            }
-        }
+        rec_num_frames_ ++;
+    }
+}
 
+/**
+ * Finishes the current recording.  Frames have been going to disk all
+ * along, so this only waits for the last few in the queue.
+ */
+void RecordingManager::FlushBufferToDisk() {
 
-    } else {
-        VideoWriter recordL = SetupVideoWriterAVI("videoL-skip-" + std::to_string(firstFrame), ringbufferL[0].size(), true);
+    if (writer_ == NULL) {
+        return;
+    }
 
-        VideoWriter recordR = SetupVideoWriterAVI("videoR-skip-"
-            + std::to_string(firstFrame), ringbufferR[0].size(), false);
+    printf("Finishing video... ");
+    fflush(stdout);
 
-        // write the video
-        for (int i=0; i<endI; i++)
-        {
-            recordL << ringbufferL[(i+firstFrame)%RINGBUFFER_SIZE];
-            recordR << ringbufferR[(i+firstFrame)%RINGBUFFER_SIZE];
+    writer_->Close();
 
-            if (quiet_mode_ == false || i % 100 == 0) {
-                printf("\rWriting video: (%.1f%%) -- %d/%d frames", (float)(i+1)/endI*100, i+1, endI);
-                fflush(stdout);
-            }
-        }
-    }
-    printf("\ndone.\n");
+    printf("done.\n");
+
+    writer_->PrintStats();
+
+    // nowhere to put frames until the next BeginNewRecording
+    recording_on_ = false;
+    writer_needs_open_ = false;
 }
 
 
@@ -191,14 +226,9 @@ VideoWriter RecordingManager::SetupVideoWriterAVI(string filenamePrefix, Size fr
 
     CheckOrCreateDirectory(stereo_config_.videoSaveDir);
 
-    string filename = GetNextVideoFilename(filenamePrefix, false, increment_number, this_video_number);
-
-    char fourcc1 = stereo_config_.fourcc.at(0);
-    char fourcc2 = stereo_config_.fourcc.at(1);
-    char fourcc3 = stereo_config_.fourcc.at(2);
-    char fourcc4 = stereo_config_.fourcc.at(3);
+    string filename = GetNextVideoFilename(filenamePrefix, ".avi", increment_number, this_video_number);
 
-    recorder.open(filename, CV_FOURCC(fourcc1, fourcc2, fourcc3, fourcc4), 30, frameSize, is_color);
+    recorder.open(filename, GetFourcc(), 30, frameSize, is_color);
     if (!recorder.isOpened())
     {
         printf("VideoWriter failed to open!\n");
@@ -210,6 +240,35 @@ VideoWriter RecordingManager::SetupVideoWriterAVI(string filenamePrefix, Size fr
 }
 
 
+/**
+ * Gets the extension of recordings in the configured format.
+ *
+ * @retval extension, or "" for directories of PGM files
+ */
+string RecordingManager::GetVideoExtension() {
+    if (stereo_config_.useStereoLog) {
+        return STEREO_LOG_EXTENSION;
+    } else if (stereo_config_.usePGM) {
+        return "";
+    } else {
+        return ".avi";
+    }
+}
+
+/**
+ * Gets the video codec from the configuration.
+ *
+ * @retval FOURCC code for VideoWriter
+ */
+int RecordingManager::GetFourcc() {
+    char fourcc1 = stereo_config_.fourcc.at(0);
+    char fourcc2 = stereo_config_.fourcc.at(1);
+    char fourcc3 = stereo_config_.fourcc.at(2);
+    char fourcc4 = stereo_config_.fourcc.at(3);
+
+    return CV_FOURCC(fourcc1, fourcc2, fourcc3, fourcc4);
+}
+
 /**
  * Sets up the system to write .pgm files into a directory named in a nice way.
  *
@@ -226,7 +285,7 @@ string RecordingManager::SetupVideoWriterPGM(string dirnamePrefix, bool incremen
     CheckOrCreateDirectory(stereo_config_.videoSaveDir);
 
     // make a new directory for a bunch of images
-    string dirpath = GetNextVideoFilename(dirnamePrefix, true, increment_number);
+    string dirpath = GetNextVideoFilename(dirnamePrefix, "", increment_number);
 
 
     if (boost::filesystem::create_directory(dirpath)) {
@@ -256,8 +315,33 @@ bool RecordingManager::LoadVideoFiles(string video_file_left, string video_file_
 
     using_video_from_disk_ = true;
 
-    // determine if we are using pgm files or avi files
-    if (boost::iequals(video_file_left.substr(video_file_left.length() - 4), ".avi")) {
+    reading_log_ = false;
+
+    // determine if we are using a stereo log, pgm files, or avi files
+    if (boost::iends_with(video_file_left, STEREO_LOG_EXTENSION)) {
+
+        // both cameras are in the one file
+
+        if (retired_log_reader_) {
+            delete retired_log_reader_;
+        }
+
+        retired_log_reader_ = log_reader_;
+
+        log_reader_ = new StereoLogReader();
+
+        if (log_reader_->Open(video_file_left) != true) {
+            return false;
+        }
+
+        reading_log_ = true;
+        reading_pgm_ = false;
+
+        if (!quiet_mode_) {
+            cout << endl << endl << "Opened " << video_file_left << " (" << log_reader_->GetNumFrames() << " frames)" << endl;
+        }
+
+    } else if (boost::iequals(video_file_left.substr(video_file_left.length() - 4), ".avi")) {
 
         // using avi files
 
@@ -281,7 +365,7 @@ bool RecordingManager::LoadVideoFiles(string video_file_left, string video_file_
             cerr << endl << "Error: failed to open " << video_file_left
                 << endl;
             return false;
-        } else {
+        } else if (!quiet_mode_) {
             cout << endl << endl << "Opened " << video_file_left << endl;
         }
 
@@ -289,7 +373,7 @@ bool RecordingManager::LoadVideoFiles(string video_file_left, string video_file_
             cerr << endl << "Error: failed to open " << video_file_right
                 << endl;
             return false;
-        } else {
+        } else if (!quiet_mode_) {
             cout << "Opened " << video_file_right << endl;
         }
 
@@ -341,12 +425,20 @@ void RecordingManager::GetFrames(Mat &left_image, Mat &right_image) {
 
     } else {
 
-        if (reading_pgm_) {
+        if (reading_log_) {
+            GetFrameStereoLog(left_image, right_image);
+        } else if (reading_pgm_) {
             GetFramePGM(left_image, right_image);
         } else {
             GetFrameAVI(left_image, right_image);
         }
     }
+
+    // nothing points into the last log's mapping anymore
+    if (retired_log_reader_) {
+        delete retired_log_reader_;
+        retired_log_reader_ = NULL;
+    }
 }
 
 void RecordingManager::GetFramePGM(Mat &left_image, Mat &right_image) {
@@ -406,6 +498,34 @@ void RecordingManager::GetFramePGM(Mat &left_image, Mat &right_image) {
 
 }
 
+/**
+ * Gets a frame from a stereo log, based on the already-set
+ * file_frame_number_ and file_frame_skip_ values.
+ *
+ * The images point straight into the memory-mapped log, so they are only
+ * good until the next call to GetFrames, and they are read-only.  Clone
+ * them to draw on them or to keep them longer.
+ *
+ * @param left_image left image to put frame into
+ * @param right_image right image to put frame into
+ */
+void RecordingManager::GetFrameStereoLog(Mat &left_image, Mat &right_image) {
+
+    int load_number = file_frame_number_ - file_frame_skip_;
+
+    if (log_reader_->MapFrames(load_number, &left_image, &right_image) != true) {
+
+        // dropped while recording, or past either end of the recording
+        boost::format formatter = boost::format("Missing frame: %05d") % load_number;
+
+        left_image = Mat::zeros(240, 376, CV_8UC1);
+        putText(left_image, formatter.str(), Point(50,100), FONT_HERSHEY_DUPLEX, .5, Scalar(255));
+
+        right_image = Mat::zeros(240, 376, CV_8UC1);
+        putText(right_image, formatter.str(), Point(50,100), FONT_HERSHEY_DUPLEX, .5, Scalar(255));
+    }
+}
+
 /**
  * Gets a frame from an AVI file.  Gets the frame at locations based
  * on the already-set file_frame_number_ and file_frame_skip_ values.
@@ -441,6 +561,71 @@ void RecordingManager::GetFrameAVI(Mat &left_image, Mat &right_image) {
     cvtColor(matR_file, right_image, CV_BGR2GRAY);
 }
 
+/**
+ * Gets the length of the loaded recording, including any frames that were
+ * dropped while recording.
+ *
+ * @retval one past the last frame number, counting from the start of the
+ *  recording (ie without the frame skip)
+ */
+int RecordingManager::GetNumPlaybackFrames() {
+
+    if (reading_log_) {
+
+        return log_reader_->GetNumFrames() > 0 ? log_reader_->GetLastFrameNumber() + 1 : 0;
+
+    } else if (reading_pgm_) {
+
+        // files are numbered by frame, so find the highest one
+        int num_frames = 0;
+
+        boost::filesystem::directory_iterator end_itr;
+        for (boost::filesystem::directory_iterator itr(pgm_left_dir_); itr != end_itr; ++itr) {
+
+            int frame_number;
+            if (sscanf(itr->path().filename().string().c_str(), "left%05d.pgm", &frame_number) == 1
+                && frame_number + 1 > num_frames) {
+
+                num_frames = frame_number + 1;
+            }
+        }
+
+        return num_frames;
+
+    } else if (left_video_capture_ != NULL) {
+
+        return left_video_capture_->get(CV_CAP_PROP_FRAME_COUNT);
+    }
+
+    return 0;
+}
+
+/**
+ * @param frame_number frame to check for, counting from the start of the
+ *  recording (ie without the frame skip)
+ *
+ * @retval false if the frame was dropped while recording, or is past
+ *  either end of the recording
+ */
+bool RecordingManager::HasPlaybackFrame(int frame_number) {
+
+    if (frame_number < 0) {
+        return false;
+    }
+
+    if (reading_log_) {
+        return log_reader_->HasFrame(frame_number);
+    } else if (reading_pgm_) {
+        boost::format formatter_left = boost::format("/left%05d.pgm") % frame_number;
+        boost::format formatter_right = boost::format("/right%05d.pgm") % frame_number;
+
+        return boost::filesystem::exists(pgm_left_dir_ + formatter_left.str())
+            && boost::filesystem::exists(pgm_right_dir_ + formatter_right.str());
+    }
+
+    return frame_number < GetNumPlaybackFrames();
+}
+
 bool RecordingManager::SetPlaybackVideoDirectory(string video_directory) {
 
     if (video_directory.length() <= 0) {
@@ -491,14 +676,14 @@ void RecordingManager::SetPlaybackFrameNumber(int frame_number) {
 }
 
 
-string RecordingManager::GetNextVideoFilename(string filename_prefix, bool use_pgm, bool increment_number, int *this_video_number) {
+string RecordingManager::GetNextVideoFilename(string filename_prefix, string extension, bool increment_number, int *this_video_number) {
 
     // format the number string
     char filenumber[100];
 
 
     if (video_number_ < 0) {
-        int vidnum = GetNextVideoNumber(use_pgm, increment_number);
+        int vidnum = GetNextVideoNumber(extension, increment_number);
 
         sprintf(filenumber, "%02d", vidnum);
         if (this_video_number != NULL) {
@@ -516,25 +701,21 @@ string RecordingManager::GetNextVideoFilename(string filename_prefix, bool use_p
                 + GetDateSring()
                 + "." + filenumber;
 
-    if (!use_pgm) {
-        return retstring + ".avi";
-    } else {
-        return retstring;
-    }
+    return retstring + extension;
 }
 
 
 /**
  * Gets next availible filename for a video file
  *
- * @param use_pgm true if we should search for directories of PGM files, false if
- *  using AVI files.
+ * @param extension extension of the video files ("" for directories of PGM
+ *  files)
  * @param increment_number true if we should increment video number
  *
  * @retval number of the next availible name
  *
  */
-int RecordingManager::GetNextVideoNumber(bool use_pgm, bool increment_number) {
+int RecordingManager::GetNextVideoNumber(string extension, bool increment_number) {
 
     string datechar = GetDateSring();
 
@@ -542,7 +723,7 @@ int RecordingManager::GetNextVideoNumber(bool use_pgm, bool increment_number) {
 
     if (boost::filesystem::exists(stereo_config_.videoSaveDir)) {
 
-        max_number = MatchVideoFile(stereo_config_.videoSaveDir,  datechar, use_pgm);
+        max_number = MatchVideoFile(stereo_config_.videoSaveDir,  datechar, extension);
 
     } else {
         cerr << "Warning: attemtped to find video files in " << stereo_config_.videoSaveDir <<
@@ -616,7 +797,7 @@ int RecordingManager::LoadVideoFileFromDir(long long timestamp, int video_number
     std::cout << cpu_dir << std::endl;
 
     int skip_amount = MatchVideoFile(video_directory_ + "/" + cpu_dir + "/onboard-vids/"
-        + hostname_, datetime, stereo_config_.usePGM, video_number);
+        + hostname_, datetime, GetVideoExtension(), video_number);
 
 
     // format the video number as a two-decimal value
@@ -634,9 +815,16 @@ int RecordingManager::LoadVideoFileFromDir(long long timestamp, int video_number
         + hostname_ + "/videoR-skip-" + to_string(skip_amount) + "-" + datetime
         + "." + video_number_str;
 
-    if (stereo_config_.usePGM == false) {
-        left_video += ".avi";
-        right_video += ".avi";
+    if (stereo_config_.useStereoLog) {
+        // one file has both cameras
+        left_video = video_directory_ + "/" + cpu_dir + "/onboard-vids/"
+            + hostname_ + "/videoS-skip-" + to_string(skip_amount) + "-" + datetime
+            + "." + video_number_str + STEREO_LOG_EXTENSION;
+
+        right_video = "";
+    } else {
+        left_video += GetVideoExtension();
+        right_video += GetVideoExtension();
     }
 
     // attempt to create video capture objects
@@ -660,7 +848,7 @@ int RecordingManager::LoadVideoFileFromDir(long long timestamp, int video_number
  *
  * @param directory directory to search for videos
  * @param datestr string containing date to search for (ex. 2013-11-16)
- * @param using_avi if true, match for .avi, otherwise without that (ie for a directory)
+ * @param extension extension to match, like ".avi" ("" for a directory)
  * @param match_number (optional).  If provided, will return the skip value for
  *  that number.  Otherwise will return the largest video number in the
  *  directory.
@@ -669,7 +857,7 @@ int RecordingManager::LoadVideoFileFromDir(long long timestamp, int video_number
  *  the directory.
  *
  */
-int RecordingManager::MatchVideoFile(string directory, string datestr, bool using_pgm, int match_number) {
+int RecordingManager::MatchVideoFile(string directory, string datestr, string extension, int match_number) {
 
     int return_number = 0;
 
@@ -687,15 +875,16 @@ int RecordingManager::MatchVideoFile(string directory, string datestr, bool usin
         // 17 characters in 2013-11-21.01.avi
         // or in            xxxx-xx-xx.xx.avi
 
-        int avi_offset;
-        if (using_pgm) {
-            avi_offset = -4; // everything is 4 characters less since we don't have ".avi" at the end
-        } else {
-            avi_offset = 0;
-        }
+        // everything is shifted by however much longer or shorter the
+        // extension is than ".avi"
+        int avi_offset = int(extension.length()) - 4;
 
         string this_file = itr->path().leaf().string();
 
+        if (extension.length() > 0 && !boost::iends_with(this_file, extension)) {
+            continue;
+        }
+
         if (int(this_file.length()) > 18 + avi_offset) {
 
             // might be a video file
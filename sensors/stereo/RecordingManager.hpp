@@ -6,8 +6,10 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/format.hpp>
 #include "../../utils/utils/RealtimeUtils.hpp"
+#include "CameraSource.hpp"
+#include "RecordingWriter.hpp"
 
-#define RINGBUFFER_SIZE (120*50) // number of seconds to allocate for recording * framerate
+#define RECORDING_QUEUE_SIZE 30 // frames that can wait for the disk (about a second)
 
 using namespace std;
 using namespace cv;
@@ -24,6 +26,7 @@ class RecordingManager {
         bool InitRecording(Mat image_left, Mat image_right);
 
         void AddFrames(Mat image_left, Mat image_right);
+        void AddFrames(const CameraFrame &frame_left, const CameraFrame &frame_right);
 
         void FlushBufferToDisk();
 
@@ -35,11 +38,17 @@ class RecordingManager {
 
         void SetRecordingOn(bool x) { recording_on_ = x; }
 
+        // true if frames passed to AddFrames are going to a recording
+        bool IsRecording() const { return recording_on_ && writer_ != NULL; }
+
         bool SetPlaybackVideoDirectory(string video_directory);
         void SetPlaybackVideoNumber(int video_number, long long timestamp);
         void SetPlaybackFrameNumber(int frame_number);
         int GetFrameNumber();
 
+        int GetNumPlaybackFrames();
+        bool HasPlaybackFrame(int frame_number);
+
         bool UsingLiveCameras() { return !using_video_from_disk_; }
 
         int GetRecVideoNumber() { return video_number_; }
@@ -58,16 +67,22 @@ class RecordingManager {
 
         string SetupVideoWriterPGM(string dirnamePrefix, bool increment_number);
         VideoWriter SetupVideoWriterAVI(string filenamePrefix, Size frameSize, bool increment_number, bool is_color = false, int *this_video_number = NULL);
+        int GetFourcc();
+        void OpenRecording();
 
         int LoadVideoFileFromDir(long long timestamp, int video_number);
 
         void GetFramePGM(Mat &left_image, Mat &right_image);
         void GetFrameAVI(Mat &left_image, Mat &right_image);
+        void GetFrameStereoLog(Mat &left_image, Mat &right_image);
 
-        string GetNextVideoFilename(string filename_prefix, bool use_pgm, bool increment_number, int *this_video_number = NULL);
-        int GetNextVideoNumber(bool use_pgm, bool increment_number);
+        void RecordFrames(Mat image_left, Mat image_right, uint64_t timestamp);
 
-        int MatchVideoFile(string directory, string datestr, bool using_avi = false, int match_number = -1);
+        string GetNextVideoFilename(string filename_prefix, string extension, bool increment_number, int *this_video_number = NULL);
+        int GetNextVideoNumber(string extension, bool increment_number);
+        string GetVideoExtension();
+
+        int MatchVideoFile(string directory, string datestr, string extension = ".avi", int match_number = -1);
         int GetSkipNumber(string filename);
         string GetDateSring();
         string CheckOrCreateDirectory(string dir);
@@ -76,9 +91,9 @@ class RecordingManager {
 
         OpenCvStereoConfig stereo_config_;
 
-        // allocate a huge array for a ringbuffer
-        Mat ringbufferL[RINGBUFFER_SIZE];
-        Mat ringbufferR[RINGBUFFER_SIZE];
+        // streams recorded frames to disk
+        RecordingWriter *writer_;
+        bool writer_needs_open_;
 
         VideoCapture *left_video_capture_;
         VideoCapture *right_video_capture_;
@@ -95,6 +110,12 @@ class RecordingManager {
         int hud_video_number_;
         bool recording_on_;
         bool reading_pgm_;
+        bool reading_log_;
+
+        // frames from a stereo log point into its mapping, so when we move
+        // to the next log the old one stays open until the next GetFrames
+        StereoLogReader *log_reader_;
+        StereoLogReader *retired_log_reader_;
 
         bool using_video_directory_;
         string video_directory_;
@@ -0,0 +1,35 @@
+/**
+ * Frame source for the batch tools that reads through a RecordingManager,
+ * so every format it can play back works there too.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef RECORDING_REPLAY_SOURCE_HPP
+#define RECORDING_REPLAY_SOURCE_HPP
+
+#include "BatchReplay.hpp"
+#include "RecordingManager.hpp"
+
+class RecordingReplaySource : public ReplayFrameSource {
+
+    public:
+        RecordingReplaySource(RecordingManager *recording_manager) : recording_manager_(recording_manager) {}
+
+        bool GetFrames(int frame_number, Mat *image_left, Mat *image_right) {
+            if (recording_manager_->HasPlaybackFrame(frame_number) == false) {
+                return false;
+            }
+
+            recording_manager_->SetPlaybackFrameNumber(frame_number);
+            recording_manager_->GetFrames(*image_left, *image_right);
+
+            return true;
+        }
+
+    private:
+        RecordingManager *recording_manager_;
+};
+
+#endif
@@ -0,0 +1,313 @@
+/**
+ * Writes recorded frames to disk on its own thread while we fly.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "RecordingWriter.hpp"
+#include <iostream>
+#include <chrono>
+#include <stdio.h>
+
+RecordingWriter::RecordingWriter(int queue_size) : queue_(queue_size) {
+
+    quit_ = false;
+
+    is_open_ = false;
+    num_pushed_ = 0;
+    closes_requested_ = 0;
+
+    num_popped_ = 0;
+    closes_done_ = 0;
+
+    num_written_ = 0;
+    num_dropped_ = 0;
+    max_queue_depth_ = 0;
+
+    output_open_ = false;
+    next_frame_number_ = 0;
+
+    thread_ = std::thread(&RecordingWriter::WriterLoop, this);
+}
+
+RecordingWriter::~RecordingWriter() {
+
+    Close();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cv_work_.notify_all();
+
+    thread_.join();
+}
+
+/**
+ * Starts a new recording as a directory of PGM files per camera.  Closes
+ * the last recording, if there was one.
+ */
+void RecordingWriter::OpenPGM(std::string dir_left, std::string dir_right) {
+    Item item;
+    item.type = ITEM_OPEN_PGM;
+    item.path_left = dir_left;
+    item.path_right = dir_right;
+
+    Push(item);
+    is_open_ = true;
+}
+
+/**
+ * Starts a new recording as an AVI file per camera.  The files are opened
+ * when the first frame shows up, since that's when we know the frame size.
+ * Closes the last recording, if there was one.
+ */
+void RecordingWriter::OpenAVI(std::string filename_left, std::string filename_right, int fourcc) {
+    Item item;
+    item.type = ITEM_OPEN_AVI;
+    item.path_left = filename_left;
+    item.path_right = filename_right;
+    item.fourcc = fourcc;
+
+    Push(item);
+    is_open_ = true;
+}
+
+/**
+ * Starts a new recording as a single stereo log file.  Closes the last
+ * recording, if there was one.
+ */
+void RecordingWriter::OpenStereoLog(std::string filename) {
+    Item item;
+    item.type = ITEM_OPEN_LOG;
+    item.path_left = filename;
+
+    Push(item);
+    is_open_ = true;
+}
+
+/**
+ * Queues a pair of frames for the disk.  Never waits: if the queue is full,
+ * the frames are dropped.
+ *
+ * The writer keeps the images until they are written, so they must not be
+ * changed afterwards (or point into a camera's buffers).
+ *
+ * @param image_left left image
+ * @param image_right right image
+ * @param frame_number number of this frame in the recording, starting at 0
+ * @param timestamp capture time in microseconds (only kept by stereo logs)
+ *
+ * @retval false if the frames were dropped, or there is no recording open
+ */
+bool RecordingWriter::AddFrames(Mat image_left, Mat image_right, int frame_number, uint64_t timestamp) {
+
+    if (is_open_ == false) {
+        return false;
+    }
+
+    Item item;
+    item.type = ITEM_FRAMES;
+    item.left = image_left;
+    item.right = image_right;
+    item.frame_number = frame_number;
+    item.timestamp = timestamp;
+
+    if (queue_.Push(item) == false) {
+        num_dropped_ ++;
+        return false;
+    }
+
+    num_pushed_ ++;
+
+    int depth = num_pushed_ - num_popped_;
+    if (depth > max_queue_depth_) {
+        max_queue_depth_ = depth;
+    }
+
+    Notify();
+
+    return true;
+}
+
+/**
+ * Finishes the recording: waits for everything queued to hit the disk and
+ * closes the files.  Since the queue is short, this is quick.
+ *
+ * @param timeout_ms how long to wait for the writer
+ *
+ * @retval false if the writer didn't finish in time (it keeps going)
+ */
+bool RecordingWriter::Close(int timeout_ms) {
+
+    if (is_open_ == false) {
+        return true;
+    }
+
+    Item item;
+    item.type = ITEM_CLOSE;
+
+    Push(item);
+    is_open_ = false;
+    closes_requested_ ++;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (cv_closed_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+        [this] { return closes_done_ >= closes_requested_; }) == false) {
+
+        std::cerr << "Warning: recording still writing to disk after " << timeout_ms << " ms." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void RecordingWriter::PrintStats() const {
+    printf("Recording: %d frames written, %d dropped because the disk fell behind, queue peaked at %d/%d.\n",
+        GetNumWritten(), GetNumDropped(), GetMaxQueueDepth(), GetQueueSize());
+}
+
+/**
+ * Queues a command, which unlike frames can't be dropped.  The writer is
+ * always draining the queue, so we don't wait long.
+ */
+void RecordingWriter::Push(const Item &item) {
+    while (queue_.Push(item) == false) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    num_pushed_ ++;
+
+    Notify();
+}
+
+void RecordingWriter::Notify() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cv_work_.notify_one();
+}
+
+void RecordingWriter::WriterLoop() {
+
+    while (true) {
+        Item item;
+
+        if (queue_.Pop(&item) == false) {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            if (quit_ && queue_.empty()) {
+                break;
+            }
+
+            cv_work_.wait(lock, [this] { return quit_ || !queue_.empty(); });
+            continue;
+        }
+
+        num_popped_ ++;
+
+        switch (item.type) {
+            case ITEM_FRAMES:
+                WriteFrames(item);
+                break;
+
+            case ITEM_OPEN_PGM:
+            case ITEM_OPEN_AVI:
+            case ITEM_OPEN_LOG:
+                CloseOutput();
+
+                output_ = item;
+                output_open_ = true;
+                next_frame_number_ = 0;
+
+                if (item.type == ITEM_OPEN_LOG) {
+                    if (log_.Open(item.path_left)) {
+                        std::cout << std::endl << "Opened " << item.path_left << std::endl;
+                    }
+                }
+                break;
+
+            case ITEM_CLOSE:
+                CloseOutput();
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    closes_done_ ++;
+                }
+                cv_closed_.notify_all();
+                break;
+        }
+    }
+
+    CloseOutput();
+}
+
+void RecordingWriter::WriteFrames(const Item &item) {
+
+    if (output_open_ == false) {
+        return;
+    }
+
+    if (output_.type == ITEM_OPEN_PGM) {
+
+        // name files by frame number, so a dropped frame is a missing file
+        char name_left[100], name_right[100];
+        snprintf(name_left, sizeof(name_left), "/left%05d.pgm", item.frame_number);
+        snprintf(name_right, sizeof(name_right), "/right%05d.pgm", item.frame_number);
+
+        imwrite(output_.path_left + name_left, item.left);
+        imwrite(output_.path_right + name_right, item.right);
+
+    } else if (output_.type == ITEM_OPEN_LOG) {
+
+        log_.WriteFrames(item.left, item.right, item.frame_number, item.timestamp);
+
+    } else {
+
+        if (avi_left_.isOpened() == false) {
+            avi_left_.open(output_.path_left, output_.fourcc, 30, item.left.size(), false);
+            avi_right_.open(output_.path_right, output_.fourcc, 30, item.right.size(), false);
+
+            if (!avi_left_.isOpened() || !avi_right_.isOpened()) {
+                printf("VideoWriter failed to open!\n");
+            } else {
+                std::cout << std::endl << "Opened " << output_.path_left << std::endl;
+            }
+        }
+
+        // AVI frames have no numbers, so fill in for dropped frames to keep
+        // the rest of the video in the right place.  Frames dropped before
+        // the first one we got are filled in with that one.
+        const Mat &fill_left = last_left_.data ? last_left_ : item.left;
+        const Mat &fill_right = last_right_.data ? last_right_ : item.right;
+
+        while (next_frame_number_ < item.frame_number) {
+            avi_left_ << fill_left;
+            avi_right_ << fill_right;
+            next_frame_number_ ++;
+        }
+
+        avi_left_ << item.left;
+        avi_right_ << item.right;
+
+        last_left_ = item.left;
+        last_right_ = item.right;
+    }
+
+    next_frame_number_ = item.frame_number + 1;
+    num_written_ ++;
+}
+
+void RecordingWriter::CloseOutput() {
+    log_.Close();
+
+    avi_left_.release();
+    avi_right_.release();
+
+    last_left_.release();
+    last_right_.release();
+
+    output_open_ = false;
+}
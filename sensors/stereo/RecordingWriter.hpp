@@ -0,0 +1,111 @@
+/**
+ * Writes recorded frames to disk on its own thread while we fly.
+ *
+ * The stereo loop hands frames over through a small lock-free queue, which
+ * only has to absorb jitter in how long the disk takes.  If the writer
+ * falls so far behind that the queue fills, frames are dropped instead of
+ * stalling the loop, and counted.  Dropped frames keep their place: PGM
+ * recordings skip their file numbers, stereo logs skip their frame numbers,
+ * and AVI recordings repeat the frame before, so frame numbers still line
+ * up with the LCM log on playback.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef RECORDING_WRITER_HPP
+#define RECORDING_WRITER_HPP
+
+#include "opencv2/opencv.hpp"
+#include "SpscQueue.hpp"
+#include "StereoLog.hpp"
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace cv;
+
+class RecordingWriter {
+
+    public:
+        /**
+         * @param queue_size frames that can wait for the disk
+         */
+        RecordingWriter(int queue_size);
+        ~RecordingWriter();
+
+        void OpenPGM(std::string dir_left, std::string dir_right);
+        void OpenAVI(std::string filename_left, std::string filename_right, int fourcc);
+        void OpenStereoLog(std::string filename);
+
+        bool AddFrames(Mat image_left, Mat image_right, int frame_number, uint64_t timestamp = 0);
+
+        bool Close(int timeout_ms = 1000);
+
+        bool IsOpen() const { return is_open_; }
+
+        int GetNumWritten() const { return num_written_; }
+        int GetNumDropped() const { return num_dropped_; }
+
+        // deepest the queue has been, out of GetQueueSize()
+        int GetMaxQueueDepth() const { return max_queue_depth_; }
+        int GetQueueSize() const { return queue_.GetCapacity(); }
+
+        void PrintStats() const;
+
+    private:
+        enum ItemType { ITEM_FRAMES, ITEM_OPEN_PGM, ITEM_OPEN_AVI, ITEM_OPEN_LOG, ITEM_CLOSE };
+
+        struct Item {
+            ItemType type;
+
+            Mat left, right;
+            int frame_number;
+            uint64_t timestamp;
+
+            // directories for PGM, filenames for AVI and the stereo log
+            std::string path_left, path_right;
+            int fourcc;
+        };
+
+        void Push(const Item &item);
+        void Notify();
+
+        void WriterLoop();
+        void WriteFrames(const Item &item);
+        void WriteAVIFrames(Mat image_left, Mat image_right);
+        void CloseOutput();
+
+        SpscQueue<Item> queue_;
+
+        std::thread thread_;
+
+        std::mutex mutex_;
+        std::condition_variable cv_work_;
+        std::condition_variable cv_closed_;
+        bool quit_;
+
+        // only touched by the thread that adds frames
+        bool is_open_;
+        int num_pushed_;
+        int closes_requested_;
+
+        std::atomic<int> num_popped_;
+        std::atomic<int> closes_done_;
+
+        std::atomic<int> num_written_;
+        std::atomic<int> num_dropped_;
+        std::atomic<int> max_queue_depth_;
+
+        // only touched by the writer thread
+        Item output_;
+        bool output_open_;
+        VideoWriter avi_left_, avi_right_;
+        StereoLogWriter log_;
+        int next_frame_number_;
+        Mat last_left_, last_right_;
+};
+
+#endif
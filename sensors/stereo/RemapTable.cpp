@@ -0,0 +1,238 @@
+/**
+ * Precomputed nearest-neighbor remap.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "RemapTable.hpp"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+/**
+ * Copies a vector into a single-row Mat that owns its data.
+ */
+template <typename T>
+static Mat VectorToMat(const std::vector<T> &vec, int type) {
+    Mat mat(1, vec.size(), type);
+
+    if (vec.size() > 0) {
+        memcpy(mat.data, &vec[0], vec.size() * sizeof(T));
+    }
+
+    return mat;
+}
+
+/**
+ * Builds the table from a fixed-point map.  Call once per calibration.
+ *
+ * @param map CV_16SC2 map, as from convertMaps(), of the same form you
+ *      would pass to cv::remap with INTER_NEAREST
+ * @param source_size size of the images that will be remapped
+ *
+ * @retval false if the map isn't a type we can use
+ */
+bool RemapTable::Build(const Mat &map, Size source_size) {
+
+    if (map.type() != CV_16SC2) {
+        std::cerr << "Warning: can only build a remap table from a CV_16SC2 map." << std::endl;
+        return false;
+    }
+
+    int rows = map.rows;
+    int cols = map.cols;
+
+    std::vector<int32_t> offsets(cols);
+
+    // length of the run of consecutive source pixels starting at each column
+    std::vector<int32_t> run_length(cols + 1);
+
+    std::vector<int32_t> row_segments(rows + 1);
+    std::vector<RemapSegment> segments;
+    std::vector<int32_t> gather_offsets;
+
+    for (int i = 0; i < rows; i++) {
+
+        const short *map_row = map.ptr<short>(i);
+
+        for (int j = 0; j < cols; j++) {
+            int x = map_row[2*j];
+            int y = map_row[2*j + 1];
+
+            // cv::remap fills in pixels that map outside the source with 0
+            if (x >= 0 && x < source_size.width && y >= 0 && y < source_size.height) {
+                offsets[j] = y * source_size.width + x;
+            } else {
+                offsets[j] = -1;
+            }
+        }
+
+        run_length[cols] = 0;
+
+        for (int j = cols - 1; j >= 0; j--) {
+            if (offsets[j] < 0) {
+                run_length[j] = 0;
+            } else if (j + 1 < cols && offsets[j + 1] == offsets[j] + 1
+                && offsets[j + 1] % source_size.width != 0) {
+
+                // runs stop at the end of a source row, so they can be
+                // copied from images with padded rows
+                run_length[j] = run_length[j + 1] + 1;
+            } else {
+                run_length[j] = 1;
+            }
+        }
+
+        row_segments[i] = segments.size();
+
+        int j = 0;
+
+        while (j < cols) {
+            RemapSegment segment;
+            segment.start = j;
+
+            if (offsets[j] < 0) {
+
+                segment.type = REMAP_SEGMENT_ZERO;
+                segment.source = 0;
+
+                while (j < cols && offsets[j] < 0) {
+                    j++;
+                }
+
+            } else if (run_length[j] >= REMAP_TABLE_MIN_COPY_RUN) {
+
+                segment.type = REMAP_SEGMENT_COPY;
+                segment.source = offsets[j];
+
+                j += run_length[j];
+
+            } else {
+
+                segment.type = REMAP_SEGMENT_GATHER;
+                segment.source = gather_offsets.size();
+
+                while (j < cols && offsets[j] >= 0 && run_length[j] < REMAP_TABLE_MIN_COPY_RUN) {
+                    gather_offsets.push_back(offsets[j]);
+                    j++;
+                }
+            }
+
+            segment.length = j - segment.start;
+            segments.push_back(segment);
+        }
+    }
+
+    row_segments[rows] = segments.size();
+
+    map_ = map;
+    source_size_ = source_size;
+
+    row_segments_ = VectorToMat(row_segments, CV_32SC1);
+    segments_ = VectorToMat(segments, CV_32SC4);
+    gather_offsets_ = VectorToMat(gather_offsets, CV_32SC1);
+
+    return true;
+}
+
+/**
+ * Remaps part of an image.  Gives exactly the same result as cv::remap
+ * with the same part of the map the table was built from and
+ * INTER_NEAREST (and falls back to that if the source isn't the size the
+ * table was built for).
+ *
+ * Sources with padded rows, like zero-copy camera frames, go through the
+ * table too, but the gathers cost a divide per pixel to find the row.
+ *
+ * @param source CV_8UC1 image to remap
+ * @param dest output, the size of roi.  Can be part of a bigger image.
+ * @param roi part of the output image to fill in
+ */
+void RemapTable::Remap(const Mat &source, Mat &dest, const Rect &roi) const {
+
+    if (source.type() != CV_8UC1 || source.cols != source_size_.width
+        || source.rows != source_size_.height) {
+
+        remap(source, dest, map_(roi), Mat(), INTER_NEAREST);
+        return;
+    }
+
+    dest.create(roi.height, roi.width, CV_8UC1);
+
+    const uint8_t *source_data = source.data;
+
+    // offsets in the table are for rows source_size_.width apart
+    int width = source_size_.width;
+    size_t step = source.step;
+    bool continuous = source.isContinuous();
+
+    const int32_t *row_segments = row_segments_.ptr<int32_t>();
+    const RemapSegment *segments = segments_.ptr<RemapSegment>();
+    const int32_t *gather_offsets = gather_offsets_.ptr<int32_t>();
+
+    int col_start = roi.x;
+    int col_end = roi.x + roi.width;
+
+    for (int i = roi.y; i < roi.y + roi.height; i++) {
+
+        uint8_t *dest_row = dest.ptr<uint8_t>(i - roi.y) - col_start;
+
+        for (int k = row_segments[i]; k < row_segments[i + 1]; k++) {
+
+            const RemapSegment &segment = segments[k];
+
+            // segments are in column order, so clip each one to the roi
+            int start = std::max(segment.start, col_start);
+            int end = std::min(segment.start + segment.length, col_end);
+
+            if (start >= col_end) {
+                break;
+            } else if (start >= end) {
+                continue;
+            }
+
+            uint8_t *out = dest_row + start;
+            int skip = start - segment.start;
+            int length = end - start;
+
+            switch (segment.type) {
+                case REMAP_SEGMENT_COPY:
+                    if (continuous) {
+                        memcpy(out, source_data + segment.source + skip, length);
+                    } else {
+                        // copies never cross a source row
+                        int y = segment.source / width;
+                        int x = segment.source - y * width;
+
+                        memcpy(out, source_data + y * step + x + skip, length);
+                    }
+                    break;
+
+                case REMAP_SEGMENT_ZERO:
+                    memset(out, 0, length);
+                    break;
+
+                default:
+                {
+                    const int32_t *offsets = gather_offsets + segment.source + skip;
+
+                    if (continuous) {
+                        for (int j = 0; j < length; j++) {
+                            out[j] = source_data[offsets[j]];
+                        }
+                    } else {
+                        for (int j = 0; j < length; j++) {
+                            int y = offsets[j] / width;
+                            int x = offsets[j] - y * width;
+
+                            out[j] = source_data[y * step + x];
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
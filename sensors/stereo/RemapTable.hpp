@@ -0,0 +1,73 @@
+/**
+ * Precomputed nearest-neighbor remap.  Built once from a calibration's
+ * fixed-point map, then remapping an image is mostly memcpy()s of the
+ * spans of pixels that move together.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef REMAP_TABLE_HPP
+#define REMAP_TABLE_HPP
+
+#include "opencv2/opencv.hpp"
+#include <stdint.h>
+
+using namespace cv;
+
+// runs of consecutive source pixels shorter than this are gathered one
+// pixel at a time instead of copied
+#define REMAP_TABLE_MIN_COPY_RUN 8
+
+enum RemapSegmentType { REMAP_SEGMENT_COPY, REMAP_SEGMENT_GATHER, REMAP_SEGMENT_ZERO };
+
+/**
+ * Piece of one output row.  For copies, source is the offset of the first
+ * source pixel, for gathers it is the index of the first offset in the
+ * gather table, and for zeros it is unused.
+ */
+struct RemapSegment {
+    int32_t start;
+    int32_t length;
+    int32_t type;
+    int32_t source;
+};
+
+class RemapTable {
+
+    public:
+        RemapTable() {}
+
+        bool Build(const Mat &map, Size source_size);
+
+        bool empty() const { return map_.empty(); }
+
+        void Remap(const Mat &source, Mat &dest, const Rect &roi) const;
+
+        void Remap(const Mat &source, Mat &dest, int row_start, int row_end) const {
+            Remap(source, dest, Rect(0, row_start, map_.cols, row_end - row_start));
+        }
+
+        void Remap(const Mat &source, Mat &dest) const { Remap(source, dest, 0, map_.rows); }
+
+        int GetNumSegments() const { return segments_.cols; }
+
+    private:
+        // kept for falling back to cv::remap if we get an image the table
+        // wasn't built for
+        Mat map_;
+
+        Size source_size_;
+
+        // CV_32SC1, rows + 1 entries: segments for row i are
+        // row_segments_[i] to row_segments_[i+1] - 1
+        Mat row_segments_;
+
+        // one RemapSegment per column, as CV_32SC4
+        Mat segments_;
+
+        // CV_32SC1 source offsets for the gather segments
+        Mat gather_offsets_;
+};
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * Compact binary file of the stereo hits from replaying recordings.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "ReplayResults.hpp"
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+
+ReplayResultsWriter::ReplayResultsWriter() {
+    file_ = NULL;
+}
+
+ReplayResultsWriter::~ReplayResultsWriter() {
+    Close();
+}
+
+/**
+ * Starts a new results file, replacing it if it exists.
+ *
+ * @param filename file to write
+ * @param state settings the hits will be found with, kept in the header
+ *
+ * @retval false if the file can't be created
+ */
+bool ReplayResultsWriter::Open(std::string filename, const PushbroomStereoState &state) {
+
+    Close();
+
+    file_ = fopen(filename.c_str(), "wb");
+
+    if (file_ == NULL) {
+        std::cerr << "Error: failed to open " << filename << " for results." << std::endl;
+        return false;
+    }
+
+    filename_ = filename;
+
+    ReplayResultsFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_RESULTS_FILE_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_RESULTS_VERSION;
+    header.disparity = state.disparity;
+    header.block_size = state.blockSize;
+    header.sad_threshold = state.sadThreshold;
+    header.sobel_limit = state.sobelLimit;
+    header.horizontal_invariance_multiplier = state.horizontalInvarianceMultiplier;
+    header.last_valid_pixel_row = state.lastValidPixelRow;
+    header.num_extra_disparities = state.extra_disparities.size();
+
+    std::vector<int32_t> extra_disparities(state.extra_disparities.begin(), state.extra_disparities.end());
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1
+        || (extra_disparities.size() > 0
+            && fwrite(extra_disparities.data(), sizeof(int32_t), extra_disparities.size(), file_) != extra_disparities.size())) {
+
+        std::cerr << "Error: failed to write to " << filename << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Starts the results for another recording.  Frames written after this
+ * belong to it.
+ *
+ * @param name name of the recording, usually its filename
+ */
+bool ReplayResultsWriter::BeginRecording(std::string name) {
+
+    if (file_ == NULL) {
+        return false;
+    }
+
+    ReplayResultsRecordingHeader header;
+    header.sync = REPLAY_RESULTS_RECORDING_SYNC;
+    header.name_length = name.length();
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1
+        || (name.length() > 0 && fwrite(name.data(), name.length(), 1, file_) != 1)) {
+
+        std::cerr << "Warning: failed to write to " << filename_ << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Writes the hits for one frame, as they come out of ProcessImages.
+ *
+ * @param frame_number frame in the recording
+ * @param points3d hit positions in the camera frame
+ * @param points2d hit positions in the image, with the SAD score in z
+ * @param disparities disparity of each hit
+ *
+ * @retval false if the frame couldn't be written
+ */
+bool ReplayResultsWriter::WriteFrame(int frame_number, const cv::vector<Point3f> &points3d, const cv::vector<Point3i> &points2d, const cv::vector<int> &disparities) {
+
+    if (file_ == NULL) {
+        return false;
+    }
+
+    int num_hits = points3d.size();
+
+    if (points2d.size() != points3d.size() || disparities.size() != points3d.size()) {
+        std::cerr << "Warning: hits for frame " << frame_number << " are missing their pixels or disparities (is show_display off?), not writing it." << std::endl;
+        return false;
+    }
+
+    hits_.resize(num_hits);
+
+    for (int i = 0; i < num_hits; i++) {
+        ReplayResultsHit *hit = &hits_[i];
+
+        hit->pixel_x = points2d[i].x;
+        hit->pixel_y = points2d[i].y;
+        hit->disparity = disparities[i];
+        hit->sad = std::min(points2d[i].z, 65535);
+
+        hit->x = points3d[i].x;
+        hit->y = points3d[i].y;
+        hit->z = points3d[i].z;
+    }
+
+    ReplayResultsFrameHeader header;
+    header.sync = REPLAY_RESULTS_FRAME_SYNC;
+    header.frame_number = frame_number;
+    header.num_hits = num_hits;
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1
+        || (num_hits > 0 && fwrite(hits_.data(), sizeof(ReplayResultsHit), num_hits, file_) != (size_t)num_hits)) {
+
+        std::cerr << "Warning: failed to write frame " << frame_number << " to " << filename_ << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool ReplayResultsWriter::Close() {
+
+    if (file_ == NULL) {
+        return true;
+    }
+
+    bool ok = fclose(file_) == 0;
+
+    file_ = NULL;
+
+    return ok;
+}
+
+
+ReplayResultsReader::ReplayResultsReader() {
+    file_ = NULL;
+    memset(&header_, 0, sizeof(header_));
+}
+
+ReplayResultsReader::~ReplayResultsReader() {
+    Close();
+}
+
+/**
+ * Opens a results file and reads its header.
+ *
+ * @retval false if the file can't be read or isn't a results file
+ */
+bool ReplayResultsReader::Open(std::string filename) {
+
+    Close();
+
+    file_ = fopen(filename.c_str(), "rb");
+
+    if (file_ == NULL) {
+        std::cerr << "Error: failed to open " << filename << std::endl;
+        return false;
+    }
+
+    if (fread(&header_, sizeof(header_), 1, file_) != 1
+        || memcmp(header_.magic, REPLAY_RESULTS_FILE_MAGIC, sizeof(header_.magic)) != 0
+        || header_.version != REPLAY_RESULTS_VERSION) {
+
+        std::cerr << "Error: " << filename << " is not a replay results file." << std::endl;
+        Close();
+        return false;
+    }
+
+    std::vector<int32_t> extra_disparities(header_.num_extra_disparities);
+
+    if (extra_disparities.size() > 0
+        && fread(extra_disparities.data(), sizeof(int32_t), extra_disparities.size(), file_) != extra_disparities.size()) {
+
+        std::cerr << "Error: " << filename << " is cut short in its header." << std::endl;
+        Close();
+        return false;
+    }
+
+    extra_disparities_.assign(extra_disparities.begin(), extra_disparities.end());
+
+    recording_ = "";
+
+    return true;
+}
+
+void ReplayResultsReader::Close() {
+    if (file_ != NULL) {
+        fclose(file_);
+    }
+
+    file_ = NULL;
+}
+
+/**
+ * Reads the next frame's hits.
+ *
+ * @param recording output: name of the recording the frame is from
+ * @param frame_number output: frame in the recording
+ * @param hits output: the frame's hits
+ *
+ * @retval false at the end of the file (or if it is cut short)
+ */
+bool ReplayResultsReader::ReadFrame(std::string *recording, int *frame_number, std::vector<ReplayResultsHit> *hits) {
+
+    if (file_ == NULL) {
+        return false;
+    }
+
+    uint32_t sync;
+
+    while (fread(&sync, sizeof(sync), 1, file_) == 1) {
+
+        if (sync == REPLAY_RESULTS_RECORDING_SYNC) {
+
+            uint32_t name_length;
+
+            if (fread(&name_length, sizeof(name_length), 1, file_) != 1) {
+                return false;
+            }
+
+            recording_.resize(name_length);
+
+            if (name_length > 0 && fread(&recording_[0], name_length, 1, file_) != 1) {
+                return false;
+            }
+
+        } else if (sync == REPLAY_RESULTS_FRAME_SYNC) {
+
+            ReplayResultsFrameHeader header;
+
+            // the rest of the header after the sync
+            if (fread(&header.frame_number, sizeof(header) - sizeof(sync), 1, file_) != 1) {
+                return false;
+            }
+
+            hits->resize(header.num_hits);
+
+            if (header.num_hits > 0 && fread(hits->data(), sizeof(ReplayResultsHit), header.num_hits, file_) != header.num_hits) {
+                return false;
+            }
+
+            *recording = recording_;
+            *frame_number = header.frame_number;
+
+            return true;
+
+        } else {
+            std::cerr << "Warning: replay results file is corrupt." << std::endl;
+            return false;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,131 @@
+/**
+ * Compact binary file of the stereo hits from replaying recordings.
+ *
+ * The file is a header with the settings the hits were found with and
+ * the list of extra disparities searched, then for each recording a small header with its name, followed by a record
+ * per frame: the frame number, the number of hits, and the hits.  Frames
+ * are always in order and the file holds nothing that depends on timing,
+ * so replaying the same recordings with the same settings gives the same
+ * bytes no matter how many threads did the work.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef REPLAY_RESULTS_HPP
+#define REPLAY_RESULTS_HPP
+
+#include "opencv2/opencv.hpp"
+#include "pushbroom-stereo.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+#define REPLAY_RESULTS_EXTENSION ".hits"
+
+#define REPLAY_RESULTS_VERSION 2
+
+#define REPLAY_RESULTS_FILE_MAGIC "PBREPLAY"
+#define REPLAY_RESULTS_RECORDING_SYNC 0x44434552 // "RECD"
+#define REPLAY_RESULTS_FRAME_SYNC 0x53544948 // "HITS"
+
+// on-disk layout, little-endian
+#pragma pack(push, 1)
+
+struct ReplayResultsFileHeader {
+    char magic[8];
+    uint32_t version;
+
+    // settings the hits were found with
+    int32_t disparity;
+    int32_t block_size;
+    int32_t sad_threshold;
+    int32_t sobel_limit;
+    float horizontal_invariance_multiplier;
+    int32_t last_valid_pixel_row;
+
+    // followed by this many int32_t disparities searched on top of
+    // disparity
+    uint32_t num_extra_disparities;
+};
+
+// followed by name_length bytes of the recording's name
+struct ReplayResultsRecordingHeader {
+    uint32_t sync;
+    uint32_t name_length;
+};
+
+// followed by num_hits ReplayResultsHits
+struct ReplayResultsFrameHeader {
+    uint32_t sync;
+    uint32_t frame_number;
+    uint32_t num_hits;
+};
+
+struct ReplayResultsHit {
+    // block position in the image
+    uint16_t pixel_x;
+    uint16_t pixel_y;
+
+    int16_t disparity;
+
+    // SAD score, capped at 65535
+    uint16_t sad;
+
+    // position in the camera frame
+    float x;
+    float y;
+    float z;
+};
+
+#pragma pack(pop)
+
+class ReplayResultsWriter {
+
+    public:
+        ReplayResultsWriter();
+        ~ReplayResultsWriter();
+
+        bool Open(std::string filename, const PushbroomStereoState &state);
+
+        bool BeginRecording(std::string name);
+
+        bool WriteFrame(int frame_number, const cv::vector<Point3f> &points3d, const cv::vector<Point3i> &points2d, const cv::vector<int> &disparities);
+
+        bool Close();
+
+        bool IsOpen() const { return file_ != NULL; }
+
+    private:
+        FILE *file_;
+        std::string filename_;
+
+        cv::vector<ReplayResultsHit> hits_;
+};
+
+class ReplayResultsReader {
+
+    public:
+        ReplayResultsReader();
+        ~ReplayResultsReader();
+
+        bool Open(std::string filename);
+        void Close();
+
+        const ReplayResultsFileHeader& GetHeader() const { return header_; }
+        const std::vector<int>& GetExtraDisparities() const { return extra_disparities_; }
+
+        bool ReadFrame(std::string *recording, int *frame_number, std::vector<ReplayResultsHit> *hits);
+
+    private:
+        FILE *file_;
+
+        ReplayResultsFileHeader header_;
+        std::vector<int> extra_disparities_;
+        std::string recording_;
+};
+
+#endif
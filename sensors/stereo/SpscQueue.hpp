@@ -0,0 +1,84 @@
+/**
+ * Fixed-size lock-free queue for exactly one producer thread and one
+ * consumer thread.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <stddef.h>
+#include <vector>
+#include <atomic>
+#include <utility>
+
+template <class T>
+class SpscQueue {
+
+    public:
+        /**
+         * @param capacity most items the queue holds at once
+         */
+        SpscQueue(int capacity) : slots_(capacity + 1), head_(0), tail_(0) {}
+
+        /**
+         * Adds an item.  Only call from the producer thread.
+         *
+         * @retval false if the queue is full, in which case item is not added
+         */
+        bool Push(const T &item) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            size_t next = Next(tail);
+
+            if (next == head_.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            slots_[tail] = item;
+            tail_.store(next, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Takes the oldest item.  Only call from the consumer thread.  The
+         * slot is cleared so the queue doesn't hold on to anything the
+         * item owns.
+         *
+         * @retval false if the queue is empty
+         */
+        bool Pop(T *item) {
+            size_t head = head_.load(std::memory_order_relaxed);
+
+            if (head == tail_.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            *item = std::move(slots_[head]);
+            slots_[head] = T();
+            head_.store(Next(head), std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+        int GetCapacity() const { return (int)slots_.size() - 1; }
+
+    private:
+        size_t Next(size_t index) const { return index + 1 == slots_.size() ? 0 : index + 1; }
+
+        // one slot is always empty so that full and empty look different
+        std::vector<T> slots_;
+
+        // producer and consumer write to different cache lines.  Padded
+        // rather than aligned so that queues can live in objects made with
+        // plain new.
+        std::atomic<size_t> head_;
+        char padding_[64];
+        std::atomic<size_t> tail_;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * Lightweight timers for the stages of the stereo pipeline.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "StageTimer.hpp"
+#include "SpscQueue.hpp"
+#include <mutex>
+#include <algorithm>
+#include <math.h>
+
+struct StageSample {
+    int stage;
+    uint64_t duration_ns;
+};
+
+/**
+ * One thread's samples.  Only that thread pushes, and only Collect pops.
+ */
+struct StageTimerBuffer {
+    StageTimerBuffer() : samples(STAGE_TIMER_BUFFER_SIZE), dropped(0), retired(false) {}
+
+    SpscQueue<StageSample> samples;
+
+    // samples that didn't fit
+    std::atomic<int> dropped;
+
+    // set when the thread exits, so Collect can free the buffer once it's
+    // drained
+    std::atomic<bool> retired;
+};
+
+/**
+ * Holds each thread's buffer and retires it when the thread exits.
+ */
+class StageTimerBufferOwner {
+
+    public:
+        StageTimerBufferOwner() : buffer(NULL) {}
+
+        ~StageTimerBufferOwner() {
+            if (buffer != NULL) {
+                buffer->retired.store(true, std::memory_order_release);
+            }
+        }
+
+        StageTimerBuffer *buffer;
+};
+
+std::atomic<bool> StageProfiler::enabled_(false);
+
+// every thread's buffer.  Only locked the first time a thread records and
+// by Collect.
+static std::mutex registry_mutex;
+static std::vector<StageTimerBuffer*> registry;
+
+static thread_local StageTimerBufferOwner thread_buffer;
+
+const char* StageProfiler::GetStageName(int stage) {
+
+    static const char *names[NUM_TIMED_STAGES] = {
+        "capture",
+        "remap",
+        "interest op",
+        "stereo",
+        "invariance",
+        "merge",
+        "lcm",
+        "recording",
+        "frame"
+    };
+
+    if (stage < 0 || stage >= NUM_TIMED_STAGES) {
+        return "unknown";
+    }
+
+    return names[stage];
+}
+
+/**
+ * Adds a sample to this thread's buffer.  Doesn't lock, except the first
+ * time a thread records anything.
+ *
+ * @param stage stage from TimedStage
+ * @param duration_ns time the stage took
+ */
+void StageProfiler::Record(int stage, uint64_t duration_ns) {
+
+    StageTimerBuffer *buffer = thread_buffer.buffer;
+
+    if (buffer == NULL) {
+        buffer = new StageTimerBuffer();
+
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            registry.push_back(buffer);
+        }
+
+        thread_buffer.buffer = buffer;
+    }
+
+    StageSample sample;
+    sample.stage = stage;
+    sample.duration_ns = duration_ns;
+
+    if (buffer->samples.Push(sample) == false) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Nearest-rank percentile.
+ *
+ * @param sorted values, in order
+ * @param percentile 0 to 100
+ */
+static double Percentile(const std::vector<double> &sorted, double percentile) {
+
+    if (sorted.size() == 0) {
+        return 0;
+    }
+
+    int rank = ceil(percentile / 100.0 * sorted.size());
+
+    return sorted[std::min(std::max(rank, 1), (int)sorted.size()) - 1];
+}
+
+/**
+ * Takes every sample recorded since the last call, from every thread, and
+ * works out the statistics for each stage.
+ *
+ * @param stats output: NUM_TIMED_STAGES entries, indexed by TimedStage
+ * @param dropped output: number of samples that were lost because a
+ *      thread's buffer was full
+ */
+void StageProfiler::Collect(std::vector<StageStats> *stats, int *dropped) {
+
+    std::vector<std::vector<double> > durations(NUM_TIMED_STAGES);
+
+    *dropped = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+
+        for (unsigned int i = 0; i < registry.size(); ) {
+
+            StageTimerBuffer *buffer = registry[i];
+
+            // read this before draining so that we get everything the
+            // thread pushed before it exited
+            bool retired = buffer->retired.load(std::memory_order_acquire);
+
+            StageSample sample;
+
+            while (buffer->samples.Pop(&sample)) {
+                if (sample.stage >= 0 && sample.stage < NUM_TIMED_STAGES) {
+                    durations[sample.stage].push_back(sample.duration_ns / 1000000.0);
+                }
+            }
+
+            *dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+
+            if (retired) {
+                delete buffer;
+                registry.erase(registry.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    stats->resize(NUM_TIMED_STAGES);
+
+    for (int stage = 0; stage < NUM_TIMED_STAGES; stage++) {
+
+        std::vector<double> &samples = durations[stage];
+        StageStats *stage_stats = &(*stats)[stage];
+
+        std::sort(samples.begin(), samples.end());
+
+        stage_stats->count = samples.size();
+        stage_stats->total_ms = 0;
+
+        for (unsigned int i = 0; i < samples.size(); i++) {
+            stage_stats->total_ms += samples[i];
+        }
+
+        stage_stats->mean_ms = samples.size() > 0 ? stage_stats->total_ms / samples.size() : 0;
+        stage_stats->p50_ms = Percentile(samples, 50);
+        stage_stats->p90_ms = Percentile(samples, 90);
+        stage_stats->p99_ms = Percentile(samples, 99);
+        stage_stats->max_ms = samples.size() > 0 ? samples.back() : 0;
+    }
+}
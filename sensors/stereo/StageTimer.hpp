@@ -0,0 +1,100 @@
+/**
+ * Lightweight timers for the stages of the stereo pipeline, cheap enough to
+ * leave compiled into the flight code.
+ *
+ * A StageTimer reads CLOCK_MONOTONIC when it is made and when it goes out
+ * of scope, and pushes the time onto a ring buffer that belongs to the
+ * thread it ran on, so there are no locks and nothing shared on the hot
+ * path.  Once in a while (every second in pushbroom-stereo) one thread
+ * calls StageProfiler::Collect to drain every thread's buffer and work out
+ * the statistics for each stage.  If the profiler is off, a timer costs one
+ * load of a flag.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef STAGE_TIMER_HPP
+#define STAGE_TIMER_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <vector>
+
+// samples each thread can hold between calls to Collect.  Samples past
+// this are dropped (and counted).
+#define STAGE_TIMER_BUFFER_SIZE 8192
+
+enum TimedStage {
+    STAGE_CAPTURE,
+    STAGE_REMAP,
+    STAGE_INTEREST_OP,
+    STAGE_STEREO, // includes the horizontal invariance check
+    STAGE_INVARIANCE,
+    STAGE_MERGE,
+    STAGE_LCM,
+    STAGE_RECORDING,
+    STAGE_FRAME, // everything for one frame
+    NUM_TIMED_STAGES
+};
+
+struct StageStats {
+    int count;
+
+    double total_ms;
+    double mean_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+};
+
+class StageProfiler {
+
+    public:
+        static const char* GetStageName(int stage);
+
+        static void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+        static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+
+        static uint64_t GetTimeNs() {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+        }
+
+        static void Record(int stage, uint64_t duration_ns);
+
+        static void Collect(std::vector<StageStats> *stats, int *dropped);
+
+    private:
+        static std::atomic<bool> enabled_;
+};
+
+/**
+ * Times from when it's made until it goes out of scope (or Stop is
+ * called).
+ */
+class StageTimer {
+
+    public:
+        StageTimer(int stage) : stage_(stage) {
+            start_ns_ = StageProfiler::IsEnabled() ? StageProfiler::GetTimeNs() : 0;
+        }
+
+        ~StageTimer() { Stop(); }
+
+        void Stop() {
+            if (start_ns_ != 0) {
+                StageProfiler::Record(stage_, StageProfiler::GetTimeNs() - start_ns_);
+                start_ns_ = 0;
+            }
+        }
+
+    private:
+        int stage_;
+        uint64_t start_ns_;
+};
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * Captures from both cameras at once, one thread per camera, and pairs the
+ * frames up by timestamp.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "StereoCapture.hpp"
+#include <chrono>
+
+StereoCapture::StereoCapture(CameraSource *left, CameraSource *right, uint64_t max_skew, int queue_size)
+    : queue_left_(queue_size), queue_right_(queue_size) {
+
+    source_left_ = left;
+    source_right_ = right;
+    max_skew_ = max_skew;
+
+    running_ = false;
+
+    num_dropped_ = 0;
+    num_unpaired_ = 0;
+    num_pairs_ = 0;
+}
+
+StereoCapture::~StereoCapture() {
+    Stop();
+}
+
+void StereoCapture::Start() {
+    if (running_) {
+        return;
+    }
+
+    running_ = true;
+
+    thread_left_ = std::thread(&StereoCapture::CaptureLoop, this, source_left_, &queue_left_);
+    thread_right_ = std::thread(&StereoCapture::CaptureLoop, this, source_right_, &queue_right_);
+}
+
+/**
+ * Stops the capture threads and gives every frame we are holding back to
+ * the cameras.  Call from the same thread as GetPair.  Frames already
+ * returned by GetPair are the caller's to release.
+ */
+void StereoCapture::Stop() {
+    running_ = false;
+
+    // a capture thread can be waiting on a camera whose buffers are all
+    // sitting with us, so hand them back before waiting on the threads
+    DrainQueues();
+    pending_left_.clear();
+    pending_right_.clear();
+
+    if (thread_left_.joinable()) {
+        thread_left_.join();
+    }
+
+    if (thread_right_.joinable()) {
+        thread_right_.join();
+    }
+
+    DrainQueues();
+    pending_left_.clear();
+    pending_right_.clear();
+}
+
+void StereoCapture::CaptureLoop(CameraSource *source, SpscQueue<CameraFrame> *queue) {
+
+    while (running_) {
+        CameraFrame frame;
+
+        if (source->GrabFrame(&frame) == false) {
+            // don't spin on a camera that's gone away
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        if (queue->Push(frame) == false) {
+            // the stereo loop isn't keeping up.  Drop this one, the waiting
+            // frames are about as fresh and it keeps the camera's buffers
+            // free.
+            num_dropped_ ++;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+        }
+        cv_frame_.notify_one();
+    }
+}
+
+/**
+ * Waits for the newest pair of frames that were taken within max_skew of
+ * each other.
+ *
+ * @param left output: left frame.  Released first, like GrabFrame.
+ * @param right output: right frame.  Released first.
+ * @param timeout_ms how long to wait for a pair
+ *
+ * @retval false if no pair showed up in time
+ */
+bool StereoCapture::GetPair(CameraFrame *left, CameraFrame *right, int timeout_ms) {
+
+    left->Release();
+    right->Release();
+
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (true) {
+        DrainQueues();
+
+        if (PairFrames(left, right)) {
+            num_pairs_ ++;
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+
+        if (cv_frame_.wait_until(lock, deadline,
+            [this] { return !queue_left_.empty() || !queue_right_.empty(); }) == false) {
+
+            return false;
+        }
+    }
+}
+
+void StereoCapture::DrainQueues() {
+    CameraFrame frame;
+
+    while (queue_left_.Pop(&frame)) {
+        pending_left_.push_back(frame);
+    }
+
+    while (queue_right_.Pop(&frame)) {
+        pending_right_.push_back(frame);
+    }
+}
+
+/**
+ * Takes the newest left frame that has a right frame within max_skew of it,
+ * along with its closest right frame.  Everything older on either side
+ * is dropped.
+ *
+ * @retval false if nothing pairs up yet
+ */
+bool StereoCapture::PairFrames(CameraFrame *left, CameraFrame *right) {
+
+    for (int i = (int)pending_left_.size() - 1; i >= 0; i--) {
+
+        int best_j = -1;
+
+        for (int j = 0; j < (int)pending_right_.size(); j++) {
+            if (Skew(pending_left_[i], pending_right_[j]) <= max_skew_
+                && (best_j < 0 || Skew(pending_left_[i], pending_right_[j]) < Skew(pending_left_[i], pending_right_[best_j]))) {
+
+                best_j = j;
+            }
+        }
+
+        if (best_j >= 0) {
+            *left = pending_left_[i];
+            *right = pending_right_[best_j];
+
+            num_unpaired_ += i + best_j;
+
+            pending_left_.erase(pending_left_.begin(), pending_left_.begin() + i + 1);
+            pending_right_.erase(pending_right_.begin(), pending_right_.begin() + best_j + 1);
+
+            return true;
+        }
+    }
+
+    DropUnmatchable(&pending_left_, pending_right_);
+    DropUnmatchable(&pending_right_, pending_left_);
+
+    return false;
+}
+
+/**
+ * Drops frames that can't pair with anything: the other camera's frames
+ * only get newer, so once its newest frame is more than max_skew past one
+ * of ours, ours will never match.  Also keeps us from sitting on all of a
+ * camera's buffers when the other camera stops.
+ */
+void StereoCapture::DropUnmatchable(std::deque<CameraFrame> *frames, const std::deque<CameraFrame> &other) {
+
+    if (other.empty() == false) {
+        uint64_t newest_other = other.back().GetTimestamp();
+
+        while (frames->empty() == false && frames->front().GetTimestamp() + max_skew_ < newest_other) {
+            frames->pop_front();
+            num_unpaired_ ++;
+        }
+    }
+
+    while ((int)frames->size() > queue_left_.GetCapacity()) {
+        frames->pop_front();
+        num_unpaired_ ++;
+    }
+}
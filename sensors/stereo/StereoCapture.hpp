@@ -0,0 +1,88 @@
+/**
+ * Captures from both cameras at once, one thread per camera, and pairs the
+ * frames up by timestamp.  The stereo loop always gets the newest pair
+ * whose frames were taken close enough together; anything older is
+ * dropped and its buffer goes straight back to the camera.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef STEREO_CAPTURE_HPP
+#define STEREO_CAPTURE_HPP
+
+#include "CameraSource.hpp"
+#include "SpscQueue.hpp"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class StereoCapture {
+
+    public:
+        /**
+         * Each camera needs at least 2 * queue_size + 2 capture buffers: one
+         * being filled, queue_size waiting in the queue, up to queue_size
+         * waiting for a partner, and one with the caller.
+         *
+         * When the caller falls behind, the queue fills and new frames are
+         * dropped, so the pair it gets next is up to one loop old.  That's
+         * still no older than what a blocking dequeue would have given it.
+         *
+         * @param left left camera
+         * @param right right camera
+         * @param max_skew most microseconds between the two frames of a pair
+         * @param queue_size frames each capture thread may have waiting
+         */
+        StereoCapture(CameraSource *left, CameraSource *right, uint64_t max_skew, int queue_size = 1);
+        ~StereoCapture();
+
+        void Start();
+        void Stop();
+
+        bool GetPair(CameraFrame *left, CameraFrame *right, int timeout_ms = 1000);
+
+        // frames dropped because the stereo loop wasn't keeping up
+        int GetNumDropped() const { return num_dropped_; }
+
+        // frames thrown out because something newer paired up first, or
+        // because nothing from the other camera could match them
+        int GetNumUnpaired() const { return num_unpaired_; }
+
+        int GetNumPairs() const { return num_pairs_; }
+
+    private:
+        void CaptureLoop(CameraSource *source, SpscQueue<CameraFrame> *queue);
+
+        void DrainQueues();
+        bool PairFrames(CameraFrame *left, CameraFrame *right);
+        void DropUnmatchable(std::deque<CameraFrame> *frames, const std::deque<CameraFrame> &other);
+
+        static uint64_t Skew(const CameraFrame &a, const CameraFrame &b) {
+            return a.GetTimestamp() > b.GetTimestamp() ? a.GetTimestamp() - b.GetTimestamp() : b.GetTimestamp() - a.GetTimestamp();
+        }
+
+        CameraSource *source_left_, *source_right_;
+        uint64_t max_skew_;
+
+        SpscQueue<CameraFrame> queue_left_, queue_right_;
+
+        // frames out of the queues that haven't been paired yet, oldest
+        // first.  Only touched by the thread calling GetPair.
+        std::deque<CameraFrame> pending_left_, pending_right_;
+
+        std::thread thread_left_, thread_right_;
+        std::atomic<bool> running_;
+
+        // only for sleeping until a frame shows up, the queues don't need it
+        std::mutex wake_mutex_;
+        std::condition_variable cv_frame_;
+
+        std::atomic<int> num_dropped_;
+        int num_unpaired_;
+        int num_pairs_;
+};
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * Encodes stereo hits straight into an lcmt_stereo message.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "StereoHitEncoder.hpp"
+#include <string.h>
+
+static inline void EncodeInt32(uint8_t *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static inline void EncodeInt64(uint8_t *buf, uint64_t value) {
+    EncodeInt32(buf, value >> 32);
+    EncodeInt32(buf + 4, value);
+}
+
+static inline void EncodeFloat(uint8_t *buf, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    EncodeInt32(buf, bits);
+}
+
+StereoHitEncoder::StereoHitEncoder(uint64_t fingerprint) {
+    fingerprint_ = fingerprint;
+    size_ = 0;
+}
+
+/**
+ * Encodes one frame's hits.  The message is in GetData() until the next
+ * call.
+ *
+ * @param hits hits from ProcessImages
+ * @param timestamp message timestamp
+ * @param frame_number message frame number
+ * @param video_number message video number
+ * @param unit_conversion the hits' positions are divided by this, like
+ *      calibrationUnitConversion
+ */
+void StereoHitEncoder::Encode(const PushbroomHits &hits, int64_t timestamp, int32_t frame_number, int32_t video_number, float unit_conversion) {
+
+    int n = hits.count;
+
+    size_ = STEREO_MESSAGE_HEADER_SIZE + n * STEREO_MESSAGE_BYTES_PER_POINT;
+
+    if ((int)buffer_.size() < size_) {
+        buffer_.resize(size_);
+    }
+
+    uint8_t *buf = buffer_.data();
+
+    EncodeInt64(buf, fingerprint_);
+    EncodeInt64(buf + 8, timestamp);
+    EncodeInt32(buf + 16, n);
+    EncodeInt32(buf + 20, frame_number);
+    EncodeInt32(buf + 24, video_number);
+
+    uint8_t *x = buf + STEREO_MESSAGE_HEADER_SIZE;
+    uint8_t *y = x + 4 * n;
+    uint8_t *z = y + 4 * n;
+    uint8_t *grey = z + 4 * n;
+
+    for (int i = 0; i < n; i++) {
+        EncodeFloat(x + 4 * i, hits.x[i] / unit_conversion);
+        EncodeFloat(y + 4 * i, hits.y[i] / unit_conversion);
+        EncodeFloat(z + 4 * i, hits.z[i] / unit_conversion);
+    }
+
+    if (n > 0) {
+        memcpy(grey, hits.grey, n);
+    }
+}
@@ -0,0 +1,59 @@
+/**
+ * Encodes the hits from PushbroomStereo::ProcessImages straight into an
+ * lcmt_stereo message, ready for lcm_publish.
+ *
+ * lcmt_stereo_publish needs the hits copied into float arrays in the
+ * message's units first, then mallocs a buffer and encodes them again.
+ * This converts the units and byte-swaps each hit into the message's
+ * arrays in one pass, into a buffer that is kept between frames.
+ *
+ * The layout is lcmt_stereo's:
+ *
+ *   fingerprint, timestamp, number_of_points, frame_number, video_number,
+ *   x[n], y[n], z[n], grey[n]
+ *
+ * all big-endian.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef STEREO_HIT_ENCODER_HPP
+#define STEREO_HIT_ENCODER_HPP
+
+#include <stdint.h>
+#include <vector>
+
+#include "pushbroom-stereo.hpp"
+
+// fingerprint, timestamp, number_of_points, frame_number, video_number
+#define STEREO_MESSAGE_HEADER_SIZE (8 + 8 + 4 + 4 + 4)
+
+// x, y, z, and grey
+#define STEREO_MESSAGE_BYTES_PER_POINT (4 + 4 + 4 + 1)
+
+class StereoHitEncoder {
+
+    public:
+        /**
+         * @param fingerprint lcmt_stereo's fingerprint, as it is written at
+         *  the start of an encoded message
+         */
+        StereoHitEncoder(uint64_t fingerprint);
+
+        void Encode(const PushbroomHits &hits, int64_t timestamp, int32_t frame_number, int32_t video_number, float unit_conversion);
+
+        const uint8_t* GetData() const { return buffer_.data(); }
+
+        int GetSize() const { return size_; }
+
+    private:
+        uint64_t fingerprint_;
+
+        // only grows, so once it has held the most hits we see, encoding
+        // doesn't allocate
+        std::vector<uint8_t> buffer_;
+        int size_;
+};
+
+#endif
@@ -0,0 +1,489 @@
+/**
+ * Raw stereo recordings: one append-only file per recording.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "StereoLog.hpp"
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// big enough that the disk sees a few large writes per frame
+#define STEREO_LOG_WRITE_BUFFER (1024*1024)
+
+StereoLogWriter::StereoLogWriter() {
+    file_ = NULL;
+    offset_ = 0;
+}
+
+StereoLogWriter::~StereoLogWriter() {
+    Close();
+}
+
+/**
+ * Starts a new recording, replacing the file if it exists.
+ *
+ * @retval false if the file can't be created
+ */
+bool StereoLogWriter::Open(std::string filename) {
+
+    Close();
+
+    file_ = fopen(filename.c_str(), "wb");
+
+    if (file_ == NULL) {
+        std::cerr << "Error: failed to open " << filename << " for recording." << std::endl;
+        return false;
+    }
+
+    setvbuf(file_, NULL, _IOFBF, STEREO_LOG_WRITE_BUFFER);
+
+    filename_ = filename;
+    index_.clear();
+
+    StereoLogFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STEREO_LOG_FILE_MAGIC, sizeof(header.magic));
+    header.version = STEREO_LOG_VERSION;
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+        std::cerr << "Error: failed to write to " << filename << std::endl;
+        return false;
+    }
+
+    offset_ = sizeof(header);
+
+    return true;
+}
+
+/**
+ * Appends a pair of frames.
+ *
+ * @param image_left left image, 8-bit greyscale
+ * @param image_right right image, same size as the left
+ * @param frame_number frame number in the recording
+ * @param timestamp capture time in microseconds
+ *
+ * @retval false if the frames couldn't be written
+ */
+bool StereoLogWriter::WriteFrames(const Mat &image_left, const Mat &image_right, int frame_number, uint64_t timestamp) {
+
+    if (file_ == NULL) {
+        return false;
+    }
+
+    if (image_left.type() != CV_8UC1 || image_right.type() != CV_8UC1
+        || image_left.size() != image_right.size()) {
+
+        std::cerr << "Warning: stereo log only takes pairs of 8-bit greyscale images of the same size, not writing frame " << frame_number << "." << std::endl;
+        return false;
+    }
+
+    StereoLogFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.sync = STEREO_LOG_FRAME_SYNC;
+    header.frame_number = frame_number;
+    header.timestamp = timestamp;
+    header.width = image_left.cols;
+    header.height = image_left.rows;
+
+    if (fwrite(&header, sizeof(header), 1, file_) != 1
+        || WriteImage(image_left) == false
+        || WriteImage(image_right) == false) {
+
+        std::cerr << "Warning: failed to write frame " << frame_number << " to " << filename_ << std::endl;
+        return false;
+    }
+
+    StereoLogIndexEntry entry;
+    entry.frame_number = frame_number;
+    entry.reserved = 0;
+    entry.offset = offset_;
+    index_.push_back(entry);
+
+    offset_ += sizeof(header) + 2 * image_left.rows * image_left.cols;
+
+    return true;
+}
+
+bool StereoLogWriter::WriteImage(const Mat &image) {
+    if (image.isContinuous()) {
+        return fwrite(image.data, image.rows * image.cols, 1, file_) == 1;
+    }
+
+    for (int row = 0; row < image.rows; row++) {
+        if (fwrite(image.ptr<uchar>(row), image.cols, 1, file_) != 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Writes the index and closes the file.
+ *
+ * @retval false if the index couldn't be written (the reader can still
+ *      rebuild it)
+ */
+bool StereoLogWriter::Close() {
+
+    if (file_ == NULL) {
+        return true;
+    }
+
+    StereoLogTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.index_offset = offset_;
+    trailer.num_frames = index_.size();
+    memcpy(trailer.magic, STEREO_LOG_INDEX_MAGIC, sizeof(trailer.magic));
+
+    bool ok = true;
+
+    if ((index_.size() > 0 && fwrite(index_.data(), sizeof(StereoLogIndexEntry), index_.size(), file_) != index_.size())
+        || fwrite(&trailer, sizeof(trailer), 1, file_) != 1) {
+
+        std::cerr << "Warning: failed to write the index to " << filename_ << std::endl;
+        ok = false;
+    }
+
+    if (fclose(file_) != 0) {
+        ok = false;
+    }
+
+    file_ = NULL;
+    index_.clear();
+
+    return ok;
+}
+
+
+const uint64_t StereoLogReader::NO_FRAME = (uint64_t)-1;
+
+StereoLogReader::StereoLogReader() {
+    fd_ = -1;
+    map_ = NULL;
+    map_size_ = 0;
+    last_frame_number_ = 0;
+    advised_begin_ = 0;
+    advised_end_ = 0;
+    first_frame_number_ = 0;
+    num_frames_ = 0;
+}
+
+StereoLogReader::~StereoLogReader() {
+    Close();
+}
+
+/**
+ * Opens a recording for playback.
+ *
+ * @retval false if the file can't be read or isn't a stereo log
+ */
+bool StereoLogReader::Open(std::string filename) {
+
+    Close();
+
+    fd_ = open(filename.c_str(), O_RDONLY);
+
+    if (fd_ < 0) {
+        std::cerr << "Error: failed to open " << filename << std::endl;
+        return false;
+    }
+
+    struct stat file_stat;
+    StereoLogFileHeader header;
+
+    if (fstat(fd_, &file_stat) != 0
+        || pread(fd_, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, STEREO_LOG_FILE_MAGIC, sizeof(header.magic)) != 0) {
+
+        std::cerr << "Error: " << filename << " is not a stereo log." << std::endl;
+        Close();
+        return false;
+    }
+
+    if (header.version != STEREO_LOG_VERSION) {
+        std::cerr << "Error: " << filename << " is stereo log version " << header.version << ", but we only read version " << STEREO_LOG_VERSION << "." << std::endl;
+        Close();
+        return false;
+    }
+
+    if (ReadIndex(file_stat.st_size) == false) {
+        std::cerr << "Warning: " << filename << " has no index (was the recording cut short?), scanning it instead." << std::endl;
+
+        ScanRecords(file_stat.st_size);
+    }
+
+    // read-only, so that anything drawing on a mapped frame crashes
+    // instead of leaving its drawing there for the next time the frame is
+    // played back
+    void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+
+    if (map == MAP_FAILED) {
+        std::cerr << "Warning: failed to map " << filename << " into memory, reading frames instead." << std::endl;
+    } else {
+        map_ = (uint8_t*)map;
+        map_size_ = file_stat.st_size;
+    }
+
+    return true;
+}
+
+void StereoLogReader::Close() {
+    if (map_ != NULL) {
+        munmap(map_, map_size_);
+    }
+
+    map_ = NULL;
+    map_size_ = 0;
+    last_frame_number_ = 0;
+    advised_begin_ = 0;
+    advised_end_ = 0;
+
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+
+    fd_ = -1;
+    offsets_.clear();
+    first_frame_number_ = 0;
+    num_frames_ = 0;
+}
+
+bool StereoLogReader::ReadIndex(uint64_t file_size) {
+
+    StereoLogTrailer trailer;
+
+    if (file_size < sizeof(StereoLogFileHeader) + sizeof(trailer)
+        || pread(fd_, &trailer, sizeof(trailer), file_size - sizeof(trailer)) != sizeof(trailer)
+        || memcmp(trailer.magic, STEREO_LOG_INDEX_MAGIC, sizeof(trailer.magic)) != 0
+        || trailer.index_offset + trailer.num_frames * sizeof(StereoLogIndexEntry) + sizeof(trailer) != file_size) {
+
+        return false;
+    }
+
+    std::vector<StereoLogIndexEntry> index(trailer.num_frames);
+
+    ssize_t index_bytes = trailer.num_frames * sizeof(StereoLogIndexEntry);
+
+    if (pread(fd_, index.data(), index_bytes, trailer.index_offset) != index_bytes) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < index.size(); i++) {
+        AddToIndex(index[i].frame_number, index[i].offset);
+    }
+
+    return true;
+}
+
+/**
+ * Rebuilds the index by walking the records from the start.  Stops at the
+ * first record that isn't all there.
+ */
+bool StereoLogReader::ScanRecords(uint64_t file_size) {
+
+    uint64_t offset = sizeof(StereoLogFileHeader);
+
+    StereoLogFrameHeader header;
+
+    while (offset + sizeof(header) <= file_size) {
+
+        if (pread(fd_, &header, sizeof(header), offset) != sizeof(header)
+            || header.sync != STEREO_LOG_FRAME_SYNC) {
+
+            break;
+        }
+
+        uint64_t record_size = sizeof(header) + 2 * (uint64_t)header.width * header.height;
+
+        if (offset + record_size > file_size) {
+            break;
+        }
+
+        AddToIndex(header.frame_number, offset);
+
+        offset += record_size;
+    }
+
+    return num_frames_ > 0;
+}
+
+void StereoLogReader::AddToIndex(uint32_t frame_number, uint64_t offset) {
+
+    if (offsets_.empty()) {
+        first_frame_number_ = frame_number;
+    } else if ((int)frame_number < first_frame_number_) {
+        offsets_.insert(offsets_.begin(), first_frame_number_ - frame_number, NO_FRAME);
+        first_frame_number_ = frame_number;
+    }
+
+    unsigned int position = frame_number - first_frame_number_;
+
+    if (position >= offsets_.size()) {
+        offsets_.resize(position + 1, NO_FRAME);
+    }
+
+    if (offsets_[position] == NO_FRAME) {
+        num_frames_ ++;
+    }
+
+    offsets_[position] = offset;
+}
+
+bool StereoLogReader::HasFrame(int frame_number) const {
+    int position = frame_number - first_frame_number_;
+
+    return position >= 0 && position < (int)offsets_.size() && offsets_[position] != NO_FRAME;
+}
+
+/**
+ * Reads a pair of frames.
+ *
+ * @param frame_number frame to read
+ * @param image_left output: left image
+ * @param image_right output: right image
+ * @param timestamp (optional) output: capture time in microseconds
+ *
+ * @retval false if the frame isn't in the recording or can't be read
+ */
+bool StereoLogReader::ReadFrames(int frame_number, Mat *image_left, Mat *image_right, uint64_t *timestamp) {
+
+    if (HasFrame(frame_number) == false) {
+        return false;
+    }
+
+    uint64_t offset = offsets_[frame_number - first_frame_number_];
+
+    StereoLogFrameHeader header;
+
+    if (pread(fd_, &header, sizeof(header), offset) != sizeof(header)
+        || header.sync != STEREO_LOG_FRAME_SYNC
+        || (int)header.frame_number != frame_number) {
+
+        return false;
+    }
+
+    // widen before multiplying, so a corrupt header can't overflow
+    uint64_t image_bytes = (uint64_t)header.width * header.height;
+
+    // new images every time, like imread, in case someone still has the
+    // last ones
+    *image_left = Mat(header.height, header.width, CV_8UC1);
+    *image_right = Mat(header.height, header.width, CV_8UC1);
+
+    if ((uint64_t)pread(fd_, image_left->data, image_bytes, offset + sizeof(header)) != image_bytes
+        || (uint64_t)pread(fd_, image_right->data, image_bytes, offset + sizeof(header) + image_bytes) != image_bytes) {
+
+        return false;
+    }
+
+    if (timestamp != NULL) {
+        *timestamp = header.timestamp;
+    }
+
+    return true;
+}
+
+/**
+ * Gets a pair of frames without copying them: the images point into the
+ * mapped file.  They are only good until the reader is closed, and are
+ * read-only, so clone them to draw on them.  Falls back to ReadFrames if
+ * the file couldn't be mapped.
+ *
+ * @param frame_number frame to get
+ * @param image_left output: left image
+ * @param image_right output: right image
+ * @param timestamp (optional) output: capture time in microseconds
+ *
+ * @retval false if the frame isn't in the recording
+ */
+bool StereoLogReader::MapFrames(int frame_number, Mat *image_left, Mat *image_right, uint64_t *timestamp) {
+
+    if (map_ == NULL) {
+        return ReadFrames(frame_number, image_left, image_right, timestamp);
+    }
+
+    if (HasFrame(frame_number) == false) {
+        return false;
+    }
+
+    uint64_t offset = offsets_[frame_number - first_frame_number_];
+
+    if (offset + sizeof(StereoLogFrameHeader) > map_size_) {
+        return false;
+    }
+
+    const StereoLogFrameHeader *header = (const StereoLogFrameHeader*)(map_ + offset);
+
+    uint64_t image_bytes = (uint64_t)header->width * header->height;
+    uint64_t record_size = sizeof(StereoLogFrameHeader) + 2 * image_bytes;
+
+    if (header->sync != STEREO_LOG_FRAME_SYNC
+        || (int)header->frame_number != frame_number
+        || offset + record_size > map_size_) {
+
+        return false;
+    }
+
+    // Mat has no read-only view, so this is only as const as the mapping
+    uint8_t *data = map_ + offset + sizeof(StereoLogFrameHeader);
+
+    *image_left = Mat(header->height, header->width, CV_8UC1, data);
+    *image_right = Mat(header->height, header->width, CV_8UC1, data + image_bytes);
+
+    if (timestamp != NULL) {
+        *timestamp = header->timestamp;
+    }
+
+    Prefetch(frame_number, offset, record_size);
+
+    return true;
+}
+
+/**
+ * Asks the kernel to start reading the next few frames in whichever
+ * direction playback is going.  Only bothers when playback gets past the
+ * middle of the last window, so most frames cost no system call.
+ */
+void StereoLogReader::Prefetch(int frame_number, uint64_t offset, uint64_t record_size) {
+
+    bool forward = frame_number >= last_frame_number_;
+    last_frame_number_ = frame_number;
+
+    uint64_t window = STEREO_LOG_PREFETCH_FRAMES * record_size;
+
+    uint64_t begin, end;
+
+    if (forward) {
+        if (offset >= advised_begin_ && offset + record_size + window / 2 <= advised_end_) {
+            return;
+        }
+
+        begin = offset;
+        end = std::min<uint64_t>(offset + window, map_size_);
+    } else {
+        if (offset >= advised_begin_ + window / 2 && offset + record_size <= advised_end_) {
+            return;
+        }
+
+        end = offset + record_size;
+        begin = end > window ? end - window : 0;
+    }
+
+    // madvise wants a page-aligned start
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    uint64_t aligned_begin = begin / page_size * page_size;
+
+    madvise(map_ + aligned_begin, end - aligned_begin, MADV_WILLNEED);
+
+    advised_begin_ = begin;
+    advised_end_ = end;
+}
@@ -0,0 +1,151 @@
+/**
+ * Raw stereo recordings: one append-only file per recording.
+ *
+ * The file is a header, then one record per frame pair (a small header
+ * with the frame number and capture timestamp, the left image and then the
+ * right image, all 8-bit greyscale), then an index of where each frame
+ * starts and a trailer that points at the index.  Recording is a single
+ * sequential stream, and playback can seek straight to any frame.
+ *
+ * If a recording is cut short (crash, power) there is no index, so the
+ * reader rebuilds it by walking the records.
+ *
+ * For playback, the reader maps the whole file into memory and hands out
+ * images that point straight into the mapping, so there's no decoding and
+ * no copying.  The kernel is asked to read ahead of wherever playback is
+ * going, in either direction.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef STEREO_LOG_HPP
+#define STEREO_LOG_HPP
+
+#include "opencv2/opencv.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace cv;
+
+#define STEREO_LOG_EXTENSION ".slog"
+
+#define STEREO_LOG_VERSION 1
+
+#define STEREO_LOG_FILE_MAGIC "STEREOLG"
+#define STEREO_LOG_INDEX_MAGIC "STEREOIX"
+#define STEREO_LOG_FRAME_SYNC 0x454d5246 // "FRME"
+
+#define STEREO_LOG_PREFETCH_FRAMES 32 // frames to read ahead during playback
+
+// on-disk layout, little-endian
+#pragma pack(push, 1)
+
+struct StereoLogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct StereoLogFrameHeader {
+    uint32_t sync;
+    uint32_t frame_number;
+    uint64_t timestamp;
+    uint16_t width;
+    uint16_t height;
+    uint32_t reserved;
+};
+
+struct StereoLogIndexEntry {
+    uint32_t frame_number;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+struct StereoLogTrailer {
+    uint64_t index_offset;
+    uint32_t num_frames;
+    uint32_t reserved;
+    char magic[8];
+};
+
+#pragma pack(pop)
+
+class StereoLogWriter {
+
+    public:
+        StereoLogWriter();
+        ~StereoLogWriter();
+
+        bool Open(std::string filename);
+
+        bool WriteFrames(const Mat &image_left, const Mat &image_right, int frame_number, uint64_t timestamp);
+
+        bool Close();
+
+        bool IsOpen() const { return file_ != NULL; }
+
+    private:
+        bool WriteImage(const Mat &image);
+
+        FILE *file_;
+        std::string filename_;
+
+        uint64_t offset_;
+        std::vector<StereoLogIndexEntry> index_;
+};
+
+class StereoLogReader {
+
+    public:
+        StereoLogReader();
+        ~StereoLogReader();
+
+        bool Open(std::string filename);
+        void Close();
+
+        bool IsOpen() const { return fd_ >= 0; }
+
+        int GetNumFrames() const { return num_frames_; }
+
+        // frame numbers can have gaps where frames were dropped
+        int GetFirstFrameNumber() const { return first_frame_number_; }
+        int GetLastFrameNumber() const { return first_frame_number_ + (int)offsets_.size() - 1; }
+
+        bool HasFrame(int frame_number) const;
+
+        bool ReadFrames(int frame_number, Mat *image_left, Mat *image_right, uint64_t *timestamp = NULL);
+
+        bool MapFrames(int frame_number, Mat *image_left, Mat *image_right, uint64_t *timestamp = NULL);
+
+        bool IsMapped() const { return map_ != NULL; }
+
+    private:
+        bool ReadIndex(uint64_t file_size);
+        bool ScanRecords(uint64_t file_size);
+        void AddToIndex(uint32_t frame_number, uint64_t offset);
+
+        void Prefetch(int frame_number, uint64_t offset, uint64_t record_size);
+
+        int fd_;
+
+        uint8_t *map_;
+        size_t map_size_;
+
+        // where playback was last, and what we last asked the kernel to
+        // read in
+        int last_frame_number_;
+        uint64_t advised_begin_, advised_end_;
+
+        // offsets_[n] is where frame first_frame_number_ + n starts, or
+        // NO_FRAME if it's missing
+        std::vector<uint64_t> offsets_;
+        int first_frame_number_;
+        int num_frames_;
+
+        static const uint64_t NO_FRAME;
+};
+
+#endif
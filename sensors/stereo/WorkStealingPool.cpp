@@ -0,0 +1,284 @@
+/**
+ * Small persistent work-stealing thread pool.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "WorkStealingPool.hpp"
+
+// tasks each queue has room for to start with.  Enough for every strip of
+// a frame, so the queues normally never grow.
+#define TASK_QUEUE_INITIAL_SIZE 64
+
+// which pool (if any) the current thread is a worker for, and which queue
+// is its own
+static thread_local WorkStealingPool *current_pool = NULL;
+static thread_local int current_queue = -1;
+
+/**
+ * Starts the worker threads.
+ *
+ * @param num_threads total number of threads that will run tasks,
+ *      including the thread that calls Wait.  0 means one per hardware
+ *      thread.
+ */
+WorkStealingPool::WorkStealingPool(int num_threads) {
+
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+
+        if (num_threads <= 0) {
+            // unknown, make a guess
+            num_threads = 4;
+        }
+    }
+
+    // the thread that calls Wait works too, so we need one fewer worker
+    num_workers_ = num_threads - 1;
+
+    pending_ = 0;
+    queued_ = 0;
+    next_queue_ = 0;
+    quit_ = false;
+
+    for (int i = 0; i < num_workers_ + 1; i++) {
+        queues_.push_back(new TaskQueue());
+    }
+
+    for (int i = 0; i < num_workers_; i++) {
+        threads_.push_back(std::thread(&WorkStealingPool::WorkerLoop, this, i));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        quit_ = true;
+    }
+
+    cv_work_.notify_all();
+
+    for (unsigned int i = 0; i < threads_.size(); i++) {
+        threads_[i].join();
+    }
+
+    for (unsigned int i = 0; i < queues_.size(); i++) {
+        delete queues_[i];
+    }
+}
+
+/**
+ * Adds a task to the pool.  Can be called from anywhere, including from
+ * inside a running task, in which case the new task goes on the current
+ * worker's own queue.
+ *
+ * @param function function to run
+ * @param context first argument to the function
+ * @param index second argument to the function
+ */
+void WorkStealingPool::Submit(TaskFunction function, void *context, int index) {
+
+    Task task;
+    task.function = function;
+    task.context = context;
+    task.index = index;
+
+    pending_ ++;
+
+    int queue;
+
+    if (current_pool == this) {
+        queue = current_queue;
+    } else {
+        // spread work from outside the pool over the workers
+        queue = next_queue_++ % queues_.size();
+    }
+
+    PushTask(queue, task);
+}
+
+/**
+ * Runs tasks on the calling thread until every submitted task (and
+ * everything those tasks submitted) is done.
+ */
+void WorkStealingPool::Wait() {
+
+    int queue = num_workers_;
+
+    WorkStealingPool *last_pool = current_pool;
+    int last_queue = current_queue;
+
+    current_pool = this;
+    current_queue = queue;
+
+    while (pending_ > 0) {
+
+        if (RunOneTask(queue)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        cv_done_.wait(lock, [this]{ return pending_ == 0 || queued_ > 0; });
+    }
+
+    current_pool = last_pool;
+    current_queue = last_queue;
+}
+
+/**
+ * Tells a task which of the pool's threads it is running on, so it can use
+ * per-thread scratch space.
+ *
+ * @retval index between 0 and GetNumThreads() - 1, or -1 if the calling
+ *      thread isn't running tasks for this pool
+ */
+int WorkStealingPool::GetCurrentThreadIndex() const {
+    if (current_pool != this) {
+        return -1;
+    }
+
+    return current_queue;
+}
+
+void WorkStealingPool::WorkerLoop(int worker) {
+
+    current_pool = this;
+    current_queue = worker;
+
+    while (true) {
+
+        if (RunOneTask(worker)) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        cv_work_.wait(lock, [this]{ return quit_ || queued_ > 0; });
+
+        if (quit_) {
+            return;
+        }
+    }
+}
+
+/**
+ * Runs one task from our own queue, or one stolen from someone else.
+ *
+ * @retval false if there was nothing to run
+ */
+bool WorkStealingPool::RunOneTask(int queue) {
+
+    Task task;
+
+    if (PopOwnTask(queue, &task) == false && StealTask(queue, &task) == false) {
+        return false;
+    }
+
+    task.function(task.context, task.index);
+
+    if (--pending_ == 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        cv_done_.notify_all();
+    }
+
+    return true;
+}
+
+bool WorkStealingPool::PopOwnTask(int queue, Task *task) {
+
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+
+    TaskQueue *tasks = queues_[queue];
+
+    if (tasks->Empty()) {
+        return false;
+    }
+
+    // newest first: it was probably just made ready by the task we ran
+    *task = tasks->PopNewest();
+    queued_ --;
+
+    return true;
+}
+
+bool WorkStealingPool::StealTask(int queue, Task *task) {
+
+    int num_queues = queues_.size();
+
+    for (int i = 1; i < num_queues; i++) {
+
+        int victim = (queue + i) % num_queues;
+
+        std::lock_guard<std::mutex> lock(queues_[victim]->mutex);
+
+        TaskQueue *tasks = queues_[victim];
+
+        if (tasks->Empty() == false) {
+            // oldest first, so we don't take work the owner is about to need
+            *task = tasks->PopOldest();
+            queued_ --;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkStealingPool::PushTask(int queue, const Task &task) {
+
+    {
+        std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+        queues_[queue]->PushNewest(task);
+        queued_ ++;
+    }
+
+    // take the sleep lock so a worker that just decided to sleep can't
+    // miss this
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+
+    cv_work_.notify_one();
+    cv_done_.notify_all();
+}
+
+WorkStealingPool::TaskQueue::TaskQueue() : tasks(TASK_QUEUE_INITIAL_SIZE), head(0), count(0) {}
+
+void WorkStealingPool::TaskQueue::PushNewest(const Task &task) {
+
+    int size = tasks.size();
+
+    if (count == size) {
+        // full: unwrap into a buffer twice the size
+        std::vector<Task> bigger(2 * size);
+
+        for (int i = 0; i < count; i++) {
+            bigger[i] = tasks[(head + i) % size];
+        }
+
+        tasks.swap(bigger);
+        head = 0;
+        size = tasks.size();
+    }
+
+    tasks[(head + count) % size] = task;
+    count ++;
+}
+
+WorkStealingPool::Task WorkStealingPool::TaskQueue::PopNewest() {
+
+    count --;
+
+    return tasks[(head + count) % tasks.size()];
+}
+
+WorkStealingPool::Task WorkStealingPool::TaskQueue::PopOldest() {
+
+    Task task = tasks[head];
+
+    head = (head + 1) % tasks.size();
+    count --;
+
+    return task;
+}
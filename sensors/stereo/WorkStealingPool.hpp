@@ -0,0 +1,92 @@
+/**
+ * Small persistent work-stealing thread pool.
+ *
+ * Each worker has its own task queue.  Workers run their own newest task
+ * first, so a task that makes another task ready (by submitting it from
+ * inside the pool) usually has that task run next on the same core while
+ * its data is still in cache.  Idle workers steal the oldest task from
+ * someone else's queue.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class WorkStealingPool {
+
+    public:
+        typedef void (*TaskFunction)(void *context, int index);
+
+        WorkStealingPool(int num_threads = 0);
+        ~WorkStealingPool();
+
+        void Submit(TaskFunction function, void *context, int index);
+
+        void Wait();
+
+        int GetNumThreads() const { return num_workers_ + 1; }
+
+        int GetCurrentThreadIndex() const;
+
+    private:
+        struct Task {
+            TaskFunction function;
+            void *context;
+            int index;
+        };
+
+        /**
+         * Ring buffer of tasks, oldest first.  It doubles when it's full
+         * and never shrinks, so once it has been as full as it gets,
+         * Submit doesn't allocate.
+         */
+        struct TaskQueue {
+            TaskQueue();
+
+            bool Empty() const { return count == 0; }
+
+            void PushNewest(const Task &task);
+            Task PopNewest();
+            Task PopOldest();
+
+            std::mutex mutex;
+
+            std::vector<Task> tasks;
+            int head; // oldest task
+            int count;
+        };
+
+        void WorkerLoop(int worker);
+
+        bool RunOneTask(int queue);
+        bool PopOwnTask(int queue, Task *task);
+        bool StealTask(int queue, Task *task);
+
+        void PushTask(int queue, const Task &task);
+
+        int num_workers_;
+
+        // one queue per worker, plus one for threads outside the pool
+        // (ie the one that calls Wait)
+        std::vector<TaskQueue*> queues_;
+        std::vector<std::thread> threads_;
+
+        std::atomic<int> pending_; // submitted but not finished
+        std::atomic<int> queued_; // sitting in a queue
+        std::atomic<unsigned int> next_queue_;
+
+        std::mutex sleep_mutex_;
+        std::condition_variable cv_work_;
+        std::condition_variable cv_done_;
+        bool quit_;
+};
+
+#endif
@@ -1,5 +1,5 @@
 TARGET = opencv-calibrate
-SOURCES = opencv-calibrate.cpp opencv-stereo-util.cpp ../../externals/jpeg-utils/jpeg-utils.c ../../utils/utils/RealtimeUtils.cpp
+SOURCES = opencv-calibrate.cpp opencv-stereo-util.cpp RemapTable.cpp ../../externals/jpeg-utils/jpeg-utils.c ../../utils/utils/RealtimeUtils.cpp
 
 # include a standard makefile that uses these variables and builds everything
 include ../../utils/make/flight.mk
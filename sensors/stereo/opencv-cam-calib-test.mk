@@ -1,4 +1,4 @@
 TARGET = opencv-cam-calib-test
-SOURCES = opencv-cam-calib-test.cpp opencv-stereo-util.cpp ../../externals/jpeg-utils/jpeg-utils.c RecordingManager.cpp ../../utils/utils/RealtimeUtils.cpp
+SOURCES = opencv-cam-calib-test.cpp opencv-stereo-util.cpp RemapTable.cpp ../../externals/jpeg-utils/jpeg-utils.c RecordingManager.cpp RecordingWriter.cpp StereoLog.cpp ../../utils/utils/RealtimeUtils.cpp
 
 include ../../utils/make/flight.mk
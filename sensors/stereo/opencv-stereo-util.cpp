@@ -301,6 +301,19 @@ bool ParseConfigFile(string configFile, OpenCvStereoConfig *configStruct)
     }
     configStruct->log_size_channel3 = log_size_channel3;
 
+    const char *stereo_timing_channel = g_key_file_get_string(keyfile, "lcm", "stereo_timing_channel", NULL);
+
+    if (stereo_timing_channel == NULL)
+    {
+        // optional: stage timing is only collected and published when
+        // there is a channel for it, so there's nothing to warn about
+        stereo_timing_channel = "";
+    } else if (stereo_timing_channel[0] == '\0')
+    {
+        fprintf(stderr, "Warning: lcm.stereo_timing_channel is set but empty, not publishing stage timing.\n");
+    }
+    configStruct->stereo_timing_channel = stereo_timing_channel;
+
 
 
     char *lcmUrl = g_key_file_get_string(keyfile, "lcm", "url", NULL);
@@ -363,6 +376,26 @@ bool ParseConfigFile(string configFile, OpenCvStereoConfig *configStruct)
     }
     configStruct->usePGM = usePGM;
 
+    configStruct->useStereoLog = g_key_file_get_boolean(keyfile,
+        "cameras", "useStereoLog", &gerror);
+    if (gerror != NULL)
+    {
+        // no need to get upset, this is an optional parameter
+        configStruct->useStereoLog = false;
+        g_error_free(gerror);
+        gerror = NULL;
+    }
+
+    configStruct->maxCaptureSkew = g_key_file_get_integer(keyfile,
+        "cameras", "maxCaptureSkew", &gerror);
+    if (gerror != NULL)
+    {
+        // no need to get upset, this is an optional parameter
+        configStruct->maxCaptureSkew = 17000;
+        g_error_free(gerror);
+        gerror = NULL;
+    }
+
 
 
     configStruct->displayOffsetX = g_key_file_get_integer(keyfile,
@@ -401,6 +434,23 @@ bool ParseConfigFile(string configFile, OpenCvStereoConfig *configStruct)
         return false;
     }
 
+    // more disparities to search along with the main one
+    gsize num_extra_disparities;
+    gint *extra_disparities = g_key_file_get_integer_list(keyfile,
+        "settings", "extraDisparities", &num_extra_disparities, &gerror);
+
+    configStruct->extraDisparities.clear();
+
+    if (gerror != NULL)
+    {
+        // no need to get upset, this is an optional parameter
+        g_error_free(gerror);
+        gerror = NULL;
+    } else {
+        configStruct->extraDisparities.assign(extra_disparities, extra_disparities + num_extra_disparities);
+        g_free(extra_disparities);
+    }
+
     configStruct->infiniteDisparity = g_key_file_get_integer(keyfile,
         "settings", "infiniteDisparity", &gerror);
 
@@ -630,6 +680,11 @@ bool LoadCalibration(string calibrationDir, OpenCvStereoCalibration *stereoCalib
     stereoCalibration->mx1fp = mx1fp;
     stereoCalibration->mx2fp = mx2fp;
 
+    // the maps don't change, so work out the remap once.  The camera
+    // images are the same size as the rectified ones.
+    stereoCalibration->mx1Table.Build(mx1fp, mx1fp.size());
+    stereoCalibration->mx2Table.Build(mx2fp, mx2fp.size());
+
     stereoCalibration->M1 = m1Mat;
     stereoCalibration->D1 = d1Mat;
     stereoCalibration->R1 = r1Mat;
@@ -24,6 +24,7 @@
 
 #include "../../LCM/lcmt_stereo.h"
 #include "../../utils/utils/RealtimeUtils.hpp"
+#include "RemapTable.hpp"
 
 
 
@@ -59,6 +60,11 @@ struct OpenCvStereoConfig
     string fourcc;
 
     bool usePGM;
+    bool useStereoLog;
+
+    // most microseconds between left and right frames when capturing
+    // asynchronously
+    int maxCaptureSkew;
 
     string stereo_replay_channel;
     string baro_airspeed_channel;
@@ -75,8 +81,11 @@ struct OpenCvStereoConfig
     string log_size_channel2;
     string log_size_channel3;
 
+    string stereo_timing_channel;
+
 
     int disparity;
+    vector<int> extraDisparities;
     int infiniteDisparity;
     int interestOperatorLimit;
     int blockSize;
@@ -92,6 +101,10 @@ struct OpenCvStereoCalibration
 {
     Mat mx1fp;
     Mat mx2fp;
+
+    // precomputed versions of mx1fp and mx2fp for fast remapping
+    RemapTable mx1Table;
+    RemapTable mx2Table;
     Mat qMat;
 
     Mat M1;
@@ -0,0 +1,1206 @@
+/**
+ * Micro-benchmark for the pushbroom stereo kernels.
+ *
+ * Runs every SAD kernel this CPU supports over every block position of a
+ * random image pair, checks that they all agree with the scalar kernel, and
+ * prints the time per block.  Then does the same for the strip kernels,
+ * which score a whole row of blocks at once.  Finally runs the whole
+ * pipeline on the fixed thread pool and on the work-stealing scheduler
+ * (with and without fused strips) and prints a histogram of the per-frame
+ * latency for each, and times searching several disparities in one call
+ * against a separate call for each.
+ *
+ * The pieces of the pipeline (remapping, the interest operator, GetSAD, and
+ * CheckHorizontalInvariance) are timed on their own, and the whole pipeline
+ * is run with each scheduler at several thread counts.  Those run on
+ * recorded frames when given a left and right image or a stereo log, with
+ * the real rectification when given a calibration directory.
+ *
+ * Given a stereo log, also times playing it back, forwards and backwards,
+ * from the memory mapping against reading each frame.
+ *
+ * With -j, everything is also written to a JSON file in the same format as
+ * Google Benchmark's --benchmark_format=json, so runs from different
+ * commits can be compared with its compare.py.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "../../externals/ConciseArgs.hpp"
+#include "opencv-stereo-util.hpp"
+#include "pushbroom-kernels.hpp"
+#include "pushbroom-stereo.hpp"
+#include "LatencyHistogram.hpp"
+#include "StageTimer.hpp"
+#include "StereoLog.hpp"
+
+// pad the right side of each row so the SIMD kernels can always
+// read SAD_KERNEL_MAX_BLOCK_SIZE bytes
+#define IMAGE_PADDING SAD_KERNEL_MAX_BLOCK_SIZE
+
+struct BenchmarkImages {
+    int rows;
+    int cols;
+    size_t step;
+
+    std::vector<uint8_t> left;
+    std::vector<uint8_t> right;
+    std::vector<uint8_t> laplacian_left;
+    std::vector<uint8_t> laplacian_right;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    long iterations;
+
+    // time per iteration, in time_unit ("ns", "us", or "ms")
+    double time;
+    std::string time_unit;
+
+    // tail latencies in time_unit, or less than zero if not kept
+    double p50;
+    double p90;
+    double p99;
+
+    // results that didn't agree with the reference
+    int mismatches;
+};
+
+struct BenchmarkContext {
+    std::string executable;
+    std::string frames;
+    std::string calibration_dir;
+
+    int rows;
+    int cols;
+    int block_size;
+    int disparity;
+};
+
+// everything that was measured, for WriteJson
+static std::vector<BenchmarkResult> benchmark_results;
+
+static void AddResult(std::string name, long iterations, double time, std::string time_unit, int mismatches = 0) {
+
+    BenchmarkResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.time = time;
+    result.time_unit = time_unit;
+    result.p50 = -1;
+    result.p90 = -1;
+    result.p99 = -1;
+    result.mismatches = mismatches;
+
+    benchmark_results.push_back(result);
+}
+
+static void AddResult(std::string name, const LatencyHistogram &histogram, int mismatches = 0) {
+
+    AddResult(name, histogram.GetCount(), histogram.GetMean(), "ms", mismatches);
+
+    benchmark_results.back().p50 = histogram.GetPercentile(50);
+    benchmark_results.back().p90 = histogram.GetPercentile(90);
+    benchmark_results.back().p99 = histogram.GetPercentile(99);
+}
+
+static std::string JsonEscape(std::string text) {
+
+    std::string escaped;
+
+    for (unsigned int i = 0; i < text.length(); i++) {
+        if (text[i] == '"' || text[i] == '\\') {
+            escaped += '\\';
+        }
+
+        escaped += text[i];
+    }
+
+    return escaped;
+}
+
+/**
+ * Writes every result in Google Benchmark's JSON format.  Only wall time is
+ * measured, so cpu_time is the same as real_time.
+ *
+ * @param filename file to write
+ * @param context settings the benchmark was run with
+ *
+ * @retval false if the file couldn't be written
+ */
+static bool WriteJson(std::string filename, const BenchmarkContext &context) {
+
+    FILE *file = fopen(filename.c_str(), "w");
+
+    if (file == NULL) {
+        fprintf(stderr, "Error: failed to open %s\n", filename.c_str());
+        return false;
+    }
+
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"context\": {\n");
+    fprintf(file, "    \"date\": \"%s\",\n", date);
+    fprintf(file, "    \"executable\": \"%s\",\n", JsonEscape(context.executable).c_str());
+    fprintf(file, "    \"num_cpus\": %d,\n", (int)std::thread::hardware_concurrency());
+    fprintf(file, "    \"sad_kernel\": \"%s\",\n", GetSadKernelName(GetBestSadKernelType()));
+    fprintf(file, "    \"frames\": \"%s\",\n", JsonEscape(context.frames).c_str());
+    fprintf(file, "    \"calibration\": \"%s\",\n", JsonEscape(context.calibration_dir).c_str());
+    fprintf(file, "    \"rows\": %d,\n", context.rows);
+    fprintf(file, "    \"cols\": %d,\n", context.cols);
+    fprintf(file, "    \"block_size\": %d,\n", context.block_size);
+    fprintf(file, "    \"disparity\": %d\n", context.disparity);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"benchmarks\": [\n");
+
+    for (unsigned int i = 0; i < benchmark_results.size(); i++) {
+
+        const BenchmarkResult &result = benchmark_results[i];
+
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", JsonEscape(result.name).c_str());
+        fprintf(file, "      \"run_type\": \"iteration\",\n");
+        fprintf(file, "      \"iterations\": %ld,\n", result.iterations);
+        fprintf(file, "      \"real_time\": %.6g,\n", result.time);
+        fprintf(file, "      \"cpu_time\": %.6g,\n", result.time);
+        fprintf(file, "      \"time_unit\": \"%s\",\n", result.time_unit.c_str());
+
+        if (result.p50 >= 0) {
+            fprintf(file, "      \"p50\": %.6g,\n", result.p50);
+            fprintf(file, "      \"p90\": %.6g,\n", result.p90);
+            fprintf(file, "      \"p99\": %.6g,\n", result.p99);
+        }
+
+        fprintf(file, "      \"mismatches\": %d\n", result.mismatches);
+        fprintf(file, "    }%s\n", i + 1 < benchmark_results.size() ? "," : "");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: failed to write %s\n", filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static double GetSeconds() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+static void FillRandom(std::vector<uint8_t> *image, std::default_random_engine *rand_engine) {
+    std::uniform_int_distribution<int> uniform_dist(0, 255);
+
+    for (unsigned int i = 0; i < image->size(); i++) {
+        (*image)[i] = uniform_dist(*rand_engine);
+    }
+}
+
+/**
+ * Runs a kernel over every block position in the image.
+ *
+ * @param kernel kernel to run
+ * @param images input images
+ * @param block_size size of the SAD block
+ * @param disparity disparity to search at
+ * @param checksum output: sum over every block of all three kernel outputs
+ *
+ * @retval number of blocks processed
+ */
+static long RunKernelOverImage(SadKernel kernel, const BenchmarkImages &images, int block_size, int disparity, long *checksum) {
+
+    int start_j = disparity < 0 ? -disparity : 0;
+    int stop_j = disparity < 0 ? images.cols - block_size : images.cols - (disparity + block_size);
+
+    long num_blocks = 0;
+    long sum = 0;
+
+    for (int i = 0; i + block_size <= images.rows; i += block_size) {
+        for (int j = start_j; j < stop_j; j += block_size) {
+            size_t offset_L = i * images.step + j;
+            size_t offset_R = offset_L + disparity;
+
+            int sad, left_interest, right_interest;
+
+            kernel(&images.left[offset_L], &images.right[offset_R],
+                &images.laplacian_left[offset_L], &images.laplacian_right[offset_R],
+                images.step, block_size, &sad, &left_interest, &right_interest);
+
+            sum += sad + left_interest + right_interest;
+            num_blocks ++;
+        }
+    }
+
+    *checksum = sum;
+    return num_blocks;
+}
+
+/**
+ * Runs a strip kernel over every row of blocks in the image, including
+ * adding up the columns for each block, which is the same work that
+ * PushbroomStereo::GetSADStrip does.
+ *
+ * @retval number of blocks processed
+ */
+static long RunStripKernelOverImage(SadStripKernel kernel, const BenchmarkImages &images, int block_size, int disparity, long *checksum, int *mismatches) {
+
+    int start_j = disparity < 0 ? -disparity : 0;
+    int stop_j = disparity < 0 ? images.cols - block_size : images.cols - (disparity + block_size);
+
+    int num_blocks = (stop_j - start_j + block_size - 1) / block_size;
+    int width = num_blocks * block_size;
+
+    std::vector<uint16_t> sad_columns(width), left_columns(width), right_columns(width);
+
+    long total_blocks = 0;
+    long sum = 0;
+
+    for (int i = 0; i + block_size <= images.rows; i += block_size) {
+        size_t offset_L = i * images.step + start_j;
+        size_t offset_R = offset_L + disparity;
+
+        kernel(&images.left[offset_L], &images.right[offset_R],
+            &images.laplacian_left[offset_L], &images.laplacian_right[offset_R],
+            images.step, block_size, width, &sad_columns[0], &left_columns[0],
+            &right_columns[0]);
+
+        for (int block = 0; block < num_blocks; block++) {
+            int sad = 0, left_interest = 0, right_interest = 0;
+
+            for (int j = block * block_size; j < (block + 1) * block_size; j++) {
+                sad += sad_columns[j];
+                left_interest += left_columns[j];
+                right_interest += right_columns[j];
+            }
+
+            if (mismatches != NULL) {
+                int sad2, left_interest2, right_interest2;
+
+                SadBlockScalar(&images.left[offset_L + block * block_size],
+                    &images.right[offset_R + block * block_size],
+                    &images.laplacian_left[offset_L + block * block_size],
+                    &images.laplacian_right[offset_R + block * block_size],
+                    images.step, block_size, &sad2, &left_interest2, &right_interest2);
+
+                if (sad != sad2 || left_interest != left_interest2 || right_interest != right_interest2) {
+                    (*mismatches) ++;
+                }
+            }
+
+            sum += sad + left_interest + right_interest;
+        }
+
+        total_blocks += num_blocks;
+    }
+
+    *checksum = sum;
+    return total_blocks;
+}
+
+/**
+ * Checks a kernel against the scalar kernel at every block position.
+ *
+ * @retval number of blocks that do not match
+ */
+static int CompareToScalar(SadKernel kernel, const BenchmarkImages &images, int block_size, int disparity) {
+
+    int start_j = disparity < 0 ? -disparity : 0;
+    int stop_j = disparity < 0 ? images.cols - block_size : images.cols - (disparity + block_size);
+
+    int mismatches = 0;
+
+    for (int i = 0; i + block_size <= images.rows; i++) {
+        for (int j = start_j; j < stop_j; j++) {
+            size_t offset_L = i * images.step + j;
+            size_t offset_R = offset_L + disparity;
+
+            int sad, left_interest, right_interest;
+            int sad2, left_interest2, right_interest2;
+
+            SadBlockScalar(&images.left[offset_L], &images.right[offset_R],
+                &images.laplacian_left[offset_L], &images.laplacian_right[offset_R],
+                images.step, block_size, &sad, &left_interest, &right_interest);
+
+            kernel(&images.left[offset_L], &images.right[offset_R],
+                &images.laplacian_left[offset_L], &images.laplacian_right[offset_R],
+                images.step, block_size, &sad2, &left_interest2, &right_interest2);
+
+            if (sad != sad2 || left_interest != left_interest2 || right_interest != right_interest2) {
+                mismatches ++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+/**
+ * Sets up a state for running the whole pipeline.
+ *
+ * @param rows image height
+ * @param cols image width
+ * @param block_size SAD block size
+ * @param disparity disparity to search at
+ * @param state_out output: state with an identity rectification
+ */
+static void SetUpState(int rows, int cols, int block_size, int disparity, PushbroomStereoState *state_out) {
+
+    PushbroomStereoState &state = *state_out;
+    state.disparity = disparity;
+    state.zero_dist_disparity = disparity + 10;
+    state.sobelLimit = 860 * block_size * block_size / 25;
+    state.blockSize = block_size;
+    state.sadThreshold = 54;
+    state.horizontalInvarianceMultiplier = 0.5;
+    state.lastValidPixelRow = 0;
+    state.show_display = false;
+    state.check_horizontal_invariance = true;
+    state.random_results = -1;
+
+    // identity rectification
+    state.mapxL.create(rows, cols, CV_16SC2);
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            state.mapxL.ptr<short>(i)[2*j] = j;
+            state.mapxL.ptr<short>(i)[2*j + 1] = i;
+        }
+    }
+    state.mapxR = state.mapxL;
+    state.Q = Mat::eye(4, 4, CV_64F);
+}
+
+/**
+ * Sets up a frame and a state for running the whole pipeline on random
+ * images.
+ *
+ * @param images random images to use
+ * @param block_size SAD block size
+ * @param disparity disparity to search at.  Matches are planted in the top
+ *      half of the right image at this disparity.
+ * @param left output: left image
+ * @param right output: right image, with the planted matches
+ * @param state_out output: state with an identity rectification
+ */
+static void SetUpPipeline(const BenchmarkImages &images, int block_size, int disparity, Mat *left, Mat *right, PushbroomStereoState *state_out) {
+
+    *left = Mat(images.rows, images.cols, CV_8UC1, (void*)&images.left[0], images.step);
+    *right = Mat(images.rows, images.cols, CV_8UC1, (void*)&images.right[0], images.step).clone();
+
+    // random images have almost no matches, so copy the left image into the
+    // top half of the right one at the disparity we're searching
+    for (int i = 0; i < images.rows / 2; i++) {
+        for (int j = 0; j < images.cols; j++) {
+            int j_right = j + disparity;
+            if (j_right >= 0 && j_right < images.cols) {
+                right->at<uchar>(i, j_right) = left->at<uchar>(i, j);
+            }
+        }
+    }
+
+    SetUpState(images.rows, images.cols, block_size, disparity, state_out);
+}
+
+/**
+ * Loads recorded frames to run the stage and pipeline benchmarks on.
+ *
+ * @param left_image left image file, or "" to use a stereo log
+ * @param right_image right image file
+ * @param log_file stereo log to take frames from, or ""
+ * @param max_frames most frames to take from the log.  They're spread
+ *      evenly through it.
+ * @param lefts output: left frames.  Empty if there's nothing to load.
+ * @param rights output: right frames
+ *
+ * @retval false if the frames couldn't be read
+ */
+static bool LoadRecordedFrames(std::string left_image, std::string right_image, std::string log_file, int max_frames, std::vector<Mat> *lefts, std::vector<Mat> *rights) {
+
+    if (left_image != "") {
+        // 0 to load them as greyscale, like the cameras
+        Mat left = imread(left_image, 0);
+        Mat right = imread(right_image, 0);
+
+        if (left.empty() || right.empty() || left.size() != right.size()) {
+            fprintf(stderr, "Error: failed to read a matching pair of images from %s and %s\n", left_image.c_str(), right_image.c_str());
+            return false;
+        }
+
+        lefts->push_back(left);
+        rights->push_back(right);
+
+        return true;
+    }
+
+    if (log_file == "" || max_frames <= 0) {
+        return true;
+    }
+
+    StereoLogReader reader;
+
+    if (reader.Open(log_file) == false) {
+        return false;
+    }
+
+    int first = reader.GetFirstFrameNumber();
+    int last = reader.GetLastFrameNumber();
+
+    for (int k = 0; k < max_frames; k++) {
+
+        int frame_number = first + (long)k * (last - first) / std::max(max_frames - 1, 1);
+
+        Mat left, right;
+
+        if (reader.ReadFrames(frame_number, &left, &right)) {
+            lefts->push_back(left);
+            rights->push_back(right);
+        }
+
+        if (last == first) {
+            break;
+        }
+    }
+
+    if (lefts->size() == 0) {
+        fprintf(stderr, "Error: no frames in %s\n", log_file.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Times the pieces of the pipeline on their own, on this thread: remapping
+ * and the interest operator for each frame, and GetSAD and
+ * CheckHorizontalInvariance at every block.
+ *
+ * @param lefts left frames
+ * @param rights right frames
+ * @param state settings and rectification
+ * @param iterations number of passes over the frames
+ * @param label name for the frames in the results ("random" or "recorded")
+ */
+static void RunStageBenchmark(const std::vector<Mat> &lefts, const std::vector<Mat> &rights, const PushbroomStereoState &state, int iterations, std::string label) {
+
+    PushbroomStereo pushbroom_stereo;
+
+    int num_frames = lefts.size();
+
+    std::vector<Mat> remapped_lefts(num_frames), remapped_rights(num_frames);
+    std::vector<Mat> laplacian_lefts(num_frames), laplacian_rights(num_frames);
+
+    LatencyHistogram remap_histogram("remap", 0.01, 1000);
+    LatencyHistogram interest_histogram("interest op", 0.01, 1000);
+
+    // RunRemapping and RunInterestOp are private, but RemapAndFilter runs
+    // them both on this thread and their StageTimers say how long each took
+    std::vector<StageStats> stats;
+    int dropped;
+
+    StageProfiler::SetEnabled(true);
+    StageProfiler::Collect(&stats, &dropped);
+
+    for (int n = 0; n < iterations; n++) {
+        for (int f = 0; f < num_frames; f++) {
+
+            pushbroom_stereo.RemapAndFilter(lefts[f], rights[f], state,
+                &remapped_lefts[f], &remapped_rights[f], &laplacian_lefts[f], &laplacian_rights[f]);
+
+            StageProfiler::Collect(&stats, &dropped);
+
+            remap_histogram.Add(stats[STAGE_REMAP].total_ms);
+            interest_histogram.Add(stats[STAGE_INTEREST_OP].total_ms);
+        }
+    }
+
+    StageProfiler::SetEnabled(false);
+
+    int block_size = state.blockSize;
+    int disparity = state.disparity;
+    int rows = remapped_lefts[0].rows;
+    int cols = remapped_lefts[0].cols;
+
+    int start_j = disparity < 0 ? -disparity : 0;
+    int stop_j = disparity < 0 ? cols - block_size : cols - (disparity + block_size);
+
+    long num_blocks = 0;
+    long sad_checksum = 0;
+
+    double start = GetSeconds();
+
+    for (int n = 0; n < iterations; n++) {
+        for (int f = 0; f < num_frames; f++) {
+            for (int i = 0; i + block_size <= rows; i += block_size) {
+                for (int j = start_j; j < stop_j; j += block_size) {
+                    sad_checksum += pushbroom_stereo.GetSAD(remapped_lefts[f], remapped_rights[f],
+                        laplacian_lefts[f], laplacian_rights[f], j, i, state);
+
+                    num_blocks ++;
+                }
+            }
+        }
+    }
+
+    double sad_ns = (GetSeconds() - start) / std::max(num_blocks, 1L) * 1e9;
+
+    long num_invariant = 0;
+
+    start = GetSeconds();
+
+    for (int n = 0; n < iterations; n++) {
+        for (int f = 0; f < num_frames; f++) {
+            for (int i = 0; i + block_size <= rows; i += block_size) {
+                for (int j = start_j; j < stop_j; j += block_size) {
+                    if (pushbroom_stereo.CheckHorizontalInvariance(remapped_lefts[f], remapped_rights[f],
+                        laplacian_lefts[f], laplacian_rights[f], j, i, state)) {
+
+                        num_invariant ++;
+                    }
+                }
+            }
+        }
+    }
+
+    double invariance_ns = (GetSeconds() - start) / std::max(num_blocks, 1L) * 1e9;
+
+    printf("\nstages on one thread, %s frames (%d frames, %d iterations):\n", label.c_str(), num_frames, iterations);
+
+    remap_histogram.PrintSummary();
+    interest_histogram.PrintSummary();
+
+    printf("%-16s %8.2f ns/block  (checksum %ld)\n", "GetSAD", sad_ns, sad_checksum);
+    printf("%-16s %8.2f ns/block  (%ld of %ld blocks invariant)\n", "invariance", invariance_ns, num_invariant, num_blocks);
+
+    AddResult("remap/" + label, remap_histogram);
+    AddResult("interest_op/" + label, interest_histogram);
+    AddResult("get_sad/" + label, num_blocks, sad_ns, "ns");
+    AddResult("check_horizontal_invariance/" + label, num_blocks, invariance_ns, "ns");
+}
+
+/**
+ * Runs ProcessImages over the frames many times with each scheduler, and
+ * with the work-stealing schedulers at each thread count.
+ *
+ * @param lefts left frames
+ * @param rights right frames
+ * @param state settings and rectification
+ * @param frames number of frames to time for each scheduler
+ * @param thread_counts threads for the work-stealing schedulers (0 for one
+ *      per core).  The fixed pool always has NUM_THREADS.
+ * @param label name for the frames in the results ("random" or "recorded")
+ *
+ * @retval number of schedulers that found different hits from the fixed
+ *      thread pool
+ */
+static int RunPipelineBenchmark(const std::vector<Mat> &lefts, const std::vector<Mat> &rights, const PushbroomStereoState &state, int frames, const std::vector<int> &thread_counts, std::string label) {
+
+    struct PipelineSetup {
+        std::string name;
+        bool work_stealing;
+        bool fused_strips;
+        int threads;
+    };
+
+    std::vector<PipelineSetup> setups;
+
+    PipelineSetup thread_pool = { "thread_pool", false, false, NUM_THREADS };
+    setups.push_back(thread_pool);
+
+    for (unsigned int t = 0; t < thread_counts.size(); t++) {
+
+        int threads = thread_counts[t] > 0 ? thread_counts[t] : (int)std::thread::hardware_concurrency();
+
+        // "0" can be the same as a count that was asked for
+        bool duplicate = false;
+
+        for (unsigned int k = 1; k < setups.size(); k++) {
+            if (setups[k].threads == threads) {
+                duplicate = true;
+            }
+        }
+
+        if (duplicate) {
+            continue;
+        }
+
+        PipelineSetup work_stealing = { "work_stealing", true, false, threads };
+        PipelineSetup fused_strips = { "fused_strips", true, true, threads };
+
+        setups.push_back(work_stealing);
+        setups.push_back(fused_strips);
+    }
+
+    int num_frames = lefts.size();
+
+    // the first pass over the frames starts threads and allocates
+    int warm_up = std::max(10, num_frames);
+
+    std::vector<LatencyHistogram> histograms;
+    std::vector<std::vector<cv::vector<Point3f> > > frame_points(setups.size());
+
+    int mismatches = 0;
+    int hits = 0;
+
+    for (unsigned int k = 0; k < setups.size(); k++) {
+
+        char name[64];
+        sprintf(name, "%s x%d", setups[k].name.c_str(), setups[k].threads);
+        histograms.push_back(LatencyHistogram(name));
+
+        PushbroomStereo pushbroom_stereo;
+        pushbroom_stereo.SetUseWorkStealing(setups[k].work_stealing);
+        pushbroom_stereo.SetUseFusedStrips(setups[k].fused_strips);
+        pushbroom_stereo.SetNumWorkStealingThreads(setups[k].threads);
+
+        frame_points[k].resize(num_frames);
+
+        for (int n = -warm_up; n < frames; n++) {
+
+            int f = (n + warm_up) % num_frames;
+
+            PushbroomHits hits;
+
+            double start = GetSeconds();
+
+            pushbroom_stereo.ProcessImages(lefts[f], rights[f], state, &hits);
+
+            if (n >= 0) {
+                histograms[k].Add((GetSeconds() - start) * 1000.0);
+            } else if (n + warm_up < num_frames) {
+                frame_points[k][f].clear();
+
+                for (int i = 0; i < hits.count; i++) {
+                    frame_points[k][f].push_back(Point3f(hits.x[i], hits.y[i], hits.z[i]));
+                }
+            }
+        }
+
+        int setup_mismatches = 0;
+
+        for (int f = 0; f < num_frames; f++) {
+
+            const cv::vector<Point3f> &expected = frame_points[0][f];
+            const cv::vector<Point3f> &points = frame_points[k][f];
+
+            if (k == 0) {
+                hits += expected.size();
+            }
+
+            if (expected.size() != points.size()) {
+                setup_mismatches ++;
+                continue;
+            }
+
+            for (unsigned int i = 0; i < expected.size(); i++) {
+                if (expected[i].x != points[i].x || expected[i].y != points[i].y) {
+                    setup_mismatches ++;
+                    break;
+                }
+            }
+        }
+
+        if (setup_mismatches > 0) {
+            mismatches ++;
+        }
+
+        char result_name[128];
+        sprintf(result_name, "process_images/%s/%s/threads:%d", label.c_str(), setups[k].name.c_str(), setups[k].threads);
+
+        AddResult(result_name, histograms[k], setup_mismatches);
+    }
+
+    printf("\nfull pipeline, %s frames, %d frames (%d hits per frame, schedulers %s):\n",
+        label.c_str(), frames, hits / num_frames, mismatches > 0 ? "DISAGREE" : "agree");
+
+    for (unsigned int k = 0; k < setups.size(); k++) {
+        histograms[k].PrintSummary();
+    }
+
+    for (unsigned int k = 0; k < setups.size(); k++) {
+        printf("\n");
+        histograms[k].Print();
+    }
+
+    return mismatches;
+}
+
+/**
+ * Times ProcessImages searching 1 to max_disparities disparities in one
+ * call, against running a separate single-disparity call for each.
+ *
+ * @retval number of disparity counts where the two found different hits
+ */
+static int RunDisparityBenchmark(const BenchmarkImages &images, int block_size, int disparity, int frames, int max_disparities) {
+
+    Mat left, right;
+    PushbroomStereoState state;
+    SetUpPipeline(images, block_size, disparity, &left, &right, &state);
+
+    PushbroomStereo pushbroom_stereo;
+
+    // step away from the main disparity, toward zero if there is more
+    // room that way
+    int step = disparity < 0 ? 2 : -2;
+
+    printf("\nmultiple disparities, %d frames each (ms per frame):\n", frames);
+    printf("  disparities   one call   separate calls   per extra disparity   hits\n");
+
+    double one_disparity_ms = 0;
+    int mismatches = 0;
+
+    for (int n = 1; n <= max_disparities; n++) {
+
+        state.extra_disparities.clear();
+        for (int k = 1; k < n; k++) {
+            state.extra_disparities.push_back(disparity + k * step);
+        }
+
+        LatencyHistogram combined("combined"), separate("separate");
+        int combined_hits = 0, separate_hits = 0;
+
+        for (int f = -5; f < frames; f++) {
+
+            cv::vector<Point3f> points3d;
+            cv::vector<uchar> colors;
+            cv::vector<Point3i> points2d;
+
+            double start = GetSeconds();
+
+            pushbroom_stereo.ProcessImages(left, right, &points3d, &colors, &points2d, state);
+
+            double middle = GetSeconds();
+
+            int hits = 0;
+
+            for (int k = 0; k < n; k++) {
+
+                PushbroomStereoState single_state = state;
+                single_state.disparity = disparity + k * step;
+                single_state.extra_disparities.clear();
+
+                cv::vector<Point3f> single_points3d;
+                cv::vector<uchar> single_colors;
+                cv::vector<Point3i> single_points2d;
+
+                pushbroom_stereo.ProcessImages(left, right, &single_points3d, &single_colors, &single_points2d, single_state);
+
+                hits += single_points3d.size();
+            }
+
+            double end = GetSeconds();
+
+            // the first few frames start threads and allocate
+            if (f >= 0) {
+                combined.Add((middle - start) * 1000.0);
+                separate.Add((end - middle) * 1000.0);
+            } else {
+                combined_hits = points3d.size();
+                separate_hits = hits;
+            }
+        }
+
+        if (n == 1) {
+            one_disparity_ms = combined.GetMean();
+        }
+
+        if (combined_hits != separate_hits) {
+            mismatches ++;
+        }
+
+        char result_name[128];
+
+        sprintf(result_name, "process_images/disparities:%d/one_call", n);
+        AddResult(result_name, combined, combined_hits != separate_hits ? 1 : 0);
+
+        sprintf(result_name, "process_images/disparities:%d/separate_calls", n);
+        AddResult(result_name, separate);
+
+        printf("  %11d   %8.3f   %14.3f   %19.3f   %d%s\n", n, combined.GetMean(), separate.GetMean(),
+            n > 1 ? (combined.GetMean() - one_disparity_ms) / (n - 1) : 0.0, combined_hits,
+            combined_hits != separate_hits ? " (MISMATCH)" : "");
+    }
+
+    return mismatches;
+}
+
+/**
+ * Plays a stereo log from end to end, then back again, and prints the frame
+ * rate.  Touches every row of each image so that mapped frames have to
+ * come in from the disk too.
+ *
+ * @param reader open log
+ * @param mapped true to use MapFrames, false to use ReadFrames
+ * @param record false to leave the times out of the results
+ *
+ * @retval sum of the first pixel of every row, to compare between the two
+ */
+static long PlayStereoLog(StereoLogReader *reader, bool mapped, bool record = true) {
+
+    long checksum = 0;
+
+    const char *directions[] = { "forwards", "backwards" };
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        int first = reader->GetFirstFrameNumber();
+        int last = reader->GetLastFrameNumber();
+        int num_played = 0;
+
+        double start = GetSeconds();
+
+        for (int n = first; n <= last; n++) {
+            int frame_number = pass == 0 ? n : first + last - n;
+
+            Mat left, right;
+
+            bool ok = mapped ? reader->MapFrames(frame_number, &left, &right)
+                : reader->ReadFrames(frame_number, &left, &right);
+
+            if (ok == false) {
+                continue;
+            }
+
+            for (int row = 0; row < left.rows; row++) {
+                checksum += left.at<uchar>(row, 0) + right.at<uchar>(row, 0);
+            }
+
+            num_played ++;
+        }
+
+        double elapsed = GetSeconds() - start;
+
+        printf("  %-6s %-9s  %6d frames  %10.1f frames/sec\n", mapped ? "mapped" : "read",
+            directions[pass], num_played, num_played / elapsed);
+
+        if (record) {
+            AddResult(std::string("playback/") + (mapped ? "mapped/" : "read/") + directions[pass],
+                num_played, elapsed / std::max(num_played, 1) * 1e6, "us");
+        }
+    }
+
+    return checksum;
+}
+
+/**
+ * Times playing back a stereo log from the memory mapping against reading
+ * every frame into new images.  The first time through brings the file into
+ * the page cache, so it's printed on its own and both timed runs start
+ * warm.
+ *
+ * @retval 1 if the two ways of playing it back saw different images
+ */
+static int RunPlaybackBenchmark(std::string log_file) {
+
+    StereoLogReader reader;
+
+    if (reader.Open(log_file) == false) {
+        return 1;
+    }
+
+    printf("\nplayback of %s (%d frames%s):\n", log_file.c_str(), reader.GetNumFrames(),
+        reader.IsMapped() ? "" : ", NOT MAPPED");
+
+    PlayStereoLog(&reader, false, false);
+
+    printf("\n");
+
+    long read_checksum = PlayStereoLog(&reader, false);
+    long mapped_checksum = PlayStereoLog(&reader, true);
+
+    if (read_checksum != mapped_checksum) {
+        printf("  MISMATCH: checksum %ld read, %ld mapped\n", read_checksum, mapped_checksum);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a comma-separated list of thread counts, like "1,2,4,0".
+ *
+ * @retval false if something in the list isn't a count
+ */
+static bool ParseThreadCounts(std::string text, std::vector<int> *counts) {
+
+    const char *position = text.c_str();
+
+    while (*position != '\0') {
+        char *end;
+        long count = strtol(position, &end, 10);
+
+        if (end == position || count < 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Error: \"%s\" is not a list of thread counts.\n", text.c_str());
+            return false;
+        }
+
+        counts->push_back(count);
+        position = *end == ',' ? end + 1 : end;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+
+    int rows = 240;
+    int cols = 376;
+    int block_size = 5;
+    int disparity = -105;
+    int iterations = 2000;
+    int frames = 500;
+    int max_disparities = 8;
+    int disparity_frames = 100;
+    std::string log_file = "";
+    std::string left_image = "", right_image = "";
+    std::string calibration_dir = "";
+    int recorded_frames = 10;
+    int stage_iterations = 20;
+    std::string threads = "1,2,4,0";
+    std::string json_file = "";
+
+    ConciseArgs parser(argc, argv);
+    parser.add(rows, "r", "rows", "Image height.");
+    parser.add(cols, "c", "cols", "Image width.");
+    parser.add(block_size, "b", "block-size", "SAD block size.");
+    parser.add(disparity, "d", "disparity", "Disparity to search at.");
+    parser.add(iterations, "n", "iterations", "Number of passes over the image for each kernel.");
+    parser.add(frames, "f", "frames", "Number of frames to run through the full pipeline with each scheduler (0 to skip).");
+    parser.add(max_disparities, "D", "max-disparities", "Largest number of disparities to time searching in one call (0 to skip).");
+    parser.add(disparity_frames, "m", "disparity-frames", "Number of frames for each number of disparities.");
+    parser.add(log_file, "l", "log-file", "Stereo log to time playing back, and to take recorded frames from.");
+    parser.add(recorded_frames, "k", "recorded-frames", "Number of frames to take from the stereo log, spread through it.");
+    parser.add(left_image, "L", "left-image", "Recorded left image to run on instead of frames from the stereo log.");
+    parser.add(right_image, "R", "right-image", "Recorded right image, only for use with the -L option.");
+    parser.add(calibration_dir, "C", "calibration-dir", "Calibration to rectify recorded frames with (default is no rectification).");
+    parser.add(stage_iterations, "s", "stage-iterations", "Number of passes over the frames when timing each stage on its own (0 to skip).");
+    parser.add(threads, "t", "threads", "Comma-separated thread counts for the work-stealing schedulers (0 for one per core).");
+    parser.add(json_file, "j", "json", "Also write the results to this file as JSON (Google Benchmark format).");
+    parser.parse();
+
+    if ((left_image == "") != (right_image == "")) {
+        fprintf(stderr, "Error: recorded images need both a left (-L) and a right (-R) image.\n");
+        return -1;
+    }
+
+    std::vector<int> thread_counts;
+
+    if (ParseThreadCounts(threads, &thread_counts) == false) {
+        return -1;
+    }
+
+    BenchmarkContext context;
+    context.executable = argv[0];
+    context.frames = "random";
+    context.calibration_dir = calibration_dir;
+    context.rows = rows;
+    context.cols = cols;
+    context.block_size = block_size;
+    context.disparity = disparity;
+
+    if (block_size < 1 || block_size > SAD_KERNEL_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Error: block size must be between 1 and %d.\n", SAD_KERNEL_MAX_BLOCK_SIZE);
+        return -1;
+    }
+
+    if (abs(disparity) + block_size >= cols) {
+        fprintf(stderr, "Error: disparity is too large for the image.\n");
+        return -1;
+    }
+
+    BenchmarkImages images;
+    images.rows = rows;
+    images.cols = cols;
+    images.step = cols + IMAGE_PADDING;
+
+    images.left.resize(rows * images.step);
+    images.right.resize(rows * images.step);
+    images.laplacian_left.resize(rows * images.step);
+    images.laplacian_right.resize(rows * images.step);
+
+    std::default_random_engine rand_engine(42);
+    FillRandom(&images.left, &rand_engine);
+    FillRandom(&images.right, &rand_engine);
+    FillRandom(&images.laplacian_left, &rand_engine);
+    FillRandom(&images.laplacian_right, &rand_engine);
+
+    printf("%dx%d image, block size = %d, disparity = %d, %d iterations\n", cols, rows, block_size, disparity, iterations);
+    printf("best kernel for this CPU: %s\n\n", GetSadKernelName(GetBestSadKernelType()));
+
+    SadKernelType types[] = { SAD_KERNEL_SCALAR, SAD_KERNEL_SSE, SAD_KERNEL_AVX2 };
+
+    double scalar_ns = -1;
+    int return_value = 0;
+
+    for (unsigned int k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+
+        SadKernel kernel = GetSadKernel(types[k]);
+
+        if (kernel == NULL) {
+            printf("%-8s not supported on this CPU\n", GetSadKernelName(types[k]));
+            continue;
+        }
+
+        int mismatches = CompareToScalar(kernel, images, block_size, disparity);
+
+        if (mismatches > 0) {
+            return_value = -1;
+        }
+
+        long checksum = 0;
+        long num_blocks = 0;
+
+        double start = GetSeconds();
+
+        for (int n = 0; n < iterations; n++) {
+            num_blocks += RunKernelOverImage(kernel, images, block_size, disparity, &checksum);
+        }
+
+        double elapsed = GetSeconds() - start;
+        double ns_per_block = elapsed / num_blocks * 1e9;
+
+        if (types[k] == SAD_KERNEL_SCALAR) {
+            scalar_ns = ns_per_block;
+        }
+
+        printf("%-8s %8.2f ns/block  %8.3f ms/frame  %5.2fx  (checksum %ld, %d mismatches)\n",
+            GetSadKernelName(types[k]), ns_per_block, elapsed / iterations * 1000.0,
+            scalar_ns / ns_per_block, checksum, mismatches);
+
+        AddResult(std::string("sad_kernel/") + GetSadKernelName(types[k]), num_blocks, ns_per_block, "ns", mismatches);
+    }
+
+    printf("\nstrip kernels (speedup is relative to the scalar per-block kernel):\n");
+
+    for (unsigned int k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+
+        SadStripKernel kernel = GetSadStripKernel(types[k]);
+
+        if (kernel == NULL) {
+            printf("%-8s not supported on this CPU\n", GetSadKernelName(types[k]));
+            continue;
+        }
+
+        int mismatches = 0;
+        long checksum = 0;
+
+        RunStripKernelOverImage(kernel, images, block_size, disparity, &checksum, &mismatches);
+
+        if (mismatches > 0) {
+            return_value = -1;
+        }
+
+        long num_blocks = 0;
+
+        double start = GetSeconds();
+
+        for (int n = 0; n < iterations; n++) {
+            num_blocks += RunStripKernelOverImage(kernel, images, block_size, disparity, &checksum, NULL);
+        }
+
+        double elapsed = GetSeconds() - start;
+        double ns_per_block = elapsed / num_blocks * 1e9;
+
+        printf("%-8s %8.2f ns/block  %8.3f ms/frame  %5.2fx  (checksum %ld, %d mismatches)\n",
+            GetSadKernelName(types[k]), ns_per_block, elapsed / iterations * 1000.0,
+            scalar_ns / ns_per_block, checksum, mismatches);
+
+        AddResult(std::string("sad_strip_kernel/") + GetSadKernelName(types[k]), num_blocks, ns_per_block, "ns", mismatches);
+    }
+
+    // the stages and the whole pipeline run on recorded frames if we have
+    // them, otherwise on the random images with planted matches
+    std::vector<Mat> lefts, rights;
+    PushbroomStereoState state;
+    std::string label = "recorded";
+
+    if (LoadRecordedFrames(left_image, right_image, log_file, recorded_frames, &lefts, &rights) == false) {
+        return -1;
+    }
+
+    if (lefts.size() > 0) {
+        SetUpState(lefts[0].rows, lefts[0].cols, block_size, disparity, &state);
+
+        context.frames = left_image != "" ? left_image + "," + right_image : log_file;
+    } else {
+        Mat left, right;
+        SetUpPipeline(images, block_size, disparity, &left, &right, &state);
+
+        lefts.push_back(left);
+        rights.push_back(right);
+        label = "random";
+    }
+
+    if (calibration_dir != "") {
+        OpenCvStereoCalibration calibration;
+
+        if (LoadCalibration(calibration_dir, &calibration) != true) {
+            fprintf(stderr, "Error: failed to read calibration from %s\n", calibration_dir.c_str());
+            return -1;
+        }
+
+        if (calibration.mx1fp.size() != lefts[0].size()) {
+            fprintf(stderr, "Error: calibration is for %dx%d images, but the frames are %dx%d.\n",
+                calibration.mx1fp.cols, calibration.mx1fp.rows, lefts[0].cols, lefts[0].rows);
+            return -1;
+        }
+
+        state.mapxL = calibration.mx1fp;
+        state.mapxR = calibration.mx2fp;
+        state.remapTableL = calibration.mx1Table;
+        state.remapTableR = calibration.mx2Table;
+        state.Q = calibration.qMat;
+    }
+
+    context.rows = lefts[0].rows;
+    context.cols = lefts[0].cols;
+
+    if (abs(disparity) + block_size >= lefts[0].cols) {
+        fprintf(stderr, "Error: disparity is too large for the frames.\n");
+        return -1;
+    }
+
+    if (stage_iterations > 0) {
+        RunStageBenchmark(lefts, rights, state, stage_iterations, label);
+    }
+
+    if (frames > 0 && RunPipelineBenchmark(lefts, rights, state, frames, thread_counts, label) > 0) {
+        return_value = -1;
+    }
+
+    if (max_disparities > 0 && disparity_frames > 0
+        && RunDisparityBenchmark(images, block_size, disparity, disparity_frames, max_disparities) > 0) {
+
+        return_value = -1;
+    }
+
+    if (log_file != "" && RunPlaybackBenchmark(log_file) > 0) {
+        return_value = -1;
+    }
+
+    if (json_file != "") {
+        if (WriteJson(json_file, context) == false) {
+            return -1;
+        }
+
+        printf("\nWrote %s\n", json_file.c_str());
+    }
+
+    return return_value;
+}
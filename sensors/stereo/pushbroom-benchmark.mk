@@ -0,0 +1,5 @@
+TARGET = pushbroom-benchmark
+SOURCES = pushbroom-benchmark.cpp opencv-stereo-util.cpp pushbroom-stereo.cpp StageTimer.cpp pushbroom-kernels.cpp WorkStealingPool.cpp LatencyHistogram.cpp RemapTable.cpp StereoLog.cpp ../../externals/jpeg-utils/jpeg-utils.c ../../utils/utils/RealtimeUtils.cpp
+
+# include a standard makefile that uses these variables and builds everything
+include ../../utils/make/flight.mk
@@ -0,0 +1,652 @@
+/**
+ * Vectorized inner-loop kernels for pushbroom stereo.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include "pushbroom-kernels.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define PUSHBROOM_KERNELS_X86 1
+    #include <immintrin.h>
+#endif
+
+#ifdef USE_NEON
+    #include <arm_neon.h>
+#endif
+
+// sliding window into this array gives a mask with the first
+// block_size bytes set, so we can load a full register per row and
+// throw away the pixels that aren't in the block
+static const uint8_t row_mask_table[2*SAD_KERNEL_MAX_BLOCK_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0 };
+
+/**
+ * Reference implementation.  This is exactly the loop that
+ * PushbroomStereo::GetSAD has always run.
+ */
+void SadBlockScalar(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest) {
+
+    int sad_sum = 0, left_sum = 0, right_sum = 0;
+
+    for (int i = 0; i < block_size; i++) {
+        const uint8_t *this_rowL = left + i*step;
+        const uint8_t *this_rowR = right + i*step;
+        const uint8_t *this_row_laplacianL = laplacian_left + i*step;
+        const uint8_t *this_row_laplacianR = laplacian_right + i*step;
+
+        for (int j = 0; j < block_size; j++) {
+            left_sum += this_row_laplacianL[j];
+            right_sum += this_row_laplacianR[j];
+
+            sad_sum += abs(this_rowL[j] - this_rowR[j]);
+        }
+    }
+
+    *sad = sad_sum;
+    *left_interest = left_sum;
+    *right_interest = right_sum;
+}
+
+/**
+ * Reference implementation of the strip kernel.
+ */
+void SadStripScalar(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns) {
+
+    for (int j = 0; j < width; j++) {
+        sad_columns[j] = 0;
+        left_interest_columns[j] = 0;
+        right_interest_columns[j] = 0;
+    }
+
+    for (int i = 0; i < block_size; i++) {
+        const uint8_t *this_rowL = left + i*step;
+        const uint8_t *this_rowR = right + i*step;
+        const uint8_t *this_row_laplacianL = laplacian_left + i*step;
+        const uint8_t *this_row_laplacianR = laplacian_right + i*step;
+
+        for (int j = 0; j < width; j++) {
+            left_interest_columns[j] += this_row_laplacianL[j];
+            right_interest_columns[j] += this_row_laplacianR[j];
+
+            sad_columns[j] += abs(this_rowL[j] - this_rowR[j]);
+        }
+    }
+}
+
+/**
+ * Finishes the columns that the vector kernels didn't get to.
+ */
+static inline void SadStripTail(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int start, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns) {
+
+    if (start < width) {
+        SadStripScalar(left + start, right + start, laplacian_left + start,
+            laplacian_right + start, step, block_size, width - start,
+            sad_columns + start, left_interest_columns + start,
+            right_interest_columns + start);
+    }
+}
+
+/**
+ * Reference implementation of the shifted SAD kernel.
+ */
+void ShiftedSadScalar(const uint8_t *left, size_t left_step,
+    const uint8_t *right, size_t right_step, int block_size, uint16_t *sads) {
+
+    for (int shift = 0; shift < SHIFTED_SAD_KERNEL_SHIFTS; shift++) {
+        sads[shift] = 0;
+    }
+
+    for (int i = 0; i < block_size; i++) {
+        const uint8_t *this_rowL = left + i*left_step;
+        const uint8_t *this_rowR = right + i*right_step;
+
+        for (int j = 0; j < block_size; j++) {
+            for (int shift = 0; shift < SHIFTED_SAD_KERNEL_SHIFTS; shift++) {
+                sads[shift] += abs(this_rowL[j] - this_rowR[j + shift]);
+            }
+        }
+    }
+}
+
+#ifdef PUSHBROOM_KERNELS_X86
+
+__attribute__((target("sse2")))
+static inline __m128i LoadRowMask(int block_size) {
+    return _mm_loadu_si128((const __m128i*)(row_mask_table + SAD_KERNEL_MAX_BLOCK_SIZE - block_size));
+}
+
+__attribute__((target("sse2")))
+static inline int HorizontalSum(__m128i sums) {
+    // psadbw leaves two 64-bit partial sums, one in each half
+    return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+}
+
+/**
+ * SSE version.  psadbw does the absolute difference and the horizontal
+ * sum for an entire block row in one instruction.  The interest operator
+ * sums use the same instruction against zero.
+ */
+__attribute__((target("sse2")))
+static void SadBlockSse(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest) {
+
+    __m128i mask = LoadRowMask(block_size);
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i sad_sum = zero, left_sum = zero, right_sum = zero;
+
+    for (int i = 0; i < block_size; i++) {
+        size_t offset = i*step;
+
+        __m128i row_L = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(left + offset)));
+        __m128i row_R = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(right + offset)));
+
+        __m128i interest_L = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(laplacian_left + offset)));
+        __m128i interest_R = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(laplacian_right + offset)));
+
+        sad_sum = _mm_add_epi64(sad_sum, _mm_sad_epu8(row_L, row_R));
+        left_sum = _mm_add_epi64(left_sum, _mm_sad_epu8(interest_L, zero));
+        right_sum = _mm_add_epi64(right_sum, _mm_sad_epu8(interest_R, zero));
+    }
+
+    *sad = HorizontalSum(sad_sum);
+    *left_interest = HorizontalSum(left_sum);
+    *right_interest = HorizontalSum(right_sum);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i LoadTwoRows(const uint8_t *row, size_t step) {
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)row)),
+        _mm_loadu_si128((const __m128i*)(row + step)), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i FoldHalves(__m256i sums) {
+    return _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+/**
+ * AVX2 version.  Same idea as the SSE version, but packs two block rows
+ * into each register so a 5x5 block takes three iterations instead of five.
+ */
+__attribute__((target("avx2")))
+static void SadBlockAvx2(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest) {
+
+    __m128i mask = LoadRowMask(block_size);
+    __m256i mask2 = _mm256_broadcastsi128_si256(mask);
+    __m256i zero = _mm256_setzero_si256();
+
+    __m256i sad_sum = zero, left_sum = zero, right_sum = zero;
+
+    int i = 0;
+    for (; i + 1 < block_size; i += 2) {
+        size_t offset = i*step;
+
+        __m256i rows_L = _mm256_and_si256(mask2, LoadTwoRows(left + offset, step));
+        __m256i rows_R = _mm256_and_si256(mask2, LoadTwoRows(right + offset, step));
+
+        __m256i interest_L = _mm256_and_si256(mask2, LoadTwoRows(laplacian_left + offset, step));
+        __m256i interest_R = _mm256_and_si256(mask2, LoadTwoRows(laplacian_right + offset, step));
+
+        sad_sum = _mm256_add_epi64(sad_sum, _mm256_sad_epu8(rows_L, rows_R));
+        left_sum = _mm256_add_epi64(left_sum, _mm256_sad_epu8(interest_L, zero));
+        right_sum = _mm256_add_epi64(right_sum, _mm256_sad_epu8(interest_R, zero));
+    }
+
+    __m128i sad_sum_128 = FoldHalves(sad_sum);
+    __m128i left_sum_128 = FoldHalves(left_sum);
+    __m128i right_sum_128 = FoldHalves(right_sum);
+
+    if (i < block_size) {
+        // odd block size, pick up the last row
+        size_t offset = i*step;
+        __m128i zero_128 = _mm_setzero_si128();
+
+        __m128i row_L = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(left + offset)));
+        __m128i row_R = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(right + offset)));
+
+        __m128i interest_L = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(laplacian_left + offset)));
+        __m128i interest_R = _mm_and_si128(mask, _mm_loadu_si128((const __m128i*)(laplacian_right + offset)));
+
+        sad_sum_128 = _mm_add_epi64(sad_sum_128, _mm_sad_epu8(row_L, row_R));
+        left_sum_128 = _mm_add_epi64(left_sum_128, _mm_sad_epu8(interest_L, zero_128));
+        right_sum_128 = _mm_add_epi64(right_sum_128, _mm_sad_epu8(interest_R, zero_128));
+    }
+
+    *sad = HorizontalSum(sad_sum_128);
+    *left_interest = HorizontalSum(left_sum_128);
+    *right_interest = HorizontalSum(right_sum_128);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i AbsDiff(__m128i a, __m128i b) {
+    // saturating subtract both ways, one of them is zero
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+/**
+ * SSE strip kernel.  Does 16 columns at a time, widening to 16 bits so
+ * the column sums can't overflow for any block size we support.
+ */
+__attribute__((target("sse2")))
+static void SadStripSse(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns) {
+
+    __m128i zero = _mm_setzero_si128();
+
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+
+        __m128i sad_lo = zero, sad_hi = zero;
+        __m128i left_lo = zero, left_hi = zero;
+        __m128i right_lo = zero, right_hi = zero;
+
+        for (int i = 0; i < block_size; i++) {
+            size_t offset = i*step + j;
+
+            __m128i diff = AbsDiff(_mm_loadu_si128((const __m128i*)(left + offset)),
+                _mm_loadu_si128((const __m128i*)(right + offset)));
+
+            __m128i interest_L = _mm_loadu_si128((const __m128i*)(laplacian_left + offset));
+            __m128i interest_R = _mm_loadu_si128((const __m128i*)(laplacian_right + offset));
+
+            sad_lo = _mm_add_epi16(sad_lo, _mm_unpacklo_epi8(diff, zero));
+            sad_hi = _mm_add_epi16(sad_hi, _mm_unpackhi_epi8(diff, zero));
+
+            left_lo = _mm_add_epi16(left_lo, _mm_unpacklo_epi8(interest_L, zero));
+            left_hi = _mm_add_epi16(left_hi, _mm_unpackhi_epi8(interest_L, zero));
+
+            right_lo = _mm_add_epi16(right_lo, _mm_unpacklo_epi8(interest_R, zero));
+            right_hi = _mm_add_epi16(right_hi, _mm_unpackhi_epi8(interest_R, zero));
+        }
+
+        _mm_storeu_si128((__m128i*)(sad_columns + j), sad_lo);
+        _mm_storeu_si128((__m128i*)(sad_columns + j + 8), sad_hi);
+        _mm_storeu_si128((__m128i*)(left_interest_columns + j), left_lo);
+        _mm_storeu_si128((__m128i*)(left_interest_columns + j + 8), left_hi);
+        _mm_storeu_si128((__m128i*)(right_interest_columns + j), right_lo);
+        _mm_storeu_si128((__m128i*)(right_interest_columns + j + 8), right_hi);
+    }
+
+    SadStripTail(left, right, laplacian_left, laplacian_right, step, block_size,
+        j, width, sad_columns, left_interest_columns, right_interest_columns);
+}
+
+/**
+ * AVX2 strip kernel, 32 columns at a time.  We widen each 128-bit half
+ * separately (instead of unpacklo/hi, which work within each half) so the
+ * columns come out in order.
+ */
+__attribute__((target("avx2")))
+static void SadStripAvx2(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns) {
+
+    __m256i zero = _mm256_setzero_si256();
+
+    int j = 0;
+    for (; j + 32 <= width; j += 32) {
+
+        __m256i sad_lo = zero, sad_hi = zero;
+        __m256i left_lo = zero, left_hi = zero;
+        __m256i right_lo = zero, right_hi = zero;
+
+        for (int i = 0; i < block_size; i++) {
+            size_t offset = i*step + j;
+
+            __m256i row_L = _mm256_loadu_si256((const __m256i*)(left + offset));
+            __m256i row_R = _mm256_loadu_si256((const __m256i*)(right + offset));
+
+            __m256i diff = _mm256_sub_epi8(_mm256_max_epu8(row_L, row_R), _mm256_min_epu8(row_L, row_R));
+
+            __m256i interest_L = _mm256_loadu_si256((const __m256i*)(laplacian_left + offset));
+            __m256i interest_R = _mm256_loadu_si256((const __m256i*)(laplacian_right + offset));
+
+            sad_lo = _mm256_add_epi16(sad_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(diff)));
+            sad_hi = _mm256_add_epi16(sad_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(diff, 1)));
+
+            left_lo = _mm256_add_epi16(left_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(interest_L)));
+            left_hi = _mm256_add_epi16(left_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(interest_L, 1)));
+
+            right_lo = _mm256_add_epi16(right_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(interest_R)));
+            right_hi = _mm256_add_epi16(right_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(interest_R, 1)));
+        }
+
+        _mm256_storeu_si256((__m256i*)(sad_columns + j), sad_lo);
+        _mm256_storeu_si256((__m256i*)(sad_columns + j + 16), sad_hi);
+        _mm256_storeu_si256((__m256i*)(left_interest_columns + j), left_lo);
+        _mm256_storeu_si256((__m256i*)(left_interest_columns + j + 16), left_hi);
+        _mm256_storeu_si256((__m256i*)(right_interest_columns + j), right_lo);
+        _mm256_storeu_si256((__m256i*)(right_interest_columns + j + 16), right_hi);
+    }
+
+    // the SSE kernel picks up the remaining 16 columns, if any
+    SadStripSse(left + j, right + j, laplacian_left + j, laplacian_right + j,
+        step, block_size, width - j, sad_columns + j, left_interest_columns + j,
+        right_interest_columns + j);
+}
+
+/**
+ * SSE4.1 shifted SAD kernel.  mpsadbw computes the SAD of four left pixels
+ * against eight consecutive 4-pixel windows of the right row in one
+ * instruction, which is exactly the sliding window we want.  Columns left
+ * over after the groups of four are done one at a time in 16 bits.
+ */
+__attribute__((target("sse4.1")))
+static void ShiftedSadSse41(const uint8_t *left, size_t left_step,
+    const uint8_t *right, size_t right_step, int block_size, uint16_t *sads) {
+
+    __m128i sums = _mm_setzero_si128();
+
+    int groups_end = block_size - block_size % 4;
+
+    for (int i = 0; i < block_size; i++) {
+        const uint8_t *this_rowL = left + i*left_step;
+        const uint8_t *this_rowR = right + i*right_step;
+
+        for (int j = 0; j < groups_end; j += 4) {
+            int32_t left_group;
+            memcpy(&left_group, this_rowL + j, sizeof(left_group));
+
+            __m128i windows = _mm_loadu_si128((const __m128i*)(this_rowR + j));
+
+            sums = _mm_add_epi16(sums, _mm_mpsadbw_epu8(windows, _mm_cvtsi32_si128(left_group), 0));
+        }
+
+        for (int j = groups_end; j < block_size; j++) {
+            __m128i pixels_R = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(this_rowR + j)));
+            __m128i pixel_L = _mm_set1_epi16(this_rowL[j]);
+
+            sums = _mm_add_epi16(sums, _mm_sub_epi16(_mm_max_epu16(pixels_R, pixel_L), _mm_min_epu16(pixels_R, pixel_L)));
+        }
+    }
+
+    _mm_storeu_si128((__m128i*)sads, sums);
+}
+
+#endif // PUSHBROOM_KERNELS_X86
+
+#ifdef USE_NEON
+
+/**
+ * NEON block kernel.  This is the loop that used to live in GetSAD, except
+ * that it masks off the lanes past block_size so it works for any block
+ * size up to 8 instead of only 5.
+ */
+static void SadBlockNeon(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest) {
+
+    if (block_size > 8) {
+        SadBlockScalar(left, right, laplacian_left, laplacian_right, step,
+            block_size, sad, left_interest, right_interest);
+        return;
+    }
+
+    uint8x8_t mask = vld1_u8(row_mask_table + SAD_KERNEL_MAX_BLOCK_SIZE - block_size);
+
+    uint16x8_t sad_sum_8x = vdupq_n_u16(0);
+    uint16x8_t interest_op_sum_8x_L = vdupq_n_u16(0);
+    uint16x8_t interest_op_sum_8x_R = vdupq_n_u16(0);
+
+    for (int i = 0; i < block_size; i++) {
+        size_t offset = i*step;
+
+        uint8x8_t this_row_8x8_L = vand_u8(mask, vld1_u8(left + offset));
+        uint8x8_t this_row_8x8_R = vand_u8(mask, vld1_u8(right + offset));
+
+        uint8x8_t interest_op_8x8_L = vand_u8(mask, vld1_u8(laplacian_left + offset));
+        uint8x8_t interest_op_8x8_R = vand_u8(mask, vld1_u8(laplacian_right + offset));
+
+        sad_sum_8x = vaddw_u8(sad_sum_8x, vabd_u8(this_row_8x8_L, this_row_8x8_R));
+
+        interest_op_sum_8x_L = vaddw_u8(interest_op_sum_8x_L, interest_op_8x8_L);
+        interest_op_sum_8x_R = vaddw_u8(interest_op_sum_8x_R, interest_op_8x8_R);
+    }
+
+    uint64x2_t sad_64 = vpaddlq_u32(vpaddlq_u16(sad_sum_8x));
+    uint64x2_t left_64 = vpaddlq_u32(vpaddlq_u16(interest_op_sum_8x_L));
+    uint64x2_t right_64 = vpaddlq_u32(vpaddlq_u16(interest_op_sum_8x_R));
+
+    *sad = vgetq_lane_u64(sad_64, 0) + vgetq_lane_u64(sad_64, 1);
+    *left_interest = vgetq_lane_u64(left_64, 0) + vgetq_lane_u64(left_64, 1);
+    *right_interest = vgetq_lane_u64(right_64, 0) + vgetq_lane_u64(right_64, 1);
+}
+
+/**
+ * NEON strip kernel, 16 columns at a time.
+ */
+static void SadStripNeon(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns) {
+
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+
+        uint16x8_t sad_lo = vdupq_n_u16(0), sad_hi = vdupq_n_u16(0);
+        uint16x8_t left_lo = vdupq_n_u16(0), left_hi = vdupq_n_u16(0);
+        uint16x8_t right_lo = vdupq_n_u16(0), right_hi = vdupq_n_u16(0);
+
+        for (int i = 0; i < block_size; i++) {
+            size_t offset = i*step + j;
+
+            uint8x16_t diff = vabdq_u8(vld1q_u8(left + offset), vld1q_u8(right + offset));
+
+            uint8x16_t interest_L = vld1q_u8(laplacian_left + offset);
+            uint8x16_t interest_R = vld1q_u8(laplacian_right + offset);
+
+            sad_lo = vaddw_u8(sad_lo, vget_low_u8(diff));
+            sad_hi = vaddw_u8(sad_hi, vget_high_u8(diff));
+
+            left_lo = vaddw_u8(left_lo, vget_low_u8(interest_L));
+            left_hi = vaddw_u8(left_hi, vget_high_u8(interest_L));
+
+            right_lo = vaddw_u8(right_lo, vget_low_u8(interest_R));
+            right_hi = vaddw_u8(right_hi, vget_high_u8(interest_R));
+        }
+
+        vst1q_u16(sad_columns + j, sad_lo);
+        vst1q_u16(sad_columns + j + 8, sad_hi);
+        vst1q_u16(left_interest_columns + j, left_lo);
+        vst1q_u16(left_interest_columns + j + 8, left_hi);
+        vst1q_u16(right_interest_columns + j, right_lo);
+        vst1q_u16(right_interest_columns + j + 8, right_hi);
+    }
+
+    SadStripTail(left, right, laplacian_left, laplacian_right, step, block_size,
+        j, width, sad_columns, left_interest_columns, right_interest_columns);
+}
+
+/**
+ * NEON shifted SAD kernel.  Each left pixel is compared against the eight
+ * right pixels it lines up with at the eight shifts.
+ */
+static void ShiftedSadNeon(const uint8_t *left, size_t left_step,
+    const uint8_t *right, size_t right_step, int block_size, uint16_t *sads) {
+
+    uint16x8_t sums = vdupq_n_u16(0);
+
+    for (int i = 0; i < block_size; i++) {
+        const uint8_t *this_rowL = left + i*left_step;
+        const uint8_t *this_rowR = right + i*right_step;
+
+        for (int j = 0; j < block_size; j++) {
+            sums = vabal_u8(sums, vld1_u8(this_rowR + j), vdup_n_u8(this_rowL[j]));
+        }
+    }
+
+    vst1q_u16(sads, sums);
+}
+
+#endif // USE_NEON
+
+/**
+ * Returns the fastest SAD kernel type that this CPU can run.
+ */
+SadKernelType GetBestSadKernelType() {
+
+    #ifdef USE_NEON
+        return SAD_KERNEL_NEON;
+    #endif
+
+    #ifdef PUSHBROOM_KERNELS_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2")) {
+            return SAD_KERNEL_AVX2;
+        }
+
+        if (__builtin_cpu_supports("sse2")) {
+            return SAD_KERNEL_SSE;
+        }
+    #endif
+
+    return SAD_KERNEL_SCALAR;
+}
+
+/**
+ * Gets a function pointer to a specific SAD kernel.
+ *
+ * @param type kernel to get
+ *
+ * @retval the kernel or NULL if this CPU (or build) does not support it
+ */
+SadKernel GetSadKernel(SadKernelType type) {
+
+    switch (type) {
+        case SAD_KERNEL_SCALAR:
+            return SadBlockScalar;
+
+        #ifdef PUSHBROOM_KERNELS_X86
+            case SAD_KERNEL_SSE:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("sse2") ? SadBlockSse : NULL;
+
+            case SAD_KERNEL_AVX2:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") ? SadBlockAvx2 : NULL;
+        #endif
+
+        #ifdef USE_NEON
+            case SAD_KERNEL_NEON:
+                return SadBlockNeon;
+        #endif
+
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Gets a function pointer to a specific strip kernel.
+ *
+ * @param type kernel to get
+ *
+ * @retval the kernel or NULL if this CPU (or build) does not support it
+ */
+SadStripKernel GetSadStripKernel(SadKernelType type) {
+
+    switch (type) {
+        case SAD_KERNEL_SCALAR:
+            return SadStripScalar;
+
+        #ifdef PUSHBROOM_KERNELS_X86
+            case SAD_KERNEL_SSE:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("sse2") ? SadStripSse : NULL;
+
+            case SAD_KERNEL_AVX2:
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") ? SadStripAvx2 : NULL;
+        #endif
+
+        #ifdef USE_NEON
+            case SAD_KERNEL_NEON:
+                return SadStripNeon;
+        #endif
+
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Gets a function pointer to a specific shifted SAD kernel.  The x86
+ * kernel needs SSE4.1, so on older CPUs the SSE type gets the scalar
+ * version instead.
+ *
+ * @param type kernel to get
+ *
+ * @retval the kernel or NULL if this CPU (or build) does not support it
+ */
+ShiftedSadKernel GetShiftedSadKernel(SadKernelType type) {
+
+    switch (type) {
+        case SAD_KERNEL_SCALAR:
+            return ShiftedSadScalar;
+
+        #ifdef PUSHBROOM_KERNELS_X86
+            case SAD_KERNEL_SSE:
+                __builtin_cpu_init();
+                if (!__builtin_cpu_supports("sse2")) {
+                    return NULL;
+                }
+                return __builtin_cpu_supports("sse4.1") ? ShiftedSadSse41 : ShiftedSadScalar;
+
+            case SAD_KERNEL_AVX2:
+                // AVX2 implies SSE4.1
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2") ? ShiftedSadSse41 : NULL;
+        #endif
+
+        #ifdef USE_NEON
+            case SAD_KERNEL_NEON:
+                return ShiftedSadNeon;
+        #endif
+
+        default:
+            return NULL;
+    }
+}
+
+const char* GetSadKernelName(SadKernelType type) {
+    switch (type) {
+        case SAD_KERNEL_SCALAR:
+            return "scalar";
+        case SAD_KERNEL_SSE:
+            return "sse";
+        case SAD_KERNEL_AVX2:
+            return "avx2";
+        case SAD_KERNEL_NEON:
+            return "neon";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * Vectorized inner-loop kernels for pushbroom stereo.
+ *
+ * Every kernel has a scalar reference version.  On x86 we also build SSE and
+ * AVX2 versions and pick the fastest one the CPU supports at runtime, so the
+ * same binary runs on any workstation we replay logs on.  ARM builds
+ * (USE_NEON) get NEON versions instead.  All versions do
+ * integer math only and give bit-identical results.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#ifndef PUSHBROOM_KERNELS_HPP
+#define PUSHBROOM_KERNELS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SIMD kernels load this many bytes per row, so the caller must guarantee
+// that many readable bytes starting at each block's left edge
+#define SAD_KERNEL_MAX_BLOCK_SIZE 16
+
+enum SadKernelType { SAD_KERNEL_SCALAR, SAD_KERNEL_SSE, SAD_KERNEL_AVX2, SAD_KERNEL_NEON };
+
+/**
+ * Computes the sum of absolute differences and the interest operator sums
+ * for one block.
+ *
+ * @param left pointer to the top left pixel of the block in the left image
+ * @param right pointer to the top left pixel of the block in the right image
+ *      (already offset by the disparity)
+ * @param laplacian_left same position as left, in the left laplacian image
+ * @param laplacian_right same position as right, in the right laplacian image
+ * @param step row step in bytes, shared by all four images
+ * @param block_size width and height of the block
+ * @param sad output: sum of absolute differences between left and right
+ * @param left_interest output: sum of the left laplacian over the block
+ * @param right_interest output: sum of the right laplacian over the block
+ */
+typedef void (*SadKernel)(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest);
+
+/**
+ * Computes per-column sums for a whole blockSize-tall strip of the image.
+ * Summing block_size adjacent columns of the outputs gives the same numbers
+ * as running a SadKernel on that block, but the work is done in long
+ * contiguous runs instead of one short block at a time.
+ *
+ * @param left pointer to the first pixel of the strip in the left image
+ * @param right pointer to the matching pixel in the right image
+ *      (already offset by the disparity)
+ * @param laplacian_left same position as left, in the left laplacian image
+ * @param laplacian_right same position as right, in the right laplacian image
+ * @param step row step in bytes, shared by all four images
+ * @param block_size number of rows in the strip
+ * @param width number of columns to sum.  Kernels never read past this.
+ * @param sad_columns output: width sums of absolute differences
+ * @param left_interest_columns output: width sums of the left laplacian
+ * @param right_interest_columns output: width sums of the right laplacian
+ */
+typedef void (*SadStripKernel)(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns);
+
+// number of horizontal shifts a ShiftedSadKernel computes at once
+#define SHIFTED_SAD_KERNEL_SHIFTS 8
+
+// ShiftedSadKernels may read this many bytes from each right image row
+#define SHIFTED_SAD_KERNEL_RIGHT_READ (SAD_KERNEL_MAX_BLOCK_SIZE + 16)
+
+/**
+ * Computes the sum of absolute differences between one block in the left
+ * image and the same block in the right image at SHIFTED_SAD_KERNEL_SHIFTS
+ * consecutive horizontal shifts.  With a row of zeros (and left_step = 0)
+ * for the left block, this gives the sum of the right block at every shift.
+ *
+ * @param left pointer to the top left pixel of the block in the left image
+ * @param left_step row step of the left image in bytes
+ * @param right pointer to the top left pixel of the block at shift 0
+ *      in the right image.  The caller must guarantee
+ *      SHIFTED_SAD_KERNEL_RIGHT_READ readable bytes on each row.
+ * @param right_step row step of the right image in bytes
+ * @param block_size width and height of the block, at most
+ *      SAD_KERNEL_MAX_BLOCK_SIZE
+ * @param sads output: SHIFTED_SAD_KERNEL_SHIFTS sums, one for each shift
+ */
+typedef void (*ShiftedSadKernel)(const uint8_t *left, size_t left_step,
+    const uint8_t *right, size_t right_step, int block_size, uint16_t *sads);
+
+SadKernel GetSadKernel(SadKernelType type);
+
+SadStripKernel GetSadStripKernel(SadKernelType type);
+
+ShiftedSadKernel GetShiftedSadKernel(SadKernelType type);
+
+SadKernelType GetBestSadKernelType();
+
+const char* GetSadKernelName(SadKernelType type);
+
+void SadBlockScalar(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int *sad, int *left_interest,
+    int *right_interest);
+
+void SadStripScalar(const uint8_t *left, const uint8_t *right,
+    const uint8_t *laplacian_left, const uint8_t *laplacian_right,
+    size_t step, int block_size, int width, uint16_t *sad_columns,
+    uint16_t *left_interest_columns, uint16_t *right_interest_columns);
+
+void ShiftedSadScalar(const uint8_t *left, size_t left_step,
+    const uint8_t *right, size_t right_step, int block_size, uint16_t *sads);
+
+#endif
@@ -0,0 +1,249 @@
+/**
+ * Runs pushbroom stereo over recordings without the display, cameras, or
+ * LCM, spreading the frames over every core, and writes the hits to a
+ * results file.  For tuning stereo parameters over lots of flights.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "../../externals/ConciseArgs.hpp"
+#include "opencv-stereo-util.hpp"
+#include "pushbroom-stereo.hpp"
+#include "RecordingManager.hpp"
+#include "RecordingReplaySource.hpp"
+#include "BatchReplay.hpp"
+#include "ReplayResults.hpp"
+
+struct Recording {
+    string left;
+    string right; // empty for stereo logs
+};
+
+/**
+ * Finds every recording under a directory: stereo logs, and pairs of
+ * videoL / videoR AVI files or PGM directories.
+ *
+ * @param directory directory to search (including subdirectories)
+ * @param recordings output: recordings found, sorted by filename
+ */
+void FindRecordings(string directory, std::vector<Recording> *recordings) {
+
+    std::vector<string> lefts;
+
+    boost::filesystem::recursive_directory_iterator end_itr;
+    for (boost::filesystem::recursive_directory_iterator itr(directory); itr != end_itr; ++itr) {
+
+        string path = itr->path().string();
+        string filename = itr->path().filename().string();
+
+        if (boost::iends_with(filename, STEREO_LOG_EXTENSION)) {
+
+            lefts.push_back(path);
+
+        } else if (boost::starts_with(filename, "videoL")) {
+
+            bool is_avi = boost::iends_with(filename, ".avi");
+
+            if (is_avi || boost::filesystem::is_directory(itr->path())) {
+                lefts.push_back(path);
+            }
+
+            if (is_avi == false) {
+                // don't look at every PGM file
+                itr.no_push();
+            }
+        }
+    }
+
+    // filesystem order is arbitrary, so sort for the same output every time
+    std::sort(lefts.begin(), lefts.end());
+
+    for (unsigned int i = 0; i < lefts.size(); i++) {
+        Recording recording;
+        recording.left = lefts[i];
+
+        if (boost::iends_with(lefts[i], STEREO_LOG_EXTENSION) == false) {
+            boost::filesystem::path left_path(lefts[i]);
+
+            string right_filename = left_path.filename().string();
+            right_filename.replace(0, strlen("videoL"), "videoR");
+
+            recording.right = (left_path.parent_path() / right_filename).string();
+
+            if (boost::filesystem::exists(recording.right) == false) {
+                cerr << "Warning: no right video for " << recording.left << ", skipping." << endl;
+                continue;
+            }
+        }
+
+        recordings->push_back(recording);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    string config_file = "";
+    string video_file_left = "", video_file_right = "", video_directory = "";
+    string results_file = "";
+    int num_workers = 0;
+    int sad_threshold = -1;
+    int sobel_limit = -1;
+    bool quiet_mode = false;
+
+    ConciseArgs parser(argc, argv);
+    parser.add(config_file, "c", "config", "Configuration file with the stereo parameters and calibration.", true);
+    parser.add(video_file_left, "l", "video-file-left", "Recording to replay (also requires a right video file, unless this is a .slog recording).");
+    parser.add(video_file_right, "t", "video-file-right", "Right video file, only for use with the -l option.");
+    parser.add(video_directory, "i", "video-directory", "Replay every recording in this directory and the directories under it.");
+    parser.add(results_file, "o", "output", "File to write the hits to.", true);
+    parser.add(num_workers, "j", "jobs", "Number of frames to run at once (0 for one per core).");
+    parser.add(sad_threshold, "S", "sad-threshold", "Use this SAD threshold instead of the one in the configuration file.");
+    parser.add(sobel_limit, "I", "sobel-limit", "Use this interest operator limit instead of the one in the configuration file.");
+    parser.add(quiet_mode, "q", "quiet", "Reduce text output.");
+    parser.parse();
+
+    OpenCvStereoConfig stereo_config;
+
+    if (ParseConfigFile(config_file, &stereo_config) != true) {
+        fprintf(stderr, "Failed to parse configuration file, quitting.\n");
+        return -1;
+    }
+
+    std::vector<Recording> recordings;
+
+    if (video_file_left.length() > 0) {
+
+        if (video_file_right.length() <= 0
+            && !boost::iends_with(video_file_left, STEREO_LOG_EXTENSION)) {
+
+            fprintf(stderr, "Error: for playback you must specify both "
+                "a right and left video file. (Only got a left one.)\n");
+
+            return -1;
+        }
+
+        Recording recording;
+        recording.left = video_file_left;
+        recording.right = video_file_right;
+        recordings.push_back(recording);
+    }
+
+    if (video_directory.length() > 0) {
+        if (!boost::filesystem::is_directory(video_directory)) {
+            fprintf(stderr, "Error: %s is not a directory.\n", video_directory.c_str());
+            return -1;
+        }
+
+        FindRecordings(video_directory, &recordings);
+    }
+
+    if (recordings.size() == 0) {
+        fprintf(stderr, "Error: no recordings to replay (use -l or -i).\n");
+        return -1;
+    }
+
+    OpenCvStereoCalibration stereo_calibration;
+
+    if (LoadCalibration(stereo_config.calibrationDir, &stereo_calibration) != true) {
+        cerr << "Error: failed to read calibration files. Quitting." << endl;
+        return -1;
+    }
+
+    // tell opencv to use only one core so that we can manage our
+    // own threading without a fight
+    setNumThreads(1);
+
+    PushbroomStereoState state;
+
+    state.disparity = stereo_config.disparity;
+    state.extra_disparities = stereo_config.extraDisparities;
+    state.zero_dist_disparity = stereo_config.infiniteDisparity;
+    state.sobelLimit = sobel_limit >= 0 ? sobel_limit : stereo_config.interestOperatorLimit;
+    state.horizontalInvarianceMultiplier = stereo_config.horizontalInvarianceMultiplier;
+    state.blockSize = stereo_config.blockSize;
+    state.random_results = -1;
+    state.check_horizontal_invariance = true;
+    state.sadThreshold = sad_threshold >= 0 ? sad_threshold : stereo_config.sadThreshold;
+
+    state.mapxL = stereo_calibration.mx1fp;
+    state.mapxR = stereo_calibration.mx2fp;
+    state.remapTableL = stereo_calibration.mx1Table;
+    state.remapTableR = stereo_calibration.mx2Table;
+    state.Q = stereo_calibration.qMat;
+
+    state.lastValidPixelRow = stereo_config.lastValidPixelRow;
+
+    ReplayResultsWriter results;
+
+    if (results.Open(results_file, state) != true) {
+        return -1;
+    }
+
+    BatchReplay replay(state, num_workers);
+
+    printf("Replaying %d recording(s) on %d workers, sadThreshold = %d, sobelLimit = %d.\n",
+        (int)recordings.size(), replay.GetNumWorkers(), state.sadThreshold, state.sobelLimit);
+
+    int return_value = 0;
+
+    for (unsigned int i = 0; i < recordings.size(); i++) {
+
+        // every worker reads through its own RecordingManager
+        std::vector<RecordingManager*> recording_managers;
+        std::vector<ReplayFrameSource*> sources;
+
+        bool loaded = true;
+
+        for (int k = 0; k < replay.GetNumWorkers() && loaded; k++) {
+            RecordingManager *recording_manager = new RecordingManager();
+            recording_manager->Init(stereo_config);
+            recording_manager->SetQuietMode(true);
+
+            loaded = recording_manager->LoadVideoFiles(recordings[i].left, recordings[i].right);
+
+            recording_managers.push_back(recording_manager);
+            sources.push_back(new RecordingReplaySource(recording_manager));
+        }
+
+        if (loaded) {
+            int num_frames = recording_managers[0]->GetNumPlaybackFrames();
+
+            if (!quiet_mode) {
+                printf("%s: %d frames\n", recordings[i].left.c_str(), num_frames);
+            }
+
+            results.BeginRecording(recordings[i].left);
+
+            if (replay.Run(sources, 0, num_frames - 1, &results) != true) {
+                return_value = -1;
+            }
+        } else {
+            cerr << "Warning: failed to load " << recordings[i].left << ", skipping." << endl;
+        }
+
+        for (unsigned int k = 0; k < sources.size(); k++) {
+            delete sources[k];
+            delete recording_managers[k];
+        }
+    }
+
+    if (results.Close() != true) {
+        return_value = -1;
+    }
+
+    replay.PrintStats();
+
+    printf("Wrote %s\n", results_file.c_str());
+
+    return return_value;
+}
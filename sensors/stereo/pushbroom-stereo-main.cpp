@@ -66,6 +66,11 @@ dc1394camera_t  *camera;
 dc1394_t        *d2;
 dc1394camera_t  *camera2;
 
+StereoCapture *stereo_capture = NULL;
+
+// set by control_c_handler, the main loop shuts down when it sees it
+volatile sig_atomic_t ctrl_c_pressed = 0;
+
 OpenCvStereoConfig stereoConfig;
 
 /**
@@ -77,18 +82,10 @@ OpenCvStereoConfig stereoConfig;
  */
 void control_c_handler(int s)
 {
-    cout << endl << "exiting via ctrl-c" << endl;
-
-    if (recording_manager.UsingLiveCameras()) {
-
-        StopCapture(d, camera);
-        StopCapture(d2, camera2);
-
-        cout << "\tpress ctrl+\\ to quit while writing video." << endl;
-        recording_manager.FlushBufferToDisk();
-    }
-
-    exit(0);
+    // the main thread can be anywhere, including in the middle of taking
+    // frames from stereo_capture, so leave stopping the cameras and
+    // writing the video to it
+    ctrl_c_pressed = 1;
 }
 
 
@@ -148,6 +145,10 @@ int main(int argc, char *argv[])
     int starting_frame_number = 0;
     bool enable_gamma = false;
     float random_results = -1.0;
+    bool legacy_thread_pool = false;
+    bool fused_strips = false;
+    bool zero_copy_capture = false;
+    bool async_capture = false;
 
     int last_frame_number = -1;
 
@@ -162,7 +163,7 @@ int main(int argc, char *argv[])
     parser.add(force_brightness, "b", "force-brightness", "Force a brightness setting.");
     parser.add(force_exposure, "e", "force-exposure", "Force an exposure setting.");
     parser.add(quiet_mode, "q", "quiet", "Reduce text output.");
-    parser.add(video_file_left, "l", "video-file-left", "Do not use cameras, instead use this video file (also requires a right video file).");
+    parser.add(video_file_left, "l", "video-file-left", "Do not use cameras, instead use this video file (also requires a right video file, unless this is a .slog recording).");
     parser.add(video_file_right, "t", "video-file-right", "Right video file, only for use with the -l option.");
     parser.add(video_directory, "i", "video-directory", "Directory to search for videos in (for playback).");
     parser.add(starting_frame_number, "f", "starting-frame", "Frame to start at when playing back videos.");
@@ -172,6 +173,10 @@ int main(int argc, char *argv[])
     parser.add(enable_gamma, "g", "enable-gamma", "Turn gamma on for both cameras.");
     parser.add(random_results, "R", "random-results", "Number of random points to produce per frame.  Can be a float in which case we'll take a random sample to decide if to produce the last one.  Disables real stereo processing.  Only for debugging / analysis!");
     parser.add(publish_all_images, "P", "publish-all-images", "Publish all images to LCM");
+    parser.add(legacy_thread_pool, "L", "legacy-thread-pool", "Run stereo on the old fixed pool of worker threads instead of the work-stealing scheduler (for comparison).");
+    parser.add(fused_strips, "F", "fused-strips", "Remap, filter, and search each strip of rows in one task on one core instead of in three passes over the frame.");
+    parser.add(zero_copy_capture, "z", "zero-copy-capture", "Run stereo and the display straight out of the cameras' DMA buffers instead of copying every frame out first.  Frames are only copied while recording.");
+    parser.add(async_capture, "a", "async-capture", "Capture from each camera on its own thread and pair the frames up by timestamp, so stereo always gets the newest synchronized pair.  Implies -z.");
     parser.parse();
 
     // parse the config file
@@ -182,7 +187,8 @@ int main(int argc, char *argv[])
     }
 
     if (video_file_left.length() > 0
-        && video_file_right.length() <= 0) {
+        && video_file_right.length() <= 0
+        && !boost::iends_with(video_file_left, STEREO_LOG_EXTENSION)) {
 
         fprintf(stderr, "Error: for playback you must specify both "
             "a right and left video file. (Only got a left one.)\n");
@@ -239,7 +245,8 @@ int main(int argc, char *argv[])
 
     sigIntHandler.sa_handler = control_c_handler;
     sigemptyset(&sigIntHandler.sa_mask);
-    sigIntHandler.sa_flags = 0;
+    // a second ctrl-c kills us, in case the main loop is stuck
+    sigIntHandler.sa_flags = SA_RESETHAND;
 
     sigaction(SIGINT, &sigIntHandler, NULL);
     // --- end ctrl-c handling code ---
@@ -384,6 +391,7 @@ int main(int argc, char *argv[])
     //PushbroomStereoState state; // HACK
 
     state.disparity = stereoConfig.disparity;
+    state.extra_disparities = stereoConfig.extraDisparities;
     state.zero_dist_disparity = stereoConfig.infiniteDisparity;
     state.sobelLimit = stereoConfig.interestOperatorLimit;
     state.horizontalInvarianceMultiplier = stereoConfig.horizontalInvarianceMultiplier;
@@ -401,6 +409,8 @@ int main(int argc, char *argv[])
 
     state.mapxL = stereoCalibration.mx1fp;
     state.mapxR = stereoCalibration.mx2fp;
+    state.remapTableL = stereoCalibration.mx1Table;
+    state.remapTableR = stereoCalibration.mx2Table;
     state.Q = stereoCalibration.qMat;
     state.show_display = show_display;
 
@@ -451,12 +461,41 @@ int main(int argc, char *argv[])
 
     // spool up worker threads
     PushbroomStereo pushbroom_stereo;
+    pushbroom_stereo.SetUseWorkStealing(!legacy_thread_pool);
+    pushbroom_stereo.SetUseFusedStrips(fused_strips);
+
+    StereoHitEncoder stereo_encoder(GetStereoMessageFingerprint());
+
+    LatencyHistogram stereo_latency(legacy_thread_pool ? "thread pool" : (fused_strips ? "fused strips" : "work stealing"));
+
+    // for zero-copy capture: each frame keeps its camera buffer until the
+    // next grab replaces it
+    Dc1394CameraSource camera_source_left(camera);
+    Dc1394CameraSource camera_source_right(camera2);
+    CameraFrame frameL, frameR;
+
+    if (async_capture && recording_manager.UsingLiveCameras()) {
+        zero_copy_capture = true;
+
+        stereo_capture = new StereoCapture(&camera_source_left, &camera_source_right, stereoConfig.maxCaptureSkew);
+        stereo_capture->Start();
+    }
+
+    // time each stage of the loop if anyone is listening for it
+    bool publish_timing = stereoConfig.stereo_timing_channel.length() > 0;
+    StageProfiler::SetEnabled(publish_timing);
+
+    uint64_t last_timing_ns = StageProfiler::GetTimeNs();
+    int timing_frames = 0;
 
     // start the framerate clock
     struct timeval start, now;
     gettimeofday( &start, NULL );
 
-    while (quit == false) {
+    while (quit == false && ctrl_c_pressed == 0) {
+
+        StageTimer frame_timer(STAGE_FRAME);
+        StageTimer capture_timer(STAGE_CAPTURE);
 
         // get the frames from the camera
         if (recording_manager.UsingLiveCameras()) {
@@ -468,12 +507,49 @@ int main(int argc, char *argv[])
                 MatchBrightnessSettings(camera, camera2);
             }
 
-            // capture images from the cameras
-            matL = GetFrameFormat7(camera);
-            matR = GetFrameFormat7(camera2);
+            if (zero_copy_capture) {
+                if (stereo_capture != NULL) {
+                    if (stereo_capture->GetPair(&frameL, &frameR)) {
+                        matL = frameL.GetImage();
+                        matR = frameR.GetImage();
+                    } else {
+                        std::cout << "Warning: no synchronized frames from the cameras, using black frames." << std::endl;
+
+                        matL = Mat::zeros(240, 376, CV_8UC1);
+                        matR = Mat::zeros(240, 376, CV_8UC1);
+                    }
+                } else {
+                    matL = GrabFrameZeroCopy(&camera_source_left, &frameL);
+                    matR = GrabFrameZeroCopy(&camera_source_right, &frameR);
+                }
+
+                capture_timer.Stop();
+
+                // record video (copies only if we are recording)
+                StageTimer recording_timer(STAGE_RECORDING);
 
-            // record video
-            recording_manager.AddFrames(matL, matR);
+                if (frameL.empty() || frameR.empty()) {
+                    if (recording_manager.IsRecording()) {
+                        // black frames are already ours, but a frame from a
+                        // camera that worked is still in its capture buffer
+                        recording_manager.AddFrames(frameL.empty() ? matL : matL.clone(),
+                            frameR.empty() ? matR : matR.clone());
+                    }
+                } else {
+                    recording_manager.AddFrames(frameL, frameR);
+                }
+            } else {
+                // capture images from the cameras
+                matL = GetFrameFormat7(camera);
+                matR = GetFrameFormat7(camera2);
+
+                capture_timer.Stop();
+
+                // record video
+                StageTimer recording_timer(STAGE_RECORDING);
+
+                recording_manager.AddFrames(matL, matR);
+            }
 
 
         } else {
@@ -481,10 +557,11 @@ int main(int argc, char *argv[])
             recording_manager.GetFrames(matL, matR);
         }
 
-        cv::vector<Point3f> pointVector3d;
-        cv::vector<uchar> pointColors;
-        cv::vector<Point3i> pointVector2d; // for display
-        cv::vector<Point3i> pointVector2d_inf; // for display
+        capture_timer.Stop();
+
+        // points into pushbroom_stereo's buffers, good until the next frame
+        PushbroomHits hits;
+        hits.count = 0;
 
         // do the main stereo processing
         if (disable_stereo != true) {
@@ -492,7 +569,7 @@ int main(int argc, char *argv[])
             gettimeofday( &now, NULL );
             double before = now.tv_usec + now.tv_sec * 1000 * 1000;
 
-            pushbroom_stereo.ProcessImages(matL, matR, &pointVector3d, &pointColors, &pointVector2d, state);
+            pushbroom_stereo.ProcessImages(matL, matR, state, &hits);
 
             gettimeofday( &now, NULL );
             double after = now.tv_usec + now.tv_sec * 1000 * 1000;
@@ -500,58 +577,44 @@ int main(int argc, char *argv[])
             timer_sum += after-before;
             timer_count ++;
 
+            stereo_latency.Add((after - before) / 1000.0);
+
         }
 
-        // build an LCM message for the stereo data
-        lcmt_stereo msg;
+        StageTimer lcm_timer(STAGE_LCM);
 
+        // build an LCM message for the stereo data
+        int64_t timestamp;
 
         if (recording_manager.UsingLiveCameras() || stereo_lcm_msg == NULL) {
-            msg.timestamp = getTimestampNow();
+            timestamp = getTimestampNow();
         } else {
             // if we are replaying videos, preserve the timestamp of the original video
-            msg.timestamp = stereo_lcm_msg->timestamp;
+            timestamp = stereo_lcm_msg->timestamp;
 
         }
 
-
-        msg.number_of_points = (int)pointVector3d.size();
-
-        float x[msg.number_of_points];
-        float y[msg.number_of_points];
-        float z[msg.number_of_points];
-        uchar grey[msg.number_of_points];
-
-        for (unsigned int i=0;i<pointVector3d.size();i++) {
-
-            x[i] = pointVector3d[i].x / stereoConfig.calibrationUnitConversion;
-            y[i] = pointVector3d[i].y / stereoConfig.calibrationUnitConversion;
-            z[i] = pointVector3d[i].z / stereoConfig.calibrationUnitConversion;
-            grey[i] = pointColors[i];
-        }
-
-        msg.x = x;
-        msg.y = y;
-        msg.z = z;
-        msg.grey = grey;
-        msg.frame_number = recording_manager.GetFrameNumber();
+        int frame_number = recording_manager.GetFrameNumber();
 
         if (recording_manager.UsingLiveCameras()) {
-            msg.frame_number = msg.frame_number - 1;  // minus one since recording manager has
-                                                      // already recorded this frame (above in
-                                                      // AddFrames) but we haven't made a message
-                                                      // for it yet
+            frame_number = frame_number - 1;  // minus one since recording manager has
+                                              // already recorded this frame (above in
+                                              // AddFrames) but we haven't made a message
+                                              // for it yet
         }
 
-
-        msg.video_number = recording_manager.GetRecVideoNumber();
-
         // publish the LCM message
-        if (last_frame_number != msg.frame_number) {
-            lcmt_stereo_publish(lcm, "stereo", &msg);
-            last_frame_number = msg.frame_number;
+        if (last_frame_number != frame_number) {
+            // encode the hits straight into the message, converting units
+            // as we go
+            stereo_encoder.Encode(hits, timestamp, frame_number, recording_manager.GetRecVideoNumber(), stereoConfig.calibrationUnitConversion);
+
+            lcm_publish(lcm, "stereo", stereo_encoder.GetData(), stereo_encoder.GetSize());
+            last_frame_number = frame_number;
         }
 
+        lcm_timer.Stop();
+
         if (publish_all_images) {
             if (recording_manager.GetFrameNumber() != last_playback_frame_number) {
                 SendImageOverLcm(lcm, "stereo_image_left", matL, 80);
@@ -575,8 +638,14 @@ int main(int argc, char *argv[])
             remapL = remapLtemp;
             remapR = remapRtemp;
 
-            remap(matL, remapL, stereoCalibration.mx1fp, Mat(), INTER_NEAREST);
-            remap(matR, remapR, stereoCalibration.mx2fp, Mat(), INTER_NEAREST);
+            if (stereoCalibration.mx1Table.empty() || stereoCalibration.mx2Table.empty()) {
+                remap(matL, remapL, stereoCalibration.mx1fp, Mat(), INTER_NEAREST);
+                remap(matR, remapR, stereoCalibration.mx2fp, Mat(), INTER_NEAREST);
+            } else {
+                // handles zero-copy frames' padded rows too
+                stereoCalibration.mx1Table.Remap(matL, remapL);
+                stereoCalibration.mx2Table.Remap(matR, remapR);
+            }
 
             remapL.copyTo(matDisp);
 
@@ -588,10 +657,10 @@ int main(int argc, char *argv[])
 
         if (show_display) {
 
-            for (unsigned int i=0;i<pointVector2d.size();i++) {
-                int x2 = pointVector2d[i].x;
-                int y2 = pointVector2d[i].y;
-                //int sad = pointVector2d[i].z;
+            for (int i=0;i<hits.count;i++) {
+                int x2 = hits.pixel_x[i];
+                int y2 = hits.pixel_y[i];
+                //int sad = hits.sad[i];
                 rectangle(matDisp, Point(x2,y2), Point(x2+state.blockSize, y2+state.blockSize), 0,  CV_FILLED);
                 rectangle(matDisp, Point(x2+1,y2+1), Point(x2+state.blockSize-1, y2-1+state.blockSize), 255);
 
@@ -613,7 +682,9 @@ int main(int argc, char *argv[])
                 Get3DPointsFromStereoMsg(stereo_lcm_msg, &lcm_points);
 
                 // draw the points on the unrectified image (to see these
-                // you must pass the -u flag)
+                // you must pass the -u flag).  Draw on a copy: the frame
+                // can be a read-only view of a log or a camera's buffer.
+                matL = matL.clone();
                 Draw3DPointsOnImage(matL, &lcm_points, stereoCalibration.M1, stereoCalibration.D1, stereoCalibration.R1, 128);
 
             }
@@ -881,6 +952,24 @@ int main(int argc, char *argv[])
 
         numFrames ++;
 
+        frame_timer.Stop();
+
+        if (publish_timing) {
+            timing_frames ++;
+
+            uint64_t now_ns = StageProfiler::GetTimeNs();
+
+            // publish the breakdown once a second
+            if (now_ns - last_timing_ns >= 1000000000ull) {
+                PublishStageTiming(lcm, stereoConfig.stereo_timing_channel,
+                    recording_manager.GetRecVideoNumber(), last_frame_number,
+                    timing_frames, (now_ns - last_timing_ns) / 1000000.0);
+
+                last_timing_ns = now_ns;
+                timing_frames = 0;
+            }
+        }
+
         // check for new LCM messages
         NonBlockingLcm(lcm);
 
@@ -898,22 +987,160 @@ int main(int argc, char *argv[])
 
     } // end main while loop
 
+    if (ctrl_c_pressed) {
+        cout << endl << "exiting via ctrl-c" << endl;
+    }
+
     printf("\n\n");
 
+    if (disable_stereo != true) {
+        printf("stereo latency per frame:\n");
+        stereo_latency.Print();
+        printf("\n");
+    }
+
     destroyWindow("Input");
     destroyWindow("Input2");
     destroyWindow("Stereo");
 
+    if (stereo_capture != NULL) {
+        stereo_capture->Stop();
+
+        printf("capture: %d pairs, %d frames dropped, %d frames unpaired\n\n",
+            stereo_capture->GetNumPairs(), stereo_capture->GetNumDropped(), stereo_capture->GetNumUnpaired());
+
+        delete stereo_capture;
+        stereo_capture = NULL;
+    }
+
     // close camera
     if (recording_manager.UsingLiveCameras()) {
+        // buffers have to go back before capture stops
+        matL.release();
+        matR.release();
+        frameL.Release();
+        frameR.Release();
+
         StopCapture(d, camera);
         StopCapture(d2, camera2);
+
+        if (ctrl_c_pressed) {
+            cout << "\tpress ctrl+c again to quit while writing video." << endl;
+        }
+
+        recording_manager.FlushBufferToDisk();
     }
 
     return 0;
 }
 
 
+/**
+ * Reads lcmt_stereo's fingerprint by encoding a message with no points, for
+ * StereoHitEncoder.
+ *
+ * @retval fingerprint as it is written at the start of a message
+ */
+uint64_t GetStereoMessageFingerprint() {
+
+    lcmt_stereo msg;
+    memset(&msg, 0, sizeof(msg));
+
+    uint8_t buf[STEREO_MESSAGE_HEADER_SIZE];
+
+    if (lcmt_stereo_encoded_size(&msg) != STEREO_MESSAGE_HEADER_SIZE
+        || lcmt_stereo_encode(buf, 0, sizeof(buf), &msg) != STEREO_MESSAGE_HEADER_SIZE) {
+
+        cerr << "Warning: lcmt_stereo doesn't match StereoHitEncoder's layout, stereo messages will be wrong." << endl;
+    }
+
+    uint64_t fingerprint = 0;
+
+    for (int i = 0; i < 8; i++) {
+        fingerprint = (fingerprint << 8) | buf[i];
+    }
+
+    return fingerprint;
+}
+
+/**
+ * Publishes how long each stage of the pipeline took since the last call
+ * (see StageTimer.hpp).
+ *
+ * @param lcm lcm object
+ * @param channel channel to publish on
+ * @param video_number video number we're recording to
+ * @param frame_number last frame we published stereo for
+ * @param num_frames number of frames since the last call
+ * @param period_ms time since the last call
+ */
+void PublishStageTiming(lcm_t *lcm, string channel, int video_number, int frame_number, int num_frames, double period_ms) {
+
+    std::vector<StageStats> stats;
+    int dropped;
+
+    StageProfiler::Collect(&stats, &dropped);
+
+    lcmt_stereo_timing msg;
+
+    msg.timestamp = getTimestampNow();
+    msg.video_number = video_number;
+    msg.frame_number = frame_number;
+    msg.num_frames = num_frames;
+    msg.period_ms = period_ms;
+    msg.dropped_samples = dropped;
+    msg.num_stages = NUM_TIMED_STAGES;
+
+    char *stage_name[NUM_TIMED_STAGES];
+    int32_t count[NUM_TIMED_STAGES];
+    double total_ms[NUM_TIMED_STAGES];
+    double mean_ms[NUM_TIMED_STAGES];
+    double p50_ms[NUM_TIMED_STAGES];
+    double p90_ms[NUM_TIMED_STAGES];
+    double p99_ms[NUM_TIMED_STAGES];
+    double max_ms[NUM_TIMED_STAGES];
+
+    for (int i = 0; i < NUM_TIMED_STAGES; i++) {
+        stage_name[i] = (char*)StageProfiler::GetStageName(i);
+        count[i] = stats[i].count;
+        total_ms[i] = stats[i].total_ms;
+        mean_ms[i] = stats[i].mean_ms;
+        p50_ms[i] = stats[i].p50_ms;
+        p90_ms[i] = stats[i].p90_ms;
+        p99_ms[i] = stats[i].p99_ms;
+        max_ms[i] = stats[i].max_ms;
+    }
+
+    msg.stage_name = stage_name;
+    msg.count = count;
+    msg.total_ms = total_ms;
+    msg.mean_ms = mean_ms;
+    msg.p50_ms = p50_ms;
+    msg.p90_ms = p90_ms;
+    msg.p99_ms = p99_ms;
+    msg.max_ms = max_ms;
+
+    lcmt_stereo_timing_publish(lcm, channel.c_str(), &msg);
+}
+
+/**
+ * Grabs a frame that points into the camera's buffer, without copying it.
+ * The returned image is only good until the frame is released or grabbed
+ * into again.
+ *
+ * @param source camera to grab from
+ * @param frame frame that holds on to the buffer
+ *
+ * @retval image, or a black frame if the camera failed (like GetFrameFormat7)
+ */
+Mat GrabFrameZeroCopy(CameraSource *source, CameraFrame *frame) {
+    if (source->GrabFrame(frame)) {
+        return frame->GetImage();
+    }
+
+    return Mat::zeros(240, 376, CV_8UC1);
+}
+
 /**
  * Mouse callback so that the user can click on an image
  * and see where the disparity line is on the other image pair
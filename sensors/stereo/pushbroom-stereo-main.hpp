@@ -33,6 +33,7 @@
 #include "../../LCM/mav_pose_t.h"
 #include "../../LCM/lcmt_cpu_info.h"
 #include "../../LCM/lcmt_log_size.h"
+#include "../../LCM/lcmt_stereo_timing.h"
 
 #include "../../LCM/lcmt_stereo_control.h"
 
@@ -51,8 +52,13 @@
 
 #include "opencv-stereo-util.hpp"
 #include "pushbroom-stereo.hpp"
+#include "LatencyHistogram.hpp"
+#include "StageTimer.hpp"
+#include "StereoHitEncoder.hpp"
 #include "../../ui/hud/hud.hpp"
 #include "RecordingManager.hpp"
+#include "Dc1394CameraSource.hpp"
+#include "StereoCapture.hpp"
 
 using namespace std;
 using namespace cv;
@@ -99,10 +105,16 @@ void WriteVideo();
 
 void onMouse( int event, int x, int y, int, void* );
 void onMouseStereo( int event, int x, int y, int, void* hud);
+Mat GrabFrameZeroCopy(CameraSource *source, CameraFrame *frame);
+
 void DrawLines(Mat leftImg, Mat rightImg, Mat stereoImg, int lineX, int lineY, int disparity, int inf_disparity);
 
 void DisplayPixelBlocks(Mat left_image, Mat right_image, int left, int top, PushbroomStereoState state, PushbroomStereo *barry_moore_stereo);
 
+uint64_t GetStereoMessageFingerprint();
+
+void PublishStageTiming(lcm_t *lcm, string channel, int video_number, int frame_number, int num_frames, double period_ms);
+
 Mat WriteDisparityMap(cv::vector<Point3i> *pointVector2d, PushbroomStereoState state, int pixel_value = 128, Mat existing_map = Mat::zeros(240, 376, CV_8UC1));
 
 void stereo_replay_handler(const lcm_recv_buf_t *rbuf, const char* channel, const lcmt_stereo *msg, void *user);
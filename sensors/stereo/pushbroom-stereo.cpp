@@ -6,7 +6,9 @@
  */
 
 #include "pushbroom-stereo.hpp"
+#include "StageTimer.hpp"
 #include <pthread.h>
+#include <float.h>
 
 // if USE_SAFTEY_CHECKS is 1, GetSAD will try to make sure
 // that it will do the right thing even if you ask it for pixel
@@ -20,16 +22,141 @@
 #define INVARIANCE_CHECK_HORZ_OFFSET_MIN (-3)
 #define INVARIANCE_CHECK_HORZ_OFFSET_MAX 3
 
+#define INVARIANCE_CHECK_NUM_OFFSETS \
+    (((INVARIANCE_CHECK_VERT_OFFSET_MAX - INVARIANCE_CHECK_VERT_OFFSET_MIN) / INVARIANCE_CHECK_VERT_OFFSET_INCREMENT + 1) \
+    * (INVARIANCE_CHECK_HORZ_OFFSET_MAX - INVARIANCE_CHECK_HORZ_OFFSET_MIN + 1))
+
 #define NUMERIC_CONST 333 // just a constant that we multiply the score by to make
                           // all the parameters in a nice integer range
 
 PushbroomStereoThreadStarter thread_starter[NUM_THREADS+1];
 
+/**
+ * Turns the raw sums for a block into the score that we threshold on.
+ * Shared by GetSAD and GetSADStrip so they always agree.
+ *
+ * @retval scaled sum of absolute differences, or -1 if either side of
+ *      the block doesn't pass the interest operator
+ */
+static inline int ScoreBlock(int sad, int leftVal, int rightVal, int sobelLimit) {
+
+    if (leftVal < sobelLimit || rightVal < sobelLimit)// || diff_score > state.interest_diff_limit)
+    {
+        return -1;
+    }
+
+    int laplacian_value = leftVal + rightVal;
+
+    // weight laplacian_value into the score
+    return NUMERIC_CONST*(float)sad/(float)laplacian_value;
+}
+
+/**
+ * Test for one offset of the horizontal invariance check.  Shared by
+ * CheckHorizontalInvariance and CheckHorizontalInvarianceStrip.
+ *
+ * @retval true if the block matches at this offset
+ */
+static inline bool InvarianceMatch(int sad, int leftVal, int rightVal, const PushbroomStereoState &state) {
+
+    int sobel = leftVal + rightVal;
+
+    // we don't check for leftVal >= sobelLimit because we have already
+    // checked that in the main search loop (in GetSAD).
+    //if (right_val_array[i] >= sobelLimit && 100*(float)sad_array[i]/(float)((float)sobel_array[i]*state.interestOperatorMultiplierHorizontalInvariance) < state.sadThreshold) {
+    return rightVal >= state.sobelLimit && NUMERIC_CONST*state.horizontalInvarianceMultiplier*(float)sad/((float)sobel) < state.sadThreshold;
+}
+
+/**
+ * Number of disparities to search: state.disparity and any extras.
+ */
+static inline int GetNumDisparities(const PushbroomStereoState &state) {
+    return 1 + state.extra_disparities.size();
+}
+
+/**
+ * Disparity number k.  Zero is state.disparity.
+ */
+static inline int GetDisparity(const PushbroomStereoState &state, int k) {
+    return k == 0 ? state.disparity : state.extra_disparities[k - 1];
+}
+
+/**
+ * Part of a region that falls in a range of rows.  If they don't overlap,
+ * the result has no rows.
+ */
+static Rect ClipRows(const Rect &roi, int row_start, int row_end) {
+
+    int start = max(roi.y, row_start);
+    int end = max(start, min(roi.y + roi.height, row_end));
+
+    return Rect(roi.x, start, roi.width, end - start);
+}
+
+/**
+ * Grows a region by a border on every side, staying inside the image.
+ * Empty regions stay empty.
+ */
+static Rect GrowRect(const Rect &roi, int border, Size image_size) {
+
+    if (roi.area() <= 0) {
+        return roi;
+    }
+
+    int x0 = max(0, roi.x - border);
+    int y0 = max(0, roi.y - border);
+    int x1 = min(image_size.width, roi.x + roi.width + border);
+    int y1 = min(image_size.height, roi.y + roi.height + border);
+
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
 
 PushbroomStereo::PushbroomStereo() {
-    // init worker threads
 
+    // pick the fastest SAD kernel this CPU supports
+    SetSadKernel(GetBestSadKernelType());
+
+    // both thread pools are started the first time they are used, so we
+    // don't have idle threads from the one we aren't using
+    thread_pool_started_ = false;
+
+    use_work_stealing_ = true;
+    use_fused_strips_ = false;
+    work_stealing_pool_ = NULL;
+    num_work_stealing_threads_ = 0;
+
+    strip_tasks_ = NULL;
+    num_strips_ = 0;
+
+    strip_rows_ = -1;
+    strip_height_ = -1;
+    strip_block_size_ = -1;
+    strip_last_valid_pixel_row_ = -1;
+}
+
+PushbroomStereo::~PushbroomStereo() {
 
+    // the fixed pool's threads wait on our condition variables, so they
+    // have to be stopped before those go away
+    if (thread_pool_started_) {
+        for (int i = 0; i < NUM_THREADS; i++) {
+            StartWorkerThread(i, QUIT);
+        }
+
+        for (int i = 0; i < NUM_THREADS; i++) {
+            pthread_join(worker_pool_[i], NULL);
+        }
+    }
+
+    delete work_stealing_pool_;
+    delete [] strip_tasks_;
+}
+
+/**
+ * Starts the fixed pool of NUM_THREADS worker threads.
+ */
+void PushbroomStereo::StartThreadPool() {
 
     for (int i = 0; i < NUM_THREADS; i++) {
         // start all the worker threads
@@ -50,6 +177,8 @@ PushbroomStereo::PushbroomStereo() {
         pthread_create(&(worker_pool_[i]), NULL, WorkerThread, &(thread_starter[i]));
 
     }
+
+    thread_pool_started_ = true;
 }
 
 void* PushbroomStereo::WorkerThread(void *x) {
@@ -91,7 +220,9 @@ void* PushbroomStereo::WorkerThread(void *x) {
         //cout << "[thread " << thread_number << "] running" << endl;
 
         // see if that work is remapping or stereo processing
-        switch (parent->GetWorkType(thread_number)) {
+        ThreadWorkType work_type = parent->GetWorkType(thread_number);
+
+        switch (work_type) {
             case REMAP:
                 parent->RunRemapping(parent->GetRemapState(thread_number));
                 break;
@@ -104,6 +235,9 @@ void* PushbroomStereo::WorkerThread(void *x) {
                 parent->RunStereoPushbroomStereo(parent->GetThreadedState(thread_number));
                 break;
 
+            case QUIT:
+                break;
+
             default:
                 cerr << "Warning: unknown thread work type." << endl;
                 break;
@@ -117,6 +251,10 @@ void* PushbroomStereo::WorkerThread(void *x) {
         data_mutex->unlock();
         //cout << "[thread unlocked]" << endl;
 
+        if (work_type == QUIT) {
+            break;
+        }
+
         //cout << "[thread " << thread_number << "] done" << endl;
 
     }
@@ -124,25 +262,449 @@ void* PushbroomStereo::WorkerThread(void *x) {
     return NULL;
 }
 
+/**
+ * Grows a hit buffer so it can hold at least capacity hits.  Never shrinks,
+ * so once the buffer is big enough for the settings this doesn't allocate.
+ */
+static void ReserveHits(PushbroomHitBuffer *buffer, int capacity) {
+
+    if ((int)buffer->x.size() >= capacity) {
+        return;
+    }
+
+    buffer->x.resize(capacity);
+    buffer->y.resize(capacity);
+    buffer->z.resize(capacity);
+    buffer->grey.resize(capacity);
+    buffer->disparity.resize(capacity);
+    buffer->pixel_x.resize(capacity);
+    buffer->pixel_y.resize(capacity);
+    buffer->sad.resize(capacity);
+}
+
+/**
+ * Runs the fast, single-disparity stereo algorithm and returns the points
+ * where it found disparity matches in the image.
+ *
+ * Once the buffers are sized for the settings (on the first frame, or
+ * after the image size, block size, or disparities change), this doesn't
+ * allocate any memory.
+ *
+ * @param leftImage left camera image as a CV_8UC1
+ * @param rightImage right camera image as a CV_8UC1
+ * @param state set of configuration parameters for the function.
+ *      You can change these on each run of the function if you'd like.
+ * @param hits output: the hits, in arrays that are good until the next
+ *      call
+ */
+void PushbroomStereo::ProcessImages(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state, PushbroomHits *hits) {
+
+    // make sure that the inputs are of the right type
+    CV_Assert(leftImage.type() == CV_8UC1 && rightImage.type() == CV_8UC1);
+
+    hits_.count = 0;
+
+    // random results mode picks a number of points per fixed thread, so it
+    // always uses the fixed pool
+    if (use_work_stealing_ && state.random_results < 0) {
+        ProcessImagesWorkStealing(leftImage, rightImage, state);
+    } else {
+        ProcessImagesThreadPool(leftImage, rightImage, state);
+    }
+
+    hits->count = hits_.count;
+    hits->x = hits_.x.data();
+    hits->y = hits_.y.data();
+    hits->z = hits_.z.data();
+    hits->grey = hits_.grey.data();
+    hits->disparity = hits_.disparity.data();
+    hits->pixel_x = hits_.pixel_x.data();
+    hits->pixel_y = hits_.pixel_y.data();
+    hits->sad = hits_.sad.data();
+}
+
 /**
  * Runs the fast, single-disparity stereo algorithm.  Returns a
  * vector of points where it found disparity matches in the image.
  *
+ * Copies the hits into the vectors, so this allocates.  See the other
+ * ProcessImages.
+ *
  * @param _leftImage left camera image as a CV_8UC1
  * @param _rightImage right camera image as a CV_8UC1
- * @param hitVector a cv::vector that we will populate with cv::Point()s
+ * @param pointVector3d hits are added to this
+ * @param pointColors grey value of each hit is added to this
+ * @param pointVector2d if state.show_display is set, the top left corner
+ *      and score of each hit's block are added to this
  * @param state set of configuration parameters for the function.
  *      You can change these on each run of the function if you'd like.
+ * @param pointDisparities optional: filled with the disparity each hit was
+ *      found at, for when state.extra_disparities isn't empty
  */
-void PushbroomStereo::ProcessImages(InputArray _leftImage, InputArray _rightImage, cv::vector<Point3f> *pointVector3d, cv::vector<uchar> *pointColors, cv::vector<Point3i> *pointVector2d, PushbroomStereoState state) {
+void PushbroomStereo::ProcessImages(InputArray _leftImage, InputArray _rightImage, cv::vector<Point3f> *pointVector3d, cv::vector<uchar> *pointColors, cv::vector<Point3i> *pointVector2d, PushbroomStereoState state, cv::vector<int> *pointDisparities) {
 
-    //cout << "[main] entering process images" << endl;
+    PushbroomHits hits;
+    ProcessImages(_leftImage.getMat(), _rightImage.getMat(), state, &hits);
 
-    Mat leftImage = _leftImage.getMat();
-    Mat rightImage = _rightImage.getMat();
+    pointVector3d->reserve(pointVector3d->size() + hits.count);
+    pointColors->reserve(pointColors->size() + hits.count);
 
-    // make sure that the inputs are of the right type
-    CV_Assert(leftImage.type() == CV_8UC1 && rightImage.type() == CV_8UC1);
+    for (int i = 0; i < hits.count; i++) {
+        pointVector3d->push_back(Point3f(hits.x[i], hits.y[i], hits.z[i]));
+        pointColors->push_back(hits.grey[i]);
+
+        if (pointDisparities != NULL) {
+            pointDisparities->push_back(hits.disparity[i]);
+        }
+
+        if (state.show_display) {
+            pointVector2d->push_back(Point3i(hits.pixel_x[i], hits.pixel_y[i], hits.sad[i]));
+        }
+    }
+}
+
+/**
+ * Adds one thread's hits to the end of hits_, which must already have room
+ * for them.
+ */
+void PushbroomStereo::AppendHits(const PushbroomHitBuffer &from) {
+
+    int n = from.count;
+    int start = hits_.count;
+
+    if (n <= 0) {
+        return;
+    }
+
+    memcpy(&hits_.x[start], &from.x[0], n * sizeof(float));
+    memcpy(&hits_.y[start], &from.y[0], n * sizeof(float));
+    memcpy(&hits_.z[start], &from.z[0], n * sizeof(float));
+    memcpy(&hits_.grey[start], &from.grey[0], n * sizeof(uchar));
+    memcpy(&hits_.disparity[start], &from.disparity[0], n * sizeof(int));
+    memcpy(&hits_.pixel_x[start], &from.pixel_x[0], n * sizeof(int));
+    memcpy(&hits_.pixel_y[start], &from.pixel_y[0], n * sizeof(int));
+    memcpy(&hits_.sad[start], &from.sad[0], n * sizeof(int));
+
+    hits_.count += n;
+}
+
+/**
+ * Splits the rows that the stereo search covers between the NUM_THREADS
+ * threads of the fixed pool.  The work-stealing scheduler uses the same
+ * split so both search exactly the same blocks.
+ *
+ * @param rows number of rows in the image
+ * @param state configuration parameters (blockSize and lastValidPixelRow)
+ * @param row_starts output: first row for each thread
+ * @param row_ends output: row for each thread to stop before
+ */
+void PushbroomStereo::GetStereoRowRanges(int rows, const PushbroomStereoState &state, int *row_starts, int *row_ends) {
+
+    if (state.lastValidPixelRow > 0) {
+
+        // crop image to be only include valid pixels
+        rows = state.lastValidPixelRow;
+    }
+
+
+    // figure out how to split up the work
+    int thread_increment = RoundUp(rows/NUM_THREADS, state.blockSize);
+    int last_thread_num_rows = rows - thread_increment * (NUM_THREADS - 1);
+
+    // make sure the last thread has a number of rows divisible by the block size
+    last_thread_num_rows = last_thread_num_rows - last_thread_num_rows % state.blockSize;
+
+    //printf("thread increment: %d, last thread: %d\n", thread_increment, last_thread_num_rows);
+
+    for (int i=0;i<NUM_THREADS;i++)
+    {
+        row_starts[i] = thread_increment * i;
+
+        if (i < NUM_THREADS - 1) {
+            // not the last thread
+            row_ends[i] = thread_increment*(i+1) - 1;
+        } else {
+            // the last thread
+            row_ends[i] = row_starts[i] + last_thread_num_rows - 1;
+        }
+    }
+}
+
+/**
+ * Columns of the left image where the stereo search puts blocks.
+ *
+ * @param cols number of columns in the image
+ * @param blockSize block size
+ * @param disparity disparity being searched
+ * @param start_j output: left edge of the first block
+ * @param stop_j output: blocks start before this column
+ */
+void PushbroomStereo::GetStereoColumns(int cols, int blockSize, int disparity, int *start_j, int *stop_j) {
+
+    *start_j = 0;
+    *stop_j = cols - (disparity + blockSize);
+    if (disparity < 0)
+    {
+        *start_j = -disparity;
+        *stop_j = cols - blockSize;
+    }
+}
+
+/**
+ * Sets up each disparity the stereo search looks at: a copy of the state
+ * set to that disparity and the blocks it covers in every row.
+ *
+ * @param cols number of columns in the image
+ * @param state configuration parameters
+ * @param searches output: one for state.disparity and each extra disparity
+ */
+void PushbroomStereo::SetUpDisparitySearches(int cols, const PushbroomStereoState &state, cv::vector<DisparitySearch> *searches) {
+
+    int blockSize = state.blockSize;
+
+    searches->resize(GetNumDisparities(state));
+
+    for (unsigned int k = 0; k < searches->size(); k++) {
+
+        DisparitySearch *search = &(*searches)[k];
+
+        int this_disparity = GetDisparity(state, k);
+
+        search->state = state;
+        search->state.disparity = this_disparity;
+
+        search->projector.Set(state.Q, this_disparity);
+
+        int search_stop_j;
+        GetStereoColumns(cols, blockSize, this_disparity, &search->start_j, &search_stop_j);
+
+        // number of blocks in each row, same as stepping j from startJ
+        // to stopJ by blockSize
+        search->num_blocks = 0;
+        if (search_stop_j > search->start_j) {
+            search->num_blocks = (search_stop_j - search->start_j + blockSize - 1) / blockSize;
+        }
+    }
+}
+
+DisparityProjector::DisparityProjector() {
+    affine_ = true;
+
+    memset(scale_, 0, sizeof(scale_));
+    memset(offset_, 0, sizeof(offset_));
+    memset(q_, 0, sizeof(q_));
+
+    disparity_ = 0;
+}
+
+/**
+ * Works out the transform for one disparity.  Cheap enough to do every
+ * frame.
+ *
+ * @param Q 4x4 reprojection matrix (CV_32F or CV_64F).  If it's empty,
+ *      every point goes to the origin.
+ * @param disparity disparity the hits are at
+ */
+void DisparityProjector::Set(const Mat &Q, int disparity) {
+
+    memset(q_, 0, sizeof(q_));
+
+    if (Q.rows == 4 && Q.cols == 4) {
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                q_[4*r + c] = Q.type() == CV_32F ? Q.at<float>(r, c) : Q.at<double>(r, c);
+            }
+        }
+    }
+
+    // hits are (u, v, -disparity) going into Q, like they always have
+    disparity_ = -disparity;
+
+    // the divide only depends on the pixel through the bottom row of Q
+    affine_ = q_[12] == 0 && q_[13] == 0;
+
+    if (affine_ == false) {
+        return;
+    }
+
+    double w = disparity_ * q_[14] + q_[15];
+
+    if (fabs(w) <= FLT_EPSILON) {
+        // perspectiveTransform gives zeros when it can't divide
+        memset(scale_, 0, sizeof(scale_));
+        memset(offset_, 0, sizeof(offset_));
+        return;
+    }
+
+    w = 1.0 / w;
+
+    for (int r = 0; r < 3; r++) {
+        scale_[r][0] = q_[4*r] * w;
+        scale_[r][1] = q_[4*r + 1] * w;
+        offset_[r] = (disparity_ * q_[4*r + 2] + q_[4*r + 3]) * w;
+    }
+}
+
+/**
+ * Transforms hits to 3D points.
+ *
+ * @param pixel_x column of each hit
+ * @param pixel_y row of each hit
+ * @param num_points number of hits
+ * @param offset added to the pixel's row and column first, to move it to
+ *      the center of its block
+ * @param x output: x of each point
+ * @param y output: y of each point
+ * @param z output: z of each point
+ */
+void DisparityProjector::Project(const int *pixel_x, const int *pixel_y, int num_points, float offset, float *x, float *y, float *z) const {
+
+    if (affine_) {
+        // simple enough for the compiler to vectorize
+        float x_u = scale_[0][0], x_v = scale_[0][1], x_0 = offset_[0];
+        float y_u = scale_[1][0], y_v = scale_[1][1], y_0 = offset_[1];
+        float z_u = scale_[2][0], z_v = scale_[2][1], z_0 = offset_[2];
+
+        for (int i = 0; i < num_points; i++) {
+            float u = pixel_x[i] + offset;
+            float v = pixel_y[i] + offset;
+
+            x[i] = x_u * u + x_v * v + x_0;
+            y[i] = y_u * u + y_v * v + y_0;
+            z[i] = z_u * u + z_v * v + z_0;
+        }
+
+        return;
+    }
+
+    // same as perspectiveTransform
+    for (int i = 0; i < num_points; i++) {
+        double u = pixel_x[i] + offset;
+        double v = pixel_y[i] + offset;
+
+        double w = u * q_[12] + v * q_[13] + disparity_ * q_[14] + q_[15];
+
+        if (fabs(w) > FLT_EPSILON) {
+            w = 1.0 / w;
+
+            x[i] = (u * q_[0] + v * q_[1] + disparity_ * q_[2] + q_[3]) * w;
+            y[i] = (u * q_[4] + v * q_[5] + disparity_ * q_[6] + q_[7]) * w;
+            z[i] = (u * q_[8] + v * q_[9] + disparity_ * q_[10] + q_[11]) * w;
+        } else {
+            x[i] = y[i] = z[i] = 0;
+        }
+    }
+}
+
+/**
+ * Works out which part of each rectified image the stereo search reads,
+ * including the horizontal invariance check, so we only remap and filter
+ * that.  Depends on the disparities, block size, and lastValidPixelRow.
+ * With extra disparities, this covers all of them.
+ *
+ * The SIMD kernels may load a few bytes past the edge of this, but those
+ * bytes never change the result.
+ *
+ * @param image_size size of the rectified images
+ * @param state configuration parameters
+ * @param roi_left output: part of the left (and left Laplacian) image
+ *      the search reads
+ * @param roi_right output: same for the right image
+ */
+void PushbroomStereo::GetStereoRoi(Size image_size, const PushbroomStereoState &state, Rect *roi_left, Rect *roi_right) {
+
+    int blockSize = state.blockSize;
+
+    *roi_left = Rect(0, 0, 0, 0);
+    *roi_right = Rect(0, 0, 0, 0);
+
+    // rows: from the top of the first block to the bottom of the last
+    int row_starts[NUM_THREADS], row_ends[NUM_THREADS];
+    GetStereoRowRanges(image_size.height, state, row_starts, row_ends);
+
+    int search_start = image_size.height;
+    int search_end = 0;
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        if (row_ends[i] > row_starts[i]) {
+            int last_block = row_starts[i] + (row_ends[i] - 1 - row_starts[i]) / blockSize * blockSize;
+
+            search_start = min(search_start, row_starts[i]);
+            search_end = max(search_end, last_block + blockSize);
+        }
+    }
+
+    if (search_end <= search_start) {
+        // no rows to search
+        return;
+    }
+
+    // columns: every block in a row for each disparity, same as
+    // RunStereoPushbroomStereo
+    int left_x0 = image_size.width, left_x1 = 0;
+    int right_x0 = image_size.width, right_x1 = 0;
+
+    for (int k = 0; k < GetNumDisparities(state); k++) {
+
+        int disparity = GetDisparity(state, k);
+
+        int startJ, stopJ;
+        GetStereoColumns(image_size.width, blockSize, disparity, &startJ, &stopJ);
+
+        if (stopJ <= startJ) {
+            continue;
+        }
+
+        int num_blocks = (stopJ - startJ + blockSize - 1) / blockSize;
+        int width = num_blocks * blockSize;
+
+        left_x0 = min(left_x0, startJ);
+        left_x1 = max(left_x1, startJ + width);
+
+        // the right image is read at the disparity, and the invariance
+        // check reads it around the zero-distance disparity
+        right_x0 = min(right_x0, startJ + disparity);
+        right_x1 = max(right_x1, startJ + width + disparity);
+
+        if (state.check_horizontal_invariance) {
+            right_x0 = min(right_x0, startJ + state.zero_dist_disparity + INVARIANCE_CHECK_HORZ_OFFSET_MIN);
+            right_x1 = max(right_x1, startJ + width + state.zero_dist_disparity + INVARIANCE_CHECK_HORZ_OFFSET_MAX);
+        }
+    }
+
+    if (left_x1 <= left_x0) {
+        // no blocks to search
+        return;
+    }
+
+    int right_y0 = search_start;
+    int right_y1 = search_end;
+
+    if (state.check_horizontal_invariance) {
+        right_y0 += INVARIANCE_CHECK_VERT_OFFSET_MIN;
+        right_y1 += INVARIANCE_CHECK_VERT_OFFSET_MAX;
+    }
+
+    left_x0 = max(0, left_x0);
+    left_x1 = min(image_size.width, left_x1);
+    right_x0 = max(0, right_x0);
+    right_x1 = min(image_size.width, right_x1);
+    right_y0 = max(0, right_y0);
+    right_y1 = min(image_size.height, right_y1);
+
+    *roi_left = Rect(left_x0, search_start, left_x1 - left_x0, search_end - search_start);
+    *roi_right = Rect(right_x0, right_y0, right_x1 - right_x0, right_y1 - right_y0);
+}
+
+/**
+ * ProcessImages on the fixed pool: remaps, filters, and searches the whole
+ * image in NUM_THREADS pieces with a barrier between each step.
+ */
+void PushbroomStereo::ProcessImagesThreadPool(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state) {
+
+    if (thread_pool_started_ == false) {
+        StartThreadPool();
+    }
 
     // we want to use the sum-of-absolute-differences (SAD) algorithm
     // on a single disparity
@@ -154,28 +716,46 @@ void PushbroomStereo::ProcessImages(InputArray _leftImage, InputArray _rightImag
 
     // we split these arrays up and send them into each
     // thread so at the end, each thread has written to the
-    // appropriate spot in the array
-    Mat remapped_left(state.mapxL.rows, state.mapxL.cols, leftImage.depth());
-    Mat remapped_right(state.mapxR.rows, state.mapxR.cols, rightImage.depth());
+    // appropriate spot in the array.  create() only allocates if the size
+    // changed.
+    remapped_left_.create(state.mapxL.rows, state.mapxL.cols, leftImage.depth());
+    remapped_right_.create(state.mapxR.rows, state.mapxR.cols, rightImage.depth());
+
+    Mat &remapped_left = remapped_left_;
+    Mat &remapped_right = remapped_right_;
 
+    // only remap and filter the part of the images that the search reads.
+    // The Laplacian needs one more pixel on each side of that.
+    Rect roi_left, roi_right;
+    GetStereoRoi(remapped_left.size(), state, &roi_left, &roi_right);
 
+    Rect remap_roi_left = GrowRect(roi_left, 1, remapped_left.size());
+    Rect remap_roi_right = GrowRect(roi_right, 1, remapped_right.size());
 
     for (int i = 0; i < NUM_THREADS; i++) {
 
         int start = rows/NUM_THREADS*i;
         int end = rows/NUM_THREADS*(i+1);
 
+        Rect left = ClipRows(remap_roi_left, start, end);
+        Rect right = ClipRows(remap_roi_right, start, end);
+
         remap_thread_states_[i].left_image = leftImage;
         remap_thread_states_[i].right_image = rightImage;
 
         // send in a subset of the map
-        remap_thread_states_[i].submapxL = state.mapxL.rowRange(start, end);
-        remap_thread_states_[i].submapxR = state.mapxR.rowRange(start, end);
+        remap_thread_states_[i].submapxL = state.mapxL(left);
+        remap_thread_states_[i].submapxR = state.mapxR(right);
+
+        remap_thread_states_[i].remap_table_left = state.remapTableL;
+        remap_thread_states_[i].remap_table_right = state.remapTableR;
+        remap_thread_states_[i].roi_left = left;
+        remap_thread_states_[i].roi_right = right;
 
         // send in subsets of the arrays to be filled in
-        remap_thread_states_[i].sub_remapped_left_image = remapped_left.rowRange(start, end);
+        remap_thread_states_[i].sub_remapped_left_image = remapped_left(left);
 
-        remap_thread_states_[i].sub_remapped_right_image = remapped_right.rowRange(start, end);
+        remap_thread_states_[i].sub_remapped_right_image = remapped_right(right);
 
         StartWorkerThread(i, REMAP);
 
@@ -189,24 +769,30 @@ void PushbroomStereo::ProcessImages(InputArray _leftImage, InputArray _rightImag
     //cout << "[main] all remap threads finished" << endl;
 
 
-    Mat laplacian_left(remapped_left.rows, remapped_left.cols, remapped_left.depth());
-    Mat laplacian_right(remapped_right.rows, remapped_right.cols, remapped_right.depth());
+    laplacian_left_.create(remapped_left.rows, remapped_left.cols, remapped_left.depth());
+    laplacian_right_.create(remapped_right.rows, remapped_right.cols, remapped_right.depth());
+
+    Mat &laplacian_left = laplacian_left_;
+    Mat &laplacian_right = laplacian_right_;
 
     for (int i = 0; i < NUM_THREADS; i++) {
 
         int start = rows/NUM_THREADS*i;
         int end = rows/NUM_THREADS*(i+1);
 
+        Rect left = ClipRows(roi_left, start, end);
+        Rect right = ClipRows(roi_right, start, end);
+
         interest_op_states_[i].left_image = remapped_left;
         interest_op_states_[i].right_image = remapped_right;
 
         // send in subsets of the arrays to be filled in
 
-        interest_op_states_[i].sub_laplacian_left = laplacian_left.rowRange(start, end);
-        interest_op_states_[i].sub_laplacian_right = laplacian_right.rowRange(start, end);
+        interest_op_states_[i].sub_laplacian_left = laplacian_left(left);
+        interest_op_states_[i].sub_laplacian_right = laplacian_right(right);
 
-        interest_op_states_[i].row_start = start;
-        interest_op_states_[i].row_end = end;
+        interest_op_states_[i].roi_left = left;
+        interest_op_states_[i].roi_right = right;
 
 
         StartWorkerThread(i, INTEREST_OP);
@@ -220,94 +806,412 @@ void PushbroomStereo::ProcessImages(InputArray _leftImage, InputArray _rightImag
 
     //cout << "[main] imshow2 ok" << endl;
 
-    cv::vector<Point3f> pointVector3dArray[NUM_THREADS+1];
-    cv::vector<Point3i> pointVector2dArray[NUM_THREADS+1];
-    cv::vector<uchar> pointColorsArray[NUM_THREADS+1];
-
     //cout << "[main] firing worker threads..." << endl;
 
-    if (state.lastValidPixelRow > 0) {
+    // figure out how to split up the work
+    int row_starts[NUM_THREADS], row_ends[NUM_THREADS];
+    GetStereoRowRanges(rows, state, row_starts, row_ends);
 
-        // crop image to be only include valid pixels
-        rows = state.lastValidPixelRow;
+    for (int i=0;i<NUM_THREADS;i++)
+    {
+
+        thread_states_[i].state = state;
+
+        int start = row_starts[i];
+        int end = row_ends[i];
+
+        //printf("start: %d, end: %d\n", start, end);
+
+        // send in the whole image because each thread needs
+        // the entire image to do its small remapping job
+        thread_states_[i].remapped_left = remapped_left;
+        thread_states_[i].remapped_right = remapped_right;
+
+        thread_states_[i].laplacian_left = laplacian_left;
+        thread_states_[i].laplacian_right = laplacian_right;
+
+        thread_states_[i].row_start = start;
+        thread_states_[i].row_end = end;
+
+
+
+        // fire the worker thread
+        StartWorkerThread(i, STEREO);
     }
 
+    // wait for all the threads to come back
+    SyncWorkerThreads();
 
-    // figure out how to split up the work
-    int thread_increment = RoundUp(rows/NUM_THREADS, state.blockSize);
-    int last_thread_num_rows = rows - thread_increment * (NUM_THREADS - 1);
+    //cout << "[main] got all stereo" << endl;
 
-    // make sure the last thread has a number of rows divisible by the block size
-    last_thread_num_rows = last_thread_num_rows - last_thread_num_rows % state.blockSize;
+    StageTimer merge_timer(STAGE_MERGE);
 
-    //printf("thread increment: %d, last thread: %d\n", thread_increment, last_thread_num_rows);
+    // make room for as many hits as the threads could have found, so this
+    // only grows when the settings do
+    int capacity = 0;
+    for (int i=0;i<NUM_THREADS;i++)
+    {
+        capacity += thread_states_[i].hits.x.size();
+    }
+    ReserveHits(&hits_, capacity);
 
+    // combine the hits
     for (int i=0;i<NUM_THREADS;i++)
     {
+        AppendHits(thread_states_[i].hits);
+    }
 
-        thread_states_[i].state = state;
+}
 
-        int start = thread_increment * i;
-        int end;
+/**
+ * ProcessImages on the work-stealing pool.  The image is cut into strips
+ * of rows and each strip is remapped, filtered, and searched as soon as the
+ * rows it reads are ready, so a core can usually take one strip all the way
+ * through while it is still in cache and nobody waits for the slowest
+ * thread between steps.
+ */
+void PushbroomStereo::ProcessImagesWorkStealing(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state) {
+
+    if (work_stealing_pool_ == NULL) {
+        work_stealing_pool_ = new WorkStealingPool(num_work_stealing_threads_);
+        scratch_.resize(work_stealing_pool_->GetNumThreads());
+    }
+
+    int rows = state.mapxL.rows;
+
+    int strip_height = RoundUp(use_fused_strips_ ? FUSED_STRIP_MIN_HEIGHT : STRIP_MIN_HEIGHT, state.blockSize);
+
+    if (rows != strip_rows_ || strip_height != strip_height_ || state.blockSize != strip_block_size_
+        || state.lastValidPixelRow != strip_last_valid_pixel_row_) {
+
+        BuildStripTasks(rows, strip_height, state);
+    }
+
+    if (use_fused_strips_ == false) {
+        // create() only allocates if the size changed
+        remapped_left_.create(state.mapxL.rows, state.mapxL.cols, leftImage.depth());
+        remapped_right_.create(state.mapxR.rows, state.mapxR.cols, rightImage.depth());
+
+        laplacian_left_.create(remapped_left_.rows, remapped_left_.cols, remapped_left_.depth());
+        laplacian_right_.create(remapped_right_.rows, remapped_right_.cols, remapped_right_.depth());
+    }
+
+    // only remap and filter the part of the images that the search reads,
+    // plus a pixel around it for the Laplacian
+    Size image_size(state.mapxL.cols, state.mapxL.rows);
+
+    Rect roi_left, roi_right;
+    GetStereoRoi(image_size, state, &roi_left, &roi_right);
+
+    Rect remap_roi_left = GrowRect(roi_left, 1, image_size);
+    Rect remap_roi_right = GrowRect(roi_right, 1, image_size);
+
+    for (int k = 0; k < num_strips_; k++) {
+
+        StereoStripTask *strip = &strip_tasks_[k];
+
+        strip->remap_state.left_image = leftImage;
+        strip->remap_state.right_image = rightImage;
+
+        strip->remap_state.remap_table_left = state.remapTableL;
+        strip->remap_state.remap_table_right = state.remapTableR;
+
+        if (use_fused_strips_) {
+            // a fused strip remaps the rows it searches plus one on each
+            // side for the Laplacian.  Where those go depends on which
+            // thread runs it, so the rest is filled in by RunFusedStrip.
+            int start = max(0, strip->search_row_start - 1);
+            int end = min(rows, strip->search_row_end + 1);
+
+            Rect left = ClipRows(remap_roi_left, start, end);
+            Rect right = ClipRows(remap_roi_right, start, end);
+
+            strip->remap_state.submapxL = state.mapxL(left);
+            strip->remap_state.submapxR = state.mapxR(right);
+            strip->remap_state.roi_left = left;
+            strip->remap_state.roi_right = right;
+
+            strip->interest_state.roi_left = ClipRows(roi_left, strip->search_row_start, strip->search_row_end);
+            strip->interest_state.roi_right = ClipRows(roi_right, strip->search_row_start, strip->search_row_end);
 
-        if (i < NUM_THREADS - 1) {
-            // not the last thread
-            end = thread_increment*(i+1) - 1;
         } else {
-            // the last thread
-            end = start + last_thread_num_rows - 1;
+            int start = strip->row_start;
+            int end = strip->row_end;
+
+            Rect left = ClipRows(remap_roi_left, start, end);
+            Rect right = ClipRows(remap_roi_right, start, end);
+
+            strip->remap_state.submapxL = state.mapxL(left);
+            strip->remap_state.submapxR = state.mapxR(right);
+            strip->remap_state.roi_left = left;
+            strip->remap_state.roi_right = right;
+            strip->remap_state.sub_remapped_left_image = remapped_left_(left);
+            strip->remap_state.sub_remapped_right_image = remapped_right_(right);
+
+            left = ClipRows(roi_left, start, end);
+            right = ClipRows(roi_right, start, end);
+
+            strip->interest_state.left_image = remapped_left_;
+            strip->interest_state.right_image = remapped_right_;
+            strip->interest_state.sub_laplacian_left = laplacian_left_(left);
+            strip->interest_state.sub_laplacian_right = laplacian_right_(right);
+            strip->interest_state.roi_left = left;
+            strip->interest_state.roi_right = right;
         }
 
-        //printf("start: %d, end: %d\n", start, end);
+        for (unsigned int p = 0; p < strip->stereo_pieces.size(); p++) {
 
-        // send in the whole image because each thread needs
-        // the entire image to do its small remapping job
-        thread_states_[i].remapped_left = remapped_left;
-        thread_states_[i].remapped_right = remapped_right;
+            StereoStripPiece *piece = &strip->stereo_pieces[p];
+            PushbroomStereoStateThreaded *statet = &piece->stereo_state;
+
+            statet->state = state;
+
+            if (use_fused_strips_ == false) {
+                statet->remapped_left = remapped_left_;
+                statet->remapped_right = remapped_right_;
+
+                statet->laplacian_left = laplacian_left_;
+                statet->laplacian_right = laplacian_right_;
+            }
+        }
+
+        strip->interest_inputs_waiting = strip->interest_num_inputs;
+        strip->stereo_inputs_waiting = strip->stereo_num_inputs;
+    }
+
+    for (int k = 0; k < num_strips_; k++) {
+        if (use_fused_strips_) {
+            // fused strips don't wait on each other at all
+            if (strip_tasks_[k].stereo_pieces.empty() == false) {
+                work_stealing_pool_->Submit(RunFusedStrip, this, k);
+            }
+        } else {
+            // the remap tasks don't wait on anything, everything else is
+            // started by the tasks it waits on
+            work_stealing_pool_->Submit(RunRemapStrip, this, k);
+        }
+    }
+
+    work_stealing_pool_->Wait();
+
+    StageTimer merge_timer(STAGE_MERGE);
+
+    // combine the hits in the same order as the fixed pool
+    int capacity = 0;
+    for (int k = 0; k < num_strips_; k++) {
+        for (unsigned int p = 0; p < strip_tasks_[k].stereo_pieces.size(); p++) {
+            capacity += strip_tasks_[k].stereo_pieces[p].stereo_state.hits.x.size();
+        }
+    }
+    ReserveHits(&hits_, capacity);
+
+    for (int k = 0; k < num_strips_; k++) {
+        for (unsigned int p = 0; p < strip_tasks_[k].stereo_pieces.size(); p++) {
+            AppendHits(strip_tasks_[k].stereo_pieces[p].stereo_state.hits);
+        }
+    }
+}
+
+/**
+ * Cuts the image into strips and works out which strips' tasks wait on
+ * which.  Only needs to be rerun when the image size, block size, or last
+ * valid row changes.
+ *
+ * @param rows number of rows in the remapped image
+ * @param strip_height number of rows in each strip.  Must be a multiple
+ *      of the block size so that a strip boundary never falls inside a
+ *      block.
+ * @param state configuration parameters
+ */
+void PushbroomStereo::BuildStripTasks(int rows, int strip_height, const PushbroomStereoState &state) {
+
+    int num_strips = (rows + strip_height - 1) / strip_height;
+
+    if (num_strips != num_strips_) {
+        delete [] strip_tasks_;
+        strip_tasks_ = new StereoStripTask[num_strips];
+        num_strips_ = num_strips;
+    }
+
+    for (int k = 0; k < num_strips; k++) {
+        StereoStripTask *strip = &strip_tasks_[k];
+
+        strip->row_start = k * strip_height;
+        strip->row_end = min(rows, (k + 1) * strip_height);
+
+        strip->remap_dependents_first = num_strips;
+        strip->remap_dependents_last = -1;
+        strip->interest_dependents_first = num_strips;
+        strip->interest_dependents_last = -1;
+
+        strip->stereo_pieces.clear();
+    }
+
+    // search the same rows as the fixed pool would, cut at the strip
+    // boundaries.  Both are multiples of the block size, so each piece
+    // starts on the same block row the thread would have.
+    int row_starts[NUM_THREADS], row_ends[NUM_THREADS];
+    GetStereoRowRanges(rows, state, row_starts, row_ends);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        for (int k = 0; k < num_strips; k++) {
+            int start = max(row_starts[i], strip_tasks_[k].row_start);
+            int end = min(row_ends[i], strip_tasks_[k].row_end);
+
+            if (start < end) {
+                StereoStripPiece piece;
+                piece.stereo_state.row_start = start;
+                piece.stereo_state.row_end = end;
+
+                strip_tasks_[k].stereo_pieces.push_back(piece);
+            }
+        }
+    }
+
+    for (int k = 0; k < num_strips; k++) {
+        StereoStripTask *strip = &strip_tasks_[k];
+
+        // the 3x3 Laplacian reads one row above and below the strip
+        int first = max(0, strip->row_start - 1) / strip_height;
+        int last = min(rows - 1, strip->row_end) / strip_height;
+
+        strip->interest_num_inputs = last - first + 1;
+
+        for (int j = first; j <= last; j++) {
+            strip_tasks_[j].remap_dependents_first = min(strip_tasks_[j].remap_dependents_first, k);
+            strip_tasks_[j].remap_dependents_last = max(strip_tasks_[j].remap_dependents_last, k);
+        }
+
+        // the search reads the block and the horizontal invariance check
+        // reads up to INVARIANCE_CHECK_VERT_OFFSET_MAX rows on either side
+        strip->stereo_num_inputs = 0;
+
+        strip->search_row_start = strip->row_start;
+        strip->search_row_end = strip->row_start;
+
+        if (strip->stereo_pieces.empty()) {
+            continue;
+        }
+
+        int lowest = strip->stereo_pieces.front().stereo_state.row_start + INVARIANCE_CHECK_VERT_OFFSET_MIN;
+        int highest = strip->stereo_pieces.back().stereo_state.row_end - 1 + state.blockSize - 1 + INVARIANCE_CHECK_VERT_OFFSET_MAX;
+
+        strip->search_row_start = max(0, lowest);
+        strip->search_row_end = min(rows, highest + 1);
+
+        first = strip->search_row_start / strip_height;
+        last = (strip->search_row_end - 1) / strip_height;
+
+        strip->stereo_num_inputs = last - first + 1;
+
+        for (int j = first; j <= last; j++) {
+            strip_tasks_[j].interest_dependents_first = min(strip_tasks_[j].interest_dependents_first, k);
+            strip_tasks_[j].interest_dependents_last = max(strip_tasks_[j].interest_dependents_last, k);
+        }
+    }
+
+    strip_rows_ = rows;
+    strip_height_ = strip_height;
+    strip_block_size_ = state.blockSize;
+    strip_last_valid_pixel_row_ = state.lastValidPixelRow;
+}
+
+/**
+ * Work-stealing task: remaps one strip and starts the interest op for any
+ * strip that was only waiting on this one.
+ */
+void PushbroomStereo::RunRemapStrip(void *context, int strip) {
+
+    PushbroomStereo *parent = (PushbroomStereo*) context;
+    StereoStripTask *task = &parent->strip_tasks_[strip];
+
+    parent->RunRemapping(&task->remap_state);
+
+    for (int k = task->remap_dependents_first; k <= task->remap_dependents_last; k++) {
+        if (--parent->strip_tasks_[k].interest_inputs_waiting == 0) {
+            parent->work_stealing_pool_->Submit(RunInterestOpStrip, parent, k);
+        }
+    }
+}
+
+/**
+ * Work-stealing task: runs the interest op on one strip and starts the
+ * search for any strip that was only waiting on this one.
+ */
+void PushbroomStereo::RunInterestOpStrip(void *context, int strip) {
+
+    PushbroomStereo *parent = (PushbroomStereo*) context;
+    StereoStripTask *task = &parent->strip_tasks_[strip];
+
+    parent->RunInterestOp(&task->interest_state);
+
+    for (int k = task->interest_dependents_first; k <= task->interest_dependents_last; k++) {
+        if (--parent->strip_tasks_[k].stereo_inputs_waiting == 0) {
+            parent->work_stealing_pool_->Submit(RunStereoStrip, parent, k);
+        }
+    }
+}
+
+/**
+ * Work-stealing task for fused strips: remaps and filters just the rows the
+ * search reads into this thread's scratch images, then searches them
+ * straight away while they're still in cache.
+ */
+void PushbroomStereo::RunFusedStrip(void *context, int strip) {
+
+    PushbroomStereo *parent = (PushbroomStereo*) context;
+    StereoStripTask *task = &parent->strip_tasks_[strip];
 
-        thread_states_[i].laplacian_left = laplacian_left;
-        thread_states_[i].laplacian_right = laplacian_right;
+    StereoScratch *scratch = &parent->scratch_[parent->work_stealing_pool_->GetCurrentThreadIndex()];
 
-        thread_states_[i].pointVector3d = &pointVector3dArray[i];
-        thread_states_[i].pointVector2d = &pointVector2dArray[i];
-        thread_states_[i].pointColors = &pointColorsArray[i];
-        thread_states_[i].row_start = start;
-        thread_states_[i].row_end = end;
+    const Mat &mapxL = task->stereo_pieces[0].stereo_state.state.mapxL;
+    const Mat &mapxR = task->stereo_pieces[0].stereo_state.state.mapxR;
 
+    // create() only allocates the first time
+    scratch->remapped_left.create(mapxL.rows, mapxL.cols, task->remap_state.left_image.depth());
+    scratch->remapped_right.create(mapxR.rows, mapxR.cols, task->remap_state.right_image.depth());
+    scratch->laplacian_left.create(mapxL.rows, mapxL.cols, task->remap_state.left_image.depth());
+    scratch->laplacian_right.create(mapxR.rows, mapxR.cols, task->remap_state.right_image.depth());
 
+    // the regions were filled in by ProcessImagesWorkStealing
+    task->remap_state.sub_remapped_left_image = scratch->remapped_left(task->remap_state.roi_left);
+    task->remap_state.sub_remapped_right_image = scratch->remapped_right(task->remap_state.roi_right);
 
-        // fire the worker thread
-        StartWorkerThread(i, STEREO);
-    }
+    parent->RunRemapping(&task->remap_state);
 
-    // wait for all the threads to come back
-    SyncWorkerThreads();
+    // the Laplacian reads the pixels around its roi from the parent
+    // image, which we just remapped
+    task->interest_state.left_image = scratch->remapped_left;
+    task->interest_state.right_image = scratch->remapped_right;
+    task->interest_state.sub_laplacian_left = scratch->laplacian_left(task->interest_state.roi_left);
+    task->interest_state.sub_laplacian_right = scratch->laplacian_right(task->interest_state.roi_right);
 
-    //cout << "[main] got all stereo" << endl;
+    parent->RunInterestOp(&task->interest_state);
 
-    int numPoints = 0;
-    // compute the required size of our return vector
-    // this prevents multiple memory allocations
-    for (int i=0;i<NUM_THREADS;i++)
-    {
-        numPoints += pointVector3dArray[i].size();
-    }
-    pointVector3d->reserve(numPoints);
-    pointColors->reserve(numPoints);
+    for (unsigned int p = 0; p < task->stereo_pieces.size(); p++) {
+        PushbroomStereoStateThreaded *statet = &task->stereo_pieces[p].stereo_state;
 
-    // combine the hit vectors
-    for (int i=0;i<NUM_THREADS;i++)
-    {
-        pointVector3d->insert( pointVector3d->end(), pointVector3dArray[i].begin(), pointVector3dArray[i].end() );
+        statet->remapped_left = scratch->remapped_left;
+        statet->remapped_right = scratch->remapped_right;
 
-        pointColors->insert( pointColors->end(), pointColorsArray[i].begin(), pointColorsArray[i].end() );
+        statet->laplacian_left = scratch->laplacian_left;
+        statet->laplacian_right = scratch->laplacian_right;
 
-        if (state.show_display)
-        {
-            pointVector2d->insert( pointVector2d->end(), pointVector2dArray[i].begin(), pointVector2dArray[i].end() );
-        }
+        parent->RunStereoPushbroomStereo(statet);
     }
+}
+
+/**
+ * Work-stealing task: runs the stereo search on one strip.
+ */
+void PushbroomStereo::RunStereoStrip(void *context, int strip) {
+
+    PushbroomStereo *parent = (PushbroomStereo*) context;
+    StereoStripTask *task = &parent->strip_tasks_[strip];
 
+    for (unsigned int p = 0; p < task->stereo_pieces.size(); p++) {
+        parent->RunStereoPushbroomStereo(&task->stereo_pieces[p].stereo_state);
+    }
 }
 
 void PushbroomStereo::StartWorkerThread(int i, ThreadWorkType work_type) {
@@ -344,27 +1248,80 @@ void PushbroomStereo::SyncWorkerThreads() {
     //cout << "[main] leaving sync workers" << endl;
 }
 
+/**
+ * Selects which SAD kernel GetSAD uses.  Falls back to the scalar kernel
+ * if the requested one isn't supported on this CPU.
+ *
+ * @param type kernel type to use
+ */
+void PushbroomStereo::SetSadKernel(SadKernelType type) {
+    sad_kernel_ = GetSadKernel(type);
+    sad_strip_kernel_ = GetSadStripKernel(type);
+    shifted_sad_kernel_ = GetShiftedSadKernel(type);
+    sad_kernel_type_ = type;
+
+    if (sad_kernel_ == NULL || sad_strip_kernel_ == NULL || shifted_sad_kernel_ == NULL) {
+        cerr << "Warning: SAD kernel \"" << GetSadKernelName(type) << "\" is not supported on this CPU, using scalar." << endl;
+        sad_kernel_ = GetSadKernel(SAD_KERNEL_SCALAR);
+        sad_strip_kernel_ = GetSadStripKernel(SAD_KERNEL_SCALAR);
+        shifted_sad_kernel_ = GetShiftedSadKernel(SAD_KERNEL_SCALAR);
+        sad_kernel_type_ = SAD_KERNEL_SCALAR;
+    }
+}
+
 /**
  * Function (for running in a thread) that remaps images
  *
  */
 void PushbroomStereo::RunRemapping(RemapThreadState *remap_state) {
 
+    StageTimer timer(STAGE_REMAP);
+
     // remap this part of the image
 
-    remap(remap_state->left_image, remap_state->sub_remapped_left_image, remap_state->submapxL, Mat(), INTER_NEAREST);
-    remap(remap_state->right_image, remap_state->sub_remapped_right_image, remap_state->submapxR, Mat(), INTER_NEAREST);
+    bool use_tables = remap_state->remap_table_left.empty() == false && remap_state->remap_table_right.empty() == false;
 
+    if (remap_state->roi_left.area() > 0) {
+        if (use_tables) {
+            remap_state->remap_table_left.Remap(remap_state->left_image, remap_state->sub_remapped_left_image, remap_state->roi_left);
+        } else {
+            remap(remap_state->left_image, remap_state->sub_remapped_left_image, remap_state->submapxL, Mat(), INTER_NEAREST);
+        }
+    }
 
+    if (remap_state->roi_right.area() > 0) {
+        if (use_tables) {
+            remap_state->remap_table_right.Remap(remap_state->right_image, remap_state->sub_remapped_right_image, remap_state->roi_right);
+        } else {
+            remap(remap_state->right_image, remap_state->sub_remapped_right_image, remap_state->submapxR, Mat(), INTER_NEAREST);
+        }
+    }
 
 }
 
 void PushbroomStereo::RunInterestOp(InterestOpState *interest_state) {
 
-    // apply interest operator
-    Laplacian(interest_state->left_image.rowRange(interest_state->row_start, interest_state->row_end), interest_state->sub_laplacian_left, -1, 3, 1, 0, BORDER_DEFAULT);
+    StageTimer timer(STAGE_INTEREST_OP);
+
+    // Laplacian(src, dst, -1, 3, 1, 0, BORDER_DEFAULT) builds this filter
+    // (and its row buffers) every time it is called.  Keeping it means the
+    // buffers are only allocated once.
+    if (interest_state->laplacian_filter.empty()) {
+        float kernel_values[9] = { 2, 0, 2, 0, -8, 0, 2, 0, 2 };
+        Mat kernel(3, 3, CV_32F, kernel_values);
+
+        interest_state->laplacian_filter = createLinearFilter(CV_8UC1, CV_8UC1, kernel, Point(-1, -1), 0, BORDER_DEFAULT);
+    }
+
+    // apply interest operator.  Inside the image, the filter reads the
+    // pixels around the roi from the parent image.
+    if (interest_state->roi_left.area() > 0) {
+        interest_state->laplacian_filter->apply(interest_state->left_image(interest_state->roi_left), interest_state->sub_laplacian_left);
+    }
 
-    Laplacian(interest_state->right_image.rowRange(interest_state->row_start, interest_state->row_end), interest_state->sub_laplacian_right, -1, 3, 1, 0, BORDER_DEFAULT);
+    if (interest_state->roi_right.area() > 0) {
+        interest_state->laplacian_filter->apply(interest_state->right_image(interest_state->roi_right), interest_state->sub_laplacian_right);
+    }
 
 }
 
@@ -372,93 +1329,138 @@ void PushbroomStereo::RunInterestOp(InterestOpState *interest_state) {
  * Function that actually does the work for the PushbroomStereo algorithm.
  *
  * @param statet all the parameters are set
- *          as a PushbroomStereoStateThreaded struct.
- *
- * @retval will always be NULL since the real values are passed
- *      back in the vector that is in statet.
+ *          as a PushbroomStereoStateThreaded struct.  The hits are put in
+ *          statet->hits.
  */
 void PushbroomStereo::RunStereoPushbroomStereo(PushbroomStereoStateThreaded *statet)
 {
 
-    Mat leftImage = statet->remapped_left;
-    Mat rightImage = statet->remapped_right;
-    Mat laplacian_left = statet->laplacian_left;
-    Mat laplacian_right = statet->laplacian_right;
+    StageTimer timer(STAGE_STEREO);
+
+    const Mat &leftImage = statet->remapped_left;
+    const Mat &rightImage = statet->remapped_right;
+    const Mat &laplacian_left = statet->laplacian_left;
+    const Mat &laplacian_right = statet->laplacian_right;
 
-    cv::vector<Point3f> *pointVector3d = statet->pointVector3d;
-    cv::vector<Point3i> *pointVector2d = statet->pointVector2d;
-    cv::vector<uchar> *pointColors = statet->pointColors;
+    PushbroomHitBuffer *hits = &statet->hits;
 
     int row_start = statet->row_start;
     int row_end = statet->row_end;
 
-    PushbroomStereoState state = statet->state;
+    const PushbroomStereoState &state = statet->state;
 
     // we will do this by looping through every block in the left image
     // (defined by blockSize) and checking for a matching value on
     // the right image
 
-    cv::vector<Point3f> localHitPoints;
-
     int blockSize = state.blockSize;
     int disparity = state.disparity;
     int sadThreshold = state.sadThreshold;
 
-    int startJ = 0;
-    int stopJ = leftImage.cols - (disparity + blockSize);
-    if (disparity < 0)
-    {
-        startJ = -disparity;
-        stopJ = leftImage.cols - blockSize;
-    }
+    int startJ, stopJ;
+    GetStereoColumns(leftImage.cols, blockSize, disparity, &startJ, &stopJ);
 
     //printf("row_start: %d, row_end: %d, startJ: %d, stopJ: %d, rows: %d, cols: %d\n", row_start, row_end, startJ, stopJ, leftImage.rows, leftImage.cols);
 
     int hitCounter = 0;
 
+    hits->count = 0;
 
     if (state.random_results < 0) {
+
+        // set up each disparity we search.  The row of blocks for every
+        // disparity is scored before moving on to the next row, so they
+        // all read the same rows of the left image while it's in cache.
+        cv::vector<DisparitySearch> &searches = statet->disparity_searches;
+        SetUpDisparitySearches(leftImage.cols, state, &searches);
+
+        // make room for every block to be a hit, so adding hits never
+        // allocates.  This only grows when the settings change.
+        int num_block_rows = row_end > row_start ? (row_end - row_start + blockSize - 1) / blockSize : 0;
+        int max_hits = 0;
+
+        for (unsigned int k = 0; k < searches.size(); k++) {
+            max_hits += num_block_rows * searches[k].num_blocks;
+        }
+
+        ReserveHits(hits, max_hits);
+
+        // hits go to the center of the block instead of the top left
+        // corner
+        float block_center = blockSize / 2.0;
+
+        StereoStripBuffers *strip_buffers = &statet->strip_buffers;
+
+        // the invariance check runs once per row of blocks, so add it up
+        // and record it once instead of filling the profiler's buffer
+        bool time_invariance = state.check_horizontal_invariance && StageProfiler::IsEnabled();
+        uint64_t invariance_ns = 0;
+
         for (int i=row_start; i < row_end; i+=blockSize)
         {
-            for (int j=startJ; j < stopJ; j+=blockSize)
+            for (unsigned int k = 0; k < searches.size(); k++)
             {
-                // get the sum of absolute differences for this location
-                // on both images
-                int sad = GetSAD(leftImage, rightImage, laplacian_left, laplacian_right, j, i, state);
-                // check to see if the SAD is below the threshold,
-                // indicating a hit
-                if (sad < sadThreshold && sad >= 0)
-                {
-                    // got a hit
-
-                    // now check for horizontal invariance
-                    // (ie check for parts of the image that look the same as this
-                    // which would indicate that this might be a false-positive)
-
-                    if (!state.check_horizontal_invariance || CheckHorizontalInvariance(leftImage, rightImage, laplacian_left, laplacian_right, j, i, state) == false) {
+                const PushbroomStereoState &search_state = searches[k].state;
+                int search_disparity = search_state.disparity;
+                int search_start_j = searches[k].start_j;
+                int num_blocks = searches[k].num_blocks;
 
-                        // add it to the vector of matches
-                        // don't forget to offset it by the blockSize,
-                        // so we match the center of the block instead
-                        // of the top left corner
-                        localHitPoints.push_back(Point3f(j+blockSize/2.0, i+blockSize/2.0, -disparity));
+                // get the sum of absolute differences for every block
+                // in this row in one pass
+                GetSADStrip(leftImage, rightImage, laplacian_left, laplacian_right, i, search_start_j, num_blocks, search_state, strip_buffers);
 
-                        //localHitPoints.push_back(Point3f(state.debugJ, state.debugI, -disparity));
+                if (state.check_horizontal_invariance) {
+                    uint64_t invariance_start_ns = time_invariance ? StageProfiler::GetTimeNs() : 0;
 
+                    CheckHorizontalInvarianceStrip(leftImage, rightImage, laplacian_left, laplacian_right, i, search_start_j, num_blocks, search_state, strip_buffers);
 
-                        uchar pxL = leftImage.at<uchar>(i,j);
-                        pointColors->push_back(pxL); // TODO: this is the corner of the box, not the center
+                    if (time_invariance) {
+                        invariance_ns += StageProfiler::GetTimeNs() - invariance_start_ns;
+                    }
+                }
 
-                        hitCounter ++;
+                int first_hit = hitCounter;
 
-                        if (state.show_display)
-                        {
-                            pointVector2d->push_back(Point3i(j, i, sad));
-                        }
-                    } // check horizontal invariance
+                for (int block = 0; block < num_blocks; block++)
+                {
+                    int j = search_start_j + block * blockSize;
+                    int sad = strip_buffers->scores[block];
+
+                    // check to see if the SAD is below the threshold,
+                    // indicating a hit
+                    if (sad < sadThreshold && sad >= 0)
+                    {
+                        // got a hit
+
+                        // now check for horizontal invariance
+                        // (ie check for parts of the image that look the same as this
+                        // which would indicate that this might be a false-positive)
+
+                        if (!state.check_horizontal_invariance || strip_buffers->invariant[block] == false) {
+
+                            // add it to the hits.  Its 3D point is filled
+                            // in below.
+                            hits->grey[hitCounter] = leftImage.at<uchar>(i,j); // TODO: this is the corner of the box, not the center
+                            hits->disparity[hitCounter] = search_disparity;
+                            hits->pixel_x[hitCounter] = j;
+                            hits->pixel_y[hitCounter] = i;
+                            hits->sad[hitCounter] = sad;
+
+                            hitCounter ++;
+                        } // check horizontal invariance
+                    }
                 }
+
+                // every hit from this row of blocks is at the same
+                // disparity, so transform them to 3d points together
+                searches[k].projector.Project(hits->pixel_x.data() + first_hit, hits->pixel_y.data() + first_hit, hitCounter - first_hit, block_center,
+                    hits->x.data() + first_hit, hits->y.data() + first_hit, hits->z.data() + first_hit);
             }
         }
+
+        if (time_invariance) {
+            StageProfiler::Record(STAGE_INVARIANCE, invariance_ns);
+        }
     } else {
 
         double intpart;
@@ -475,23 +1477,216 @@ void PushbroomStereo::RunStereoPushbroomStereo(PushbroomStereoStateThreaded *sta
             hitCounter ++;
         }
 
+        ReserveHits(hits, hitCounter);
+
         for (int i = 0; i < hitCounter; i++) {
 
             int randx = rand() % (stopJ - startJ) + startJ;
             int randy = rand() % (row_end - row_start) + row_start;
 
-            localHitPoints.push_back(Point3f(randx, randy, -disparity));
+            hits->grey[i] = leftImage.at<uchar>(randy, randx);
+            hits->disparity[i] = disparity;
+            hits->pixel_x[i] = randx;
+            hits->pixel_y[i] = randy;
+            hits->sad[i] = 0;
         }
-    }
 
-    // now we have an array of hits -- transform them to 3d points
-    if (hitCounter > 0) {
+        // transform them to 3d points
+        DisparityProjector projector;
+        projector.Set(state.Q, disparity);
 
-        perspectiveTransform(localHitPoints, *pointVector3d, state.Q);
+        projector.Project(hits->pixel_x.data(), hits->pixel_y.data(), hitCounter, 0, hits->x.data(), hits->y.data(), hits->z.data());
     }
 
+    hits->count = hitCounter;
+}
+
+
+/**
+ * Remaps and filters a whole pair of images on the calling thread, the same
+ * way ProcessImages does before it searches.  For running the search more
+ * than once on the same frame (see GetBlockScores).
+ *
+ * @param leftImage left image from the camera
+ * @param rightImage right image from the camera
+ * @param state configuration parameters (the maps are all that's used)
+ * @param remapped_left output: rectified left image
+ * @param remapped_right output: rectified right image
+ * @param laplacian_left output: interest operator on the rectified left image
+ * @param laplacian_right output: same for the right image
+ */
+void PushbroomStereo::RemapAndFilter(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state, Mat *remapped_left, Mat *remapped_right, Mat *laplacian_left, Mat *laplacian_right) {
+
+    CV_Assert(leftImage.type() == CV_8UC1 && rightImage.type() == CV_8UC1);
+
+    remapped_left->create(state.mapxL.rows, state.mapxL.cols, leftImage.depth());
+    remapped_right->create(state.mapxR.rows, state.mapxR.cols, rightImage.depth());
+
+    RemapThreadState remap_state;
+
+    remap_state.left_image = leftImage;
+    remap_state.right_image = rightImage;
+    remap_state.submapxL = state.mapxL;
+    remap_state.submapxR = state.mapxR;
+    remap_state.remap_table_left = state.remapTableL;
+    remap_state.remap_table_right = state.remapTableR;
+    remap_state.roi_left = Rect(0, 0, remapped_left->cols, remapped_left->rows);
+    remap_state.roi_right = Rect(0, 0, remapped_right->cols, remapped_right->rows);
+    remap_state.sub_remapped_left_image = *remapped_left;
+    remap_state.sub_remapped_right_image = *remapped_right;
+
+    RunRemapping(&remap_state);
+
+    laplacian_left->create(remapped_left->rows, remapped_left->cols, remapped_left->depth());
+    laplacian_right->create(remapped_right->rows, remapped_right->cols, remapped_right->depth());
+
+    InterestOpState interest_state;
+
+    interest_state.left_image = *remapped_left;
+    interest_state.right_image = *remapped_right;
+    interest_state.sub_laplacian_left = *laplacian_left;
+    interest_state.sub_laplacian_right = *laplacian_right;
+    interest_state.roi_left = remap_state.roi_left;
+    interest_state.roi_right = remap_state.roi_right;
+
+    RunInterestOp(&interest_state);
+}
+
+/**
+ * Scores every block the stereo search looks at and keeps the raw sums
+ * that the thresholds are compared against, so IsBlockHit can try other
+ * values of sadThreshold, sobelLimit, and horizontalInvarianceMultiplier
+ * without searching again.  Blocks are in the same order that
+ * ProcessImages returns hits.
+ *
+ * Blocks (and horizontal invariance offsets) that can't be a hit with
+ * state.sadThreshold and state.sobelLimit are left out to save space, so
+ * pass the loosest values you are going to try.
+ *
+ * Runs on the calling thread.
+ *
+ * @param leftImage rectified left image (from RemapAndFilter)
+ * @param rightImage rectified right image
+ * @param laplacian_left laplacian-filtered left image
+ * @param laplacian_right laplacian-filtered right image
+ * @param state configuration parameters
+ * @param scores output: blocks that could be hits
+ */
+void PushbroomStereo::GetBlockScores(const Mat &leftImage, const Mat &rightImage, const Mat &laplacian_left, const Mat &laplacian_right, const PushbroomStereoState &state, PushbroomFrameScores *scores) {
+
+    int blockSize = state.blockSize;
+
+    scores->block_size = blockSize;
+    scores->check_horizontal_invariance = state.check_horizontal_invariance;
+
+    scores->blocks.clear();
+    scores->offset_sad.clear();
+    scores->offset_right_interest.clear();
+
+    int row_starts[NUM_THREADS], row_ends[NUM_THREADS];
+    GetStereoRowRanges(leftImage.rows, state, row_starts, row_ends);
+
+    cv::vector<DisparitySearch> searches;
+    SetUpDisparitySearches(leftImage.cols, state, &searches);
+
+    int sad_array[INVARIANCE_CHECK_NUM_OFFSETS];
+    int right_val_array[INVARIANCE_CHECK_NUM_OFFSETS];
+
+    // go through the rows in the same order as the threads' hits are put
+    // together
+    for (int t = 0; t < NUM_THREADS; t++) {
+        for (int i = row_starts[t]; i < row_ends[t]; i += blockSize) {
+            for (unsigned int k = 0; k < searches.size(); k++) {
+
+                const PushbroomStereoState &search_state = searches[k].state;
+
+                for (int block = 0; block < searches[k].num_blocks; block++) {
+
+                    int j = searches[k].start_j + block * blockSize;
+
+                    PushbroomBlockScore score;
+
+                    GetSAD(leftImage, rightImage, laplacian_left, laplacian_right, j, i, search_state, &score.left_interest, &score.right_interest, &score.sad);
+
+                    int sad = ScoreBlock(score.sad, score.left_interest, score.right_interest, state.sobelLimit);
+
+                    if (sad < 0 || sad >= state.sadThreshold) {
+                        // not a hit with these settings, so not with any
+                        // stricter ones either
+                        continue;
+                    }
+
+                    score.pixel_x = j;
+                    score.pixel_y = i;
+                    score.disparity = search_state.disparity;
+                    score.invariance_off_edge = false;
+                    score.first_offset = scores->offset_sad.size();
+                    score.num_offsets = 0;
+
+                    if (state.check_horizontal_invariance) {
+
+                        int leftVal;
+
+                        if (GetInvarianceSums(leftImage, rightImage, laplacian_left, laplacian_right, j, i, search_state, &leftVal, sad_array, right_val_array) == false) {
+                            score.invariance_off_edge = true;
+                        } else {
+                            for (int n = 0; n < INVARIANCE_CHECK_NUM_OFFSETS; n++) {
+                                // offsets that fail the interest operator
+                                // here never match
+                                if (right_val_array[n] >= state.sobelLimit) {
+                                    scores->offset_sad.push_back(sad_array[n]);
+                                    scores->offset_right_interest.push_back(right_val_array[n]);
+                                    score.num_offsets ++;
+                                }
+                            }
+                        }
+                    }
+
+                    scores->blocks.push_back(score);
+                }
+            }
+        }
+    }
 }
 
+/**
+ * Decides if a block from GetBlockScores is a hit, giving exactly the same
+ * answer ProcessImages would.
+ *
+ * @param scores scores from GetBlockScores
+ * @param block index in scores.blocks
+ * @param state thresholds to use: sadThreshold, sobelLimit, and
+ *      horizontalInvarianceMultiplier.  (The horizontal invariance check is
+ *      on if it was when the scores were found.)
+ *
+ * @retval true for a hit
+ */
+bool PushbroomStereo::IsBlockHit(const PushbroomFrameScores &scores, int block, const PushbroomStereoState &state) {
+
+    const PushbroomBlockScore &score = scores.blocks[block];
+
+    int sad = ScoreBlock(score.sad, score.left_interest, score.right_interest, state.sobelLimit);
+
+    if (sad < 0 || sad >= state.sadThreshold) {
+        return false;
+    }
+
+    if (scores.check_horizontal_invariance == false) {
+        return true;
+    }
+
+    if (score.invariance_off_edge) {
+        return false;
+    }
+
+    for (int n = score.first_offset; n < score.first_offset + score.num_offsets; n++) {
+        if (InvarianceMatch(scores.offset_sad[n], score.left_interest, scores.offset_right_interest[n], state)) {
+            return false;
+        }
+    }
+
+    return true;
+}
 
 /**
  * Get the sum of absolute differences for a specific pixel location and disparity
@@ -509,7 +1704,7 @@ void PushbroomStereo::RunStereoPushbroomStereo(PushbroomStereoStateThreaded *sta
  * @retval scaled sum of absolute differences for this block --
  *      the value is the sum/numberOfPixels
  */
-int PushbroomStereo::GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat laplacianR, int pxX, int pxY, PushbroomStereoState state, int *left_interest, int *right_interest, int *raw_sad)
+int PushbroomStereo::GetSAD(const Mat &leftImage, const Mat &rightImage, const Mat &laplacianL, const Mat &laplacianR, int pxX, int pxY, const PushbroomStereoState &state, int *left_interest, int *right_interest, int *raw_sad)
 {
     // init parameters
     int blockSize = state.blockSize;
@@ -521,10 +1716,7 @@ int PushbroomStereo::GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat l
     int startY = pxY;
 
     // bottom right corner of the SAD box
-    #ifndef USE_NEON
-        int endX = pxX + blockSize - 1;
-    #endif
-
+    int endX = pxX + blockSize - 1;
     int endY = pxY + blockSize - 1;
 
     #if USE_SAFTEY_CHECKS
@@ -608,82 +1800,105 @@ int PushbroomStereo::GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat l
 
     #endif
 
-    for (int i=startY;i<=endY;i++) {
-        // get a pointer for this row
-        uchar *this_rowL = leftImage.ptr<uchar>(i);
-        uchar *this_rowR = rightImage.ptr<uchar>(i);
+    bool used_kernel = false;
+
+    // if the whole block fits, hand it to the vectorized kernel.  The SIMD
+    // kernels read SAD_KERNEL_MAX_BLOCK_SIZE bytes per row, so blocks
+    // right at the edge of the image go through the loop below instead.
+    if (endX - startX + 1 == blockSize && endY - startY + 1 == blockSize
+        && blockSize <= SAD_KERNEL_MAX_BLOCK_SIZE
+        && startX + disparity >= 0
+        && startX + SAD_KERNEL_MAX_BLOCK_SIZE <= leftImage.cols
+        && startX + disparity + SAD_KERNEL_MAX_BLOCK_SIZE <= rightImage.cols
+        && leftImage.step[0] == rightImage.step[0]
+        && leftImage.step[0] == laplacianL.step[0]
+        && leftImage.step[0] == laplacianR.step[0]) {
+
+        sad_kernel_(leftImage.ptr<uchar>(startY) + startX,
+            rightImage.ptr<uchar>(startY) + startX + disparity,
+            laplacianL.ptr<uchar>(startY) + startX,
+            laplacianR.ptr<uchar>(startY) + startX + disparity,
+            leftImage.step[0], blockSize, &sad, &leftVal, &rightVal);
+
+        used_kernel = true;
+    }
 
-        uchar *this_row_laplacianL = laplacianL.ptr<uchar>(i);
-        uchar *this_row_laplacianR = laplacianR.ptr<uchar>(i);
+    if (!used_kernel) {
+        for (int i=startY;i<=endY;i++) {
+            // get a pointer for this row
+            const uchar *this_rowL = leftImage.ptr<uchar>(i);
+            const uchar *this_rowR = rightImage.ptr<uchar>(i);
 
-        #ifdef USE_NEON
-            // load this row into memory
-            uint8x8_t this_row_8x8_L = vld1_u8(this_rowL + startX);
-            uint8x8_t this_row_8x8_R = vld1_u8(this_rowR + startX + disparity);
+            const uchar *this_row_laplacianL = laplacianL.ptr<uchar>(i);
+            const uchar *this_row_laplacianR = laplacianR.ptr<uchar>(i);
 
-            uint8x8_t interest_op_8x8_L = vld1_u8(this_row_laplacianL + startX);
-            uint8x8_t interest_op_8x8_R = vld1_u8(this_row_laplacianR + startX + disparity);
+            #ifdef USE_NEON
+                // load this row into memory
+                uint8x8_t this_row_8x8_L = vld1_u8(this_rowL + startX);
+                uint8x8_t this_row_8x8_R = vld1_u8(this_rowR + startX + disparity);
 
-            // do absolute differencing for the entire row in one operation!
-            uint8x8_t sad_8x = vabd_u8(this_row_8x8_L, this_row_8x8_R);
+                uint8x8_t interest_op_8x8_L = vld1_u8(this_row_laplacianL + startX);
+                uint8x8_t interest_op_8x8_R = vld1_u8(this_row_laplacianR + startX + disparity);
 
-            // sum up
-            sad_sum_8x = vaddw_u8(sad_sum_8x, sad_8x);
+                // do absolute differencing for the entire row in one operation!
+                uint8x8_t sad_8x = vabd_u8(this_row_8x8_L, this_row_8x8_R);
 
-            // sum laplacian values
-            interest_op_sum_8x_L = vaddw_u8(interest_op_sum_8x_L, interest_op_8x8_L);
-            interest_op_sum_8x_R = vaddw_u8(interest_op_sum_8x_R, interest_op_8x8_R);
+                // sum up
+                sad_sum_8x = vaddw_u8(sad_sum_8x, sad_8x);
 
-        #else // USE_NEON
+                // sum laplacian values
+                interest_op_sum_8x_L = vaddw_u8(interest_op_sum_8x_L, interest_op_8x8_L);
+                interest_op_sum_8x_R = vaddw_u8(interest_op_sum_8x_R, interest_op_8x8_R);
 
-            for (int j=startX;j<=endX;j++) {
-                // we are now looking at a single pixel value
-                /*uchar pxL = leftImage.at<uchar>(i,j);
-                uchar pxR = rightImage.at<uchar>(i,j + disparity);
+            #else // USE_NEON
 
-                uchar sL = laplacianL.at<uchar>(i,j);
-                uchar sR = laplacianR.at<uchar>(i,j + disparity);
-                */
+                for (int j=startX;j<=endX;j++) {
+                    // we are now looking at a single pixel value
+                    /*uchar pxL = leftImage.at<uchar>(i,j);
+                    uchar pxR = rightImage.at<uchar>(i,j + disparity);
 
+                    uchar sL = laplacianL.at<uchar>(i,j);
+                    uchar sR = laplacianR.at<uchar>(i,j + disparity);
+                    */
 
-                uchar sL = this_row_laplacianL[j];//laplacianL.at<uchar>(i,j);
-                uchar sR = this_row_laplacianR[j + disparity]; //laplacianR.at<uchar>(i,j + disparity);
 
-                leftVal += sL;
-                rightVal += sR;
+                    uchar sL = this_row_laplacianL[j];//laplacianL.at<uchar>(i,j);
+                    uchar sR = this_row_laplacianR[j + disparity]; //laplacianR.at<uchar>(i,j + disparity);
 
-                uchar pxL = this_rowL[j];
-                uchar pxR = this_rowR[j + disparity];
+                    leftVal += sL;
+                    rightVal += sR;
 
-                sad += abs(pxL - pxR);
-            }
-        #endif // USE_NEON
-    }
+                    uchar pxL = this_rowL[j];
+                    uchar pxR = this_rowR[j + disparity];
 
-    #ifdef USE_NEON
-        // sum up
-        sad = vgetq_lane_u16(sad_sum_8x, 0) + vgetq_lane_u16(sad_sum_8x, 1)
-           + vgetq_lane_u16(sad_sum_8x, 2) + vgetq_lane_u16(sad_sum_8x, 3)
-           + vgetq_lane_u16(sad_sum_8x, 4);// + vgetq_lane_u16(sad_sum_8x, 5)
-    //           + vgetq_lane_u16(sad_sum_8x, 6) + vgetq_lane_u16(sad_sum_8x, 7);
-
-        leftVal = vgetq_lane_u16(interest_op_sum_8x_L, 0)
-                + vgetq_lane_u16(interest_op_sum_8x_L, 1)
-                + vgetq_lane_u16(interest_op_sum_8x_L, 2)
-                + vgetq_lane_u16(interest_op_sum_8x_L, 3)
-                + vgetq_lane_u16(interest_op_sum_8x_L, 4);
-
-
-        rightVal = vgetq_lane_u16(interest_op_sum_8x_R, 0)
-                 + vgetq_lane_u16(interest_op_sum_8x_R, 1)
-                 + vgetq_lane_u16(interest_op_sum_8x_R, 2)
-                 + vgetq_lane_u16(interest_op_sum_8x_R, 3)
-                 + vgetq_lane_u16(interest_op_sum_8x_R, 4);
-    #endif
+                    sad += abs(pxL - pxR);
+                }
+            #endif // USE_NEON
+        }
 
-    //cout << "(" << leftVal << ", " << rightVal << ") vs. (" << leftVal2 << ", " << rightVal2 << ")" << endl;
+        #ifdef USE_NEON
+            // sum up
+            sad = vgetq_lane_u16(sad_sum_8x, 0) + vgetq_lane_u16(sad_sum_8x, 1)
+               + vgetq_lane_u16(sad_sum_8x, 2) + vgetq_lane_u16(sad_sum_8x, 3)
+               + vgetq_lane_u16(sad_sum_8x, 4);// + vgetq_lane_u16(sad_sum_8x, 5)
+        //           + vgetq_lane_u16(sad_sum_8x, 6) + vgetq_lane_u16(sad_sum_8x, 7);
+
+            leftVal = vgetq_lane_u16(interest_op_sum_8x_L, 0)
+                    + vgetq_lane_u16(interest_op_sum_8x_L, 1)
+                    + vgetq_lane_u16(interest_op_sum_8x_L, 2)
+                    + vgetq_lane_u16(interest_op_sum_8x_L, 3)
+                    + vgetq_lane_u16(interest_op_sum_8x_L, 4);
+
+
+            rightVal = vgetq_lane_u16(interest_op_sum_8x_R, 0)
+                     + vgetq_lane_u16(interest_op_sum_8x_R, 1)
+                     + vgetq_lane_u16(interest_op_sum_8x_R, 2)
+                     + vgetq_lane_u16(interest_op_sum_8x_R, 3)
+                     + vgetq_lane_u16(interest_op_sum_8x_R, 4);
+        #endif
+    }
 
-    int laplacian_value = leftVal + rightVal;
+    //cout << "(" << leftVal << ", " << rightVal << ") vs. (" << leftVal2 << ", " << rightVal2 << ")" << endl;
 
     //cout << "sad with neon: " << sad << " without neon: " << sad2 << endl;
 
@@ -702,16 +1917,87 @@ int PushbroomStereo::GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat l
         *raw_sad = sad;
     }
 
+    return ScoreBlock(sad, leftVal, rightVal, sobelLimit);
+}
 
-    if (leftVal < sobelLimit || rightVal < sobelLimit)// || diff_score > state.interest_diff_limit)
-    {
-        return -1;
+/**
+ * Batched version of GetSAD.  Scores every block in a blockSize-tall strip
+ * of the image in one pass: the strip kernel sums each column over the
+ * strip's rows, then each block's sums are just blockSize adjacent columns.
+ * Results are identical to calling GetSAD on each block.
+ *
+ * @param leftImage left image
+ * @param rightImage right image
+ * @param laplacianL laplacian-fitlered left image
+ * @param laplacianR laplacian-filtered right image
+ * @param pxY row of the top of the strip
+ * @param startX column of the left side of the first block
+ * @param num_blocks number of blocks to score, each blockSize to the right
+ *      of the last
+ * @param state state structure that includes a number of parameters
+ * @param buffers per-thread scratch space.  On return, buffers->scores
+ *      holds the GetSAD result for each block.
+ */
+void PushbroomStereo::GetSADStrip(const Mat &leftImage, const Mat &rightImage, const Mat &laplacianL, const Mat &laplacianR, int pxY, int startX, int num_blocks, const PushbroomStereoState &state, StereoStripBuffers *buffers)
+{
+    int blockSize = state.blockSize;
+    int disparity = state.disparity;
+    int sobelLimit = state.sobelLimit;
+
+    int width = num_blocks * blockSize;
+
+    buffers->scores.resize(num_blocks);
+
+    if (num_blocks <= 0) {
+        return;
     }
 
-    // weight laplacian_value into the score
+    // the strip kernel needs the whole strip inside the image and the same
+    // row step for every image.  If that isn't true, do it one block at
+    // a time
+    if (   pxY < 0 || startX < 0 || startX + disparity < 0
+        || pxY + blockSize > leftImage.rows || pxY + blockSize > rightImage.rows
+        || startX + width > leftImage.cols || startX + disparity + width > rightImage.cols
+        || leftImage.step[0] != rightImage.step[0]
+        || leftImage.step[0] != laplacianL.step[0]
+        || leftImage.step[0] != laplacianR.step[0]) {
+
+        for (int block = 0; block < num_blocks; block++) {
+            buffers->scores[block] = GetSAD(leftImage, rightImage, laplacianL, laplacianR, startX + block * blockSize, pxY, state);
+        }
+        return;
+    }
 
-    //return sobel;
-    return NUMERIC_CONST*(float)sad/(float)laplacian_value;
+    buffers->sad_columns.resize(width);
+    buffers->left_interest_columns.resize(width);
+    buffers->right_interest_columns.resize(width);
+
+    uint16_t *sad_columns = &buffers->sad_columns[0];
+    uint16_t *left_columns = &buffers->left_interest_columns[0];
+    uint16_t *right_columns = &buffers->right_interest_columns[0];
+
+    sad_strip_kernel_(leftImage.ptr<uchar>(pxY) + startX,
+        rightImage.ptr<uchar>(pxY) + startX + disparity,
+        laplacianL.ptr<uchar>(pxY) + startX,
+        laplacianR.ptr<uchar>(pxY) + startX + disparity,
+        leftImage.step[0], blockSize, width, sad_columns, left_columns,
+        right_columns);
+
+    int *scores = &buffers->scores[0];
+
+    for (int block = 0; block < num_blocks; block++) {
+        int sad = 0, leftVal = 0, rightVal = 0;
+
+        int column = block * blockSize;
+
+        for (int j = column; j < column + blockSize; j++) {
+            sad += sad_columns[j];
+            leftVal += left_columns[j];
+            rightVal += right_columns[j];
+        }
+
+        scores[block] = ScoreBlock(sad, leftVal, rightVal, sobelLimit);
+    }
 }
 
 /**
@@ -728,13 +2014,57 @@ int PushbroomStereo::GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat l
  *
  * @retval true if there is another match (so NOT an obstacle)
  */
-bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, Mat sobelL,
-    Mat sobelR, int pxX, int pxY, PushbroomStereoState state) {
+bool PushbroomStereo::CheckHorizontalInvariance(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL,
+    const Mat &sobelR, int pxX, int pxY, const PushbroomStereoState &state) {
+
+    int leftVal;
+    int right_val_array[INVARIANCE_CHECK_NUM_OFFSETS];
+    int sad_array[INVARIANCE_CHECK_NUM_OFFSETS];
+
+    if (GetInvarianceSums(leftImage, rightImage, sobelL, sobelR, pxX, pxY, state, &leftVal, sad_array, right_val_array) == false) {
+        // if we are off the edge of the image so we can't tell if this
+        // might be an issue -- give up and return true
+        // (note: this used to be false and caused bad detections on real flight
+        // data near the edge of the frame)
+        return true;
+    }
+
+    for (int i = 0; i < INVARIANCE_CHECK_NUM_OFFSETS; i++)
+    {
+        if (InvarianceMatch(sad_array[i], leftVal, right_val_array[i], state)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Gets the raw sums behind the horizontal invariance check for one block:
+ * the SAD and right-image interest at every offset around the
+ * zero-disparity match, in the order CheckHorizontalInvariance tests them.
+ *
+ * @param leftImage left image
+ * @param rightImage right image
+ * @param sobelL laplacian-filtered left image
+ * @param sobelR laplacian-filtered right image
+ * @param pxX column pixel location
+ * @param pxY row pixel location
+ * @param state state structure that includes a number of parameters
+ * @param left_interest output: interest operator sum for the left block
+ * @param sads output: INVARIANCE_CHECK_NUM_OFFSETS sums of absolute
+ *      differences
+ * @param right_interests output: INVARIANCE_CHECK_NUM_OFFSETS interest
+ *      operator sums for the right image
+ *
+ * @retval false if the offsets go off the edge of the image, in which case
+ *      the check gives up and rejects the block
+ */
+bool PushbroomStereo::GetInvarianceSums(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL,
+    const Mat &sobelR, int pxX, int pxY, const PushbroomStereoState &state, int *left_interest, int *sads, int *right_interests) {
 
     // init parameters
     int blockSize = state.blockSize;
     int disparity = state.zero_dist_disparity;
-    int sobelLimit = state.sobelLimit;
 
     // top left corner of the SAD box
     int startX = pxX;
@@ -745,14 +2075,10 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
     int endY = pxY + blockSize - 1;
 
 
-    // if we are off the edge of the image so we can't tell if this
-    // might be an issue -- give up and return true
-    // (note: this used to be false and caused bad detections on real flight
-    // data near the edge of the frame)
     if (   startX + disparity + INVARIANCE_CHECK_HORZ_OFFSET_MIN < 0
         || endX + disparity + INVARIANCE_CHECK_HORZ_OFFSET_MAX > rightImage.cols) {
 
-        return true;
+        return false;
     }
 
     if (startY + INVARIANCE_CHECK_VERT_OFFSET_MIN < 0
@@ -762,7 +2088,7 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
         // TODO: be smarter here
 
         // give up and bail out, deleting potential hits
-        return true;
+        return false;
 
     }
 
@@ -776,14 +2102,9 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
     // first check zero-disparity
     int leftVal = 0;
 
-    int right_val_array[400];
-    int sad_array[400];
-    int sobel_array[400];
-
-    for (int i=0;i<400;i++) {
-        right_val_array[i] = 0;
-        sad_array[i] = 0;
-        sobel_array[i] = 0;
+    for (int i = 0; i < INVARIANCE_CHECK_NUM_OFFSETS; i++) {
+        right_interests[i] = 0;
+        sads[i] = 0;
     }
 
     int counter = 0;
@@ -795,15 +2116,13 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
             // we are now looking at a single pixel value
             uchar pxL = leftImage.at<uchar>(i,j);
 
-            uchar pxR_array[400], sR_array[400];
-
             // for each pixel in the left image, we are going to search a bunch
             // of pixels in the right image.  We do it this way to save the computation
             // of dealing with the same left-image pixel over and over again.
 
             // counter indexes which location we're looking at for this run, so for each
             // pixel in the left image, we examine a bunch of pixels in the right image
-            // and add up their results into different slots in sad_array over the loop
+            // and add up their results into different slots in sads over the loop
             counter = 0;
 
             for (int vert_offset = INVARIANCE_CHECK_VERT_OFFSET_MIN;
@@ -814,11 +2133,11 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
                     horz_offset <= INVARIANCE_CHECK_HORZ_OFFSET_MAX;
                     horz_offset++) {
 
-                    pxR_array[counter] = rightImage.at<uchar>(i + vert_offset, j + disparity + horz_offset);
-                    sR_array[counter] = sobelR.at<uchar>(i + vert_offset, j + disparity + horz_offset);
-                    right_val_array[counter] += sR_array[counter];
+                    uchar pxR = rightImage.at<uchar>(i + vert_offset, j + disparity + horz_offset);
+                    uchar sR = sobelR.at<uchar>(i + vert_offset, j + disparity + horz_offset);
+                    right_interests[counter] += sR;
 
-                    sad_array[counter] += abs(pxL - pxR_array[counter]);
+                    sads[counter] += abs(pxL - pxR);
 
 
                     counter ++;
@@ -832,20 +2151,123 @@ bool PushbroomStereo::CheckHorizontalInvariance(Mat leftImage, Mat rightImage, M
         }
     }
 
-    for (int i = 0; i < counter; i++)
-    {
-        sobel_array[i] = leftVal + right_val_array[i];
+    *left_interest = leftVal;
 
-        // we don't check for leftVal >= sobelLimit because we have already
-        // checked that in the main search loop (in GetSAD).
-        //if (right_val_array[i] >= sobelLimit && 100*(float)sad_array[i]/(float)((float)sobel_array[i]*state.interestOperatorMultiplierHorizontalInvariance) < state.sadThreshold) {
-        if (right_val_array[i] >= sobelLimit && NUMERIC_CONST*state.horizontalInvarianceMultiplier*(float)sad_array[i]/((float)sobel_array[i]) < state.sadThreshold) {
-            return true;
-        }
+    return true;
+}
+
+/**
+ * Runs the horizontal invariance check for every candidate hit in a strip.
+ * Candidates are blocks whose score in buffers->scores passed sadThreshold.
+ *
+ * Instead of walking each candidate's pixels once per offset, the shifted
+ * SAD kernel does every horizontal offset of one vertical offset in a
+ * single pass (one instruction per four pixels on x86), and the same kernel
+ * run against a row of zeros gives the right-image interest sums.  Blocks
+ * near the edges of the image go through CheckHorizontalInvariance, which
+ * is also the reference for this function: results are identical.
+ *
+ * @param leftImage left image
+ * @param rightImage right image
+ * @param sobelL laplacian-filtered left image
+ * @param sobelR laplacian-filtered right image
+ * @param pxY row of the top of the strip
+ * @param startX column of the left side of the first block
+ * @param num_blocks number of blocks in the strip
+ * @param state state structure that includes a number of parameters
+ * @param buffers per-thread scratch space.  On return, buffers->invariant
+ *      is true for candidates that CheckHorizontalInvariance would have
+ *      rejected.
+ */
+void PushbroomStereo::CheckHorizontalInvarianceStrip(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL, const Mat &sobelR, int pxY, int startX, int num_blocks, const PushbroomStereoState &state, StereoStripBuffers *buffers) {
+
+    // the kernels compute a fixed number of shifts, make sure that's enough
+    // to cover the offsets we check
+    static_assert(INVARIANCE_CHECK_HORZ_OFFSET_MAX - INVARIANCE_CHECK_HORZ_OFFSET_MIN < SHIFTED_SAD_KERNEL_SHIFTS,
+        "too many horizontal invariance offsets for the shifted SAD kernel");
+
+    static const uint8_t zero_row[SAD_KERNEL_MAX_BLOCK_SIZE] = { 0 };
+
+    int blockSize = state.blockSize;
+    int disparity = state.zero_dist_disparity;
+    int sadThreshold = state.sadThreshold;
+
+    buffers->invariant.assign(num_blocks, false);
+
+    if (num_blocks <= 0) {
+        return;
     }
-    return false;
 
+    const int *scores = &buffers->scores[0];
+    uchar *invariant = &buffers->invariant[0];
+
+    int startY = pxY;
+    int endY = pxY + blockSize - 1;
+
+    // the kernels can only be used if every vertical offset is inside
+    // the image
+    bool strip_ok = blockSize <= SAD_KERNEL_MAX_BLOCK_SIZE
+        && startY + INVARIANCE_CHECK_VERT_OFFSET_MIN >= 0
+        && endY + INVARIANCE_CHECK_VERT_OFFSET_MAX < rightImage.rows
+        && endY < leftImage.rows;
+
+    for (int block = 0; block < num_blocks; block++) {
+
+        if (scores[block] < 0 || scores[block] >= sadThreshold) {
+            // not a candidate
+            continue;
+        }
+
+        int startX_block = startX + block * blockSize;
+
+        // leftmost pixel we look at in the right image
+        int right_start = startX_block + disparity + INVARIANCE_CHECK_HORZ_OFFSET_MIN;
+
+        if (!strip_ok
+            || right_start < 0
+            || right_start + SHIFTED_SAD_KERNEL_RIGHT_READ > rightImage.cols
+            || startX_block + blockSize > leftImage.cols) {
+
+            invariant[block] = CheckHorizontalInvariance(leftImage, rightImage, sobelL, sobelR, startX_block, pxY, state);
+            continue;
+        }
+
+        int leftVal = 0;
+
+        for (int i = startY; i <= endY; i++) {
+            const uchar *this_row_sobelL = sobelL.ptr<uchar>(i) + startX_block;
+
+            for (int j = 0; j < blockSize; j++) {
+                leftVal += this_row_sobelL[j];
+            }
+        }
+
+        const uchar *left_block = leftImage.ptr<uchar>(startY) + startX_block;
+
+        for (int vert_offset = INVARIANCE_CHECK_VERT_OFFSET_MIN;
+            vert_offset <= INVARIANCE_CHECK_VERT_OFFSET_MAX && invariant[block] == false;
+            vert_offset+= INVARIANCE_CHECK_VERT_OFFSET_INCREMENT) {
 
+            uint16_t sads[SHIFTED_SAD_KERNEL_SHIFTS];
+            uint16_t right_vals[SHIFTED_SAD_KERNEL_SHIFTS];
+
+            shifted_sad_kernel_(left_block, leftImage.step[0],
+                rightImage.ptr<uchar>(startY + vert_offset) + right_start,
+                rightImage.step[0], blockSize, sads);
+
+            shifted_sad_kernel_(zero_row, 0,
+                sobelR.ptr<uchar>(startY + vert_offset) + right_start,
+                sobelR.step[0], blockSize, right_vals);
+
+            for (int shift = 0; shift <= INVARIANCE_CHECK_HORZ_OFFSET_MAX - INVARIANCE_CHECK_HORZ_OFFSET_MIN; shift++) {
+
+                if (InvarianceMatch(sads[shift], leftVal, right_vals[shift], state)) {
+                    invariant[block] = true;
+                    break;
+                }
+            }
+        }
+    }
 }
 
 /**
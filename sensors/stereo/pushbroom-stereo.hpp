@@ -14,23 +14,41 @@
 #include <mutex>
 #include <condition_variable>
 #include <math.h>
+#include <atomic>
 #include <random> // for debug random generator
 
 #ifdef USE_NEON
 #include <arm_neon.h>
 #endif // USE_NEON
 
+#include "pushbroom-kernels.hpp"
+#include "WorkStealingPool.hpp"
+#include "RemapTable.hpp"
+
 #define NUM_THREADS 8
+
+// smallest strip of rows the work-stealing scheduler hands out as one task.
+// Strips are rounded up to a multiple of the block size.
+#define STRIP_MIN_HEIGHT 16
+
+// fused strips redo the rows around them, so they are taller to keep
+// that overhead down
+#define FUSED_STRIP_MIN_HEIGHT 32
 //#define NUM_REMAP_THREADS 8
 
 using namespace cv;
 using namespace std;
 
-enum ThreadWorkType { REMAP, INTEREST_OP, STEREO };
+enum ThreadWorkType { REMAP, INTEREST_OP, STEREO, QUIT };
 
 struct PushbroomStereoState
 {
     int disparity;
+
+    // more disparities to search along with disparity.  They share the
+    // remapping and interest operator, so each one costs only the search.
+    cv::vector<int> extra_disparities;
+
     int zero_dist_disparity;
     int sobelLimit;
     int blockSize;
@@ -43,6 +61,11 @@ struct PushbroomStereoState
 
     Mat mapxR;
 
+    // optional precomputed versions of mapxL and mapxR.  If they are
+    // built, they are used instead of cv::remap.
+    RemapTable remapTableL;
+    RemapTable remapTableR;
+
     Mat Q;
 
     bool show_display, check_horizontal_invariance;
@@ -54,6 +77,111 @@ struct PushbroomStereoState
     //cv::vector<Point3f> *localHitPoints; // this is an array of cv::vector<Point3f>'s
 };
 
+/**
+ * Scratch space for scoring one strip of blocks at a time.  Each worker
+ * thread keeps its own so we don't allocate in the stereo loop.
+ */
+struct StereoStripBuffers {
+    cv::vector<uint16_t> sad_columns;
+    cv::vector<uint16_t> left_interest_columns;
+    cv::vector<uint16_t> right_interest_columns;
+
+    cv::vector<int> scores;
+
+    // result of the horizontal invariance check for each block
+    cv::vector<uchar> invariant;
+};
+
+/**
+ * Q's perspective transform (what cv::perspectiveTransform does) for hits
+ * at one disparity.  For a rectified pair, the bottom row of Q doesn't
+ * depend on the pixel, so with the disparity fixed the divide is the same
+ * for every hit and the transform is just a scale and offset on the pixel.
+ * That is worked out once per frame instead of doing a 4x4 multiply and
+ * divide for each hit.  Any other Q gets the full transform.
+ */
+class DisparityProjector {
+
+    public:
+        DisparityProjector();
+
+        void Set(const Mat &Q, int disparity);
+
+        void Project(const int *pixel_x, const int *pixel_y, int num_points, float offset, float *x, float *y, float *z) const;
+
+    private:
+        bool affine_;
+
+        // x = scale_[0][0]*u + scale_[0][1]*v + offset_[0], and the same
+        // for y and z
+        float scale_[3][2];
+        float offset_[3];
+
+        // for Q's that aren't affine
+        double q_[16];
+        double disparity_;
+};
+
+/**
+ * One of the disparities a search thread looks at, with a copy of the
+ * state set to it for GetSADStrip and CheckHorizontalInvarianceStrip.
+ */
+struct DisparitySearch {
+    PushbroomStereoState state;
+
+    // turns hits at this disparity into 3D points
+    DisparityProjector projector;
+
+    int start_j;
+    int num_blocks;
+};
+
+/**
+ * Hits, one array per field.  The arrays are sized for the most hits the
+ * current settings can produce and only grow when the settings change, so
+ * filling one never allocates.
+ */
+struct PushbroomHitBuffer {
+    PushbroomHitBuffer() : count(0) {}
+
+    int count;
+
+    // 3D position, from Q
+    cv::vector<float> x;
+    cv::vector<float> y;
+    cv::vector<float> z;
+
+    // left image pixel at the corner of the block
+    cv::vector<uchar> grey;
+
+    cv::vector<int> disparity;
+
+    // top left corner of the block in the rectified image, and its score
+    cv::vector<int> pixel_x;
+    cv::vector<int> pixel_y;
+    cv::vector<int> sad;
+};
+
+/**
+ * Hits for one frame, as returned by ProcessImages.  The arrays belong to
+ * the PushbroomStereo and are only good until its next ProcessImages.
+ */
+struct PushbroomHits {
+    int count;
+
+    const float *x;
+    const float *y;
+    const float *z;
+
+    const uchar *grey;
+
+    const int *disparity;
+
+    const int *pixel_x;
+    const int *pixel_y;
+    const int *sad;
+};
+
 struct PushbroomStereoStateThreaded {
     PushbroomStereoState state;
 
@@ -63,14 +191,16 @@ struct PushbroomStereoStateThreaded {
     Mat laplacian_left;
     Mat laplacian_right;
 
-    cv::vector<Point3f> *pointVector3d;
-    cv::vector<Point3i> *pointVector2d;
-    cv::vector<uchar> *pointColors;
+    // this thread's hits
+    PushbroomHitBuffer hits;
 
     int row_start;
     int row_end;
 
+    StereoStripBuffers strip_buffers;
 
+    // kept between frames so we don't allocate them every time
+    cv::vector<DisparitySearch> disparity_searches;
 };
 
 struct RemapThreadState {
@@ -85,6 +215,14 @@ struct RemapThreadState {
 
     Mat submapxL;
     Mat submapxR;
+
+    // used instead of the submaps if they are built
+    RemapTable remap_table_left;
+    RemapTable remap_table_right;
+
+    // part of the full map that the submaps and sub images cover
+    Rect roi_left;
+    Rect roi_right;
 };
 
 struct InterestOpState {
@@ -94,8 +232,111 @@ struct InterestOpState {
     Mat sub_laplacian_left;
     Mat sub_laplacian_right;
 
+    // part of the image that the sub images cover
+    Rect roi_left;
+    Rect roi_right;
+
+    // the filter Laplacian uses, made once instead of on every call
+    Ptr<FilterEngine> laplacian_filter;
+};
+
+/**
+ * Part of one of the fixed thread pool's row ranges that falls inside a
+ * strip.  The work-stealing scheduler searches the same rows as the fixed
+ * pool and keeps the hits from each piece separate so it can put them back
+ * together in the same order.
+ */
+struct StereoStripPiece {
+    PushbroomStereoStateThreaded stereo_state;
+};
+
+/**
+ * One strip of rows for the work-stealing scheduler.  The strip is
+ * remapped, filtered, and searched as three tasks, each of which is
+ * started as soon as the rows it reads are ready instead of waiting for
+ * the whole image.
+ */
+struct StereoStripTask {
     int row_start;
     int row_end;
+
+    RemapThreadState remap_state;
+    InterestOpState interest_state;
+
+    cv::vector<StereoStripPiece> stereo_pieces;
+
+    // strips whose interest op / stereo tasks read rows this strip's
+    // remap / interest op tasks write
+    int remap_dependents_first, remap_dependents_last;
+    int interest_dependents_first, interest_dependents_last;
+
+    // number of tasks each of this strip's tasks waits on
+    int interest_num_inputs;
+    int stereo_num_inputs;
+
+    std::atomic<int> interest_inputs_waiting;
+    std::atomic<int> stereo_inputs_waiting;
+
+    // rows the stereo search reads (including the horizontal invariance
+    // check), which is what a fused strip has to remap and filter
+    int search_row_start;
+    int search_row_end;
+};
+
+/**
+ * Per-thread scratch images for fused strips.  They are the size of the
+ * whole frame so the search can use image coordinates, but each fused
+ * strip only writes the rows it reads, so those rows stay in cache.
+ */
+struct StereoScratch {
+    Mat remapped_left;
+    Mat remapped_right;
+
+    Mat laplacian_left;
+    Mat laplacian_right;
+};
+
+
+/**
+ * One block that the stereo search scored, with the raw sums its
+ * thresholds are compared against.  See PushbroomStereo::GetBlockScores.
+ */
+struct PushbroomBlockScore {
+    // top left corner of the block
+    int pixel_x;
+    int pixel_y;
+
+    int disparity;
+
+    int sad;
+    int left_interest;
+    int right_interest;
+
+    // true if the horizontal invariance check gives up on this block
+    // because it's too close to the edge, which rejects it for any
+    // thresholds
+    bool invariance_off_edge;
+
+    // where this block's horizontal invariance offsets are in
+    // PushbroomFrameScores
+    int first_offset;
+    int num_offsets;
+};
+
+/**
+ * Raw scores for the blocks of one frame that could be hits, so the
+ * thresholds can be changed without remapping, filtering, or searching
+ * again.
+ */
+struct PushbroomFrameScores {
+    int block_size;
+    bool check_horizontal_invariance;
+
+    cv::vector<PushbroomBlockScore> blocks;
+
+    // sums for each horizontal invariance offset that could still match
+    cv::vector<int> offset_sad;
+    cv::vector<int> offset_right_interest;
 };
 
 
@@ -107,8 +348,6 @@ class PushbroomStereo {
 
         void RunInterestOp(InterestOpState *interest_state);
 
-        bool CheckHorizontalInvariance(Mat leftImage, Mat rightImage, Mat sobelL, Mat sobelR, int pxX, int pxY, PushbroomStereoState state);
-
         void StartWorkerThread(int i, ThreadWorkType work_type);
         void SyncWorkerThreads();
 
@@ -118,6 +357,32 @@ class PushbroomStereo {
 
         int RoundUp(int numToRound, int multiple);
 
+        void GetStereoRowRanges(int rows, const PushbroomStereoState &state, int *row_starts, int *row_ends);
+
+        void GetStereoColumns(int cols, int blockSize, int disparity, int *start_j, int *stop_j);
+
+        void GetStereoRoi(Size image_size, const PushbroomStereoState &state, Rect *roi_left, Rect *roi_right);
+
+        void SetUpDisparitySearches(int cols, const PushbroomStereoState &state, cv::vector<DisparitySearch> *searches);
+
+        bool GetInvarianceSums(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL, const Mat &sobelR, int pxX, int pxY, const PushbroomStereoState &state, int *left_interest, int *sads, int *right_interests);
+
+        void StartThreadPool();
+
+        void ProcessImagesThreadPool(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state);
+
+        void ProcessImagesWorkStealing(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state);
+
+        void AppendHits(const PushbroomHitBuffer &from);
+
+        void BuildStripTasks(int rows, int strip_height, const PushbroomStereoState &state);
+
+        // work-stealing tasks, static for the same reason as WorkerThread
+        static void RunRemapStrip(void *context, int strip);
+        static void RunInterestOpStrip(void *context, int strip);
+        static void RunStereoStrip(void *context, int strip);
+        static void RunFusedStrip(void *context, int strip);
+
         pthread_t worker_pool_[NUM_THREADS+1];
         ThreadWorkType work_type_[NUM_THREADS+1];
 
@@ -134,11 +399,48 @@ class PushbroomStereo {
 
         unique_lock<mutex> lockers_[NUM_THREADS+1];
 
+        bool thread_pool_started_;
+
+        bool use_work_stealing_;
+        bool use_fused_strips_;
+        WorkStealingPool *work_stealing_pool_;
+        int num_work_stealing_threads_;
+
+        // one per work-stealing thread
+        cv::vector<StereoScratch> scratch_;
+
+        // whole-frame images for the fixed pool and the unfused
+        // work-stealing scheduler, kept between
+        // frames so we don't allocate them every time
+        Mat remapped_left_;
+        Mat remapped_right_;
+        Mat laplacian_left_;
+        Mat laplacian_right_;
+
+        // every thread's hits put together, which ProcessImages returns
+        PushbroomHitBuffer hits_;
+
+        StereoStripTask *strip_tasks_;
+        int num_strips_;
+
+        // settings the strip tasks were built for
+        int strip_rows_;
+        int strip_height_;
+        int strip_block_size_;
+        int strip_last_valid_pixel_row_;
+
+        SadKernel sad_kernel_;
+        SadStripKernel sad_strip_kernel_;
+        ShiftedSadKernel shifted_sad_kernel_;
+        SadKernelType sad_kernel_type_;
 
     public:
         PushbroomStereo();
+        ~PushbroomStereo();
 
-        void ProcessImages(InputArray _leftImage, InputArray _rightImage, cv::vector<Point3f> *pointVector3d, cv::vector<uchar> *pointColors, cv::vector<Point3i> *pointVector2d, PushbroomStereoState state);
+        void ProcessImages(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state, PushbroomHits *hits);
+
+        void ProcessImages(InputArray _leftImage, InputArray _rightImage, cv::vector<Point3f> *pointVector3d, cv::vector<uchar> *pointColors, cv::vector<Point3i> *pointVector2d, PushbroomStereoState state, cv::vector<int> *pointDisparities = NULL);
 
         ThreadWorkType GetWorkType(int i) { return work_type_[i]; }
 
@@ -149,12 +451,38 @@ class PushbroomStereo {
         bool GetHasNewData(int i) { return has_new_data_[i]; }
         void SetHasNewData(int i, bool val) { has_new_data_[i] = val; }
 
-        int GetSAD(Mat leftImage, Mat rightImage, Mat laplacianL, Mat laplacianR, int pxX, int pxY, PushbroomStereoState state, int *left_interest = NULL, int *right_interest = NULL, int *raw_sad = NULL);
+        int GetSAD(const Mat &leftImage, const Mat &rightImage, const Mat &laplacianL, const Mat &laplacianR, int pxX, int pxY, const PushbroomStereoState &state, int *left_interest = NULL, int *right_interest = NULL, int *raw_sad = NULL);
+
+        void GetSADStrip(const Mat &leftImage, const Mat &rightImage, const Mat &laplacianL, const Mat &laplacianR, int pxY, int startX, int num_blocks, const PushbroomStereoState &state, StereoStripBuffers *buffers);
+
+        bool CheckHorizontalInvariance(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL, const Mat &sobelR, int pxX, int pxY, const PushbroomStereoState &state);
+
+        void CheckHorizontalInvarianceStrip(const Mat &leftImage, const Mat &rightImage, const Mat &sobelL, const Mat &sobelR, int pxY, int startX, int num_blocks, const PushbroomStereoState &state, StereoStripBuffers *buffers);
+
+        void RemapAndFilter(const Mat &leftImage, const Mat &rightImage, const PushbroomStereoState &state, Mat *remapped_left, Mat *remapped_right, Mat *laplacian_left, Mat *laplacian_right);
+
+        void GetBlockScores(const Mat &leftImage, const Mat &rightImage, const Mat &laplacian_left, const Mat &laplacian_right, const PushbroomStereoState &state, PushbroomFrameScores *scores);
+
+        static bool IsBlockHit(const PushbroomFrameScores &scores, int block, const PushbroomStereoState &state);
 
         RemapThreadState* GetRemapState(int i) { return &(remap_thread_states_[i]); }
 
         InterestOpState* GetInterestOpState(int i) { return &(interest_op_states_[i]); }
 
+        void SetSadKernel(SadKernelType type);
+        SadKernelType GetSadKernelType() const { return sad_kernel_type_; }
+
+        void SetUseWorkStealing(bool use_work_stealing) { use_work_stealing_ = use_work_stealing; }
+        bool GetUseWorkStealing() const { return use_work_stealing_; }
+
+        void SetUseFusedStrips(bool use_fused_strips) { use_fused_strips_ = use_fused_strips; }
+        bool GetUseFusedStrips() const { return use_fused_strips_; }
+
+        // threads for the work-stealing scheduler, including the one that
+        // calls ProcessImages (0 for one per core).  Only takes effect
+        // before the first frame.
+        void SetNumWorkStealingThreads(int num_threads) { num_work_stealing_threads_ = num_threads; }
+
 };
 
 struct PushbroomStereoThreadStarter {
@@ -0,0 +1,254 @@
+/**
+ * Sweeps pushbroom stereo thresholds over a recording and writes the hit
+ * counts for every combination, scored against boxes drawn with the HUD,
+ * to a CSV file.  For picking sadThreshold, sobelLimit, blockSize, and
+ * horizontalInvarianceMultiplier.
+ *
+ * Copyright 2015, Andrew Barry <abarry@csail.mit.edu>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+
+#include "../../externals/ConciseArgs.hpp"
+#include "opencv-stereo-util.hpp"
+#include "pushbroom-stereo.hpp"
+#include "RecordingManager.hpp"
+#include "RecordingReplaySource.hpp"
+#include "ParameterSweep.hpp"
+
+/**
+ * Reads a comma-separated list of numbers, like "40,50,60".
+ *
+ * @param text list to read
+ * @param values output: the numbers.  Left alone if text is empty.
+ *
+ * @retval false if something in the list isn't a number
+ */
+template <class T>
+bool ParseList(string text, std::vector<T> *values) {
+
+    if (text.length() == 0) {
+        return true;
+    }
+
+    std::vector<string> items;
+    boost::split(items, text, boost::is_any_of(","));
+
+    values->clear();
+
+    for (unsigned int i = 0; i < items.size(); i++) {
+        char *end;
+        double value = strtod(items[i].c_str(), &end);
+
+        if (items[i].length() == 0 || *end != '\0') {
+            fprintf(stderr, "Error: \"%s\" is not a number.\n", items[i].c_str());
+            return false;
+        }
+
+        values->push_back((T)value);
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+
+    string config_file = "";
+    string video_file_left = "", video_file_right = "";
+    string box_file = "";
+    string output_file = "";
+    string cache_file = "";
+    string block_sizes = "", sad_thresholds = "", sobel_limits = "", multipliers = "";
+    int video_number = -1;
+    int num_workers = 0;
+
+    ConciseArgs parser(argc, argv);
+    parser.add(config_file, "c", "config", "Configuration file with the stereo parameters and calibration.", true);
+    parser.add(video_file_left, "l", "video-file-left", "Recording to sweep over (also requires a right video file, unless this is a .slog recording).", true);
+    parser.add(video_file_right, "t", "video-file-right", "Right video file, only for use with the -l option.");
+    parser.add(box_file, "b", "box-file", "Ground truth boxes, drawn with hud -b.");
+    parser.add(video_number, "n", "video-number", "Only use boxes for this video number.");
+    parser.add(output_file, "o", "output", "CSV file to write the results to.", true);
+    parser.add(block_sizes, "B", "block-sizes", "Comma-separated block sizes to try.");
+    parser.add(sad_thresholds, "S", "sad-thresholds", "Comma-separated SAD thresholds to try.");
+    parser.add(sobel_limits, "I", "sobel-limits", "Comma-separated interest operator limits to try.");
+    parser.add(multipliers, "H", "horizontal-invariance-multipliers", "Comma-separated horizontal invariance multipliers to try.");
+    parser.add(cache_file, "m", "cache-file", "Cache the rectified frames in files starting with this instead of in memory (for long recordings).");
+    parser.add(num_workers, "j", "jobs", "Number of frames to run at once (0 for one per core).");
+    parser.parse();
+
+    if (video_file_right.length() <= 0
+        && !boost::iends_with(video_file_left, STEREO_LOG_EXTENSION)) {
+
+        fprintf(stderr, "Error: for playback you must specify both "
+            "a right and left video file. (Only got a left one.)\n");
+
+        return -1;
+    }
+
+    OpenCvStereoConfig stereo_config;
+
+    if (ParseConfigFile(config_file, &stereo_config) != true) {
+        fprintf(stderr, "Failed to parse configuration file, quitting.\n");
+        return -1;
+    }
+
+    // anything not swept uses the value from the configuration file
+    SweepGrid grid;
+    grid.block_sizes.push_back(stereo_config.blockSize);
+    grid.sad_thresholds.push_back(stereo_config.sadThreshold);
+    grid.sobel_limits.push_back(stereo_config.interestOperatorLimit);
+    grid.horizontal_invariance_multipliers.push_back(stereo_config.horizontalInvarianceMultiplier);
+
+    if (ParseList(block_sizes, &grid.block_sizes) != true
+        || ParseList(sad_thresholds, &grid.sad_thresholds) != true
+        || ParseList(sobel_limits, &grid.sobel_limits) != true
+        || ParseList(multipliers, &grid.horizontal_invariance_multipliers) != true) {
+
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < grid.block_sizes.size(); i++) {
+        if (grid.block_sizes[i] <= 0) {
+            fprintf(stderr, "Error: block sizes must be positive.\n");
+            return -1;
+        }
+    }
+
+    GroundTruthBoxes boxes;
+
+    if (box_file.length() > 0) {
+        if (boxes.Load(box_file, video_number) != true) {
+            return -1;
+        }
+
+        printf("Read boxes for %d frames from %s\n", boxes.GetNumFrames(), box_file.c_str());
+    }
+
+    OpenCvStereoCalibration stereo_calibration;
+
+    if (LoadCalibration(stereo_config.calibrationDir, &stereo_calibration) != true) {
+        cerr << "Error: failed to read calibration files. Quitting." << endl;
+        return -1;
+    }
+
+    // tell opencv to use only one core so that we can manage our
+    // own threading without a fight
+    setNumThreads(1);
+
+    PushbroomStereoState state;
+
+    state.disparity = stereo_config.disparity;
+    state.extra_disparities = stereo_config.extraDisparities;
+    state.zero_dist_disparity = stereo_config.infiniteDisparity;
+    state.sobelLimit = stereo_config.interestOperatorLimit;
+    state.horizontalInvarianceMultiplier = stereo_config.horizontalInvarianceMultiplier;
+    state.blockSize = stereo_config.blockSize;
+    state.random_results = -1;
+    state.check_horizontal_invariance = true;
+    state.sadThreshold = stereo_config.sadThreshold;
+
+    state.mapxL = stereo_calibration.mx1fp;
+    state.mapxR = stereo_calibration.mx2fp;
+    state.remapTableL = stereo_calibration.mx1Table;
+    state.remapTableR = stereo_calibration.mx2Table;
+    state.Q = stereo_calibration.qMat;
+
+    state.lastValidPixelRow = stereo_config.lastValidPixelRow;
+
+    ParameterSweep sweep(state, num_workers);
+
+    // every worker reads through its own RecordingManager
+    std::vector<RecordingManager*> recording_managers;
+    std::vector<ReplayFrameSource*> sources;
+
+    for (int i = 0; i < sweep.GetNumWorkers(); i++) {
+        RecordingManager *recording_manager = new RecordingManager();
+        recording_manager->Init(stereo_config);
+        recording_manager->SetQuietMode(true);
+
+        recording_managers.push_back(recording_manager);
+        sources.push_back(new RecordingReplaySource(recording_manager));
+
+        if (recording_manager->LoadVideoFiles(video_file_left, video_file_right) != true) {
+            cerr << "Error: failed to load " << video_file_left << endl;
+            return -1;
+        }
+    }
+
+    int num_frames = recording_managers[0]->GetNumPlaybackFrames();
+
+    printf("Caching %d frames on %d workers...\n", num_frames, sweep.GetNumWorkers());
+
+    bool cached = sweep.CacheFrames(sources, 0, num_frames - 1, cache_file);
+
+    for (unsigned int i = 0; i < sources.size(); i++) {
+        delete sources[i];
+        delete recording_managers[i];
+    }
+
+    if (cached != true) {
+        cerr << "Error: failed to cache frames." << endl;
+        return -1;
+    }
+
+    std::vector<SweepResult> results;
+
+    printf("Sweeping %d settings...\n", (int)(grid.block_sizes.size() * grid.sad_thresholds.size()
+        * grid.sobel_limits.size() * grid.horizontal_invariance_multipliers.size()));
+
+    if (sweep.Run(grid, box_file.length() > 0 ? &boxes : NULL, &results) != true) {
+        return -1;
+    }
+
+    FILE *file = fopen(output_file.c_str(), "w");
+
+    if (file == NULL) {
+        fprintf(stderr, "Error: failed to open %s\n", output_file.c_str());
+        return -1;
+    }
+
+    int num_frames_cached = sweep.GetNumCachedFrames();
+
+    // not swept, but hits from searching more disparities aren't
+    // comparable with hits from searching one
+    string extra_disparities = "";
+
+    for (unsigned int i = 0; i < state.extra_disparities.size(); i++) {
+        extra_disparities += (i > 0 ? " " : "") + std::to_string(state.extra_disparities[i]);
+    }
+
+    fprintf(file, "block_size,sad_threshold,sobel_limit,horizontal_invariance_multiplier,extra_disparities,"
+        "hits,hits_per_frame,boxed_frame_hits,hits_in_boxes,precision,boxed_frames_detected,boxed_frames\n");
+
+    for (unsigned int i = 0; i < results.size(); i++) {
+
+        const SweepResult &result = results[i];
+
+        double precision = result.boxed_frame_hits > 0 ? (double)result.hits_in_boxes / result.boxed_frame_hits : 0;
+
+        fprintf(file, "%d,%d,%d,%g,%s,%ld,%f,%ld,%ld,%f,%d,%d\n",
+            result.block_size, result.sad_threshold, result.sobel_limit,
+            result.horizontal_invariance_multiplier, extra_disparities.c_str(), result.hits,
+            num_frames_cached > 0 ? (double)result.hits / num_frames_cached : 0.0,
+            result.boxed_frame_hits, result.hits_in_boxes, precision,
+            result.boxed_frames_detected, boxes.GetNumFrames());
+    }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: failed to write %s\n", output_file.c_str());
+        return -1;
+    }
+
+    sweep.PrintStats();
+
+    printf("Wrote %s\n", output_file.c_str());
+
+    return 0;
+}
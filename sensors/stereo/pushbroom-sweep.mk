@@ -0,0 +1,5 @@
+TARGET = pushbroom-sweep
+SOURCES = pushbroom-sweep.cpp opencv-stereo-util.cpp RemapTable.cpp pushbroom-stereo.cpp StageTimer.cpp pushbroom-kernels.cpp WorkStealingPool.cpp ParameterSweep.cpp RecordingManager.cpp RecordingWriter.cpp StereoLog.cpp ../../externals/jpeg-utils/jpeg-utils.c ../../ui/hud/hud.cpp ../../utils/utils/RealtimeUtils.cpp
+
+# include a standard makefile that uses these variables and builds everything
+include ../../utils/make/flight.mk
@@ -0,0 +1,6 @@
+TARGET = test
+
+SOURCES = tests.cpp pushbroom-stereo.cpp StereoHitEncoder.cpp StageTimer.cpp pushbroom-kernels.cpp WorkStealingPool.cpp RemapTable.cpp CameraSource.cpp FakeCameraSource.cpp StereoCapture.cpp RecordingWriter.cpp StereoLog.cpp LatencyHistogram.cpp BatchReplay.cpp ReplayResults.cpp ParameterSweep.cpp ../../utils/utils/RealtimeUtils.cpp
+
+
+include ../../utils/make/flight.mk
@@ -0,0 +1,2176 @@
+#include "pushbroom-stereo.hpp"
+#include "pushbroom-kernels.hpp"
+#include "WorkStealingPool.hpp"
+#include "FakeCameraSource.hpp"
+#include "StereoCapture.hpp"
+#include "SpscQueue.hpp"
+#include "RecordingWriter.hpp"
+#include "StereoLog.hpp"
+#include "BatchReplay.hpp"
+#include "ReplayResults.hpp"
+#include "ParameterSweep.hpp"
+#include "StageTimer.hpp"
+#include "StereoHitEncoder.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "../../utils/utils/RealtimeUtils.hpp"
+#include <random>
+
+#ifdef __GLIBC__
+// Counts heap allocations made by any thread while count_allocations is
+// set, for checking that code doesn't allocate.  Everything is passed on
+// to glibc's allocator.
+extern "C" {
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t num, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<bool> count_allocations(false);
+static std::atomic<long> num_allocations(0);
+
+extern "C" {
+    void *malloc(size_t size) {
+        if (count_allocations.load(std::memory_order_relaxed)) {
+            num_allocations ++;
+        }
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t num, size_t size) {
+        if (count_allocations.load(std::memory_order_relaxed)) {
+            num_allocations ++;
+        }
+        return __libc_calloc(num, size);
+    }
+
+    void *realloc(void *ptr, size_t size) {
+        if (count_allocations.load(std::memory_order_relaxed)) {
+            num_allocations ++;
+        }
+        return __libc_realloc(ptr, size);
+    }
+
+    void *memalign(size_t alignment, size_t size) {
+        if (count_allocations.load(std::memory_order_relaxed)) {
+            num_allocations ++;
+        }
+        return __libc_memalign(alignment, size);
+    }
+}
+#endif // __GLIBC__
+
+class PushbroomStereoTest : public testing::Test {
+
+    protected:
+
+        static void SetUpTestCase() {
+            // PushbroomStereo starts two pools of worker threads, so share
+            // one between all the tests
+            if (pushbroom_stereo_ == NULL) {
+                pushbroom_stereo_ = new PushbroomStereo();
+            }
+        }
+
+        virtual void SetUp() {
+
+            pushbroom_stereo_->SetSadKernel(GetBestSadKernelType());
+
+            std::default_random_engine rand_engine(42);
+            std::uniform_int_distribution<int> uniform_dist(0, 255);
+
+            Mat *images[4] = { &left_, &right_, &laplacian_left_, &laplacian_right_ };
+
+            for (int k = 0; k < 4; k++) {
+                images[k]->create(rows_, cols_, CV_8UC1);
+
+                for (int i = 0; i < rows_; i++) {
+                    uchar *row = images[k]->ptr<uchar>(i);
+                    for (int j = 0; j < cols_; j++) {
+                        row[j] = uniform_dist(rand_engine);
+                    }
+                }
+            }
+
+            state_.disparity = -105;
+            state_.zero_dist_disparity = -95;
+            state_.sobelLimit = 860;
+            state_.blockSize = 5;
+            state_.sadThreshold = 54;
+            state_.horizontalInvarianceMultiplier = 0.5;
+            state_.lastValidPixelRow = 0;
+            state_.show_display = false;
+            state_.check_horizontal_invariance = true;
+            state_.random_results = -1;
+        }
+
+        /**
+         * Runs GetSAD at every block position in the image with the scalar
+         * kernel and with another kernel and counts the number of times
+         * any of the outputs disagree.
+         */
+        int CountMismatches(PushbroomStereo *pushbroom_stereo, SadKernelType type) {
+
+            int start_j = state_.disparity < 0 ? -state_.disparity : 0;
+            int stop_j = state_.disparity < 0 ? cols_ - state_.blockSize : cols_ - (state_.disparity + state_.blockSize);
+
+            int mismatches = 0;
+
+            for (int i = 0; i + state_.blockSize <= rows_; i++) {
+                for (int j = start_j; j <= stop_j; j++) {
+
+                    int left, right, raw_sad;
+                    int left2, right2, raw_sad2;
+
+                    pushbroom_stereo->SetSadKernel(SAD_KERNEL_SCALAR);
+                    int sad = pushbroom_stereo->GetSAD(left_, right_, laplacian_left_, laplacian_right_, j, i, state_, &left, &right, &raw_sad);
+
+                    pushbroom_stereo->SetSadKernel(type);
+                    int sad2 = pushbroom_stereo->GetSAD(left_, right_, laplacian_left_, laplacian_right_, j, i, state_, &left2, &right2, &raw_sad2);
+
+                    if (sad != sad2 || left != left2 || right != right2 || raw_sad != raw_sad2) {
+                        mismatches ++;
+                    }
+                }
+            }
+
+            return mismatches;
+        }
+
+        int rows_ = 240;
+        int cols_ = 376;
+
+        Mat left_, right_, laplacian_left_, laplacian_right_;
+
+        PushbroomStereoState state_;
+
+        static PushbroomStereo *pushbroom_stereo_;
+
+};
+
+PushbroomStereo *PushbroomStereoTest::pushbroom_stereo_ = NULL;
+
+/**
+ * Checks that every SAD kernel this CPU supports gives exactly the same
+ * answer as the scalar loop, including at the right edge of the image
+ * where the SIMD kernels aren't allowed to read.
+ */
+TEST_F(PushbroomStereoTest, SadKernelsMatchScalar) {
+
+    SadKernelType types[] = { SAD_KERNEL_SSE, SAD_KERNEL_AVX2 };
+
+    int block_sizes[] = { 1, 4, 5, 7, 16 };
+
+    for (unsigned int k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+
+        if (GetSadKernel(types[k]) == NULL) {
+            std::cout << "Skipping " << GetSadKernelName(types[k]) << ", not supported on this CPU." << std::endl;
+            continue;
+        }
+
+        for (unsigned int b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+            state_.blockSize = block_sizes[b];
+
+            EXPECT_EQ_ARM(CountMismatches(pushbroom_stereo_, types[k]), 0);
+        }
+    }
+}
+
+/**
+ * The strip version of GetSAD must give the same score as GetSAD for every
+ * block, for every kernel, block size, and disparity sign.
+ */
+TEST_F(PushbroomStereoTest, StripMatchesGetSAD) {
+
+    SadKernelType types[] = { SAD_KERNEL_SCALAR, SAD_KERNEL_SSE, SAD_KERNEL_AVX2 };
+
+    int block_sizes[] = { 1, 3, 5, 8, 16 };
+    int disparities[] = { -105, -3, 0, 20 };
+
+    StereoStripBuffers buffers;
+
+    for (unsigned int k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+
+        if (GetSadKernel(types[k]) == NULL) {
+            continue;
+        }
+
+        pushbroom_stereo_->SetSadKernel(types[k]);
+
+        for (unsigned int b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+            for (unsigned int d = 0; d < sizeof(disparities) / sizeof(disparities[0]); d++) {
+
+                state_.blockSize = block_sizes[b];
+                state_.disparity = disparities[d];
+
+                // sobelLimit scales with the number of pixels in the block
+                state_.sobelLimit = 860 * state_.blockSize * state_.blockSize / 25;
+
+                int start_j = state_.disparity < 0 ? -state_.disparity : 0;
+                int stop_j = state_.disparity < 0 ? cols_ - state_.blockSize : cols_ - (state_.disparity + state_.blockSize);
+                int num_blocks = (stop_j - start_j + state_.blockSize - 1) / state_.blockSize;
+
+                int mismatches = 0;
+
+                for (int i = 0; i + state_.blockSize <= rows_; i += state_.blockSize) {
+
+                    pushbroom_stereo_->GetSADStrip(left_, right_, laplacian_left_, laplacian_right_, i, start_j, num_blocks, state_, &buffers);
+
+                    for (int block = 0; block < num_blocks; block++) {
+                        int sad = pushbroom_stereo_->GetSAD(left_, right_, laplacian_left_, laplacian_right_, start_j + block * state_.blockSize, i, state_);
+
+                        if (sad != buffers.scores[block]) {
+                            mismatches ++;
+                        }
+                    }
+                }
+
+                EXPECT_EQ_ARM(mismatches, 0);
+            }
+        }
+    }
+}
+
+/**
+ * The strip version of the horizontal invariance check must agree with
+ * CheckHorizontalInvariance for every candidate, including ones near the
+ * edges of the image that take the slow path.
+ */
+TEST_F(PushbroomStereoTest, InvarianceStripMatchesReference) {
+
+    SadKernelType types[] = { SAD_KERNEL_SCALAR, SAD_KERNEL_SSE, SAD_KERNEL_AVX2 };
+
+    int block_sizes[] = { 3, 4, 5, 8, 16 };
+    int zero_dist_disparities[] = { -95, 0, 10 };
+
+    StereoStripBuffers buffers;
+
+    for (unsigned int k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+
+        if (GetSadKernel(types[k]) == NULL) {
+            continue;
+        }
+
+        pushbroom_stereo_->SetSadKernel(types[k]);
+
+        for (unsigned int b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+            for (unsigned int d = 0; d < sizeof(zero_dist_disparities) / sizeof(zero_dist_disparities[0]); d++) {
+
+                state_.blockSize = block_sizes[b];
+                state_.zero_dist_disparity = zero_dist_disparities[d];
+                state_.sobelLimit = 860 * state_.blockSize * state_.blockSize / 25;
+                state_.horizontalInvarianceMultiplier = 1.0;
+
+                // random images almost never match, so copy the left image
+                // into the top half of the right image at the zero-distance
+                // disparity to get some blocks that do
+                Mat right = right_.clone();
+                for (int i = 0; i < rows_ / 2; i++) {
+                    for (int j = 0; j < cols_; j++) {
+                        int j_right = j + state_.zero_dist_disparity;
+                        if (j_right >= 0 && j_right < cols_) {
+                            right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+                        }
+                    }
+                }
+
+                int num_blocks = cols_ / state_.blockSize;
+
+                int mismatches = 0;
+                int num_invariant = 0;
+                int num_candidates = 0;
+
+                for (int i = 0; i + state_.blockSize <= rows_; i += state_.blockSize) {
+
+                    // make a mix of single candidates and runs of candidates
+                    buffers.scores.resize(num_blocks);
+                    for (int block = 0; block < num_blocks; block++) {
+                        buffers.scores[block] = (block * 7 + i) % 3 == 0 ? state_.sadThreshold : 0;
+                    }
+
+                    pushbroom_stereo_->CheckHorizontalInvarianceStrip(left_, right, laplacian_left_, laplacian_right_, i, 0, num_blocks, state_, &buffers);
+
+                    for (int block = 0; block < num_blocks; block++) {
+
+                        if (buffers.scores[block] != 0) {
+                            EXPECT_FALSE(buffers.invariant[block]);
+                            continue;
+                        }
+
+                        bool expected = pushbroom_stereo_->CheckHorizontalInvariance(left_, right, laplacian_left_, laplacian_right_, block * state_.blockSize, i, state_);
+
+                        if (expected != (bool)buffers.invariant[block]) {
+                            mismatches ++;
+                        }
+
+                        num_invariant += expected;
+                        num_candidates ++;
+                    }
+                }
+
+                EXPECT_EQ_ARM(mismatches, 0);
+
+                // make sure the test is actually exercising both outcomes
+                EXPECT_TRUE(num_invariant > 0 && num_invariant < num_candidates);
+            }
+        }
+    }
+}
+
+/**
+ * Unsupported kernels should fall back to scalar instead of crashing.
+ */
+TEST_F(PushbroomStereoTest, SadKernelFallback) {
+
+    pushbroom_stereo_->SetSadKernel(SAD_KERNEL_SCALAR);
+    EXPECT_EQ_ARM(pushbroom_stereo_->GetSadKernelType(), SAD_KERNEL_SCALAR);
+
+    pushbroom_stereo_->SetSadKernel(GetBestSadKernelType());
+    EXPECT_EQ_ARM(pushbroom_stereo_->GetSadKernelType(), GetBestSadKernelType());
+}
+
+/**
+ * The work-stealing scheduler, with and without fused strips, must find
+ * exactly the same hits, in the same order, as the fixed thread pool.
+ */
+TEST_F(PushbroomStereoTest, WorkStealingMatchesThreadPool) {
+
+    // remap maps that shift the right image over by a couple of pixels
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+    state_.mapxR.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            short *left_map = state_.mapxL.ptr<short>(i) + 2*j;
+            short *right_map = state_.mapxR.ptr<short>(i) + 2*j;
+
+            left_map[0] = j;
+            left_map[1] = i;
+
+            right_map[0] = min(j + 2, cols_ - 1);
+            right_map[1] = i;
+        }
+    }
+
+    state_.Q = Mat::eye(4, 4, CV_64F);
+
+    // put some matches in the top of the image
+    Mat right = right_.clone();
+    for (int i = 0; i < rows_ / 2; i++) {
+        for (int j = 0; j < cols_; j++) {
+            int j_right = j + state_.disparity + 2;
+            if (j_right >= 0 && j_right < cols_) {
+                right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+            }
+        }
+    }
+
+    state_.show_display = true;
+
+    int block_sizes[] = { 1, 3, 5, 8 };
+    int last_valid_rows[] = { 0, 200 };
+
+    for (unsigned int b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+        for (unsigned int r = 0; r < sizeof(last_valid_rows) / sizeof(last_valid_rows[0]); r++) {
+            for (int check_invariance = 0; check_invariance < 2; check_invariance++) {
+
+                state_.blockSize = block_sizes[b];
+                state_.sobelLimit = 860 * state_.blockSize * state_.blockSize / 25;
+                state_.lastValidPixelRow = last_valid_rows[r];
+                state_.check_horizontal_invariance = check_invariance;
+
+                // fixed pool, work stealing, work stealing with fused strips
+                cv::vector<Point3f> points3d[3];
+                cv::vector<uchar> colors[3];
+                cv::vector<Point3i> points2d[3];
+
+                for (int k = 0; k < 3; k++) {
+                    pushbroom_stereo_->SetUseWorkStealing(k > 0);
+                    pushbroom_stereo_->SetUseFusedStrips(k == 2);
+                    pushbroom_stereo_->ProcessImages(left_, right, &points3d[k], &colors[k], &points2d[k], state_);
+                }
+
+                if (check_invariance == false) {
+                    EXPECT_TRUE(points3d[0].size() > 0);
+                }
+
+                for (int k = 1; k < 3; k++) {
+                    ASSERT_EQ(points3d[0].size(), points3d[k].size());
+                    ASSERT_EQ(points2d[0].size(), points2d[k].size());
+                    EXPECT_TRUE(colors[0] == colors[k]);
+
+                    for (unsigned int i = 0; i < points3d[0].size(); i++) {
+                        EXPECT_EQ_ARM(points3d[0][i].x, points3d[k][i].x);
+                        EXPECT_EQ_ARM(points3d[0][i].y, points3d[k][i].y);
+                        EXPECT_EQ_ARM(points3d[0][i].z, points3d[k][i].z);
+                    }
+
+                    for (unsigned int i = 0; i < points2d[0].size(); i++) {
+                        EXPECT_EQ_ARM(points2d[0][i].x, points2d[k][i].x);
+                        EXPECT_EQ_ARM(points2d[0][i].y, points2d[k][i].y);
+                        EXPECT_EQ_ARM(points2d[0][i].z, points2d[k][i].z);
+                    }
+                }
+            }
+        }
+    }
+
+    pushbroom_stereo_->SetUseWorkStealing(true);
+    pushbroom_stereo_->SetUseFusedStrips(false);
+}
+
+/**
+ * ProcessImages only remaps and filters the part of the image the search
+ * reads.  Check that nothing outside of that changes the hits by running
+ * each frame once on fresh images and once on images left over from a
+ * different frame.
+ */
+TEST_F(PushbroomStereoTest, StereoRoiCoversSearch) {
+
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+    state_.mapxR.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            short *left_map = state_.mapxL.ptr<short>(i) + 2*j;
+            short *right_map = state_.mapxR.ptr<short>(i) + 2*j;
+
+            left_map[0] = j;
+            left_map[1] = i;
+
+            right_map[0] = j;
+            right_map[1] = i;
+        }
+    }
+
+    state_.Q = Mat::eye(4, 4, CV_64F);
+    state_.show_display = true;
+
+    int disparities[] = { -105, -20 };
+    int last_valid_rows[] = { 0, 150 };
+
+    for (unsigned int d = 0; d < sizeof(disparities) / sizeof(disparities[0]); d++) {
+        for (unsigned int r = 0; r < sizeof(last_valid_rows) / sizeof(last_valid_rows[0]); r++) {
+            for (int check_invariance = 0; check_invariance < 2; check_invariance++) {
+
+                PushbroomStereoState state = state_;
+                state.disparity = disparities[d];
+                state.zero_dist_disparity = disparities[d] + 10;
+                state.lastValidPixelRow = last_valid_rows[r];
+                state.check_horizontal_invariance = check_invariance;
+
+                // noise passes the invariance check at the default
+                // multiplier, but we want hits near the bottom
+                state.horizontalInvarianceMultiplier = 2;
+
+                // plant matches all over the image
+                Mat right = right_.clone();
+                for (int i = 0; i < rows_; i++) {
+                    for (int j = 0; j < cols_; j++) {
+                        int j_right = j + state.disparity;
+                        if (j_right >= 0 && (i / 20) % 2 == 1) {
+                            right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+                        }
+                    }
+                }
+
+                // a frame that searches almost everything, to fill the
+                // images with something else.  Its right image would pass
+                // the invariance check 8 rows down, so reading rows the
+                // search shouldn't changes the hits.
+                PushbroomStereoState full_state = state_;
+                full_state.disparity = -1;
+                full_state.zero_dist_disparity = 0;
+
+                Mat full_right = right_.clone();
+                for (int i = 0; i + 8 < rows_; i++) {
+                    for (int j = 0; j < cols_; j++) {
+                        int j_right = j + state.zero_dist_disparity;
+                        if (j_right >= 0) {
+                            full_right.at<uchar>(i + 8, j_right) = left_.at<uchar>(i, j);
+                        }
+                    }
+                }
+
+                for (int fused = 0; fused < 2; fused++) {
+
+                    cv::vector<Point3f> points3d[2];
+                    cv::vector<uchar> colors[2];
+                    cv::vector<Point3i> points2d[2];
+
+                    PushbroomStereo fresh;
+                    fresh.SetUseWorkStealing(true);
+                    fresh.SetUseFusedStrips(fused);
+                    fresh.ProcessImages(left_, right, &points3d[0], &colors[0], &points2d[0], state);
+
+                    cv::vector<Point3f> points3d_full;
+                    cv::vector<uchar> colors_full;
+                    cv::vector<Point3i> points2d_full;
+
+                    pushbroom_stereo_->SetUseWorkStealing(true);
+                    pushbroom_stereo_->SetUseFusedStrips(fused);
+                    pushbroom_stereo_->ProcessImages(left_, full_right, &points3d_full, &colors_full, &points2d_full, full_state);
+                    pushbroom_stereo_->ProcessImages(left_, right, &points3d[1], &colors[1], &points2d[1], state);
+
+                    if (check_invariance == false) {
+                        EXPECT_TRUE(points3d[0].size() > 0);
+                    }
+
+                    ASSERT_EQ(points2d[0].size(), points2d[1].size());
+                    EXPECT_TRUE(colors[0] == colors[1]);
+
+                    for (unsigned int i = 0; i < points2d[0].size(); i++) {
+                        EXPECT_EQ_ARM(points2d[0][i].x, points2d[1][i].x);
+                        EXPECT_EQ_ARM(points2d[0][i].y, points2d[1][i].y);
+                        EXPECT_EQ_ARM(points2d[0][i].z, points2d[1][i].z);
+                    }
+                }
+            }
+        }
+    }
+
+    pushbroom_stereo_->SetUseFusedStrips(false);
+}
+
+/**
+ * Searching several disparities at once must find exactly the hits that
+ * searching each one on its own does, tagged with the right disparity.
+ */
+TEST_F(PushbroomStereoTest, MultipleDisparitiesMatchSingle) {
+
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            state_.mapxL.ptr<short>(i)[2*j] = j;
+            state_.mapxL.ptr<short>(i)[2*j + 1] = i;
+        }
+    }
+
+    state_.mapxR = state_.mapxL;
+    state_.Q = Mat::eye(4, 4, CV_64F);
+    state_.show_display = true;
+
+    int disparities[] = { -105, -90, -60, -20 };
+    int num_disparities = sizeof(disparities) / sizeof(disparities[0]);
+
+    // plant matches for each disparity in its own band of rows
+    Mat right = right_.clone();
+    for (int i = 0; i < rows_; i++) {
+        int disparity = disparities[(i / 30) % num_disparities];
+
+        for (int j = 0; j < cols_; j++) {
+            int j_right = j + disparity;
+            if (j_right >= 0) {
+                right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+            }
+        }
+    }
+
+    for (int k = 0; k < 3; k++) {
+        pushbroom_stereo_->SetUseWorkStealing(k > 0);
+        pushbroom_stereo_->SetUseFusedStrips(k == 2);
+
+        for (int check_invariance = 0; check_invariance < 2; check_invariance++) {
+
+            PushbroomStereoState state = state_;
+            state.check_horizontal_invariance = check_invariance;
+            state.disparity = disparities[0];
+            state.extra_disparities.assign(disparities + 1, disparities + num_disparities);
+
+            cv::vector<Point3f> points3d;
+            cv::vector<uchar> colors;
+            cv::vector<Point3i> points2d;
+            cv::vector<int> hit_disparities;
+
+            pushbroom_stereo_->ProcessImages(left_, right, &points3d, &colors, &points2d, state, &hit_disparities);
+
+            ASSERT_EQ(points2d.size(), hit_disparities.size());
+
+            for (int d = 0; d < num_disparities; d++) {
+
+                PushbroomStereoState single_state = state;
+                single_state.disparity = disparities[d];
+                single_state.extra_disparities.clear();
+
+                cv::vector<Point3f> single_points3d;
+                cv::vector<uchar> single_colors;
+                cv::vector<Point3i> single_points2d;
+
+                pushbroom_stereo_->ProcessImages(left_, right, &single_points3d, &single_colors, &single_points2d, single_state);
+
+                if (check_invariance == false) {
+                    EXPECT_TRUE(single_points2d.size() > 0);
+                }
+
+                // pick out the hits for this disparity, which should be in
+                // the same order
+                cv::vector<Point3i> tagged_points2d;
+                cv::vector<Point3f> tagged_points3d;
+
+                for (unsigned int i = 0; i < hit_disparities.size(); i++) {
+                    if (hit_disparities[i] == disparities[d]) {
+                        tagged_points2d.push_back(points2d[i]);
+                        tagged_points3d.push_back(points3d[i]);
+                    }
+                }
+
+                ASSERT_EQ(single_points2d.size(), tagged_points2d.size());
+
+                for (unsigned int i = 0; i < single_points2d.size(); i++) {
+                    EXPECT_EQ_ARM(single_points2d[i].x, tagged_points2d[i].x);
+                    EXPECT_EQ_ARM(single_points2d[i].y, tagged_points2d[i].y);
+                    EXPECT_EQ_ARM(single_points2d[i].z, tagged_points2d[i].z);
+                    EXPECT_EQ_ARM(single_points3d[i].z, tagged_points3d[i].z);
+                }
+            }
+        }
+    }
+
+    pushbroom_stereo_->SetUseWorkStealing(true);
+    pushbroom_stereo_->SetUseFusedStrips(false);
+}
+
+/**
+ * Frames for BatchReplay out of memory, with one missing.
+ */
+class MemoryReplaySource : public ReplayFrameSource {
+
+    public:
+        MemoryReplaySource(const std::vector<Mat> *lefts, const std::vector<Mat> *rights, int missing_frame)
+            : lefts_(lefts), rights_(rights), missing_frame_(missing_frame) {}
+
+        bool GetFrames(int frame_number, Mat *image_left, Mat *image_right) {
+            if (frame_number == missing_frame_ || frame_number >= (int)lefts_->size()) {
+                return false;
+            }
+
+            *image_left = (*lefts_)[frame_number];
+            *image_right = (*rights_)[frame_number];
+            return true;
+        }
+
+    private:
+        const std::vector<Mat> *lefts_, *rights_;
+        int missing_frame_;
+};
+
+/**
+ * Replaying frames on any number of workers must write exactly the same
+ * results file, with the same hits as running the frames one at a time.
+ */
+TEST_F(PushbroomStereoTest, BatchReplayIsSameForAnyNumberOfWorkers) {
+
+    const int num_frames = 12;
+    const int missing_frame = 5;
+
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            state_.mapxL.ptr<short>(i)[2*j] = j;
+            state_.mapxL.ptr<short>(i)[2*j + 1] = i;
+        }
+    }
+
+    state_.mapxR = state_.mapxL;
+    state_.Q = Mat::eye(4, 4, CV_64F);
+
+    // plant a match in a different band of rows in each frame, so every
+    // frame has different hits
+    std::vector<Mat> lefts, rights;
+
+    for (int f = 0; f < num_frames; f++) {
+        Mat right = right_.clone();
+
+        for (int i = f * 15; i < f * 15 + 30; i++) {
+            for (int j = 0; j < cols_; j++) {
+                int j_right = j + state_.disparity;
+                if (j_right >= 0) {
+                    right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+                }
+            }
+        }
+
+        lefts.push_back(left_);
+        rights.push_back(right);
+    }
+
+    int worker_counts[] = { 1, 4 };
+    std::vector<char> file_contents[2];
+
+    for (int k = 0; k < 2; k++) {
+
+        char filename[] = "/tmp/replay-results-test-XXXXXX";
+        int fd = mkstemp(filename);
+        ASSERT_GE(fd, 0);
+        close(fd);
+
+        std::vector<MemoryReplaySource*> memory_sources;
+        std::vector<ReplayFrameSource*> sources;
+
+        for (int i = 0; i < worker_counts[k]; i++) {
+            memory_sources.push_back(new MemoryReplaySource(&lefts, &rights, missing_frame));
+            sources.push_back(memory_sources.back());
+        }
+
+        BatchReplay replay(state_, worker_counts[k]);
+        EXPECT_EQ_ARM(replay.GetNumWorkers(), worker_counts[k]);
+
+        ReplayResultsWriter writer;
+        ASSERT_TRUE(writer.Open(filename, state_));
+        EXPECT_TRUE(writer.BeginRecording("memory"));
+        EXPECT_TRUE(replay.Run(sources, 0, num_frames - 1, &writer));
+        EXPECT_TRUE(writer.Close());
+
+        EXPECT_EQ_ARM(replay.GetNumFrames(), num_frames - 1);
+        EXPECT_EQ_ARM(replay.GetNumMissing(), 1);
+        EXPECT_EQ_ARM(replay.GetLatency().GetCount(), num_frames - 1);
+
+        for (unsigned int i = 0; i < memory_sources.size(); i++) {
+            delete memory_sources[i];
+        }
+
+        // check the hits against running each frame by itself
+        ReplayResultsReader reader;
+        ASSERT_TRUE(reader.Open(filename));
+        EXPECT_EQ_ARM(reader.GetHeader().sad_threshold, state_.sadThreshold);
+
+        std::string recording;
+        int frame_number;
+        std::vector<ReplayResultsHit> hits;
+
+        for (int f = 0; f < num_frames; f++) {
+            if (f == missing_frame) {
+                continue;
+            }
+
+            ASSERT_TRUE(reader.ReadFrame(&recording, &frame_number, &hits));
+
+            EXPECT_EQ(recording, "memory");
+            EXPECT_EQ_ARM(frame_number, f);
+
+            cv::vector<Point3f> points3d;
+            cv::vector<uchar> colors;
+            cv::vector<Point3i> points2d;
+
+            PushbroomStereoState state = state_;
+            state.show_display = true;
+
+            pushbroom_stereo_->ProcessImages(lefts[f], rights[f], &points3d, &colors, &points2d, state);
+
+            EXPECT_TRUE(points2d.size() > 0);
+            ASSERT_EQ(points2d.size(), hits.size());
+
+            for (unsigned int i = 0; i < hits.size(); i++) {
+                EXPECT_EQ_ARM(hits[i].pixel_x, points2d[i].x);
+                EXPECT_EQ_ARM(hits[i].pixel_y, points2d[i].y);
+                EXPECT_EQ_ARM(hits[i].disparity, state_.disparity);
+            }
+        }
+
+        EXPECT_FALSE(reader.ReadFrame(&recording, &frame_number, &hits));
+
+        reader.Close();
+
+        FILE *file = fopen(filename, "rb");
+        ASSERT_TRUE(file != NULL);
+
+        int c;
+        while ((c = fgetc(file)) != EOF) {
+            file_contents[k].push_back(c);
+        }
+
+        fclose(file);
+        remove(filename);
+    }
+
+    EXPECT_TRUE(file_contents[0].size() > sizeof(ReplayResultsFileHeader));
+    EXPECT_TRUE(file_contents[0] == file_contents[1]);
+
+    // extra disparities are kept in the header, so a multi-disparity run
+    // can be told apart from a single-disparity one
+    char filename[] = "/tmp/replay-results-test-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    state_.extra_disparities.push_back(state_.disparity + 3);
+    state_.extra_disparities.push_back(state_.disparity + 7);
+
+    ReplayResultsWriter writer;
+    ASSERT_TRUE(writer.Open(filename, state_));
+    EXPECT_TRUE(writer.Close());
+
+    ReplayResultsReader reader;
+    ASSERT_TRUE(reader.Open(filename));
+    EXPECT_EQ_ARM(reader.GetHeader().num_extra_disparities, 2u);
+
+    ASSERT_EQ(reader.GetExtraDisparities().size(), 2u);
+    EXPECT_EQ_ARM(reader.GetExtraDisparities()[0], state_.disparity + 3);
+    EXPECT_EQ_ARM(reader.GetExtraDisparities()[1], state_.disparity + 7);
+
+    reader.Close();
+    remove(filename);
+}
+
+/**
+ * Thresholding the raw block scores must give exactly the hits that
+ * ProcessImages finds, for the thresholds the scores were found with and
+ * for stricter ones.
+ */
+TEST_F(PushbroomStereoTest, BlockScoresMatchProcessImages) {
+
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            state_.mapxL.ptr<short>(i)[2*j] = j;
+            state_.mapxL.ptr<short>(i)[2*j + 1] = i;
+        }
+    }
+
+    state_.mapxR = state_.mapxL;
+    state_.Q = Mat::eye(4, 4, CV_64F);
+    state_.show_display = true;
+
+    int disparities[] = { -105, -60 };
+    state_.disparity = disparities[0];
+    state_.extra_disparities.assign(disparities + 1, disparities + 2);
+
+    // plant matches for each disparity in its own band of rows
+    Mat right = right_.clone();
+    for (int i = 0; i < rows_; i++) {
+        int disparity = disparities[(i / 30) % 2];
+
+        for (int j = 0; j < cols_; j++) {
+            int j_right = j + disparity;
+            if (j_right >= 0) {
+                right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+            }
+        }
+    }
+
+    Mat remapped_left, remapped_right, laplacian_left, laplacian_right;
+    pushbroom_stereo_->RemapAndFilter(left_, right, state_, &remapped_left, &remapped_right, &laplacian_left, &laplacian_right);
+
+    int sad_thresholds[] = { 30, 54, 150 };
+    int sobel_limits[] = { 500, 860, 3000 };
+    float multipliers[] = { 0.5, 1.0 };
+
+    int total_hits = 0;
+
+    for (int check_invariance = 0; check_invariance < 2; check_invariance++) {
+
+        PushbroomStereoState loosest = state_;
+        loosest.check_horizontal_invariance = check_invariance;
+        loosest.sadThreshold = 150;
+        loosest.sobelLimit = 500;
+
+        PushbroomFrameScores scores;
+        pushbroom_stereo_->GetBlockScores(remapped_left, remapped_right, laplacian_left, laplacian_right, loosest, &scores);
+
+        EXPECT_EQ_ARM(scores.block_size, state_.blockSize);
+
+        for (int s = 0; s < 3; s++) {
+            for (int l = 0; l < 3; l++) {
+                for (int m = 0; m < 2; m++) {
+
+                    PushbroomStereoState state = loosest;
+                    state.sadThreshold = sad_thresholds[s];
+                    state.sobelLimit = sobel_limits[l];
+                    state.horizontalInvarianceMultiplier = multipliers[m];
+
+                    cv::vector<Point3f> points3d;
+                    cv::vector<uchar> colors;
+                    cv::vector<Point3i> points2d;
+                    cv::vector<int> hit_disparities;
+
+                    pushbroom_stereo_->ProcessImages(left_, right, &points3d, &colors, &points2d, state, &hit_disparities);
+
+                    cv::vector<int> hits;
+
+                    for (unsigned int block = 0; block < scores.blocks.size(); block++) {
+                        if (PushbroomStereo::IsBlockHit(scores, block, state)) {
+                            hits.push_back(block);
+                        }
+                    }
+
+                    ASSERT_EQ(points2d.size(), hits.size());
+
+                    for (unsigned int i = 0; i < hits.size(); i++) {
+                        EXPECT_EQ_ARM(scores.blocks[hits[i]].pixel_x, points2d[i].x);
+                        EXPECT_EQ_ARM(scores.blocks[hits[i]].pixel_y, points2d[i].y);
+                        EXPECT_EQ_ARM(scores.blocks[hits[i]].disparity, hit_disparities[i]);
+                    }
+
+                    total_hits += hits.size();
+                }
+            }
+        }
+    }
+
+    EXPECT_TRUE(total_hits > 0);
+}
+
+/**
+ * A sweep must count the same hits as running ProcessImages with each
+ * setting, with the cache in memory or in files.
+ */
+TEST_F(PushbroomStereoTest, ParameterSweepMatchesProcessImages) {
+
+    const int num_frames = 6;
+    const int missing_frame = 2;
+
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            state_.mapxL.ptr<short>(i)[2*j] = j;
+            state_.mapxL.ptr<short>(i)[2*j + 1] = i;
+        }
+    }
+
+    state_.mapxR = state_.mapxL;
+    state_.Q = Mat::eye(4, 4, CV_64F);
+
+    // plant a match in a different band of rows in each frame
+    std::vector<Mat> lefts, rights;
+
+    for (int f = 0; f < num_frames; f++) {
+        Mat right = right_.clone();
+
+        for (int i = f * 30; i < f * 30 + 30; i++) {
+            for (int j = 0; j < cols_; j++) {
+                int j_right = j + state_.disparity;
+                if (j_right >= 0) {
+                    right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+                }
+            }
+        }
+
+        lefts.push_back(left_);
+        rights.push_back(right);
+    }
+
+    // boxes around part of each band, one with its corners backwards, and
+    // one for another video that should be ignored
+    char box_filename[] = "/tmp/sweep-boxes-test-XXXXXX";
+    int fd = mkstemp(box_filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    FILE *box_file = fopen(box_filename, "w");
+    ASSERT_TRUE(box_file != NULL);
+    fprintf(box_file, "0,0,100,0,250.5,30\n");
+    fprintf(box_file, "0,1,250,60,120,30\n");
+    fprintf(box_file, "0,3,0,90,376,120,17\n");
+    fprintf(box_file, "1,4,0,0,376,240\n");
+    fclose(box_file);
+
+    GroundTruthBoxes boxes;
+    ASSERT_TRUE(boxes.Load(box_filename, 0));
+    remove(box_filename);
+
+    EXPECT_EQ_ARM(boxes.GetNumFrames(), 3);
+    EXPECT_TRUE(boxes.GetBoxes(4) == NULL);
+    ASSERT_TRUE(boxes.GetBoxes(1) != NULL);
+    EXPECT_EQ((*boxes.GetBoxes(1))[0].x_min, 120);
+    EXPECT_EQ((*boxes.GetBoxes(1))[0].y_max, 60);
+
+    SweepGrid grid;
+    grid.block_sizes.push_back(5);
+    grid.block_sizes.push_back(6);
+    grid.sad_thresholds.push_back(54);
+    grid.sad_thresholds.push_back(150);
+    grid.sobel_limits.push_back(860);
+    grid.sobel_limits.push_back(3000);
+    grid.horizontal_invariance_multipliers.push_back(0.5);
+    grid.horizontal_invariance_multipliers.push_back(1.0);
+
+    long total_hits_in_boxes = 0;
+
+    for (int k = 0; k < 2; k++) {
+
+        char cache_filename[] = "/tmp/sweep-cache-test-XXXXXX";
+        fd = mkstemp(cache_filename);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        remove(cache_filename);
+
+        std::string remapped_filename = std::string(cache_filename) + "-remapped" + STEREO_LOG_EXTENSION;
+
+        std::vector<MemoryReplaySource*> memory_sources;
+        std::vector<ReplayFrameSource*> sources;
+
+        for (int i = 0; i < 2; i++) {
+            memory_sources.push_back(new MemoryReplaySource(&lefts, &rights, missing_frame));
+            sources.push_back(memory_sources.back());
+        }
+
+        std::vector<SweepResult> results;
+
+        {
+            ParameterSweep sweep(state_, 2);
+
+            ASSERT_TRUE(sweep.CacheFrames(sources, 0, num_frames - 1, k == 0 ? "" : cache_filename));
+            EXPECT_EQ_ARM(sweep.GetNumCachedFrames(), num_frames - 1);
+
+            struct stat buffer;
+            EXPECT_EQ(stat(remapped_filename.c_str(), &buffer) == 0, k == 1);
+
+            ASSERT_TRUE(sweep.Run(grid, &boxes, &results));
+        }
+
+        // the cache files go away with the sweep
+        struct stat buffer;
+        EXPECT_NE(stat(remapped_filename.c_str(), &buffer), 0);
+
+        for (unsigned int i = 0; i < memory_sources.size(); i++) {
+            delete memory_sources[i];
+        }
+
+        ASSERT_EQ(results.size(), 16u);
+
+        for (unsigned int c = 0; c < results.size(); c++) {
+
+            PushbroomStereoState state = state_;
+            state.show_display = true;
+            state.blockSize = results[c].block_size;
+            state.sadThreshold = results[c].sad_threshold;
+            state.sobelLimit = results[c].sobel_limit;
+            state.horizontalInvarianceMultiplier = results[c].horizontal_invariance_multiplier;
+
+            long hits = 0, boxed_frame_hits = 0, hits_in_boxes = 0;
+            int boxed_frames_detected = 0;
+
+            for (int f = 0; f < num_frames; f++) {
+                if (f == missing_frame) {
+                    continue;
+                }
+
+                cv::vector<Point3f> points3d;
+                cv::vector<uchar> colors;
+                cv::vector<Point3i> points2d;
+
+                pushbroom_stereo_->ProcessImages(lefts[f], rights[f], &points3d, &colors, &points2d, state);
+
+                hits += points2d.size();
+
+                const std::vector<GroundTruthBox> *frame_boxes = boxes.GetBoxes(f);
+
+                if (frame_boxes == NULL) {
+                    continue;
+                }
+
+                boxed_frame_hits += points2d.size();
+
+                bool detected = false;
+
+                for (unsigned int i = 0; i < points2d.size(); i++) {
+                    double x = points2d[i].x + state.blockSize / 2.0;
+                    double y = points2d[i].y + state.blockSize / 2.0;
+
+                    const GroundTruthBox &box = (*frame_boxes)[0];
+
+                    if (x >= box.x_min && x <= box.x_max && y >= box.y_min && y <= box.y_max) {
+                        hits_in_boxes ++;
+                        detected = true;
+                    }
+                }
+
+                if (detected) {
+                    boxed_frames_detected ++;
+                }
+            }
+
+            EXPECT_EQ(results[c].hits, hits);
+            EXPECT_EQ(results[c].boxed_frame_hits, boxed_frame_hits);
+            EXPECT_EQ(results[c].hits_in_boxes, hits_in_boxes);
+            EXPECT_EQ_ARM(results[c].boxed_frames_detected, boxed_frames_detected);
+
+            total_hits_in_boxes += hits_in_boxes;
+        }
+
+        // block size changes slowest
+        EXPECT_EQ_ARM(results[0].block_size, 5);
+        EXPECT_EQ_ARM(results[15].block_size, 6);
+        EXPECT_EQ_ARM(results[1].horizontal_invariance_multiplier, 1.0);
+    }
+
+    EXPECT_TRUE(total_hits_in_boxes > 0);
+}
+
+/**
+ * Remapping with a RemapTable must give exactly the same image as
+ * cv::remap, for the whole image and for strips of it, including pixels
+ * that map outside the source image.
+ */
+TEST_F(PushbroomStereoTest, RemapTableMatchesRemap) {
+
+    // something like a real rectification: mostly smooth shifts, with
+    // the corners mapping off the image
+    Mat map(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            short *xy = map.ptr<short>(i) + 2*j;
+
+            xy[0] = j + (int)(6 * sin(i / 40.0)) + (j * (i - rows_ / 2)) / 2000;
+            xy[1] = i + (j - cols_ / 2) * (j - cols_ / 2) / 4000 - 3;
+        }
+    }
+
+    RemapTable table;
+    ASSERT_TRUE(table.Build(map, left_.size()));
+
+    EXPECT_TRUE(table.GetNumSegments() > 0);
+    EXPECT_TRUE(table.GetNumSegments() < rows_ * cols_ / 2);
+
+    Mat expected(rows_, cols_, CV_8UC1);
+    remap(left_, expected, map, Mat(), INTER_NEAREST);
+
+    Mat whole(rows_, cols_, CV_8UC1);
+    table.Remap(left_, whole);
+
+    Mat strips(rows_, cols_, CV_8UC1);
+    for (int start = 0; start < rows_; start += 37) {
+        int end = min(rows_, start + 37);
+
+        Mat strip = strips.rowRange(start, end);
+        table.Remap(left_, strip, start, end);
+    }
+
+    int whole_mismatches = 0, strip_mismatches = 0;
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            whole_mismatches += expected.at<uchar>(i, j) != whole.at<uchar>(i, j);
+            strip_mismatches += expected.at<uchar>(i, j) != strips.at<uchar>(i, j);
+        }
+    }
+
+    EXPECT_EQ_ARM(whole_mismatches, 0);
+    EXPECT_EQ_ARM(strip_mismatches, 0);
+
+    // a source with padded rows, like a zero-copy camera frame
+    Mat padded_buffer(rows_, cols_ + 24, CV_8UC1, Scalar(255));
+    Mat padded = padded_buffer.colRange(0, cols_);
+    left_.copyTo(padded);
+
+    ASSERT_FALSE(padded.isContinuous());
+
+    Mat from_padded(rows_, cols_, CV_8UC1);
+    table.Remap(padded, from_padded);
+
+    int padded_mismatches = 0;
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            padded_mismatches += expected.at<uchar>(i, j) != from_padded.at<uchar>(i, j);
+        }
+    }
+
+    EXPECT_EQ_ARM(padded_mismatches, 0);
+
+    // the stereo pipeline gives the same hits with the table as without it
+    state_.mapxL = map;
+    state_.mapxR = map;
+    state_.Q = Mat::eye(4, 4, CV_64F);
+
+    cv::vector<Point3f> points3d[2];
+    cv::vector<uchar> colors[2];
+    cv::vector<Point3i> points2d[2];
+
+    pushbroom_stereo_->ProcessImages(left_, right_, &points3d[0], &colors[0], &points2d[0], state_);
+
+    state_.remapTableL = table;
+    state_.remapTableR = table;
+
+    pushbroom_stereo_->ProcessImages(left_, right_, &points3d[1], &colors[1], &points2d[1], state_);
+
+    ASSERT_EQ(points3d[0].size(), points3d[1].size());
+    EXPECT_TRUE(colors[0] == colors[1]);
+}
+
+#ifdef __GLIBC__
+/**
+ * Once the buffers have been sized by the first frame, ProcessImages
+ * mustn't allocate anything, on any thread, with any scheduler.  The hits
+ * it returns must be the same as the ones the vector version gives.
+ */
+TEST_F(PushbroomStereoTest, SteadyStateFramesDontAllocate) {
+
+    // shift the right image over by a couple of pixels, with remap tables
+    // like the flight code uses
+    Mat map_left(rows_, cols_, CV_16SC2);
+    Mat map_right(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            short *left_map = map_left.ptr<short>(i) + 2*j;
+            short *right_map = map_right.ptr<short>(i) + 2*j;
+
+            left_map[0] = j;
+            left_map[1] = i;
+
+            right_map[0] = min(j + 2, cols_ - 1);
+            right_map[1] = i;
+        }
+    }
+
+    state_.mapxL = map_left;
+    state_.mapxR = map_right;
+    ASSERT_TRUE(state_.remapTableL.Build(map_left, left_.size()));
+    ASSERT_TRUE(state_.remapTableR.Build(map_right, right_.size()));
+
+    state_.Q = Mat::eye(4, 4, CV_64F);
+    state_.extra_disparities.push_back(state_.disparity + 4);
+    state_.show_display = true;
+    state_.check_horizontal_invariance = false;
+
+    // put some matches in the top of the image
+    Mat right = right_.clone();
+    for (int i = 0; i < rows_ / 2; i++) {
+        for (int j = 0; j < cols_; j++) {
+            int j_right = j + state_.disparity + 2;
+            if (j_right >= 0 && j_right < cols_) {
+                right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+            }
+        }
+    }
+
+    // fixed pool, work stealing, work stealing with fused strips
+    for (int k = 0; k < 3; k++) {
+        pushbroom_stereo_->SetUseWorkStealing(k > 0);
+        pushbroom_stereo_->SetUseFusedStrips(k == 2);
+
+        PushbroomHits hits;
+
+        // warm up: sizes the buffers and starts the threads
+        for (int f = 0; f < 3; f++) {
+            pushbroom_stereo_->ProcessImages(left_, right, state_, &hits);
+        }
+
+        num_allocations = 0;
+        count_allocations = true;
+
+        for (int f = 0; f < 10; f++) {
+            pushbroom_stereo_->ProcessImages(left_, right, state_, &hits);
+        }
+
+        count_allocations = false;
+
+        EXPECT_EQ(num_allocations.load(), 0) << "scheduler " << k;
+
+        EXPECT_TRUE(hits.count > 0);
+
+        cv::vector<Point3f> points3d;
+        cv::vector<uchar> colors;
+        cv::vector<Point3i> points2d;
+        cv::vector<int> disparities;
+
+        pushbroom_stereo_->ProcessImages(left_, right, &points3d, &colors, &points2d, state_, &disparities);
+        pushbroom_stereo_->ProcessImages(left_, right, state_, &hits);
+
+        ASSERT_EQ(hits.count, (int)points3d.size());
+        ASSERT_EQ(hits.count, (int)points2d.size());
+
+        for (int i = 0; i < hits.count; i++) {
+            EXPECT_EQ_ARM(hits.x[i], points3d[i].x);
+            EXPECT_EQ_ARM(hits.y[i], points3d[i].y);
+            EXPECT_EQ_ARM(hits.z[i], points3d[i].z);
+            EXPECT_EQ_ARM(hits.grey[i], colors[i]);
+            EXPECT_EQ_ARM(hits.disparity[i], disparities[i]);
+            EXPECT_EQ_ARM(hits.pixel_x[i], points2d[i].x);
+            EXPECT_EQ_ARM(hits.pixel_y[i], points2d[i].y);
+            EXPECT_EQ_ARM(hits.sad[i], points2d[i].z);
+        }
+    }
+
+    pushbroom_stereo_->SetUseWorkStealing(true);
+    pushbroom_stereo_->SetUseFusedStrips(false);
+}
+#endif // __GLIBC__
+
+/**
+ * Checks a DisparityProjector against cv::perspectiveTransform for every
+ * block position at a few disparities.
+ *
+ * @retval number of points that are off by more than float rounding
+ */
+static int CountProjectionMismatches(const Mat &Q, int rows, int cols, float offset) {
+
+    int disparities[] = { -105, -95, -20, 0, 3, 40 };
+
+    int mismatches = 0;
+
+    for (unsigned int k = 0; k < sizeof(disparities) / sizeof(disparities[0]); k++) {
+
+        cv::vector<int> pixel_x, pixel_y;
+        cv::vector<Point3f> image_points;
+
+        for (int i = 0; i < rows; i += 3) {
+            for (int j = 0; j < cols; j += 7) {
+                pixel_x.push_back(j);
+                pixel_y.push_back(i);
+                image_points.push_back(Point3f(j + offset, i + offset, -disparities[k]));
+            }
+        }
+
+        cv::vector<Point3f> expected;
+        perspectiveTransform(image_points, expected, Q);
+
+        int n = pixel_x.size();
+        cv::vector<float> x(n), y(n), z(n);
+
+        DisparityProjector projector;
+        projector.Set(Q, disparities[k]);
+        projector.Project(pixel_x.data(), pixel_y.data(), n, offset, x.data(), y.data(), z.data());
+
+        for (int i = 0; i < n; i++) {
+            float tolerance = 1e-5 * max(1.0f, max(fabs(expected[i].x), max(fabs(expected[i].y), fabs(expected[i].z))));
+
+            if (fabs(x[i] - expected[i].x) > tolerance || fabs(y[i] - expected[i].y) > tolerance
+                || fabs(z[i] - expected[i].z) > tolerance) {
+
+                mismatches ++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+/**
+ * The per-disparity projection must give the same 3D points as
+ * perspectiveTransform, up to float rounding, for a real reprojection
+ * matrix in either precision and for one it can't simplify.
+ */
+TEST_F(PushbroomStereoTest, ProjectorMatchesPerspectiveTransform) {
+
+    // what stereoRectify makes for a pair of cameras 34 cm apart
+    double cx = 190.5, cy = 120.2, cx_right = 187.4, f = 212.3, tx = -0.34;
+
+    Mat Q = Mat::zeros(4, 4, CV_64F);
+    Q.at<double>(0, 0) = 1;
+    Q.at<double>(0, 3) = -cx;
+    Q.at<double>(1, 1) = 1;
+    Q.at<double>(1, 3) = -cy;
+    Q.at<double>(2, 3) = f;
+    Q.at<double>(3, 2) = -1.0 / tx;
+    Q.at<double>(3, 3) = (cx - cx_right) / tx;
+
+    EXPECT_EQ_ARM(CountProjectionMismatches(Q, rows_, cols_, 2.5), 0);
+    EXPECT_EQ_ARM(CountProjectionMismatches(Q, rows_, cols_, 0), 0);
+
+    Mat Q_float(4, 4, CV_32F);
+    for (int r = 0; r < 4; r++) {
+        for (int c = 0; c < 4; c++) {
+            Q_float.at<float>(r, c) = Q.at<double>(r, c);
+        }
+    }
+
+    EXPECT_EQ_ARM(CountProjectionMismatches(Q_float, rows_, cols_, 2.5), 0);
+
+    // the divide depends on the pixel, so it has to do the whole transform
+    Mat Q_tilted = Q.clone();
+    Q_tilted.at<double>(3, 0) = 0.001;
+    Q_tilted.at<double>(3, 1) = -0.002;
+
+    EXPECT_EQ_ARM(CountProjectionMismatches(Q_tilted, rows_, cols_, 2.5), 0);
+
+    // the stereo search gives the same points as transforming its hits
+    state_.Q = Q;
+    state_.mapxL.create(rows_, cols_, CV_16SC2);
+    state_.mapxR.create(rows_, cols_, CV_16SC2);
+
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            short *left_map = state_.mapxL.ptr<short>(i) + 2*j;
+            short *right_map = state_.mapxR.ptr<short>(i) + 2*j;
+
+            left_map[0] = j;
+            left_map[1] = i;
+            right_map[0] = j;
+            right_map[1] = i;
+        }
+    }
+
+    Mat right = right_.clone();
+    for (int i = 0; i < rows_; i++) {
+        for (int j = 0; j < cols_; j++) {
+            int j_right = j + state_.disparity;
+            if (j_right >= 0 && j_right < cols_) {
+                right.at<uchar>(i, j_right) = left_.at<uchar>(i, j);
+            }
+        }
+    }
+
+    state_.check_horizontal_invariance = false;
+    state_.show_display = true;
+
+    cv::vector<Point3f> points3d;
+    cv::vector<uchar> colors;
+    cv::vector<Point3i> points2d;
+
+    pushbroom_stereo_->ProcessImages(left_, right, &points3d, &colors, &points2d, state_);
+
+    ASSERT_TRUE(points3d.size() > 0);
+    ASSERT_EQ(points3d.size(), points2d.size());
+
+    cv::vector<Point3f> image_points;
+    for (unsigned int i = 0; i < points2d.size(); i++) {
+        image_points.push_back(Point3f(points2d[i].x + state_.blockSize / 2.0, points2d[i].y + state_.blockSize / 2.0, -state_.disparity));
+    }
+
+    cv::vector<Point3f> expected;
+    perspectiveTransform(image_points, expected, Q);
+
+    for (unsigned int i = 0; i < points3d.size(); i++) {
+        EXPECT_NEAR(points3d[i].x, expected[i].x, 1e-5 * max(1.0f, fabs(expected[i].x)));
+        EXPECT_NEAR(points3d[i].y, expected[i].y, 1e-5 * max(1.0f, fabs(expected[i].y)));
+        EXPECT_NEAR(points3d[i].z, expected[i].z, 1e-5 * max(1.0f, fabs(expected[i].z)));
+    }
+}
+
+static void CountTask(void *context, int index) {
+    std::atomic<int> *counts = (std::atomic<int>*) context;
+    counts[index] ++;
+}
+
+static void SpawnTask(void *context, int index) {
+    std::pair<WorkStealingPool*, std::atomic<int>*> *args = (std::pair<WorkStealingPool*, std::atomic<int>*>*) context;
+
+    // tasks submitted from inside a task have to be waited on too
+    args->first->Submit(CountTask, args->second, index);
+}
+
+/**
+ * Every task, including ones submitted by other tasks, runs exactly once
+ * before Wait returns.
+ */
+TEST(WorkStealingPoolTest, RunsEveryTaskOnce) {
+
+    const int num_tasks = 1000;
+
+    int thread_counts[] = { 1, 2, 4 };
+
+    for (unsigned int t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+
+        WorkStealingPool pool(thread_counts[t]);
+
+        EXPECT_EQ_ARM(pool.GetNumThreads(), thread_counts[t]);
+
+        for (int n = 0; n < 20; n++) {
+
+            std::atomic<int> counts[num_tasks];
+            for (int i = 0; i < num_tasks; i++) {
+                counts[i] = 0;
+            }
+
+            std::pair<WorkStealingPool*, std::atomic<int>*> args(&pool, counts);
+
+            for (int i = 0; i < num_tasks; i++) {
+                pool.Submit(SpawnTask, &args, i);
+            }
+
+            pool.Wait();
+
+            int wrong = 0;
+            for (int i = 0; i < num_tasks; i++) {
+                if (counts[i] != 1) {
+                    wrong ++;
+                }
+            }
+
+            EXPECT_EQ_ARM(wrong, 0);
+        }
+    }
+}
+/**
+ * Frames point straight into the camera's buffers, and each buffer goes
+ * back to the camera exactly once, when the last copy of its frame is done.
+ */
+TEST(CameraSourceTest, FramesShareBufferUntilLastRelease) {
+
+    FakeCameraSource source(376, 240, 2);
+
+    CameraFrame frame;
+    ASSERT_TRUE(source.GrabFrame(&frame));
+
+    EXPECT_EQ_ARM(source.GetNumOutstanding(), 1);
+
+    Mat image = frame.GetImage();
+    EXPECT_EQ_ARM(image.rows, 240);
+    EXPECT_EQ_ARM(image.cols, 376);
+    EXPECT_FALSE(image.isContinuous()); // padded rows, no copy was made
+
+    int wrong = 0;
+    for (int row = 0; row < image.rows; row++) {
+        for (int col = 0; col < image.cols; col++) {
+            if (image.at<uchar>(row, col) != FakeCameraSource::GetPixel(frame.GetFrameNumber(), row, col)) {
+                wrong ++;
+            }
+        }
+    }
+    EXPECT_EQ_ARM(wrong, 0);
+
+    CameraFrame copy = frame;
+    EXPECT_EQ(copy.GetImage().data, image.data);
+
+    frame.Release();
+    EXPECT_EQ_ARM(source.GetNumOutstanding(), 1);
+
+    {
+        CameraFrame copy2 = copy;
+        copy.Release();
+        EXPECT_EQ_ARM(source.GetNumOutstanding(), 1);
+    }
+
+    EXPECT_EQ_ARM(source.GetNumOutstanding(), 0);
+
+    // a recording is a real copy and outlives the buffer
+    ASSERT_TRUE(source.GrabFrame(&frame));
+    Mat recorded = frame.GetImage().clone();
+    uint32_t recorded_number = frame.GetFrameNumber();
+    frame.Release();
+
+    EXPECT_EQ_ARM(recorded.at<uchar>(10, 20), FakeCameraSource::GetPixel(recorded_number, 10, 20));
+
+    EXPECT_EQ_ARM(source.GetNumContractErrors(), 0);
+}
+
+/**
+ * Grabbing into a frame gives its old buffer back first, so one buffer per
+ * camera is enough for the capture loop.
+ */
+TEST(CameraSourceTest, GrabFrameReusesBuffer) {
+
+    FakeCameraSource source(64, 32, 1, 1000);
+
+    CameraFrame frame;
+
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(source.GrabFrame(&frame));
+
+        EXPECT_EQ_ARM(frame.GetFrameNumber(), (uint32_t)i);
+        EXPECT_EQ_ARM(frame.GetTimestamp(), (uint64_t)i * 1000);
+        EXPECT_EQ_ARM(source.GetNumOutstanding(), 1);
+    }
+
+    // holding on to every buffer starves the camera
+    CameraFrame held = frame;
+    CameraFrame other;
+
+    EXPECT_FALSE(source.GrabFrame(&other));
+    EXPECT_TRUE(other.empty());
+    EXPECT_EQ_ARM(source.GetNumContractErrors(), 1);
+
+    held.Release();
+    frame.Release();
+
+    EXPECT_EQ_ARM(source.GetNumOutstanding(), 0);
+    EXPECT_TRUE(source.GrabFrame(&other));
+}
+/**
+ * Everything pushed on one thread comes out on the other, once and in order.
+ */
+TEST(SpscQueueTest, PreservesOrderAcrossThreads) {
+
+    const int num_items = 100000;
+
+    SpscQueue<int> queue(16);
+
+    EXPECT_EQ_ARM(queue.GetCapacity(), 16);
+
+    std::thread producer([&queue] {
+        for (int i = 0; i < num_items; i++) {
+            while (queue.Push(i) == false) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    int expected = 0;
+    int wrong = 0;
+
+    while (expected < num_items) {
+        int item;
+        if (queue.Pop(&item)) {
+            if (item != expected) {
+                wrong ++;
+            }
+            expected ++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    producer.join();
+
+    EXPECT_EQ_ARM(wrong, 0);
+    EXPECT_TRUE(queue.empty());
+}
+
+/**
+ * Samples from every thread, including threads that have exited, are
+ * collected once, and a full buffer drops and counts the extras.
+ */
+TEST(StageProfilerTest, CollectsEveryThread) {
+
+    const int num_threads = 4;
+
+    std::vector<StageStats> stats;
+    int dropped;
+
+    StageProfiler::SetEnabled(true);
+
+    // clear out anything left from other tests
+    StageProfiler::Collect(&stats, &dropped);
+
+    // each thread takes 1 to 100 ms on the remap stage
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([] {
+            for (int i = 1; i <= 100; i++) {
+                StageProfiler::Record(STAGE_REMAP, i * 1000000ull);
+            }
+        }));
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].join();
+    }
+
+    {
+        StageTimer timer(STAGE_FRAME);
+    }
+
+    StageProfiler::Collect(&stats, &dropped);
+
+    ASSERT_EQ((int)stats.size(), (int)NUM_TIMED_STAGES);
+
+    EXPECT_EQ_ARM(dropped, 0);
+    EXPECT_EQ_ARM(stats[STAGE_REMAP].count, num_threads * 100);
+    EXPECT_NEAR(stats[STAGE_REMAP].total_ms, num_threads * 5050.0, 1e-6);
+    EXPECT_NEAR(stats[STAGE_REMAP].mean_ms, 50.5, 1e-6);
+    EXPECT_NEAR(stats[STAGE_REMAP].p50_ms, 50, 1e-6);
+    EXPECT_NEAR(stats[STAGE_REMAP].p90_ms, 90, 1e-6);
+    EXPECT_NEAR(stats[STAGE_REMAP].p99_ms, 99, 1e-6);
+    EXPECT_NEAR(stats[STAGE_REMAP].max_ms, 100, 1e-6);
+
+    EXPECT_EQ_ARM(stats[STAGE_FRAME].count, 1);
+    EXPECT_EQ_ARM(stats[STAGE_STEREO].count, 0);
+    EXPECT_EQ_ARM(stats[STAGE_STEREO].p99_ms, 0);
+
+    // nothing comes out twice
+    StageProfiler::Collect(&stats, &dropped);
+    EXPECT_EQ_ARM(stats[STAGE_REMAP].count, 0);
+    EXPECT_EQ_ARM(stats[STAGE_FRAME].count, 0);
+
+    for (int i = 0; i < STAGE_TIMER_BUFFER_SIZE + 10; i++) {
+        StageProfiler::Record(STAGE_MERGE, 1000);
+    }
+
+    StageProfiler::Collect(&stats, &dropped);
+    EXPECT_EQ_ARM(stats[STAGE_MERGE].count, STAGE_TIMER_BUFFER_SIZE);
+    EXPECT_EQ_ARM(dropped, 10);
+
+    // timers don't record anything when the profiler is off
+    StageProfiler::SetEnabled(false);
+
+    {
+        StageTimer timer(STAGE_FRAME);
+    }
+
+    StageProfiler::Collect(&stats, &dropped);
+    EXPECT_EQ_ARM(stats[STAGE_FRAME].count, 0);
+}
+
+/**
+ * Reads a big-endian 32-bit value out of an encoded message.
+ */
+static uint32_t DecodeInt32(const uint8_t *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+static float DecodeFloat(const uint8_t *buf) {
+    uint32_t bits = DecodeInt32(buf);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Encoded hits must be laid out like lcmt_stereo, with the positions in
+ * the message's units, and encoding again mustn't allocate.
+ */
+TEST(StereoHitEncoderTest, EncodesLcmtStereoLayout) {
+
+    const int n = 5;
+
+    float x[n], y[n], z[n];
+    uchar grey[n];
+    int zeros[n] = { 0 };
+
+    for (int i = 0; i < n; i++) {
+        x[i] = i + 0.5;
+        y[i] = -2.0 * i;
+        z[i] = 10.0 + i;
+        grey[i] = 50 * i;
+    }
+
+    PushbroomHits hits;
+    hits.count = n;
+    hits.x = x;
+    hits.y = y;
+    hits.z = z;
+    hits.grey = grey;
+    hits.disparity = zeros;
+    hits.pixel_x = zeros;
+    hits.pixel_y = zeros;
+    hits.sad = zeros;
+
+    uint64_t fingerprint = 0x0123456789abcdefull;
+    int64_t timestamp = 1234567890123ll;
+    float unit_conversion = 2.5;
+
+    StereoHitEncoder encoder(fingerprint);
+    encoder.Encode(hits, timestamp, 42, 7, unit_conversion);
+
+    ASSERT_EQ(encoder.GetSize(), STEREO_MESSAGE_HEADER_SIZE + n * STEREO_MESSAGE_BYTES_PER_POINT);
+
+    const uint8_t *buf = encoder.GetData();
+
+    EXPECT_EQ(((uint64_t)DecodeInt32(buf) << 32) | DecodeInt32(buf + 4), fingerprint);
+    EXPECT_EQ((int64_t)(((uint64_t)DecodeInt32(buf + 8) << 32) | DecodeInt32(buf + 12)), timestamp);
+    EXPECT_EQ_ARM((int)DecodeInt32(buf + 16), n);
+    EXPECT_EQ_ARM((int)DecodeInt32(buf + 20), 42);
+    EXPECT_EQ_ARM((int)DecodeInt32(buf + 24), 7);
+
+    const uint8_t *points = buf + STEREO_MESSAGE_HEADER_SIZE;
+
+    for (int i = 0; i < n; i++) {
+        EXPECT_EQ_ARM(DecodeFloat(points + 4 * i), x[i] / unit_conversion);
+        EXPECT_EQ_ARM(DecodeFloat(points + 4 * (n + i)), y[i] / unit_conversion);
+        EXPECT_EQ_ARM(DecodeFloat(points + 4 * (2 * n + i)), z[i] / unit_conversion);
+        EXPECT_EQ_ARM(points[12 * n + i], grey[i]);
+    }
+
+    // fewer hits reuse the buffer
+    hits.count = 2;
+    encoder.Encode(hits, timestamp, 43, 7, unit_conversion);
+
+    EXPECT_EQ_ARM(encoder.GetSize(), STEREO_MESSAGE_HEADER_SIZE + 2 * STEREO_MESSAGE_BYTES_PER_POINT);
+    EXPECT_EQ_ARM((int)DecodeInt32(encoder.GetData() + 16), 2);
+
+#ifdef __GLIBC__
+    num_allocations = 0;
+    count_allocations = true;
+
+    hits.count = n;
+    encoder.Encode(hits, timestamp, 44, 7, unit_conversion);
+
+    count_allocations = false;
+
+    EXPECT_EQ(num_allocations.load(), 0);
+#endif
+}
+
+/**
+ * Pairs come out in order, within the allowed skew, and with the right
+ * image data, even when one camera misses frames and the consumer is slow.
+ */
+TEST(StereoCaptureTest, PairsFramesByTimestamp) {
+
+    const uint64_t period = 2000;
+    const uint64_t max_skew = 1000;
+
+    FakeCameraSource left(64, 32, 4, period);
+    FakeCameraSource right(64, 32, 4, period);
+
+    left.SetRealtime(true);
+    right.SetRealtime(true);
+
+    right.SetTimestampOffset(700);
+    right.SetDropEvery(5);
+
+    StereoCapture capture(&left, &right, max_skew);
+    capture.Start();
+
+    CameraFrame frame_left, frame_right;
+    uint64_t last_timestamp = 0;
+
+    for (int i = 0; i < 60; i++) {
+        ASSERT_TRUE(capture.GetPair(&frame_left, &frame_right));
+
+        EXPECT_LE(std::abs((int64_t)frame_right.GetTimestamp() - (int64_t)frame_left.GetTimestamp()), (int64_t)max_skew);
+        if (i > 0) {
+            EXPECT_GT(frame_left.GetTimestamp(), last_timestamp);
+        }
+        last_timestamp = frame_left.GetTimestamp();
+
+        // missing right frames never get a partner
+        EXPECT_TRUE((frame_right.GetFrameNumber() + 1) % 5 != 0);
+
+        EXPECT_EQ_ARM(frame_left.GetImage().at<uchar>(20, 30), FakeCameraSource::GetPixel(frame_left.GetFrameNumber(), 20, 30));
+        EXPECT_EQ_ARM(frame_right.GetImage().at<uchar>(20, 30), FakeCameraSource::GetPixel(frame_right.GetFrameNumber(), 20, 30));
+
+        if (i % 10 == 0) {
+            // fall behind for a bit
+            std::this_thread::sleep_for(std::chrono::microseconds(5 * period));
+        }
+    }
+
+    capture.Stop();
+
+    EXPECT_GT(capture.GetNumUnpaired(), 0);
+    EXPECT_EQ_ARM(capture.GetNumPairs(), 60);
+
+    frame_left.Release();
+    frame_right.Release();
+
+    EXPECT_EQ_ARM(left.GetNumOutstanding(), 0);
+    EXPECT_EQ_ARM(right.GetNumOutstanding(), 0);
+    EXPECT_EQ_ARM(left.GetNumContractErrors(), 0);
+    EXPECT_EQ_ARM(right.GetNumContractErrors(), 0);
+}
+
+/**
+ * Frames that can never pair don't pile up and starve the cameras.
+ */
+TEST(StereoCaptureTest, UnmatchedFramesGoBackToCamera) {
+
+    FakeCameraSource left(64, 32, 4, 2000);
+    FakeCameraSource right(64, 32, 4, 2000);
+
+    left.SetRealtime(true);
+    right.SetRealtime(true);
+
+    // much too far apart to ever pair
+    right.SetTimestampOffset(1000000);
+
+    StereoCapture capture(&left, &right, 1000);
+    capture.Start();
+
+    CameraFrame frame_left, frame_right;
+
+    EXPECT_FALSE(capture.GetPair(&frame_left, &frame_right, 50));
+    EXPECT_TRUE(frame_left.empty());
+
+    capture.Stop();
+
+    EXPECT_GT(capture.GetNumUnpaired(), 0);
+
+    EXPECT_EQ_ARM(left.GetNumOutstanding(), 0);
+    EXPECT_EQ_ARM(right.GetNumOutstanding(), 0);
+    EXPECT_EQ_ARM(left.GetNumContractErrors(), 0);
+    EXPECT_EQ_ARM(right.GetNumContractErrors(), 0);
+}
+/**
+ * Frames end up on disk under their own frame numbers, dropped ones are
+ * counted, and closing only waits for what's left in the queue.
+ */
+TEST(RecordingWriterTest, StreamsPGMFrames) {
+
+    char temp_dir[] = "/tmp/recording-writer-test-XXXXXX";
+    ASSERT_TRUE(mkdtemp(temp_dir) != NULL);
+
+    std::string dir_left = std::string(temp_dir) + "/left";
+    std::string dir_right = std::string(temp_dir) + "/right";
+
+    mkdir(dir_left.c_str(), 0755);
+    mkdir(dir_right.c_str(), 0755);
+
+    const int num_frames = 50;
+    bool added[num_frames];
+
+    {
+        RecordingWriter writer(8);
+
+        // nothing to record to yet
+        EXPECT_FALSE(writer.AddFrames(Mat::zeros(24, 32, CV_8UC1), Mat::zeros(24, 32, CV_8UC1), 0));
+
+        writer.OpenPGM(dir_left, dir_right);
+
+        for (int i = 0; i < num_frames; i++) {
+            Mat left(24, 32, CV_8UC1, Scalar(i));
+            Mat right(24, 32, CV_8UC1, Scalar(255 - i));
+
+            added[i] = writer.AddFrames(left, right, i);
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        EXPECT_TRUE(writer.Close());
+        EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+
+        EXPECT_EQ_ARM(writer.GetNumWritten() + writer.GetNumDropped(), num_frames);
+        EXPECT_LE(writer.GetMaxQueueDepth(), writer.GetQueueSize());
+
+        EXPECT_FALSE(writer.AddFrames(Mat::zeros(24, 32, CV_8UC1), Mat::zeros(24, 32, CV_8UC1), num_frames));
+    }
+
+    int wrong = 0;
+
+    for (int i = 0; i < num_frames; i++) {
+        char name_left[100], name_right[100];
+        snprintf(name_left, sizeof(name_left), "/left%05d.pgm", i);
+        snprintf(name_right, sizeof(name_right), "/right%05d.pgm", i);
+
+        Mat left = imread(dir_left + name_left, -1);
+        Mat right = imread(dir_right + name_right, -1);
+
+        if (added[i]) {
+            if (left.data == NULL || right.data == NULL
+                || left.at<uchar>(5, 5) != i || right.at<uchar>(5, 5) != 255 - i) {
+
+                wrong ++;
+            }
+
+            remove((dir_left + name_left).c_str());
+            remove((dir_right + name_right).c_str());
+
+        } else if (left.data != NULL || right.data != NULL) {
+            // dropped frames leave a gap
+            wrong ++;
+        }
+    }
+
+    EXPECT_EQ_ARM(wrong, 0);
+
+    rmdir(dir_left.c_str());
+    rmdir(dir_right.c_str());
+    rmdir(temp_dir);
+}
+/**
+ * Makes a random image for the stereo log tests.
+ */
+static Mat RandomImage(int rows, int cols, std::mt19937 *rng) {
+    Mat image(rows, cols, CV_8UC1);
+
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            image.at<uchar>(i, j) = (*rng)() % 256;
+        }
+    }
+
+    return image;
+}
+
+static int CountDifferentPixels(const Mat &a, const Mat &b) {
+    if (a.size() != b.size()) {
+        return a.rows * a.cols + 1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < a.rows; i++) {
+        for (int j = 0; j < a.cols; j++) {
+            if (a.at<uchar>(i, j) != b.at<uchar>(i, j)) {
+                count ++;
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Frames come back exactly as written, in any order, with their
+ * timestamps, and dropped frames are missing.
+ */
+TEST(StereoLogTest, RandomAccessMatchesWrittenFrames) {
+
+    const int num_frames = 30;
+    const int rows = 24, cols = 40;
+
+    char filename[] = "/tmp/stereo-log-test-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    std::mt19937 rng(3);
+
+    std::vector<Mat> lefts, rights;
+
+    StereoLogWriter writer;
+    ASSERT_TRUE(writer.Open(filename));
+
+    for (int i = 0; i < num_frames; i++) {
+        Mat big_left = RandomImage(rows + 10, cols + 10, &rng);
+
+        // an image that isn't continuous in memory
+        lefts.push_back(big_left(Rect(5, 5, cols, rows)));
+        rights.push_back(RandomImage(rows, cols, &rng));
+
+        if (i == 7 || i == 20) {
+            // dropped
+            continue;
+        }
+
+        EXPECT_TRUE(writer.WriteFrames(lefts[i], rights[i], i, 1000 + 33333 * i));
+    }
+
+    EXPECT_TRUE(writer.Close());
+
+    StereoLogReader reader;
+    ASSERT_TRUE(reader.Open(filename));
+
+    EXPECT_EQ_ARM(reader.GetNumFrames(), num_frames - 2);
+    EXPECT_EQ_ARM(reader.GetFirstFrameNumber(), 0);
+    EXPECT_EQ_ARM(reader.GetLastFrameNumber(), num_frames - 1);
+
+    int wrong = 0;
+
+    for (int i = num_frames - 1; i >= 0; i--) {
+        Mat left, right;
+        uint64_t timestamp = 0;
+
+        bool ok = reader.ReadFrames(i, &left, &right, &timestamp);
+
+        if (i == 7 || i == 20) {
+            EXPECT_FALSE(ok);
+            EXPECT_FALSE(reader.HasFrame(i));
+            continue;
+        }
+
+        ASSERT_TRUE(ok);
+
+        wrong += CountDifferentPixels(left, lefts[i]) + CountDifferentPixels(right, rights[i]);
+
+        EXPECT_EQ_ARM(timestamp, (uint64_t)(1000 + 33333 * i));
+    }
+
+    EXPECT_EQ_ARM(wrong, 0);
+
+    Mat left, right;
+    EXPECT_FALSE(reader.ReadFrames(num_frames, &left, &right));
+    EXPECT_FALSE(reader.ReadFrames(-1, &left, &right));
+
+    reader.Close();
+    remove(filename);
+}
+
+/**
+ * A recording that never got its index is still readable up to the last
+ * whole frame.
+ */
+TEST(StereoLogTest, RecoversCutShortRecording) {
+
+    const int rows = 24, cols = 40;
+
+    char filename[] = "/tmp/stereo-log-test-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    std::mt19937 rng(4);
+
+    std::vector<Mat> lefts, rights;
+
+    StereoLogWriter writer;
+    ASSERT_TRUE(writer.Open(filename));
+
+    for (int i = 0; i < 10; i++) {
+        lefts.push_back(RandomImage(rows, cols, &rng));
+        rights.push_back(RandomImage(rows, cols, &rng));
+
+        EXPECT_TRUE(writer.WriteFrames(lefts[i], rights[i], i, i));
+    }
+
+    EXPECT_TRUE(writer.Close());
+
+    // lose the index and half of the last frame
+    off_t record_size = sizeof(StereoLogFrameHeader) + 2 * rows * cols;
+    ASSERT_EQ(truncate(filename, sizeof(StereoLogFileHeader) + 9 * record_size + record_size / 2), 0);
+
+    StereoLogReader reader;
+    ASSERT_TRUE(reader.Open(filename));
+
+    EXPECT_EQ_ARM(reader.GetNumFrames(), 9);
+    EXPECT_FALSE(reader.HasFrame(9));
+
+    Mat left, right;
+    ASSERT_TRUE(reader.ReadFrames(8, &left, &right));
+
+    EXPECT_EQ_ARM(CountDifferentPixels(left, lefts[8]) + CountDifferentPixels(right, rights[8]), 0);
+
+    reader.Close();
+    remove(filename);
+}
+
+TEST(StereoLogTest, MappedFramesMatchWrittenFrames) {
+
+    const int num_frames = 100;
+    const int rows = 24, cols = 40;
+
+    char filename[] = "/tmp/stereo-log-test-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    std::mt19937 rng(5);
+
+    std::vector<Mat> lefts, rights;
+
+    StereoLogWriter writer;
+    ASSERT_TRUE(writer.Open(filename));
+
+    for (int i = 0; i < num_frames; i++) {
+        lefts.push_back(RandomImage(rows, cols, &rng));
+        rights.push_back(RandomImage(rows, cols, &rng));
+
+        EXPECT_TRUE(writer.WriteFrames(lefts[i], rights[i], i, 10 * i));
+    }
+
+    EXPECT_TRUE(writer.Close());
+
+    StereoLogReader reader;
+    ASSERT_TRUE(reader.Open(filename));
+    ASSERT_TRUE(reader.IsMapped());
+
+    int wrong = 0;
+
+    // forwards, then backwards past where the prefetch window started
+    for (int pass = 0; pass < 2; pass++) {
+        for (int n = 0; n < num_frames; n++) {
+            int i = pass == 0 ? n : num_frames - 1 - n;
+
+            Mat left, right;
+            uint64_t timestamp = 0;
+
+            ASSERT_TRUE(reader.MapFrames(i, &left, &right, &timestamp));
+
+            wrong += CountDifferentPixels(left, lefts[i]) + CountDifferentPixels(right, rights[i]);
+
+            EXPECT_EQ_ARM(timestamp, (uint64_t)(10 * i));
+        }
+    }
+
+    EXPECT_EQ_ARM(wrong, 0);
+
+    EXPECT_FALSE(reader.MapFrames(num_frames, NULL, NULL));
+
+    // drawing on a copy of a mapped frame leaves the frame alone for the
+    // next time it is played back
+    Mat left, right;
+    ASSERT_TRUE(reader.MapFrames(3, &left, &right));
+
+    Mat drawn = left.clone();
+    memset(drawn.data, 0, rows * cols);
+
+    ASSERT_TRUE(reader.MapFrames(3, &left, &right));
+    EXPECT_EQ_ARM(CountDifferentPixels(left, lefts[3]), 0);
+
+    reader.Close();
+    remove(filename);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -387,6 +387,9 @@ GoForFlightFrame::GoForFlightFrame(wxWindow* parent,wxWindowID id)
     lcm.subscribe("deltawing_u", &ControllerHandler::handleMessage, &controller_handler_);
 
     lcm.subscribe("stereo-monitor", &StereoHandler::handleMessage, &stereo_handler_);
+    lcm.subscribe("stereo-timing-odroid-cam1", &StereoHandler::handleTimingMessage, &stereo_handler_);
+    lcm.subscribe("stereo-timing-odroid-cam2", &StereoHandler::handleTimingMessage, &stereo_handler_);
+    lcm.subscribe("stereo-timing-odroid-cam3", &StereoHandler::handleTimingMessage, &stereo_handler_);
 
     lcm.subscribe("STATE_ESTIMATOR_POSE", &StateEsimatorHandler::handleMessage, &state_estimator_handler_);
 
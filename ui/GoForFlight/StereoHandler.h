@@ -3,6 +3,7 @@
 
 #include "StatusHandler.h"
 #include "../../LCM/lcmt_stereo_monitor.hpp"
+#include "../../LCM/lcmt_stereo_timing.hpp"
 #include <boost/format.hpp>
 
 class StereoHandler : public StatusHandler
@@ -19,19 +20,38 @@ class StereoHandler : public StatusHandler
 
             boost::format formatter = boost::format(" (%02d -- %d)") % msg->video_number % msg->frame_number;
 
+            std::string text = formatter.str() + timing_str_;
+
             if (msg->frame_number > 0) {
                 SetStatus(true, msg->timestamp);
-                SetOnlineString(formatter.str());
-                SetOfflineString(formatter.str());
+                SetOnlineString(text);
+                SetOfflineString(text);
 
             } else {
                 SetStatus(false, msg->timestamp);
-                SetOfflineString(formatter.str());
+                SetOfflineString(text);
             }
 
         }
 
+        /**
+         * Per-stage timing from pushbroom-stereo.  Shows the time per frame
+         * next to the frame number.
+         */
+        void handleTimingMessage(const lcm::ReceiveBuffer* rbuf,
+                                 const std::string& chan,
+                                 const lcmt_stereo_timing* msg) {
+
+            for (int i = 0; i < msg->num_stages; i++) {
+                if (msg->stage_name[i] == "frame" && msg->count[i] > 0) {
+                    boost::format formatter = boost::format(" %.1f ms/frame, p99 %.1f ms") % msg->mean_ms[i] % msg->p99_ms[i];
+                    timing_str_ = formatter.str();
+                }
+            }
+        }
+
     private:
+        std::string timing_str_;
 
 };
 
@@ -17,6 +17,7 @@
 #include <sys/types.h>
 
 #include "../../LCM/lcmt_log_size.h"
+#include "../../LCM/lcmt_stereo_timing.h"
 
 #include "../../externals/ConciseArgs.hpp"
 
@@ -28,6 +29,7 @@ lcm_t * lcm;
 
 std::string log_dir = "/home/odroid";
 std::string log_info_channel_str = "log-info-hostname";
+std::string stereo_timing_channel_str = "";
 
 
 void sighandler(int dum) {
@@ -47,6 +49,22 @@ long GetFileSize(std::string filename) {
 }
 
 
+/**
+ * Prints a line with the stereo timing breakdown from pushbroom-stereo.
+ */
+void stereo_timing_handler(const lcm_recv_buf_t *rbuf, const char* channel, const lcmt_stereo_timing *msg, void *user) {
+
+    printf("%s: %d frames, %d dropped |", channel, msg->num_frames, msg->dropped_samples);
+
+    for (int i = 0; i < msg->num_stages; i++) {
+        if (msg->count[i] > 0) {
+            printf(" %s %.2f/%.2f ms", msg->stage_name[i], msg->mean_ms[i], msg->p99_ms[i]);
+        }
+    }
+
+    printf(" (mean/p99)\n");
+}
+
 int main(int argc,char** argv) {
 
     // use this computers hostname by default
@@ -61,6 +79,8 @@ int main(int argc,char** argv) {
         "LCM channel for publishing log info.");
     parser.add(log_dir, "d", "log-directory",
         "Directory containing log files.", true);
+    parser.add(stereo_timing_channel_str, "s", "stereo-timing-channel",
+        "LCM channel with pushbroom-stereo's timing to print (optional).");
     parser.parse();
 
     if (!log_dir.empty()) {
@@ -86,6 +106,12 @@ int main(int argc,char** argv) {
 
     printf("Publishing:\n\tLog size: %s\n\n", log_info_channel_str.c_str());
 
+    if (stereo_timing_channel_str.length() > 0) {
+        lcmt_stereo_timing_subscribe(lcm, stereo_timing_channel_str.c_str(), &stereo_timing_handler, NULL);
+
+        printf("Receiving:\n\tStereo timing: %s\n\n", stereo_timing_channel_str.c_str());
+    }
+
     while (true) {
         // find the logfile for today
         // formatted something like "lcmlog-2013-07-18.00"
@@ -173,6 +199,9 @@ int main(int argc,char** argv) {
 
         lcmt_log_size_publish (lcm, log_info_channel_str.c_str(), &msg);
 
+        // print any stereo timing that came in
+        while (NonBlockingLcm(lcm)) {}
+
         sleep(1);
     }
 